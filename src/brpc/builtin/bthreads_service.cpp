@@ -24,6 +24,7 @@
 
 namespace bthread {
 extern void print_task(std::ostream& os, bthread_t tid);
+extern void print_sched_stats(std::ostream& os);
 }
 
 
@@ -45,6 +46,8 @@ void BthreadsService::default_method(::google::protobuf::RpcController* cntl_bas
 #else
         os << "Use /bthreads/<bthread_id>";
 #endif // BRPC_BTHREAD_TRACER
+        os << "\n\n";
+        ::bthread::print_sched_stats(os);
     } else {
         char* endptr = NULL;
         bthread_t tid = strtoull(constraint.c_str(), &endptr, 10);
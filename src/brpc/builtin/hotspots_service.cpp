@@ -31,6 +31,8 @@
 #include "brpc/builtin/pprof_perl.h"
 #include "brpc/builtin/hotspots_service.h"
 #include "brpc/details/tcmalloc_extension.h"
+#include "brpc/details/continuous_profiler.h"
+#include "bthread/offcpu_profiler.h"
 
 extern "C" {
 int BAIDU_WEAK ProfilerStart(const char* fname);
@@ -753,7 +755,10 @@ static void DoProfiling(ProfilingType type,
                 HTTP_STATUS_INTERNAL_SERVER_ERROR);
             return NotifyWaiters(type, cntl, view);
         }
+        // gperftools samples with SIGPROF as well.
+        PauseContinuousProfiler();
         if (!ProfilerStart(prof_name)) {
+            ResumeContinuousProfiler();
             os << "Another profiler (not via /hotspots/cpu) is running, "
                 "try again later" << (use_html ? "</body></html>" : "\n");
             os.move_to(resp);
@@ -764,6 +769,7 @@ static void DoProfiling(ProfilingType type,
             PLOG(WARNING) << "Profiling has been interrupted";
         }
         ProfilerStop();
+        ResumeContinuousProfiler();
     } else if (type == PROFILING_CONTENTION) {
         if (!bthread::ContentionProfilerStart(prof_name)) {
             os << "Another profiler (not via /hotspots/contention) is running, "
@@ -1181,6 +1187,280 @@ static void StartProfiling(ProfilingType type,
     os.move_to(resp);
 }
 
+// Read unix seconds from query `key', negative values are relative to now.
+static bool ReadTimeQuery(const URI& uri, const char* key, int64_t now_s,
+                          int64_t* value) {
+    const std::string* param = uri.GetQuery(key);
+    if (param == NULL) {
+        return true;
+    }
+    char* endptr = NULL;
+    const long long t = strtoll(param->c_str(), &endptr, 10);
+    if (param->empty() || endptr != param->c_str() + param->length()) {
+        return false;
+    }
+    *value = (t < 0 ? now_s + t : t);
+    return true;
+}
+
+static void PrintEscapedHtml(std::ostream& os, const std::string& s) {
+    for (size_t i = 0; i < s.size(); ++i) {
+        switch (s[i]) {
+        case '<': os << "&lt;"; break;
+        case '>': os << "&gt;"; break;
+        case '&': os << "&amp;"; break;
+        default: os << s[i]; break;
+        }
+    }
+}
+
+// Views of folded stacks only support text and flame graph.
+static bool ReadFoldedDisplayType(Controller* cntl, DisplayType* display_type) {
+    *display_type = DisplayType::kText;
+    const std::string* display_type_query =
+        cntl->http_request().uri().GetQuery("display_type");
+    if (display_type_query) {
+        *display_type = StringToDisplayType(*display_type_query);
+        if (*display_type != DisplayType::kText
+#if defined(OS_LINUX)
+            && *display_type != DisplayType::kFlameGraph
+#endif
+            ) {
+            cntl->SetFailed(EINVAL, "Invalid display_type=%s",
+                            display_type_query->c_str());
+            return false;
+        }
+    }
+#if defined(OS_LINUX)
+    if (*display_type == DisplayType::kFlameGraph &&
+        !getenv("FLAMEGRAPH_PL_PATH")) {
+        cntl->SetFailed(EINVAL, "Failed to find environment variable "
+                        "FLAMEGRAPH_PL_PATH, please read cpu_profiler doc"
+                        "(https://github.com/apache/brpc/blob/master/docs/cn/cpu_profiler.md)");
+        return false;
+    }
+#endif
+    return true;
+}
+
+static void PrintFoldedPageHead(Controller* cntl, const char* tab_name,
+                                std::ostream& os) {
+    os << "<!DOCTYPE html><html><head>\n"
+        "<meta http-equiv=\"Content-Type\" content=\"text/html; charset=UTF-8\" />\n"
+        "<script language=\"javascript\" type=\"text/javascript\" src=\"/js/jquery_min\"></script>\n"
+       << TabsHead() << "</head>\n<body>\n";
+    cntl->server()->PrintTabsBody(os, tab_name);
+}
+
+static void PrintDisplayTypeOptions(DisplayType display_type, std::ostream& os) {
+    os << "<select name='display_type'>"
+       << "<option value='text'>text</option>"
+#if defined(OS_LINUX)
+       << "<option value='flame'"
+       << (display_type == DisplayType::kFlameGraph ? " selected" : "")
+       << ">flame</option>"
+#endif
+       << "</select>";
+}
+
+// Append `folded' stacks to `os' as text or flame graph, then move `os'
+// into the response. Flame graphs measure stacks with `countname'.
+static void ShowFoldedStacks(Controller* cntl, const std::string& folded,
+                             DisplayType display_type, const char* countname,
+                             butil::IOBufBuilder& os) {
+    const bool use_html = UseHTML(cntl->http_request());
+#if defined(OS_LINUX)
+    if (display_type == DisplayType::kFlameGraph && !folded.empty()) {
+        butil::FilePath folded_path;
+        if (!butil::CreateTemporaryFile(&folded_path) ||
+            !WriteSmallFile(folded_path.value().c_str(), folded)) {
+            cntl->http_response().set_status_code(
+                HTTP_STATUS_INTERNAL_SERVER_ERROR);
+            os << "Fail to write folded stacks"
+               << (use_html ? "</body></html>" : "\n");
+            os.move_to(cntl->response_attachment());
+            return;
+        }
+        std::ostringstream cmd;
+        cmd << "perl " << getenv("FLAMEGRAPH_PL_PATH") << " --width "
+            << (FLAGS_max_flame_graph_width > 0 ? FLAGS_max_flame_graph_width : 1200)
+            << " --countname " << countname
+            << ' ' << folded_path.value() << " 2>&1";
+        butil::IOBufBuilder svg;
+        if (butil::read_command_output(svg, cmd.str().c_str()) < 0) {
+            os << "Fail to execute `" << cmd.str() << "', " << berror() << '\n';
+        } else {
+            os << svg.buf();
+        }
+        butil::DeleteFile(folded_path, false);
+        os << (use_html ? "</body></html>" : "");
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+#endif
+    if (use_html) {
+        os << "<pre>";
+        PrintEscapedHtml(os, folded);
+        os << "</pre></body></html>";
+    } else {
+        os << folded;
+    }
+    os.move_to(cntl->response_attachment());
+}
+
+void HotspotsService::continuous(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const URI& uri = cntl->http_request().uri();
+    const bool use_html = UseHTML(cntl->http_request());
+
+    // Show last 5 minutes by default.
+    const int64_t now_s = butil::gettimeofday_s();
+    int64_t end_s = now_s + 1;
+    int64_t start_s = -1;
+    int64_t base_start_s = -1;
+    int64_t base_end_s = -1;
+    if (!ReadTimeQuery(uri, "end", now_s, &end_s) ||
+        !ReadTimeQuery(uri, "start", now_s, &start_s) ||
+        !ReadTimeQuery(uri, "base_start", now_s, &base_start_s) ||
+        !ReadTimeQuery(uri, "base_end", now_s, &base_end_s)) {
+        return cntl->SetFailed(EINVAL, "Invalid start/end/base_start/base_end");
+    }
+    if (start_s < 0) {
+        start_s = end_s - 300;
+    }
+    const bool has_base = (base_start_s >= 0);
+    if (has_base && base_end_s < 0) {
+        base_end_s = base_start_s + (end_s - start_s);
+    }
+    DisplayType display_type;
+    if (!ReadFoldedDisplayType(cntl, &display_type)) {
+        return;
+    }
+
+    FoldedProfile profile;
+    FoldedProfile base;
+    const int nprofile = GetContinuousProfile(start_s, end_s, &profile);
+    if (has_base) {
+        GetContinuousProfile(base_start_s, base_end_s, &base);
+    }
+    std::ostringstream folded;
+    PrintFoldedStacks(folded, profile.stacks, has_base ? &base.stacks : NULL);
+
+    butil::IOBufBuilder os;
+    if (use_html) {
+        cntl->http_response().set_content_type("text/html");
+        PrintFoldedPageHead(cntl, "continuous", os);
+        if (!IsContinuousProfilerRunning()) {
+            os << "<p>Continuous profiling is off, turn on "
+                "<a href='/flags/continuous_profiling'>-continuous_profiling</a>"
+                " to collect new samples.</p>\n";
+        }
+        os << "<form action='/hotspots/continuous' method='get'>\n"
+           << "start:<input name='start' value='" << start_s << "'/> "
+           << "end:<input name='end' value='" << end_s << "'/> "
+           << "base_start:<input name='base_start' value='"
+           << (has_base ? base_start_s : 0) << "'/> "
+           << "base_end:<input name='base_end' value='"
+           << (has_base ? base_end_s : 0) << "'/> ";
+        PrintDisplayTypeOptions(display_type, os);
+        os << " <input type='submit' value='show'/></form>\n"
+           << "<p>Unix seconds, negative values are relative to now. "
+           "Kept profiles:";
+        std::vector<std::pair<int64_t, int64_t> > ranges;
+        ListContinuousProfiles(&ranges);
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            os << " <a href='/hotspots/continuous?start=" << ranges[i].first
+               << "&end=" << ranges[i].second << "'>";
+            PrintRealDateTime(os, ranges[i].first * 1000000L, true);
+            os << "</a>";
+        }
+        os << "</p>\n";
+    } else {
+        cntl->http_response().set_content_type("text/plain");
+    }
+    os << (use_html ? "<pre>" : "") << "# " << profile.nsample
+       << " samples of " << nprofile << " minutes in [" << start_s << ", "
+       << end_s << ")";
+    if (has_base) {
+        os << " compared with " << base.nsample << " samples in ["
+           << base_start_s << ", " << base_end_s << ")";
+    }
+    os << (use_html ? "</pre>\n" : "\n");
+    ShowFoldedStacks(cntl, folded.str(), display_type, "samples", os);
+}
+
+void HotspotsService::offcpu(
+    ::google::protobuf::RpcController* cntl_base,
+    const ::brpc::HotspotsRequest*,
+    ::brpc::HotspotsResponse*,
+    ::google::protobuf::Closure* done) {
+    ClosureGuard done_guard(done);
+    Controller *cntl = static_cast<Controller*>(cntl_base);
+    const bool use_html = UseHTML(cntl->http_request());
+    const int seconds = ReadSeconds(cntl);
+    if (seconds < 0) {
+        return cntl->SetFailed(EINVAL, "Invalid seconds");
+    }
+    DisplayType display_type;
+    if (!ReadFoldedDisplayType(cntl, &display_type)) {
+        return;
+    }
+    butil::IOBufBuilder os;
+    if (use_html) {
+        cntl->http_response().set_content_type("text/html");
+        PrintFoldedPageHead(cntl, "offcpu", os);
+        os << "<form action='/hotspots/offcpu' method='get'>\n"
+           << "seconds:<input name='seconds' value='" << seconds << "'/> ";
+        PrintDisplayTypeOptions(display_type, os);
+        os << " <input type='submit' value='profile'/></form>\n";
+    } else {
+        cntl->http_response().set_content_type("text/plain");
+    }
+
+    LOG(INFO) << cntl->remote_side() << " requests for profiling offcpu for "
+              << seconds << " seconds";
+    if (!bthread::OffCpuProfilerStart()) {
+        cntl->http_response().set_status_code(HTTP_STATUS_SERVICE_UNAVAILABLE);
+        os << "Another off-cpu profiling is running, try again later"
+           << (use_html ? "</body></html>" : "\n");
+        os.move_to(cntl->response_attachment());
+        return;
+    }
+    if (bthread_usleep(seconds * 1000000L) != 0) {
+        PLOG(WARNING) << "Profiling has been interrupted";
+    }
+    std::vector<bthread::OffCpuStack> stacks;
+    bthread::OffCpuProfilerStop(&stacks);
+
+    // Stacks are measured by the waiting time.
+    FoldedStacks folded_stacks;
+    int64_t nwait = 0;
+    int64_t total_wait_us = 0;
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        const bthread::OffCpuStack& s = stacks[i];
+        std::string key = "[";
+        key.append(bthread::OffCpuReasonToString(s.reason));
+        key.push_back(']');
+        if (!s.pcs.empty()) {
+            AppendFoldedFrames(&s.pcs[0], s.pcs.size(), &key);
+        }
+        folded_stacks[key] += s.wait_us;
+        nwait += s.count;
+        total_wait_us += s.wait_us;
+    }
+    std::ostringstream folded;
+    PrintFoldedStacks(folded, folded_stacks, NULL);
+    os << (use_html ? "<pre>" : "") << "# " << nwait << " waits of bthreads"
+       " blocked for " << total_wait_us << "us in " << seconds << " seconds"
+       << (use_html ? "</pre>\n" : "\n");
+    ShowFoldedStacks(cntl, folded.str(), display_type, "us", os);
+}
+
 void HotspotsService::cpu(
     ::google::protobuf::RpcController* cntl_base,
     const ::brpc::HotspotsRequest*,
@@ -1280,6 +1560,14 @@ void HotspotsService::GetTabInfo(TabInfoList* info_list) const {
     info = info_list->add();
     info->path = "/hotspots/iobuf";
     info->tab_name = "iobuf";
+
+    info = info_list->add();
+    info->path = "/hotspots/continuous";
+    info->tab_name = "continuous";
+
+    info = info_list->add();
+    info->path = "/hotspots/offcpu";
+    info->tab_name = "offcpu";
 }
 
 } // namespace brpc
@@ -55,6 +55,16 @@ public:
                ::brpc::HotspotsResponse* response,
                ::google::protobuf::Closure* done);
 
+    void continuous(::google::protobuf::RpcController* cntl_base,
+                    const ::brpc::HotspotsRequest* request,
+                    ::brpc::HotspotsResponse* response,
+                    ::google::protobuf::Closure* done);
+
+    void offcpu(::google::protobuf::RpcController* cntl_base,
+                const ::brpc::HotspotsRequest* request,
+                ::brpc::HotspotsResponse* response,
+                ::google::protobuf::Closure* done);
+
     void cpu_non_responsive(::google::protobuf::RpcController* cntl_base,
                             const ::brpc::HotspotsRequest* request,
                             ::brpc::HotspotsResponse* response,
@@ -0,0 +1,437 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <inttypes.h>
+#include <google/protobuf/descriptor.h>
+#include "butil/containers/mru_cache.h"
+#include "butil/synchronization/lock.h"
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "bvar/bvar.h"
+#include "brpc/shared_object.h"
+#include "brpc/caching_channel.h"
+
+namespace brpc {
+
+DECLARE_bool(usercode_in_pthread);
+
+static bvar::Adder<int64_t>* g_nhit = NULL;
+static bvar::Adder<int64_t>* g_nmiss = NULL;
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_nhit = new bvar::Adder<int64_t>("rpc_client_cache_hit_count");
+    g_nmiss = new bvar::Adder<int64_t>("rpc_client_cache_miss_count");
+}
+
+CachingChannelOptions::CachingChannelOptions()
+    : ttl_ms(10000)
+    , max_size(64 * 1024 * 1024)
+    , cache_policy(NULL) {}
+
+// Serialized responses keyed by method and serialized requests, in the
+// order of recent use.
+class ResponseCache : public SharedObject {
+public:
+    explicit ResponseCache(size_t max_size)
+        : _max_size(max_size)
+        , _size(0)
+        , _version(0)
+        , _entries(EntryMap::NO_AUTO_EVICT) {}
+
+    // Returns false if the request can't be serialized.
+    static bool MakeKey(const google::protobuf::MethodDescriptor* method,
+                        const google::protobuf::Message* request,
+                        const butil::IOBuf& request_attachment,
+                        std::string* key);
+
+    // Parse the response cached for `key' into `response' and
+    // `response_attachment', and return true. Otherwise return false and
+    // set `version' to be passed to Fill().
+    bool Get(const std::string& key,
+             google::protobuf::Message* response,
+             butil::IOBuf* response_attachment,
+             int64_t* version);
+
+    // Cache the response unless the cache was invalidated after Get()
+    // returning `version'.
+    void Fill(const std::string& key, int64_t version, int64_t ttl_ms,
+              const google::protobuf::Message& response,
+              const butil::IOBuf& response_attachment);
+
+    // Remove cached responses with keys starting with `prefix'.
+    void Invalidate(const std::string& prefix, bool prefix_only);
+
+    size_t count() const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _entries.size();
+    }
+    size_t size() const {
+        BAIDU_SCOPED_LOCK(_mutex);
+        return _size;
+    }
+
+private:
+    struct Entry {
+        butil::IOBuf response;
+        butil::IOBuf response_attachment;
+        int64_t expire_us;
+    };
+    typedef butil::HashingMRUCache<std::string, Entry> EntryMap;
+
+    static size_t SizeOf(const std::string& key, const Entry& e) {
+        return key.size() + e.response.size() + e.response_attachment.size();
+    }
+    void EraseLocked(EntryMap::iterator it) {
+        _size -= SizeOf(it->first, it->second);
+        _entries.Erase(it);
+    }
+
+    const size_t _max_size;
+    mutable butil::Mutex _mutex;
+    size_t _size;
+    // Increased by every invalidation.
+    int64_t _version;
+    EntryMap _entries;
+};
+
+bool ResponseCache::MakeKey(const google::protobuf::MethodDescriptor* method,
+                            const google::protobuf::Message* request,
+                            const butil::IOBuf& request_attachment,
+                            std::string* key) {
+    // Method names don't contain '\0', a size prefix separates the request
+    // from the attachment.
+    key->assign(method->full_name());
+    key->push_back('\0');
+    const size_t prefix_size = key->size();
+    key->append(sizeof(uint64_t), '\0');
+    if (!request->AppendToString(key)) {
+        return false;
+    }
+    const uint64_t request_size = key->size() - prefix_size - sizeof(uint64_t);
+    memcpy(&(*key)[prefix_size], &request_size, sizeof(request_size));
+    request_attachment.append_to(key);
+    return true;
+}
+
+bool ResponseCache::Get(const std::string& key,
+                        google::protobuf::Message* response,
+                        butil::IOBuf* response_attachment,
+                        int64_t* version) {
+    butil::IOBuf buf;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        EntryMap::iterator it = _entries.Get(key);
+        if (it != _entries.end()) {
+            if (it->second.expire_us > butil::gettimeofday_us()) {
+                buf = it->second.response;
+                *response_attachment = it->second.response_attachment;
+            } else {
+                EraseLocked(it);
+                it = _entries.end();
+            }
+        }
+        if (it == _entries.end()) {
+            *version = _version;
+            return false;
+        }
+    }
+    // Parse outside the lock.
+    butil::IOBufAsZeroCopyInputStream wrapper(buf);
+    if (response->ParseFromZeroCopyStream(&wrapper)) {
+        return true;
+    }
+    response->Clear();
+    response_attachment->clear();
+    BAIDU_SCOPED_LOCK(_mutex);
+    *version = _version;
+    return false;
+}
+
+void ResponseCache::Fill(const std::string& key, int64_t version,
+                         int64_t ttl_ms,
+                         const google::protobuf::Message& response,
+                         const butil::IOBuf& response_attachment) {
+    Entry e;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&e.response);
+    if (!response.SerializeToZeroCopyStream(&wrapper)) {
+        return;
+    }
+    e.response_attachment = response_attachment;
+    e.expire_us = butil::gettimeofday_us() + ttl_ms * 1000L;
+    const size_t entry_size = SizeOf(key, e);
+    if (entry_size > _max_size) {
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (version != _version) {
+        // Invalidated during the RPC, the response is possibly stale.
+        return;
+    }
+    EntryMap::iterator it = _entries.Peek(key);
+    if (it != _entries.end()) {
+        EraseLocked(it);
+    }
+    while (_size + entry_size > _max_size) {
+        EntryMap::reverse_iterator oldest = _entries.rbegin();
+        _size -= SizeOf(oldest->first, oldest->second);
+        _entries.Erase(oldest);
+    }
+    _entries.Put(key, e);
+    _size += entry_size;
+}
+
+void ResponseCache::Invalidate(const std::string& prefix, bool prefix_only) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    ++_version;
+    if (!prefix_only) {
+        EntryMap::iterator it = _entries.Peek(prefix);
+        if (it != _entries.end()) {
+            EraseLocked(it);
+        }
+        return;
+    }
+    for (EntryMap::iterator it = _entries.begin(); it != _entries.end();) {
+        if (it->first.compare(0, prefix.size(), prefix) == 0) {
+            _size -= SizeOf(it->first, it->second);
+            it = _entries.Erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Fill the cache with the response before running user's done.
+class CachingDone : public google::protobuf::Closure {
+public:
+    CachingDone(ResponseCache* cache, const CachePolicy* policy,
+                int64_t ttl_ms, std::string* key, int64_t version,
+                Controller* cntl, google::protobuf::Message* response,
+                google::protobuf::Closure* done)
+        : _cache(cache), _policy(policy), _ttl_ms(ttl_ms), _version(version)
+        , _cntl(cntl), _response(response), _done(done) {
+        _key.swap(*key);
+    }
+
+    void Run() override {
+        Fill();
+        _done->Run();
+        delete this;
+    }
+
+    void Fill() {
+        if (_cntl->Failed()) {
+            return;
+        }
+        const int64_t ttl_ms = (_policy ?
+            _policy->GetTtlMs(_cntl, _response, _ttl_ms) : _ttl_ms);
+        if (ttl_ms > 0) {
+            _cache->Fill(_key, _version, ttl_ms, *_response,
+                         _cntl->response_attachment());
+        }
+    }
+
+private:
+    butil::intrusive_ptr<ResponseCache> _cache;
+    const CachePolicy* _policy;
+    int64_t _ttl_ms;
+    std::string _key;
+    int64_t _version;
+    Controller* _cntl;
+    google::protobuf::Message* _response;
+    google::protobuf::Closure* _done;
+};
+
+CachingChannel::CachingChannel()
+    : _sub(NULL)
+    , _ownership(DOESNT_OWN_CHANNEL) {
+}
+
+CachingChannel::~CachingChannel() {
+    if (_ownership == OWNS_CHANNEL) {
+        delete _sub;
+    }
+    _sub = NULL;
+}
+
+int CachingChannel::Init(ChannelBase* sub_channel, ChannelOwnership ownership,
+                         const CachingChannelOptions* options) {
+    if (NULL == sub_channel) {
+        LOG(ERROR) << "Parameter[sub_channel] is NULL";
+        return -1;
+    }
+    if (initialized()) {
+        LOG(ERROR) << "CachingChannel=" << this << " is already initialized";
+        return -1;
+    }
+    if (options) {
+        _options = *options;
+    }
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+    _cache.reset(new ResponseCache(_options.max_size));
+    _sub = sub_channel;
+    _ownership = ownership;
+    return 0;
+}
+
+void* CachingChannel::RunDoneAndDestroy(void* arg) {
+    Controller* c = static_cast<Controller*>(arg);
+    // Move done out from the controller.
+    google::protobuf::Closure* done = c->_done;
+    c->_done = NULL;
+    // Save call_id from the controller which may be deleted after Run().
+    const bthread_id_t cid = c->call_id();
+    done->Run();
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+    return NULL;
+}
+
+void CachingChannel::CallMethod(
+    const google::protobuf::MethodDescriptor* method,
+    google::protobuf::RpcController* cntl_base,
+    const google::protobuf::Message* request,
+    google::protobuf::Message* response,
+    google::protobuf::Closure* done) {
+    Controller* cntl = static_cast<Controller*>(cntl_base);
+    std::string key;
+    int64_t version = 0;
+    if (!initialized() || method == NULL || request == NULL ||
+        response == NULL ||
+        (_options.cache_policy &&
+         !_options.cache_policy->DoCache(method, cntl, request)) ||
+        !ResponseCache::MakeKey(method, request, cntl->request_attachment(),
+                                &key)) {
+        if (!initialized()) {
+            cntl->SetFailed(EINVAL, "CachingChannel=%p is not initialized yet",
+                            this);
+            // Fall through to end the RPC as cached ones.
+        } else {
+            return _sub->CallMethod(method, cntl, request, response, done);
+        }
+    } else if (!_cache->Get(key, response, &cntl->response_attachment(),
+                            &version)) {
+        *g_nmiss << 1;
+        if (done) {
+            return _sub->CallMethod(
+                method, cntl, request, response,
+                new CachingDone(_cache.get(), _options.cache_policy,
+                                _options.ttl_ms, &key, version, cntl,
+                                response, done));
+        }
+        _sub->CallMethod(method, cntl, request, response, NULL);
+        CachingDone(_cache.get(), _options.cache_policy, _options.ttl_ms,
+                    &key, version, cntl, response, NULL).Fill();
+        return;
+    } else {
+        *g_nhit << 1;
+    }
+
+    // End the RPC without calling the sub channel.
+    cntl->OnRPCBegin(butil::gettimeofday_us());
+    const CallId cid = cntl->call_id();
+    const int rc = bthread_id_lock(cid, NULL);
+    if (rc != 0) {
+        CHECK_EQ(EINVAL, rc);
+        if (!cntl->FailedInline()) {
+            cntl->SetFailed(EINVAL, "Fail to lock call_id=%" PRId64, cid.value);
+        }
+        LOG_IF(ERROR, cntl->is_used_by_rpc())
+            << "Controller=" << cntl << " was used by another RPC before. "
+            "Did you forget to Reset() it before reuse?";
+        // Have to run done in-place.
+        // Read comment in CallMethod() in channel.cpp for details.
+        if (done) {
+            done->Run();
+        }
+        return;
+    }
+    cntl->set_used_by_rpc();
+    if (done) {
+        if (!cntl->is_done_allowed_to_run_in_place()) {
+            bthread_t bh;
+            bthread_attr_t attr = (FLAGS_usercode_in_pthread ?
+                                   BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL);
+            // Hack: save done in cntl->_done to remove a malloc of args.
+            cntl->_done = done;
+            if (bthread_start_background(&bh, &attr, RunDoneAndDestroy, cntl) == 0) {
+                return;
+            }
+            cntl->_done = NULL;
+            LOG(FATAL) << "Fail to start bthread";
+        }
+        done->Run();
+    } else {
+        cntl->OnRPCEnd(butil::gettimeofday_us());
+    }
+    CHECK_EQ(0, bthread_id_unlock_and_destroy(cid));
+}
+
+void CachingChannel::Invalidate(const google::protobuf::MethodDescriptor* method,
+                                const google::protobuf::Message* request,
+                                const butil::IOBuf& request_attachment) {
+    std::string key;
+    if (initialized() &&
+        ResponseCache::MakeKey(method, request, request_attachment, &key)) {
+        _cache->Invalidate(key, false);
+    }
+}
+
+void CachingChannel::InvalidateMethod(
+    const google::protobuf::MethodDescriptor* method) {
+    if (initialized()) {
+        std::string prefix = method->full_name();
+        prefix.push_back('\0');
+        _cache->Invalidate(prefix, true);
+    }
+}
+
+void CachingChannel::InvalidateAll() {
+    if (initialized()) {
+        _cache->Invalidate(std::string(), true);
+    }
+}
+
+size_t CachingChannel::cached_count() const {
+    return initialized() ? _cache->count() : 0;
+}
+
+size_t CachingChannel::cached_size() const {
+    return initialized() ? _cache->size() : 0;
+}
+
+int CachingChannel::Weight() {
+    return initialized() ? _sub->Weight() : 0;
+}
+
+int CachingChannel::CheckHealth() {
+    return initialized() ? _sub->CheckHealth() : -1;
+}
+
+void CachingChannel::Describe(
+    std::ostream& os, const DescribeOptions& options) const {
+    os << "CachingChannel[";
+    if (initialized()) {
+        os << "cached=" << _cache->count() << ' ';
+        _sub->Describe(os, options);
+    } else {
+        os << "uninitialized";
+    }
+    os << ']';
+}
+
+} // namespace brpc
@@ -0,0 +1,153 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CACHING_CHANNEL_H
+#define BRPC_CACHING_CHANNEL_H
+
+// To brpc developers: This is a header included by user, don't depend
+// on internal structures, use opaque pointers instead.
+
+#include "butil/intrusive_ptr.hpp"
+#include "brpc/channel.h"
+
+
+namespace brpc {
+
+class ResponseCache;
+
+// Inherit this class to customize which RPCs are cached and for how long.
+class CachePolicy {
+public:
+    virtual ~CachePolicy() = default;
+
+    // Returns true if the RPC should be served by the cache and its
+    // response be cached, false to send it to the sub channel directly.
+    // [Example]
+    // Cache GetConfig only:
+    //   class MyCachePolicy : public brpc::CachePolicy {
+    //   public:
+    //     bool DoCache(const google::protobuf::MethodDescriptor* method,
+    //                  const brpc::Controller*,
+    //                  const google::protobuf::Message*) const {
+    //       return method->name() == "GetConfig";
+    //     }
+    //   };
+    virtual bool DoCache(const google::protobuf::MethodDescriptor* method,
+                         const Controller* controller,
+                         const google::protobuf::Message* request) const = 0;
+
+    // Returns milliseconds for which the successful `response' of the RPC
+    // is cached, non-positive value to not cache it.
+    // Returns `default_ttl_ms' (CachingChannelOptions.ttl_ms) by default.
+    virtual int64_t GetTtlMs(const Controller* controller,
+                             const google::protobuf::Message* response,
+                             int64_t default_ttl_ms) const {
+        return default_ttl_ms;
+    }
+};
+
+struct CachingChannelOptions {
+    // Constructed with default options.
+    CachingChannelOptions();
+
+    // Responses are served from the cache for so many milliseconds after
+    // being received, overridable by CachePolicy.GetTtlMs().
+    // Default: 10000 (milliseconds)
+    int64_t ttl_ms;
+
+    // Max bytes of cached requests, responses and attachments. Responses
+    // used least recently are evicted when the size is exceeded.
+    // Default: 64MB
+    size_t max_size;
+
+    // Customize which RPCs are cached. All RPCs are cached when it's NULL.
+    // This object is NOT owned by channel and should remain valid when
+    // channel is used.
+    // Default: NULL
+    const CachePolicy* cache_policy;
+};
+
+// A combo channel caching successful responses of the sub channel, aka
+// "cchan". RPCs calling the same method with the same request and request
+// attachment are served locally with the response and response attachment
+// of an earlier RPC until the cached response expires or is invalidated.
+// Requests are keyed by their serialized bytes, RPCs without request or
+// response (e.g. http calls with NULL method), or with unserializable
+// requests are not cached. Only the response and response attachment are
+// cached, other fields of Controller (e.g. http_response()) are not set for
+// cached RPCs.
+// Cached RPCs end in CallMethod, `done' of an asynchronous call is run in
+// another bthread as usual.
+class CachingChannel : public ChannelBase/*non-copyable*/ {
+public:
+    CachingChannel();
+    ~CachingChannel();
+
+    // Cache responses of `sub_channel'. If `ownership' is OWNS_CHANNEL,
+    // `sub_channel' is deleted along with this channel.
+    // Use default options if `options' is NULL.
+    // Returns 0 on success, -1 otherwise.
+    int Init(ChannelBase* sub_channel, ChannelOwnership ownership,
+             const CachingChannelOptions* options);
+
+    void CallMethod(const google::protobuf::MethodDescriptor* method,
+                    google::protobuf::RpcController* controller,
+                    const google::protobuf::Message* request,
+                    google::protobuf::Message* response,
+                    google::protobuf::Closure* done);
+
+    // Remove the cached response to `request' of `method'.
+    void Invalidate(const google::protobuf::MethodDescriptor* method,
+                    const google::protobuf::Message* request,
+                    const butil::IOBuf& request_attachment = butil::IOBuf());
+    // Remove cached responses of `method'.
+    void InvalidateMethod(const google::protobuf::MethodDescriptor* method);
+    // Remove all cached responses.
+    void InvalidateAll();
+
+    // Number of cached responses.
+    size_t cached_count() const;
+    // Bytes of the cache, see CachingChannelOptions.max_size.
+    size_t cached_size() const;
+
+    // True iff Init() was successful.
+    bool initialized() const { return _sub != NULL; }
+
+    int Weight();
+
+    int CheckHealth();
+
+    void Describe(std::ostream& os, const DescribeOptions& options) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(CachingChannel);
+
+    static void* RunDoneAndDestroy(void* arg);
+
+    ChannelBase* _sub;
+    ChannelOwnership _ownership;
+    CachingChannelOptions _options;
+    // Shared with unfinished RPCs which fill the cache after this channel
+    // is destroyed.
+    butil::intrusive_ptr<ResponseCache> _cache;
+};
+
+} // namespace brpc
+
+
+#endif  // BRPC_CACHING_CHANNEL_H
@@ -35,6 +35,7 @@
 #include "brpc/serialized_request.h"
 #include "brpc/serialized_response.h"
 #include "brpc/details/usercode_backup_pool.h"       // TooManyUserCode
+#include "brpc/details/request_coalescer.h"
 #include "brpc/rdma/rdma_helper.h"
 #include "brpc/policy/esp_authenticator.h"
 
@@ -65,6 +66,7 @@ ChannelOptions::ChannelOptions()
     , backup_request_policy(NULL)
     , retry_policy(NULL)
     , ns_filter(NULL)
+    , coalesce_requests(false)
 {}
 
 ChannelSSLOptions* ChannelOptions::mutable_ssl_options() {
@@ -209,6 +211,9 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
     _serialize_request = protocol->serialize_request;
     _pack_request = protocol->pack_request;
     _get_method_name = protocol->get_method_name;
+    if (_options.coalesce_requests && _coalescer == NULL) {
+        _coalescer.reset(new RequestCoalescer);
+    }
 
     // Check connection_type
     if (_options.connection_type == CONNECTION_TYPE_UNKNOWN) {
@@ -216,7 +221,10 @@ int Channel::InitChannelOptions(const ChannelOptions* options) {
         // connection_type.
         const bool has_error = _options.connection_type.has_error();
         
-        if (protocol->supported_connection_type & CONNECTION_TYPE_SINGLE) {
+        // http pipelines requests over "single" connection which works for
+        // servers responding in order only, thus is opt-in.
+        if ((protocol->supported_connection_type & CONNECTION_TYPE_SINGLE) &&
+            _options.protocol != PROTOCOL_HTTP) {
             _options.connection_type = CONNECTION_TYPE_SINGLE;
         } else if (protocol->supported_connection_type & CONNECTION_TYPE_POOLED) {
             _options.connection_type = CONNECTION_TYPE_POOLED;
@@ -539,6 +547,15 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
     // Share the lb with controller.
     cntl->_lb = _lb;
 
+    const bool coalesce = (_coalescer != NULL &&
+                           RequestCoalescer::CanCoalesce(cntl));
+    // The call shared by coalesced RPCs is issued with the request before
+    // serialization which may change the attachment (e.g. http).
+    butil::IOBuf unserialized_attachment;
+    if (coalesce) {
+        unserialized_attachment = cntl->request_attachment();
+    }
+
     // Ensure that serialize_request is done before pack_request in all
     // possible executions, including:
     //   HandleSendFailed => OnVersionedRPCReturned => IssueRPC(pack_request)
@@ -563,6 +580,16 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         cntl->_backup_request_policy = NULL;
     }
 
+    if (coalesce) {
+        // The shared call retries and sends backup requests by itself.
+        // NOTE: The shared call never ends before unlocking correlation_id.
+        _coalescer->Join(this, method, cntl, request, response,
+                         unserialized_attachment);
+        cntl->set_max_retry(0);
+        cntl->set_backup_request_ms(-1);
+        cntl->_backup_request_policy = NULL;
+    }
+
     if (cntl->backup_request_ms() >= 0 &&
         (cntl->backup_request_ms() < cntl->timeout_ms() ||
          cntl->timeout_ms() < 0)) {
@@ -602,7 +629,12 @@ void Channel::CallMethod(const google::protobuf::MethodDescriptor* method,
         cntl->_deadline_us = -1;
     }
 
-    cntl->IssueRPC(start_send_real_us);
+    if (!coalesce) {
+        cntl->IssueRPC(start_send_real_us);
+    } else {
+        cntl->_current_call.begin_time_us = start_send_real_us;
+        CHECK_EQ(0, bthread_id_unlock(correlation_id));
+    }
     if (done == NULL) {
         // MUST wait for response when sending synchronous RPC. It will
         // be woken up by callback when RPC finishes (succeeds or still
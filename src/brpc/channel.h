@@ -40,6 +40,8 @@
 
 namespace brpc {
 
+class RequestCoalescer;
+
 struct ChannelOptions {
     // Constructed with default options.
     ChannelOptions();
@@ -89,6 +91,12 @@ struct ChannelOptions {
     // NOTE: You can assign name of the type to this field as well, for
     // Example: options.connection_type = "single";
     // Possible values: "single", "pooled", "short".
+    // "http" uses "pooled" by default. With "single", HTTP/1.1 requests are
+    // pipelined on one connection and responses are matched with requests
+    // in order, which requires the server to respond in the order of
+    // requests (brpc servers don't, use "h2" instead). RPCs reading
+    // responses progressively or of HEAD requests, and RPCs to servers
+    // closing connections after responses, use pooled connections.
     AdaptiveConnectionType connection_type;
 
     // Channel.Init() succeeds even if there's no server in the NamingService. 
@@ -148,6 +156,15 @@ struct ChannelOptions {
     // Its priority is higher than FLAGS_health_check_path and FLAGS_health_check_timeout_ms.
     // When it is not set, FLAGS_health_check_path and FLAGS_health_check_timeout_ms will take effect.
     HealthCheckOption hc_option;
+
+    // Share one call among in-flight RPCs calling the same method with the
+    // same request (or Controller.coalescing_key()), which is useful for
+    // idempotent methods receiving bursts of identical requests, e.g. reading
+    // a hot key. Each RPC still has its own timeout and can be canceled
+    // separately, but it's not retried nor backed up by itself. RPCs with
+    // streams or reading responses progressively are never coalesced.
+    // Default: false
+    bool coalesce_requests;
 private:
     // SSLOptions is large and not often used, allocate it on heap to
     // prevent ChannelOptions from being bloated in most cases.
@@ -253,6 +270,8 @@ protected:
     butil::intrusive_ptr<SharedLoadBalancer> _lb;
     ChannelOptions _options;
     int _preferred_index;
+    // Non-NULL when _options.coalesce_requests is true.
+    butil::intrusive_ptr<RequestCoalescer> _coalescer;
 };
 
 enum ChannelOwnership {
@@ -231,7 +231,9 @@ void Controller::ResetNonPods() {
         _rpa.reset(NULL);
     }
     delete _remote_stream_settings;
+    _grpc_stream.reset(NULL);
     _thrift_method_name.clear();
+    _coalescing_key.clear();
     _after_rpc_resp_fn = nullptr;
 
     CHECK(_unfinished_call == NULL);
@@ -265,6 +267,8 @@ void Controller::ResetPods() {
     _timeout_id = 0;
     _begin_time_us = 0;
     _end_time_us = 0;
+    _start_parse_us = 0;
+    _start_callback_us = 0;
     _tos = 0;
     _preferred_index = -1;
     _request_compress_type = COMPRESS_TYPE_NONE;
@@ -1404,6 +1408,9 @@ void* Controller::session_local_data() {
 }
 
 void Controller::HandleStreamConnection(Socket *host_socket) {
+    if (_grpc_stream != NULL) {
+        _grpc_stream->OnRPCReturned(this);
+    }
     if (_request_streams.empty()) {
         CHECK(!has_remote_stream());
         return;
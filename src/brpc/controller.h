@@ -45,6 +45,7 @@
 #include "brpc/progressive_attachment.h"       // ProgressiveAttachment
 #include "brpc/progressive_reader.h"           // ProgressiveReader
 #include "brpc/grpc.h"
+#include "brpc/grpc_stream.h"                  // GrpcStream
 #include "brpc/kvmap.h"
 #include "brpc/rpc_dump.h"
 
@@ -74,6 +75,7 @@ class RetryPolicy;
 class BackupRequestPolicy;
 class InputMessageBase;
 class ThriftStub;
+class RequestCoalescer;
 namespace policy {
 class OnServerStreamCreated;
 void ProcessMongoRequest(InputMessageBase*);
@@ -118,9 +120,11 @@ friend class ParallelChannelDone;
 friend class ControllerPrivateAccessor;
 friend class ServerPrivateAccessor;
 friend class SelectiveChannel;
+friend class CachingChannel;
 friend class ThriftStub;
 friend class schan::Sender;
 friend class schan::SubDone;
+friend class RequestCoalescer;
 friend class policy::OnServerStreamCreated;
 friend int StreamCreate(StreamId*, Controller&, const StreamOptions*);
 friend int StreamCreate(StreamIds&, int, Controller&, const StreamOptions*);
@@ -151,6 +155,9 @@ friend void policy::ProcessThriftRequest(InputMessageBase*);
     static const uint32_t FLAGS_PB_SINGLE_REPEATED_TO_ARRAY = (1 << 20);
     static const uint32_t FLAGS_MANAGE_HTTP_BODY_ON_ERROR = (1 << 21);
     static const uint32_t FLAGS_WRITE_TO_SOCKET_IN_BACKGROUND = (1 << 22);
+    static const uint32_t FLAGS_PB_STREAMING_JSON = (1 << 23);
+    // The call shared by coalesced RPCs, which is not coalesced again.
+    static const uint32_t FLAGS_COALESCED_CALL = (1 << 24);
 
 public:
     struct Inheritable {
@@ -251,6 +258,15 @@ public:
     }
     bool has_request_code() const { return has_flag(FLAGS_REQUEST_CODE); }
     uint64_t request_code() const { return _request_code; }
+
+    // Identical in-flight RPCs over a channel with
+    // ChannelOptions.coalesce_requests share one call, and they're identical
+    // when calling the same method with the same key. The key is made from
+    // the serialized request (and the http request header) by default,
+    // set this to share calls of requests differing in unimportant fields,
+    // e.g. a timestamp.
+    void set_coalescing_key(const std::string& key) { _coalescing_key = key; }
+    const std::string& coalescing_key() const { return _coalescing_key; }
     
     // Mutable header of http request.
     HttpHeader& http_request() {
@@ -364,6 +380,14 @@ public:
     // of json in HTTP response.
     void set_pb_jsonify_empty_array(bool f) { set_flag(FLAGS_PB_JSONIFY_EMPTY_ARRAY, f); }
     bool has_pb_jsonify_empty_array() const { return has_flag(FLAGS_PB_JSONIFY_EMPTY_ARRAY); }
+
+    // [Server-side] Set if the pb response should be converted to json
+    // progressively and sent in chunks (as with CreateProgressiveAttachment())
+    // rather than after the whole json is generated, so that huge responses
+    // don't have to be held in memory. Only affects uncompressed json
+    // responses of HTTP/1.x.
+    void set_pb_streaming_json(bool f) { set_flag(FLAGS_PB_STREAMING_JSON, f); }
+    bool has_pb_streaming_json() const { return has_flag(FLAGS_PB_STREAMING_JSON); }
     
     // Whether to always print primitive fields. By default proto3 primitive
     // fields with default values will be omitted in JSON output. For example, an
@@ -838,6 +862,11 @@ private:
     // Begin/End time of a single RPC call (since Epoch in microseconds)
     int64_t _begin_time_us;
     int64_t _end_time_us;
+    // Server-side, when the request started being parsed and the user's
+    // callback was called (cpuwide microseconds), set with
+    // -enable_method_phase_latency only.
+    int64_t _start_parse_us;
+    int64_t _start_callback_us;
     short _tos;    // Type of service.
     // The index of parse function which `InputMessenger' will use
     int _preferred_index;
@@ -902,10 +931,14 @@ private:
     StreamIds _response_streams;
     // Defined at both sides
     StreamSettings *_remote_stream_settings;
+    // Stream of streaming gRPC methods, defined at both sides
+    butil::intrusive_ptr<GrpcStream> _grpc_stream;
 
     // Thrift method name, only used when thrift protocol enabled
     std::string _thrift_method_name;
 
+    std::string _coalescing_key;
+
     uint32_t _auth_flags;
 
     AfterRpcRespFnType _after_rpc_resp_fn;
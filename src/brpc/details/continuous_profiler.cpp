@@ -0,0 +1,667 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <signal.h>
+#include <errno.h>
+#include <dlfcn.h>                               // dladdr
+#include <cxxabi.h>                              // abi::__cxa_demangle
+#include <execinfo.h>                            // backtrace
+#include <pthread.h>
+#include <unistd.h>                              // usleep
+#include <sys/time.h>                            // setitimer
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/file_util.h"
+#include "butil/files/file_enumerator.h"
+#include "butil/logging.h"
+#include "butil/string_printf.h"
+#include "butil/strings/string_number_conversions.h"
+#include "butil/thread_local.h"
+#include "butil/time.h"
+#include "bvar/passive_status.h"
+#include "bthread/task_group.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/builtin/common.h"                 // FLAGS_rpc_profiling_dir
+#include "brpc/details/continuous_profiler.h"
+
+namespace bthread {
+extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
+}
+
+namespace brpc {
+
+static bool ValidateContinuousProfiling(const char*, bool enabled);
+
+DEFINE_bool(continuous_profiling, false,
+            "Sample cpu usage of this process continuously with a low "
+            "frequency and keep the profiles of recent minutes, which are "
+            "viewable in /hotspots/continuous");
+BRPC_VALIDATE_GFLAG(continuous_profiling, ValidateContinuousProfiling);
+
+DEFINE_int32(continuous_profiling_hz, 19,
+             "Samples per cpu-second of continuous profiling, taking effect "
+             "when -continuous_profiling is turned on");
+BRPC_VALIDATE_GFLAG(continuous_profiling_hz, PositiveInteger);
+
+DEFINE_int32(continuous_profiling_kept_minutes, 60,
+             "Number of per-minute profiles kept by continuous profiling");
+BRPC_VALIDATE_GFLAG(continuous_profiling_kept_minutes, PositiveInteger);
+
+DEFINE_bool(continuous_profiling_save_to_disk, true,
+            "Save per-minute profiles of continuous profiling into "
+            "<rpc_profiling_dir>/continuous");
+BRPC_VALIDATE_GFLAG(continuous_profiling_save_to_disk, PassValidate);
+
+static const int MAX_STACK_DEPTH = 64;
+// Frames of the signal handler and the signal trampoline.
+static const int SKIPPED_FRAMES = 2;
+// Must be power of 2. Drained every DRAIN_INTERVAL_US, large enough for
+// hundreds of busy cores at default frequency.
+static const size_t SAMPLE_RING_SIZE = 2048;
+static const int64_t DRAIN_INTERVAL_US = 100000;
+static const size_t MAX_CACHED_SYMBOLS = 65536;
+
+enum SampleSlotState {
+    SLOT_EMPTY = 0,
+    SLOT_WRITING = 1,
+    SLOT_FULL = 2
+};
+
+enum SampleContext {
+    SAMPLE_IN_PTHREAD = 0,
+    SAMPLE_IN_BTHREAD = 1,
+    SAMPLE_IN_WORKER = 2      // main task of a bthread worker, namely idle
+};
+
+struct CpuSample {
+    butil::atomic<int> state;
+    int depth;
+    int context;
+    void* entry;
+    void* pcs[MAX_STACK_DEPTH];
+};
+
+// Written by the signal handler which can't allocate memory, so slots are
+// preallocated. A slot still being written or not drained yet is skipped
+// and the sample is dropped.
+static butil::atomic<CpuSample*> g_samples(NULL);
+static butil::atomic<uint64_t> g_next_slot(0);
+static butil::atomic<bool> g_sampling(false);
+static butil::atomic<int64_t> g_nsampled(0);
+static butil::atomic<int64_t> g_ndropped(0);
+
+static void ProfileSignalHandler(int, siginfo_t*, void*) {
+    if (!g_sampling.load(butil::memory_order_acquire)) {
+        return;
+    }
+    const int saved_errno = errno;
+    const uint64_t index =
+        g_next_slot.fetch_add(1, butil::memory_order_relaxed);
+    CpuSample& s = g_samples.load(butil::memory_order_relaxed)[
+        index & (SAMPLE_RING_SIZE - 1)];
+    int expected = SLOT_EMPTY;
+    if (s.state.compare_exchange_strong(expected, SLOT_WRITING,
+                                        butil::memory_order_acquire)) {
+        s.depth = backtrace(s.pcs, MAX_STACK_DEPTH);
+        s.entry = NULL;
+        bthread::TaskGroup* g = bthread::tls_task_group;
+        if (g == NULL) {
+            s.context = SAMPLE_IN_PTHREAD;
+        } else if (g->is_current_main_task()) {
+            s.context = SAMPLE_IN_WORKER;
+        } else {
+            s.context = SAMPLE_IN_BTHREAD;
+            s.entry = (void*)g->current_task()->fn;
+        }
+        s.state.store(SLOT_FULL, butil::memory_order_release);
+        g_nsampled.fetch_add(1, butil::memory_order_relaxed);
+    } else {
+        g_ndropped.fetch_add(1, butil::memory_order_relaxed);
+    }
+    errno = saved_errno;
+}
+
+// ================ Sampler ================
+
+static pthread_mutex_t g_sampler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool g_enabled = false;
+static int g_npause = 0;
+static bool g_armed = false;
+static struct sigaction g_old_action;
+
+static void* RunAggregator(void*);
+
+static int64_t GetSampledCount(void*) {
+    return g_nsampled.load(butil::memory_order_relaxed);
+}
+static int64_t GetDroppedCount(void*) {
+    return g_ndropped.load(butil::memory_order_relaxed);
+}
+
+// Called with g_sampler_mutex held, the first time sampling starts.
+static int InitSamplerOnce() {
+    if (g_samples.load(butil::memory_order_relaxed) != NULL) {
+        return 0;
+    }
+    // The first call to backtrace() loads libgcc which allocates memory,
+    // do it before installing the handler.
+    void* dummy[4];
+    backtrace(dummy, arraysize(dummy));
+    CpuSample* samples = new (std::nothrow) CpuSample[SAMPLE_RING_SIZE];
+    if (samples == NULL) {
+        LOG(ERROR) << "Fail to allocate samples";
+        return -1;
+    }
+    for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+        samples[i].state.store(SLOT_EMPTY, butil::memory_order_relaxed);
+    }
+    g_samples.store(samples, butil::memory_order_release);
+    pthread_t th;
+    if (pthread_create(&th, NULL, RunAggregator, NULL) != 0) {
+        LOG(ERROR) << "Fail to create aggregator of continuous profiling";
+        g_samples.store(NULL, butil::memory_order_relaxed);
+        delete [] samples;
+        return -1;
+    }
+    pthread_detach(th);
+    new bvar::PassiveStatus<int64_t>(
+        "continuous_profiling_sample_count", GetSampledCount, NULL);
+    new bvar::PassiveStatus<int64_t>(
+        "continuous_profiling_dropped_count", GetDroppedCount, NULL);
+    return 0;
+}
+
+static int ArmSamplerLocked() {
+    if (InitSamplerOnce() != 0) {
+        return -1;
+    }
+    struct sigaction old_action;
+    if (sigaction(SIGPROF, NULL, &old_action) != 0) {
+        PLOG(ERROR) << "Fail to get action of SIGPROF";
+        return -1;
+    }
+    struct itimerval old_timer;
+    if (getitimer(ITIMER_PROF, &old_timer) != 0) {
+        PLOG(ERROR) << "Fail to get ITIMER_PROF";
+        return -1;
+    }
+    if (((old_action.sa_flags & SA_SIGINFO) ||
+         (old_action.sa_handler != SIG_DFL &&
+          old_action.sa_handler != SIG_IGN)) ||
+        old_timer.it_interval.tv_sec != 0 ||
+        old_timer.it_interval.tv_usec != 0) {
+        LOG(ERROR) << "Another profiler is using SIGPROF";
+        return -1;
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = ProfileSignalHandler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set action of SIGPROF";
+        return -1;
+    }
+    g_old_action = old_action;
+    g_sampling.store(true, butil::memory_order_release);
+    const int hz = std::max(1, std::min(FLAGS_continuous_profiling_hz, 1000));
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        PLOG(ERROR) << "Fail to set ITIMER_PROF";
+        g_sampling.store(false, butil::memory_order_release);
+        sigaction(SIGPROF, &g_old_action, NULL);
+        return -1;
+    }
+    g_armed = true;
+    return 0;
+}
+
+static void DisarmSamplerLocked() {
+    g_sampling.store(false, butil::memory_order_release);
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    // A SIGPROF may still be pending, don't let the default action
+    // terminate the process. gperftools accepts SIG_IGN as well.
+    struct sigaction restored = g_old_action;
+    if (!(restored.sa_flags & SA_SIGINFO) && restored.sa_handler == SIG_DFL) {
+        restored.sa_handler = SIG_IGN;
+    }
+    sigaction(SIGPROF, &restored, NULL);
+    g_armed = false;
+}
+
+static int UpdateSamplerLocked() {
+    const bool should_arm = (g_enabled && g_npause == 0);
+    if (should_arm && !g_armed) {
+        return ArmSamplerLocked();
+    } else if (!should_arm && g_armed) {
+        DisarmSamplerLocked();
+    }
+    return 0;
+}
+
+int StartContinuousProfiler() {
+    pthread_mutex_lock(&g_sampler_mutex);
+    const bool old_enabled = g_enabled;
+    g_enabled = true;
+    const int rc = UpdateSamplerLocked();
+    if (rc != 0) {
+        g_enabled = old_enabled;
+    }
+    pthread_mutex_unlock(&g_sampler_mutex);
+    return rc;
+}
+
+void StopContinuousProfiler() {
+    pthread_mutex_lock(&g_sampler_mutex);
+    g_enabled = false;
+    UpdateSamplerLocked();
+    pthread_mutex_unlock(&g_sampler_mutex);
+}
+
+bool IsContinuousProfilerRunning() {
+    pthread_mutex_lock(&g_sampler_mutex);
+    const bool enabled = g_enabled;
+    pthread_mutex_unlock(&g_sampler_mutex);
+    return enabled;
+}
+
+static bool ValidateContinuousProfiling(const char*, bool enabled) {
+    if (enabled) {
+        return StartContinuousProfiler() == 0;
+    }
+    StopContinuousProfiler();
+    return true;
+}
+
+void PauseContinuousProfiler() {
+    pthread_mutex_lock(&g_sampler_mutex);
+    ++g_npause;
+    UpdateSamplerLocked();
+    pthread_mutex_unlock(&g_sampler_mutex);
+}
+
+void ResumeContinuousProfiler() {
+    pthread_mutex_lock(&g_sampler_mutex);
+    if (g_npause > 0 && --g_npause == 0 &&
+        UpdateSamplerLocked() != 0) {
+        LOG(ERROR) << "Fail to resume continuous profiling";
+    }
+    pthread_mutex_unlock(&g_sampler_mutex);
+}
+
+// ================ Aggregator ================
+
+typedef std::shared_ptr<const FoldedProfile> FoldedProfilePtr;
+
+static pthread_mutex_t g_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Profile of current minute.
+static FoldedProfile* g_cur_profile = NULL;
+static std::deque<FoldedProfilePtr>* g_history = NULL;
+static std::unordered_map<void*, std::string>* g_symbols = NULL;
+
+static bool InitProfilesOnce() {
+    if (g_cur_profile == NULL) {
+        g_cur_profile = new FoldedProfile;
+        g_history = new std::deque<FoldedProfilePtr>;
+        g_symbols = new std::unordered_map<void*, std::string>;
+    }
+    return true;
+}
+
+static std::string ContinuousProfileDir() {
+    return FLAGS_rpc_profiling_dir + "/continuous";
+}
+
+// Frames without dynamic symbols are shown as <module>+<offset> which can
+// be resolved offline by addr2line.
+static std::string Symbolize(void* pc) {
+    std::string name;
+    Dl_info info;
+    if (dladdr(pc, &info) != 0) {
+        if (info.dli_sname != NULL) {
+            int status = 0;
+            char* demangled =
+                abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+            name = (status == 0 && demangled ? demangled : info.dli_sname);
+            free(demangled);
+        } else if (info.dli_fname != NULL) {
+            const char* base = strrchr(info.dli_fname, '/');
+            butil::string_printf(&name, "%s+%#lx",
+                                 (base ? base + 1 : info.dli_fname),
+                                 (unsigned long)((char*)pc - (char*)info.dli_fbase));
+        }
+    }
+    if (name.empty()) {
+        butil::string_printf(&name, "%p", pc);
+    }
+    // ';' separates frames and newline separates stacks.
+    for (size_t i = 0; i < name.size(); ++i) {
+        if (name[i] == ';' || name[i] == '\n') {
+            name[i] = ':';
+        }
+    }
+    return name;
+}
+
+static const std::string& GetSymbol(void* pc) {
+    if (g_symbols->size() >= MAX_CACHED_SYMBOLS) {
+        g_symbols->clear();
+    }
+    std::string& name = (*g_symbols)[pc];
+    if (name.empty()) {
+        name = Symbolize(pc);
+    }
+    return name;
+}
+
+// Called with g_profile_mutex held.
+// pcs[0] is the interrupted frame when `leaf_is_interrupted' is true.
+static void AppendFoldedFramesLocked(void* const* pcs, int depth,
+                                     bool leaf_is_interrupted,
+                                     std::string* key) {
+    // Except the interrupted frame of cpu samples, pcs are return addresses
+    // which may belong to next function when the call is the last
+    // instruction, step back by one.
+    for (int i = depth - 1; i >= 0; --i) {
+        key->push_back(';');
+        key->append(GetSymbol((i == 0 && leaf_is_interrupted) ?
+                              pcs[i] : (void*)((char*)pcs[i] - 1)));
+    }
+}
+
+void AppendFoldedFrames(void* const* pcs, int depth, std::string* key) {
+    pthread_mutex_lock(&g_profile_mutex);
+    InitProfilesOnce();
+    AppendFoldedFramesLocked(pcs, depth, false, key);
+    pthread_mutex_unlock(&g_profile_mutex);
+}
+
+static void AppendSample(const CpuSample& s, FoldedStacks* stacks) {
+    std::string key;
+    key.reserve(256);
+    switch (s.context) {
+    case SAMPLE_IN_BTHREAD:
+        key.append("[bthread:");
+        key.append(s.entry ? GetSymbol(s.entry) : "unknown");
+        key.push_back(']');
+        break;
+    case SAMPLE_IN_WORKER:
+        key.append("[bthread_worker]");
+        break;
+    default:
+        key.append("[pthread]");
+        break;
+    }
+    if (s.depth > SKIPPED_FRAMES) {
+        AppendFoldedFramesLocked(s.pcs + SKIPPED_FRAMES,
+                                 s.depth - SKIPPED_FRAMES, true, &key);
+    }
+    ++(*stacks)[key];
+}
+
+// Called with g_profile_mutex held.
+static void DrainSamplesLocked() {
+    CpuSample* samples = g_samples.load(butil::memory_order_acquire);
+    if (samples == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < SAMPLE_RING_SIZE; ++i) {
+        CpuSample& s = samples[i];
+        if (s.state.load(butil::memory_order_acquire) != SLOT_FULL) {
+            continue;
+        }
+        AppendSample(s, &g_cur_profile->stacks);
+        ++g_cur_profile->nsample;
+        s.state.store(SLOT_EMPTY, butil::memory_order_release);
+    }
+}
+
+// Move the profile of last minute into history if the minute passed.
+// Called with g_profile_mutex held. Returns the profile to be saved.
+static FoldedProfilePtr RollProfileLocked(int64_t now_s) {
+    const int64_t minute_s = now_s - now_s % 60;
+    FoldedProfilePtr finished;
+    if (g_cur_profile->start_s == minute_s) {
+        return finished;
+    }
+    if (g_cur_profile->nsample > 0) {
+        finished.reset(g_cur_profile);
+        g_history->push_back(finished);
+        g_cur_profile = new FoldedProfile;
+    }
+    g_cur_profile->start_s = minute_s;
+    g_cur_profile->end_s = minute_s + 60;
+    while (g_history->size() > (size_t)FLAGS_continuous_profiling_kept_minutes) {
+        g_history->pop_front();
+    }
+    return finished;
+}
+
+
+static std::string ProfileFileName(const std::string& dir, int64_t start_s) {
+    std::string path = dir;
+    butil::string_appendf(&path, "/%" PRId64 ".folded", start_s);
+    return path;
+}
+
+// Returns start times of saved profiles, oldest first.
+static void ListSavedProfiles(const std::string& dir,
+                              std::vector<int64_t>* starts) {
+    starts->clear();
+    butil::FileEnumerator en(butil::FilePath(dir), false,
+                             butil::FileEnumerator::FILES, "*.folded");
+    for (butil::FilePath name = en.Next(); !name.empty(); name = en.Next()) {
+        int64_t start_s = 0;
+        if (butil::StringToInt64(name.BaseName().RemoveExtension().value(),
+                                 &start_s)) {
+            starts->push_back(start_s);
+        }
+    }
+    std::sort(starts->begin(), starts->end());
+}
+
+static void SaveProfile(const FoldedProfile& p) {
+    const std::string dir = ContinuousProfileDir();
+    butil::File::Error error;
+    if (!butil::CreateDirectoryAndGetError(butil::FilePath(dir), &error)) {
+        LOG_EVERY_SECOND(ERROR) << "Fail to create directory=" << dir
+                                << ", " << error;
+        return;
+    }
+    const std::string path = ProfileFileName(dir, p.start_s);
+    std::ofstream os(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!os) {
+        LOG_EVERY_SECOND(ERROR) << "Fail to open " << path;
+        return;
+    }
+    os << "# " << p.start_s << ' ' << p.end_s << ' ' << p.nsample << '\n';
+    for (FoldedStacks::const_iterator it = p.stacks.begin();
+         it != p.stacks.end(); ++it) {
+        os << it->first << ' ' << it->second << '\n';
+    }
+    os.close();
+    std::vector<int64_t> starts;
+    ListSavedProfiles(dir, &starts);
+    const size_t kept = FLAGS_continuous_profiling_kept_minutes;
+    for (size_t i = 0; i + kept < starts.size(); ++i) {
+        butil::DeleteFile(butil::FilePath(ProfileFileName(dir, starts[i])),
+                          false);
+    }
+}
+
+static bool LoadProfile(const std::string& path, FoldedProfile* p) {
+    std::ifstream is(path.c_str());
+    std::string line;
+    if (!is || !std::getline(is, line) ||
+        sscanf(line.c_str(), "# %" SCNd64 " %" SCNd64 " %" SCNd64,
+               &p->start_s, &p->end_s, &p->nsample) != 3) {
+        return false;
+    }
+    while (std::getline(is, line)) {
+        const size_t pos = line.rfind(' ');
+        int64_t count = 0;
+        if (pos == std::string::npos ||
+            !butil::StringToInt64(butil::StringPiece(line).substr(pos + 1),
+                                  &count)) {
+            continue;
+        }
+        p->stacks[line.substr(0, pos)] += count;
+    }
+    return true;
+}
+
+static void* RunAggregator(void*) {
+    while (true) {
+        usleep(DRAIN_INTERVAL_US);
+        FoldedProfilePtr finished;
+        pthread_mutex_lock(&g_profile_mutex);
+        InitProfilesOnce();
+        DrainSamplesLocked();
+        finished = RollProfileLocked(butil::gettimeofday_s());
+        pthread_mutex_unlock(&g_profile_mutex);
+        if (finished && FLAGS_continuous_profiling_save_to_disk) {
+            SaveProfile(*finished);
+        }
+    }
+    return NULL;
+}
+
+void FlushContinuousProfiler() {
+    pthread_mutex_lock(&g_profile_mutex);
+    InitProfilesOnce();
+    DrainSamplesLocked();
+    pthread_mutex_unlock(&g_profile_mutex);
+}
+
+static void MergeProfile(const FoldedProfile& p, FoldedProfile* out) {
+    if (out->nsample == 0 && out->stacks.empty()) {
+        out->start_s = p.start_s;
+        out->end_s = p.end_s;
+    } else {
+        out->start_s = std::min(out->start_s, p.start_s);
+        out->end_s = std::max(out->end_s, p.end_s);
+    }
+    out->nsample += p.nsample;
+    for (FoldedStacks::const_iterator it = p.stacks.begin();
+         it != p.stacks.end(); ++it) {
+        out->stacks[it->first] += it->second;
+    }
+}
+
+int GetContinuousProfile(int64_t start_s, int64_t end_s, FoldedProfile* out) {
+    std::set<int64_t> merged;
+    pthread_mutex_lock(&g_profile_mutex);
+    InitProfilesOnce();
+    DrainSamplesLocked();
+    std::vector<FoldedProfilePtr> profiles(g_history->begin(), g_history->end());
+    if (g_cur_profile->nsample > 0) {
+        profiles.push_back(FoldedProfilePtr(new FoldedProfile(*g_cur_profile)));
+    }
+    pthread_mutex_unlock(&g_profile_mutex);
+    for (size_t i = 0; i < profiles.size(); ++i) {
+        const FoldedProfile& p = *profiles[i];
+        if (p.end_s > start_s && p.start_s < end_s) {
+            MergeProfile(p, out);
+            merged.insert(p.start_s);
+        }
+    }
+    // Profiles saved by previous runs of this program.
+    if (FLAGS_continuous_profiling_save_to_disk) {
+        const std::string dir = ContinuousProfileDir();
+        std::vector<int64_t> starts;
+        ListSavedProfiles(dir, &starts);
+        for (size_t i = 0; i < starts.size(); ++i) {
+            if (starts[i] >= end_s || starts[i] + 60 <= start_s ||
+                merged.count(starts[i])) {
+                continue;
+            }
+            FoldedProfile p;
+            if (LoadProfile(ProfileFileName(dir, starts[i]), &p)) {
+                MergeProfile(p, out);
+                merged.insert(starts[i]);
+            }
+        }
+    }
+    return (int)merged.size();
+}
+
+void ListContinuousProfiles(std::vector<std::pair<int64_t, int64_t> >* ranges) {
+    std::map<int64_t, int64_t> all;
+    if (FLAGS_continuous_profiling_save_to_disk) {
+        std::vector<int64_t> starts;
+        ListSavedProfiles(ContinuousProfileDir(), &starts);
+        for (size_t i = 0; i < starts.size(); ++i) {
+            all[starts[i]] = starts[i] + 60;
+        }
+    }
+    pthread_mutex_lock(&g_profile_mutex);
+    InitProfilesOnce();
+    for (size_t i = 0; i < g_history->size(); ++i) {
+        all[(*g_history)[i]->start_s] = (*g_history)[i]->end_s;
+    }
+    if (g_cur_profile->nsample > 0) {
+        all[g_cur_profile->start_s] = g_cur_profile->end_s;
+    }
+    pthread_mutex_unlock(&g_profile_mutex);
+    ranges->assign(all.begin(), all.end());
+}
+
+void PrintFoldedStacks(std::ostream& os, const FoldedStacks& stacks,
+                       const FoldedStacks* base) {
+    std::vector<std::pair<int64_t, const std::string*> > sorted;
+    sorted.reserve(stacks.size());
+    for (FoldedStacks::const_iterator it = stacks.begin();
+         it != stacks.end(); ++it) {
+        sorted.push_back(std::make_pair(it->second, &it->first));
+    }
+    if (base) {
+        // Stacks disappeared in the new profile.
+        for (FoldedStacks::const_iterator it = base->begin();
+             it != base->end(); ++it) {
+            if (stacks.find(it->first) == stacks.end()) {
+                sorted.push_back(std::make_pair(0, &it->first));
+            }
+        }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<int64_t, const std::string*>& a,
+                        const std::pair<int64_t, const std::string*>& b) {
+                         return a.first > b.first;
+                     });
+    for (size_t i = 0; i < sorted.size(); ++i) {
+        os << *sorted[i].second << ' ';
+        if (base) {
+            FoldedStacks::const_iterator it = base->find(*sorted[i].second);
+            os << (it != base->end() ? it->second : 0) << ' ';
+        }
+        os << sorted[i].first << '\n';
+    }
+}
+
+} // namespace brpc
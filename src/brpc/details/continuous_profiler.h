@@ -0,0 +1,87 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_CONTINUOUS_PROFILER_H
+#define BRPC_CONTINUOUS_PROFILER_H
+
+#include <stdint.h>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace brpc {
+
+// Stacks in the "folded" format of flamegraph.pl: frames from the root to
+// the leaf joined by ';', mapped to the number of samples.
+typedef std::map<std::string, int64_t> FoldedStacks;
+
+// Profiles aggregated during [start_s, end_s) (unix seconds).
+struct FoldedProfile {
+    FoldedProfile() : start_s(0), end_s(0), nsample(0) {}
+    int64_t start_s;
+    int64_t end_s;
+    int64_t nsample;
+    FoldedStacks stacks;
+};
+
+// Always-on CPU profiler: when -continuous_profiling is on, a SIGPROF timer
+// at -continuous_profiling_hz samples the running threads, and a background
+// thread aggregates the samples into one FoldedProfile per minute. Last
+// -continuous_profiling_kept_minutes profiles are kept in memory and (with
+// -continuous_profiling_save_to_disk) in files under
+// <rpc_profiling_dir>/continuous so that they survive restarts.
+// Stacks sampled in bthreads are rooted at "[bthread:<entry function>]",
+// the ones of idle bthread workers at "[bthread_worker]" and the others at
+// "[pthread]".
+
+// Start or stop the sampling, called when -continuous_profiling is changed.
+// Returns 0 on success, -1 otherwise, e.g. another profiler is using
+// SIGPROF.
+int StartContinuousProfiler();
+void StopContinuousProfiler();
+bool IsContinuousProfilerRunning();
+
+// Stop sampling temporarily, e.g. when gperftools is profiling with the
+// same signal. Calls nest, sampling resumes after the last Resume.
+void PauseContinuousProfiler();
+void ResumeContinuousProfiler();
+
+// Aggregate samples collected so far into the profile of current minute.
+void FlushContinuousProfiler();
+
+// Merge profiles overlapping [start_s, end_s) into `out', including the
+// one of current minute. Returns number of profiles merged.
+int GetContinuousProfile(int64_t start_s, int64_t end_s, FoldedProfile* out);
+
+// Get time ranges of all kept profiles, oldest first.
+void ListContinuousProfiles(std::vector<std::pair<int64_t, int64_t> >* ranges);
+
+// Append frames of `pcs' returned by backtrace(), which are leaf first, to
+// `key' in the folded format, namely root first and each preceded by ';'.
+void AppendFoldedFrames(void* const* pcs, int depth, std::string* key);
+
+// Print `stacks' in the folded format, heaviest stacks first. If `base' is
+// not NULL, print "<stack> <count in base> <count in stacks>" which is the
+// differential format accepted by flamegraph.pl.
+void PrintFoldedStacks(std::ostream& os, const FoldedStacks& stacks,
+                       const FoldedStacks* base);
+
+} // namespace brpc
+
+#endif // BRPC_CONTINUOUS_PROFILER_H
@@ -105,6 +105,9 @@ public:
     uint32_t pipelined_count() const { return _cntl->_pipelined_count; }
     void set_pipelined_count(uint32_t count) {  _cntl->_pipelined_count = count; }
 
+    // Let Controller choose the sending socket by connection_type() again.
+    void clear_stream_creator() { _cntl->_stream_creator = NULL; }
+
     ControllerPrivateAccessor& set_server(const Server* server) {
         _cntl->_server = server;
         return *this;
@@ -119,6 +122,9 @@ public:
         return _cntl->_remote_stream_settings;
     }
 
+    GrpcStream* grpc_stream() { return _cntl->_grpc_stream.get(); }
+    void set_grpc_stream(GrpcStream* s) { _cntl->_grpc_stream.reset(s); }
+
     StreamIds request_streams() { return _cntl->_request_streams; }
     StreamIds response_streams() { return _cntl->_response_streams; }
 
@@ -128,6 +134,15 @@ public:
     void set_readable_progressive_attachment(ReadableProgressiveAttachment* s)
     { _cntl->_rpa.reset(s); }
 
+    // Let data written into the ProgressiveAttachment from now on go to the
+    // connection directly, called after http headers are written when the
+    // server writes the attachment by itself before the RPC ends.
+    void mark_progressive_writer_as_done() {
+        if (_cntl->_wpa) {
+            _cntl->_wpa->MarkRPCAsDone(_cntl->Failed());
+        }
+    }
+
     void set_auth_flags(uint32_t auth_flags) {
         _cntl->_auth_flags = auth_flags;
     }
@@ -147,6 +162,18 @@ public:
         return *this;
     }
 
+    ControllerPrivateAccessor& set_start_parse_us(int64_t start_parse_us) {
+        _cntl->_start_parse_us = start_parse_us;
+        return *this;
+    }
+    int64_t start_parse_us() const { return _cntl->_start_parse_us; }
+
+    ControllerPrivateAccessor& set_start_callback_us(int64_t start_callback_us) {
+        _cntl->_start_callback_us = start_callback_us;
+        return *this;
+    }
+    int64_t start_callback_us() const { return _cntl->_start_callback_us; }
+
     ControllerPrivateAccessor& set_health_check_call() {
         _cntl->add_flag(Controller::FLAGS_HEALTH_CHECK_CALL);
         return *this;
@@ -23,6 +23,7 @@
 #include "butil/containers/bounded_queue.h"              // butil::BoundedQueue
 #include "butil/containers/flat_map.h"                   // butil::FlatMap
 #include "butil/containers/case_ignored_flat_map.h"      // butil::FlatMap
+#include "butil/crc32c.h"                                // butil::crc32c
 #include "brpc/details/hpack-static-table.h"       // s_static_headers
 
 
@@ -114,6 +115,15 @@ public:
     int start_index() const { return _start_index; }
     int end_index() const { return start_index() + _header_queue.size(); }
 
+    // Entries are identified by the times of additions before them, which
+    // unlike indexes don't change when more entries are added.
+    uint64_t IdOfIndex(int index) const
+    { return _add_times - (index - _start_index) - 1; }
+    int IndexOfId(uint64_t id) const
+    { return _start_index + (_add_times - id) - 1; }
+    // Entries with ids less than this were evicted.
+    uint64_t oldest_id() const { return _add_times - _header_queue.size(); }
+
     static inline size_t HeaderSize(const Header& h) {
         // https://tools.ietf.org/html/rfc7541#section-4.1
         return h.name.size() + h.value.size() + 32;
@@ -327,6 +337,8 @@ public:
         return &_node_memory[id - 1];
     }
 
+    size_t node_count() const { return _node_memory.size(); }
+
 private:
 
     HuffmanNode& node(NodeId id) {
@@ -343,135 +355,85 @@ private:
 
 };
 
-class HuffmanEncoder {
-DISALLOW_COPY_AND_ASSIGN(HuffmanEncoder);
-public:
-    HuffmanEncoder(butil::IOBufAppender* out, const HuffmanCode* table)
-        : _out(out)
-        , _table(table)
-        , _partial_byte(0)
-        , _remain_bit(8)
-        , _out_bytes(0)
-    {}
+// Huffman strings are decoded 4 bits at a time by a state machine generated
+// from HuffmanTree: states are internal nodes of the tree and each entry
+// tells the state after consuming a nibble and the symbol reached in-between
+// if any. As codes are at least 5 bits long, at most one symbol is emitted
+// per nibble.
+enum HuffmanDecodeFlags {
+    HUFFMAN_DECODE_EMIT = 1,
+    // Input may end after the nibble, namely the bits since the last symbol
+    // are a prefix of EOS (all 1) shorter than 8 bits.
+    HUFFMAN_DECODE_ACCEPT = 2,
+    // Reached EOS or an invalid code.
+    HUFFMAN_DECODE_FAIL = 4,
+};
+
+struct HuffmanDecodeEntry {
+    uint16_t state;
+    uint8_t flags;
+    uint8_t symbol;
+};
 
-    void Encode(unsigned char byte) {
-        const HuffmanCode code = _table[byte];
-        uint16_t bits_left = code.bit_len;
-        while (bits_left) {
-            const uint16_t adding_bits_len = std::min(_remain_bit, bits_left);
-            const uint8_t adding_bits = static_cast<uint8_t>(
-                    (code.code & ((1u << bits_left) - 1))   // clear leading bits
-                            >> (bits_left - adding_bits_len));  // align to LSB
-            _partial_byte |= adding_bits << (_remain_bit - adding_bits_len);
-            _remain_bit -= adding_bits_len;
-            bits_left -= adding_bits_len;
-            if (!_remain_bit) {
-                ++_out_bytes;
-                _out->push_back(_partial_byte);
-                _remain_bit = 8;
-                _partial_byte = 0;
+typedef HuffmanDecodeEntry HuffmanDecodeTable[16];
+
+static HuffmanDecodeTable* BuildHuffmanDecodeTable(const HuffmanTree& tree) {
+    typedef HuffmanTree::NodeId NodeId;
+    const size_t max_node_id = tree.node_count();
+    // Number internal nodes as states, the root is state 0.
+    std::vector<int> state_of_node(max_node_id + 1, -1);
+    std::vector<NodeId> nodes;
+    nodes.push_back(HuffmanTree::ROOT_NODE);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const HuffmanNode* n = tree.node(nodes[i]);
+        state_of_node[nodes[i]] = i;
+        const NodeId children[2] = { n->left_child, n->right_child };
+        for (NodeId child : children) {
+            const HuffmanNode* c = tree.node(child);
+            if (c != NULL && c->value == HuffmanTree::INVALID_VALUE) {
+                nodes.push_back(child);
             }
         }
     }
-
-    void EndStream() {
-        if (_remain_bit == 8u) {
-            return;
-        }
-        DCHECK_LT(_remain_bit, 8u);
-        // Add padding `1's to lsb to make _out aligned
-        _partial_byte |= (1 << _remain_bit) - 1;
-        // TODO: push_back is probably costly since it acquires tls everytime it
-        // is invoked.
-        _out->push_back(_partial_byte);
-        _partial_byte = 0;
-        _remain_bit = 0;
-        _out = NULL;
-        ++_out_bytes;
+    // Paddings are the most significant bits of EOS which are all 1.
+    std::vector<bool> accept(nodes.size(), false);
+    NodeId id = HuffmanTree::ROOT_NODE;
+    for (int depth = 0; depth < 8; ++depth) {
+        accept[state_of_node[id]] = true;
+        id = tree.node(id)->right_child;
     }
 
-    uint32_t out_bytes() const { return _out_bytes; }
-
-private:
-    butil::IOBufAppender* _out;
-    const HuffmanCode* _table;
-    uint8_t  _partial_byte;
-    uint16_t _remain_bit;
-    uint32_t _out_bytes;
-};
-
-class HuffmanDecoder {
-DISALLOW_COPY_AND_ASSIGN(HuffmanDecoder);
-public:
-    HuffmanDecoder(std::string* out, const HuffmanTree* tree)
-        // FIXME: resizing of out is costly
-        : _out(out)
-        , _tree(tree)
-        , _cur_node(tree->node(HuffmanTree::ROOT_NODE))
-        , _cur_depth(0)  // Depth of root node is 0
-        , _padding(true)
-    {}
-    int Decode(uint8_t byte) {
-        for (int i = 7; i >= 0; --i) {
-            if (byte & (1u << i)) {
-                _cur_node = _tree->node(_cur_node->right_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
+    HuffmanDecodeTable* table = new HuffmanDecodeTable[nodes.size()];
+    for (size_t state = 0; state < nodes.size(); ++state) {
+        for (int nibble = 0; nibble < 16; ++nibble) {
+            HuffmanDecodeEntry e = { 0, 0, 0 };
+            NodeId cur = nodes[state];
+            for (int i = 3; i >= 0; --i) {
+                const HuffmanNode* n = tree.node(cur);
+                cur = ((nibble >> i) & 1) ? n->right_child : n->left_child;
+                const HuffmanNode* c = tree.node(cur);
+                if (c == NULL || c->value == HPACK_HUFFMAN_EOS) {
+                    e.flags = HUFFMAN_DECODE_FAIL;
+                    break;
                 }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
+                if (c->value != HuffmanTree::INVALID_VALUE) {
+                    CHECK(!(e.flags & HUFFMAN_DECODE_EMIT));
+                    e.flags |= HUFFMAN_DECODE_EMIT;
+                    e.symbol = static_cast<uint8_t>(c->value);
+                    cur = HuffmanTree::ROOT_NODE;
                 }
-                _padding &= 1;
-            } else {
-                _cur_node = _tree->node(_cur_node->left_child);
-                if (BAIDU_UNLIKELY(!_cur_node)) {
-                    LOG(ERROR) << "Decoder stream reaches NULL_NODE";
-                    return -1;
-                }
-                if (_cur_node->value != HuffmanTree::INVALID_VALUE) {
-                    if (BAIDU_UNLIKELY(_cur_node->value == HPACK_HUFFMAN_EOS)) {
-                        LOG(ERROR) << "Decoder stream reaches EOS";
-                        return -1;
-                    }
-                    _out->push_back(static_cast<uint8_t>(_cur_node->value));
-                    _cur_node = _tree->node(HuffmanTree::ROOT_NODE);
-                    _cur_depth = 0;
-                    _padding = true;
-                    continue;
+            }
+            if (!(e.flags & HUFFMAN_DECODE_FAIL)) {
+                e.state = state_of_node[cur];
+                if (accept[e.state]) {
+                    e.flags |= HUFFMAN_DECODE_ACCEPT;
                 }
-                _padding &= 0;
             }
-            ++_cur_depth;
+            table[state][nibble] = e;
         }
-        return 0;
-    }
-    int EndStream() {
-        if (_cur_depth == 0) {
-            return 0;
-        }
-        if (_cur_depth <= 7 && _padding) {
-            return 0;
-        }
-        // Invalid stream, the padding is not corresponding to MSB of EOS
-        // https://tools.ietf.org/html/rfc7541#section-5.2
-        return -1;
     }
-private:
-    std::string* _out;
-    const HuffmanTree* _tree;
-    const HuffmanNode* _cur_node;
-    uint16_t _cur_depth;
-    bool _padding;
-};
+    return table;
+}
 
 // Primitive Type Representations
 
@@ -496,15 +458,16 @@ inline void EncodeInteger(butil::IOBufAppender* out, uint8_t msb,
 }
 
 // Static variables
-static HuffmanTree* s_huffman_tree = NULL;
+static HuffmanDecodeTable* s_huffman_decode_table = NULL;
 static IndexTable* s_static_table = NULL;
 static pthread_once_t s_create_once = PTHREAD_ONCE_INIT;
 
 static void CreateStaticTableOrDie() {
-    s_huffman_tree = new HuffmanTree;
+    HuffmanTree huffman_tree;
     for (size_t i = 0; i < ARRAY_SIZE(s_huffman_table); ++i) {
-        s_huffman_tree->AddLeafNode(i, s_huffman_table[i]);
+        huffman_tree.AddLeafNode(i, s_huffman_table[i]);
     }
+    s_huffman_decode_table = BuildHuffmanDecodeTable(huffman_tree);
     IndexTableOptions options;
     options.max_size = UINT_MAX;
     options.static_table = s_static_headers;
@@ -564,43 +527,112 @@ inline ssize_t DecodeInteger(butil::IOBufBytesIterator& iter,
     return in_bytes;
 }
 
+template <bool LOWERCASE>
+inline void HuffmanEncode(butil::IOBufAppender* out, const std::string& s) {
+    // Codes are at most 30 bits, so that bits pending in `bits' never
+    // exceed 64 after whole bytes are flushed.
+    char buf[256];
+    size_t n = 0;
+    uint64_t bits = 0;
+    uint32_t nbits = 0;
+    for (size_t i = 0; i < s.size(); ++i) {
+        const uint8_t c = (LOWERCASE ? butil::ascii_tolower(s[i]) : s[i]);
+        const HuffmanCode& code = s_huffman_table[c];
+        bits = (bits << code.bit_len) | code.code;
+        nbits += code.bit_len;
+        while (nbits >= 8) {
+            nbits -= 8;
+            buf[n++] = static_cast<char>(bits >> nbits);
+        }
+        if (n + 4 > sizeof(buf)) {
+            out->append(buf, n);
+            n = 0;
+        }
+    }
+    if (nbits) {
+        // Pad with the most significant bits of EOS which are all 1.
+        buf[n++] = static_cast<char>((bits << (8 - nbits)) | (0xFF >> nbits));
+    }
+    if (n) {
+        out->append(buf, n);
+    }
+}
+
 template <bool LOWERCASE> // use template to remove dead branches.
 inline void EncodeString(butil::IOBufAppender* out, const std::string& s,
                          bool huffman_encoding) {
-    if (!huffman_encoding) {
-        EncodeInteger(out, 0x00, 7, s.size());
+    if (huffman_encoding) {
+        uint32_t bit_len = 0;
         if (LOWERCASE) {
             for (size_t i = 0; i < s.size(); ++i) {
-                out->push_back(butil::ascii_tolower(s[i]));
+                bit_len += s_huffman_table[(uint8_t)butil::ascii_tolower(s[i])].bit_len;
             }
         } else {
-            out->append(s);
+            for (size_t i = 0; i < s.size(); ++i) {
+                bit_len += s_huffman_table[(uint8_t)s[i]].bit_len;
+            }
+        }
+        const uint32_t encoded_size = (bit_len >> 3) + !!(bit_len & 7);
+        // Binary values are probably longer after encoding, send them as
+        // they are.
+        if (encoded_size <= s.size()) {
+            EncodeInteger(out, 0x80, 7, encoded_size);
+            HuffmanEncode<LOWERCASE>(out, s);
+            return;
         }
-        return;
     }
-    // Calculate length of encoded string
-    uint32_t bit_len = 0;
+    EncodeInteger(out, 0x00, 7, s.size());
     if (LOWERCASE) {
         for (size_t i = 0; i < s.size(); ++i) {
-            bit_len += s_huffman_table[(uint8_t)butil::ascii_tolower(s[i])].bit_len;
+            out->push_back(butil::ascii_tolower(s[i]));
         }
     } else {
-        for (size_t i = 0; i < s.size(); ++i) {
-            bit_len += s_huffman_table[(uint8_t)s[i]].bit_len;
-        }
+        out->append(s);
     }
-    EncodeInteger(out, 0x80, 7, (bit_len >> 3) + !!(bit_len & 7));
-    HuffmanEncoder e(out, s_huffman_table);
-    if (LOWERCASE) {
-        for (size_t i = 0; i < s.size(); ++i) {
-            e.Encode(butil::ascii_tolower(s[i]));
+}
+
+inline int HuffmanDecode(butil::IOBufBytesIterator& iter, uint32_t length,
+                         std::string* out) {
+    // Codes are at least 5 bits long.
+    out->resize(length * 8 / 5);
+    char* const begin = &(*out)[0];
+    char* p = begin;
+    uint16_t state = 0;
+    uint8_t flags = HUFFMAN_DECODE_ACCEPT;
+    uint8_t buf[256];
+    while (length) {
+        const size_t n = iter.copy_and_forward(
+            buf, std::min((size_t)length, sizeof(buf)));
+        if (n == 0) {
+            return -1;
         }
-    } else {
-        for (size_t i = 0; i < s.size(); ++i) {
-            e.Encode(s[i]);
+        length -= n;
+        for (size_t i = 0; i < n; ++i) {
+            const HuffmanDecodeEntry& e1 = s_huffman_decode_table[state][buf[i] >> 4];
+            if (BAIDU_UNLIKELY(e1.flags & HUFFMAN_DECODE_FAIL)) {
+                return -1;
+            }
+            if (e1.flags & HUFFMAN_DECODE_EMIT) {
+                *p++ = e1.symbol;
+            }
+            const HuffmanDecodeEntry& e2 = s_huffman_decode_table[e1.state][buf[i] & 0xF];
+            if (BAIDU_UNLIKELY(e2.flags & HUFFMAN_DECODE_FAIL)) {
+                return -1;
+            }
+            if (e2.flags & HUFFMAN_DECODE_EMIT) {
+                *p++ = e2.symbol;
+            }
+            state = e2.state;
+            flags = e2.flags;
         }
     }
-    e.EndStream();
+    if (!(flags & HUFFMAN_DECODE_ACCEPT)) {
+        // Invalid stream, the padding is not corresponding to MSB of EOS
+        // https://tools.ietf.org/html/rfc7541#section-5.2
+        return -1;
+    }
+    out->resize(p - begin);
+    return 0;
 }
 
 inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
@@ -622,21 +654,71 @@ inline ssize_t DecodeString(butil::IOBufBytesIterator& iter, std::string* out) {
         iter.copy_and_forward(out, length);
         return in_bytes;
     }
-    HuffmanDecoder d(out, s_huffman_tree);
-    for (; iter != NULL && length; ++iter, --length) {
-        if (d.Decode(*iter) != 0) {
-            return -1;
-        }
-    }
-    if (d.EndStream() != 0) {
+    if (HuffmanDecode(iter, length, out) != 0) {
+        LOG(ERROR) << "Fail to decode huffman string";
         return -1;
     }
     return in_bytes;
 }
 
+// Remembers encodings of header sets that were fully indexed, see comments
+// on HPacker::EncodeHeaders().
+class HeaderBlockCache {
+public:
+    // Sets larger than this are not cached.
+    static const size_t MAX_HEADERS = 32;
+
+    struct Entry {
+        Entry() : hash(0), valid(false), min_id(0) {}
+        uint32_t hash;
+        bool valid;
+        // The smallest id of referenced entries in the dynamic table,
+        // UINT64_MAX if none.
+        uint64_t min_id;
+        std::vector<HPacker::Header> headers;
+        // Indexes in the static table, or ids of entries in the dynamic
+        // table plus `dynamic_start'.
+        std::vector<uint64_t> refs;
+    };
+
+    explicit HeaderBlockCache(int dynamic_start) : _dynamic_start(dynamic_start) {}
+
+    Entry* slot(uint32_t hash) { return &_entries[hash % ARRAY_SIZE(_entries)]; }
+
+    static uint32_t Hash(const HPacker::Header* headers, size_t count) {
+        uint32_t h = 0;
+        for (size_t i = 0; i < count; ++i) {
+            h = butil::crc32c::Extend(h, headers[i].name.data(), headers[i].name.size());
+            h = butil::crc32c::Extend(h, "", 1);
+            h = butil::crc32c::Extend(h, headers[i].value.data(), headers[i].value.size());
+        }
+        return h;
+    }
+
+    static bool Equals(const Entry& e, const HPacker::Header* headers, size_t count) {
+        if (e.headers.size() != count) {
+            return false;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (e.headers[i].name != headers[i].name ||
+                e.headers[i].value != headers[i].value) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int dynamic_start() const { return _dynamic_start; }
+
+private:
+    const int _dynamic_start;
+    Entry _entries[16];
+};
+
 HPacker::HPacker()
     : _encode_table(NULL)
-    , _decode_table(NULL) {
+    , _decode_table(NULL)
+    , _block_cache(NULL) {
     CreateStaticTableOnceOrDie();
 }
 
@@ -649,6 +731,10 @@ HPacker::~HPacker() {
         delete _decode_table;
         _decode_table = NULL;
     }
+    if (_block_cache) {
+        delete _block_cache;
+        _block_cache = NULL;
+    }
 }
 
 int HPacker::Init(size_t max_table_size) {
@@ -702,7 +788,70 @@ void HPacker::Encode(butil::IOBufAppender* out, const Header& header,
             return EncodeInteger(out, 0x80, 7, index);
         }
     } // The header can't be indexed or the header wasn't in the index table
-    
+    EncodeLiteral(out, header, options);
+}
+
+void HPacker::EncodeHeaders(butil::IOBufAppender* out, const Header* headers,
+                            size_t count, const HPackOptions& options) {
+    if (options.index_policy == HPACK_NEVER_INDEX_HEADER ||
+        count == 0 || count > HeaderBlockCache::MAX_HEADERS) {
+        for (size_t i = 0; i < count; ++i) {
+            Encode(out, headers[i], options);
+        }
+        return;
+    }
+    if (_block_cache == NULL) {
+        _block_cache = new HeaderBlockCache(_encode_table->start_index());
+    }
+    const int dynamic_start = _block_cache->dynamic_start();
+    const uint32_t hash = HeaderBlockCache::Hash(headers, count);
+    HeaderBlockCache::Entry* e = _block_cache->slot(hash);
+    if (e->valid && e->hash == hash &&
+        e->min_id >= _encode_table->oldest_id() &&
+        HeaderBlockCache::Equals(*e, headers, count)) {
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t ref = e->refs[i];
+            EncodeInteger(out, 0x80, 7, (ref < (uint64_t)dynamic_start) ?
+                          (int)ref : _encode_table->IndexOfId(ref - dynamic_start));
+        }
+        return;
+    }
+    // Encode as usual and remember the set if all headers were indexed.
+    e->valid = false;
+    e->refs.clear();
+    bool all_indexed = true;
+    uint64_t min_id = std::numeric_limits<uint64_t>::max();
+    for (size_t i = 0; i < count; ++i) {
+        const Header& h = headers[i];
+        if (!all_indexed) {
+            Encode(out, h, options);
+            continue;
+        }
+        const int index = FindHeaderFromIndexTable(h);
+        if (index > 0) {
+            EncodeInteger(out, 0x80, 7, index);
+            if (index < dynamic_start) {
+                e->refs.push_back(index);
+            } else {
+                const uint64_t id = _encode_table->IdOfIndex(index);
+                min_id = std::min(min_id, id);
+                e->refs.push_back(id + dynamic_start);
+            }
+        } else {
+            all_indexed = false;
+            EncodeLiteral(out, h, options);
+        }
+    }
+    if (all_indexed) {
+        e->hash = hash;
+        e->min_id = min_id;
+        e->headers.assign(headers, headers + count);
+        e->valid = true;
+    }
+}
+
+void HPacker::EncodeLiteral(butil::IOBufAppender* out, const Header& header,
+                            const HPackOptions& options) {
     const int name_index = FindNameFromIndexTable(header.name);
     if (options.index_policy == HPACK_INDEX_HEADER) {
         // TODO: Add Options that indexes name independently
@@ -70,6 +70,7 @@ inline HPackOptions::HPackOptions()
 {}
 
 class IndexTable;
+class HeaderBlockCache;
 
 // HPACK - Header compression algorithm for http2 (rfc7541)
 // http://httpwg.org/specs/rfc7541.html
@@ -108,6 +109,16 @@ public:
     void Encode(butil::IOBufAppender* out, const Header& header)
     { return Encode(out, header, HPackOptions()); }
 
+    // Encode `headers' in order and append the encoded buffer to |out|, the
+    // same as calling Encode() for each of them.
+    // Sets of headers repeated in many messages (e.g. pseudo headers and
+    // metadata of requests to the same method) are indexed after the first
+    // encoding, such sets are remembered along with the table entries they
+    // reference so that later encodings skip looking up the index tables
+    // until any of the entries is evicted.
+    void EncodeHeaders(butil::IOBufAppender* out, const Header* headers,
+                       size_t count, const HPackOptions& options);
+
     // Try to decode at most one Header from source and erase corresponding
     // buffer.
     // Returns:
@@ -125,6 +136,8 @@ public:
 private:
     DISALLOW_COPY_AND_ASSIGN(HPacker);
     int FindHeaderFromIndexTable(const Header& h) const;
+    void EncodeLiteral(butil::IOBufAppender* out, const Header& header,
+                       const HPackOptions& options);
     int FindNameFromIndexTable(const std::string& name) const;
     const Header* HeaderAt(int index) const;
     ssize_t DecodeWithKnownPrefix(
@@ -132,6 +145,7 @@ private:
 
     IndexTable* _encode_table;
     IndexTable* _decode_table;
+    HeaderBlockCache* _block_cache;
 };
 
 // Lowercase the input string, a fast implementation.
@@ -250,7 +250,14 @@ int HttpMessage::on_body_cb(http_parser *parser,
 }
 
 int HttpMessage::on_message_complete_cb(http_parser *parser) {
-    return static_cast<HttpMessage*>(parser->data)->OnMessageComplete();
+    HttpMessage* http_message = static_cast<HttpMessage*>(parser->data);
+    const int rc = http_message->OnMessageComplete();
+    if (rc == 0 && http_message->_stop_at_message_end) {
+        // Stop at the end of this message, following data belongs to the
+        // next (pipelined) message which is parsed by another HttpMessage.
+        http_parser_pause(parser, 1);
+    }
+    return rc;
 }
 
 int HttpMessage::OnBody(const char *at, const size_t length) {
@@ -457,6 +464,16 @@ HttpMessage::~HttpMessage() {
     }
 }
 
+// Empty lines before a message should be ignored (RFC 7230 3.5), they're
+// consumed along with the previous message if it stops at its end.
+static size_t CountLeadingLineBreaks(const char* data, size_t length) {
+    size_t n = 0;
+    while (n < length && (data[n] == '\r' || data[n] == '\n')) {
+        ++n;
+    }
+    return n;
+}
+
 ssize_t HttpMessage::ParseFromArray(const char *data, const size_t length) {
     if (Completed()) {
         if (length == 0) {
@@ -466,14 +483,20 @@ ssize_t HttpMessage::ParseFromArray(const char *data, const size_t length) {
                    << ") to already-completed message";
         return -1;
     }
-    const size_t nprocessed =
+    size_t nprocessed =
         http_parser_execute(&_parser, &g_parser_settings, data, length);
-    if (_parser.http_errno != 0) {
+    if (_parser.http_errno == HPE_PAUSED) {
+        // Paused by on_message_complete_cb
+        http_parser_pause(&_parser, 0);
+    } else if (_parser.http_errno != 0) {
         // May try HTTP on other formats, failure is norm.
         RPC_VLOG << "Fail to parse http message, parser=" << _parser
                  << ", buf=`" << butil::StringPiece(data, length) << '\'';
         return -1;
     } 
+    if (_stop_at_message_end && Completed()) {
+        nprocessed += CountLeadingLineBreaks(data + nprocessed, length - nprocessed);
+    }
     _parsed_length += nprocessed;
     return nprocessed;
 }
@@ -504,13 +527,28 @@ ssize_t HttpMessage::ParseFromIOBuf(const butil::IOBuf &buf) {
             &_parser, &g_parser_settings, blk.data(), blk.size());
         nprocessed += n;
         _parsed_block_size += n;
-        if (_parser.http_errno != 0) {
+        if (_parser.http_errno == HPE_PAUSED) {
+            // Paused by on_message_complete_cb
+            http_parser_pause(&_parser, 0);
+        } else if (_parser.http_errno != 0) {
             // May try HTTP on other formats, failure is norm.
             RPC_VLOG << "Fail to parse http message, parser=" << _parser
                      << ", buf=" << butil::ToPrintable(buf);
             return -1;
         }
         if (Completed()) {
+            if (!_stop_at_message_end) {
+                break;
+            }
+            // Skip line breaks after the message in this and following blocks.
+            size_t skipped = CountLeadingLineBreaks(blk.data() + n, blk.size() - n);
+            nprocessed += skipped;
+            while (n + skipped == blk.size() && ++i < buf.backing_block_num()) {
+                blk = buf.backing_block(i);
+                n = 0;
+                skipped = CountLeadingLineBreaks(blk.data(), blk.size());
+                nprocessed += skipped;
+            }
             break;
         }
     }
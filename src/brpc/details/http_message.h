@@ -91,6 +91,11 @@ public:
         _read_body_progressively = read_body_progressively;
     }
 
+    // Stop parsing at the end of this message, leaving following data to
+    // the next message. Set for responses of pipelined requests, which may
+    // arrive in one read.
+    void set_stop_at_message_end(bool stop) { _stop_at_message_end = stop; }
+
     // Send new parts of the body to the reader. If the body already has some
     // data, feed them to the reader immediately.
     // Any error during the setting will destroy the reader.
@@ -110,6 +115,7 @@ private:
     HttpMethod _request_method{HTTP_METHOD_GET};
     HttpHeader _header;
     bool _read_body_progressively{false};
+    bool _stop_at_message_end{false};
     // For mutual exclusion between on_body and SetBodyReader.
     butil::Mutex _body_mutex;
     // Read body progressively
@@ -0,0 +1,202 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <strings.h>
+#include "butil/time.h"
+#include "butil/third_party/murmurhash3/murmurhash3.h"
+#include "brpc/details/http_response_cache.h"
+
+namespace brpc {
+
+HttpResponseCacheOptions::HttpResponseCacheOptions()
+    : ttl_ms(1000)
+    , max_size(64 * 1024 * 1024)
+    , coalescing_timeout_ms(1000) {}
+
+size_t HttpResponseCache::get_size(void* arg) {
+    return static_cast<HttpResponseCache*>(arg)->size();
+}
+
+HttpResponseCache::HttpResponseCache(const HttpResponseCacheOptions& options)
+    : _options(options)
+    , _size(0)
+    , _size_bvar(get_size, this) {
+}
+
+HttpResponseCache::~HttpResponseCache() {
+}
+
+void HttpResponseCache::MakeKey(const HttpHeader& header,
+                                const butil::IOBuf& body,
+                                std::string* key) const {
+    // Fields are separated by '\0' which can't be in URI or header values,
+    // absent headers are marked with '\1' to be different from empty ones.
+    key->clear();
+    key->append(header.uri().path());
+    key->push_back('?');
+    key->append(header.uri().query());
+    for (size_t i = 0; i < _options.vary_headers.size(); ++i) {
+        key->push_back('\0');
+        const std::string* value = header.GetHeader(_options.vary_headers[i]);
+        if (value != NULL) {
+            key->append(*value);
+        } else {
+            key->push_back('\1');
+        }
+    }
+    if (!body.empty()) {
+        butil::MurmurHash3_x64_128_Context ctx;
+        butil::MurmurHash3_x64_128_Init(&ctx, 0);
+        for (size_t i = 0; i < body.backing_block_num(); ++i) {
+            const butil::StringPiece blk = body.backing_block(i);
+            butil::MurmurHash3_x64_128_Update(&ctx, blk.data(), blk.size());
+        }
+        char digest[16];
+        butil::MurmurHash3_x64_128_Final(digest, &ctx);
+        key->push_back('\0');
+        key->append(digest, sizeof(digest));
+    }
+}
+
+HttpResponseCache::GetResult HttpResponseCache::Get(
+    const std::string& key, HttpHeader* header, butil::IOBuf* body,
+    int* compress_type) {
+    int64_t now_us = butil::cpuwide_time_us();
+    const int64_t deadline_us = now_us + _options.coalescing_timeout_ms * 1000L;
+    bool waited = false;
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    while (true) {
+        Entry& e = _entries[key];
+        if (e.expire_us > now_us) {
+            header->set_status_code(e.status_code);
+            header->set_content_type(e.content_type);
+            for (size_t i = 0; i < e.headers.size(); ++i) {
+                header->AppendHeader(e.headers[i].first, e.headers[i].second);
+            }
+            *body = e.body;
+            *compress_type = e.compress_type;
+            mu.unlock();
+            _nhit << 1;
+            if (waited) {
+                _ncoalesced << 1;
+            }
+            return HIT;
+        }
+        if (!e.filling) {
+            e.filling = true;
+            mu.unlock();
+            _nmiss << 1;
+            return MISS_AND_FILL;
+        }
+        if (now_us >= deadline_us) {
+            mu.unlock();
+            _nmiss << 1;
+            return MISS;
+        }
+        _cond.wait_for(mu, deadline_us - now_us);
+        waited = true;
+        now_us = butil::cpuwide_time_us();
+    }
+}
+
+void HttpResponseCache::Fill(const std::string& key, const HttpHeader& header,
+                             const butil::IOBuf& body, int compress_type) {
+    const int64_t now_us = butil::cpuwide_time_us();
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    Entry& e = _entries[key];
+    _size -= e.body.size();
+    e.status_code = header.status_code();
+    e.content_type = header.content_type();
+    e.headers.clear();
+    for (HttpHeader::HeaderIterator it = header.HeaderBegin();
+         it != header.HeaderEnd(); ++it) {
+        // Connection is decided by each request.
+        if (strcasecmp(it->first.c_str(), "Connection") != 0) {
+            e.headers.emplace_back(it->first, it->second);
+        }
+    }
+    e.body = body;
+    e.compress_type = compress_type;
+    e.expire_us = now_us + _options.ttl_ms * 1000L;
+    e.filling = false;
+    _size += e.body.size();
+    _fill_order.emplace_back(key, e.expire_us);
+    EvictLocked(now_us);
+    mu.unlock();
+    _cond.notify_all();
+}
+
+void HttpResponseCache::Abandon(const std::string& key) {
+    const int64_t now_us = butil::cpuwide_time_us();
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    EntryMap::iterator it = _entries.find(key);
+    if (it != _entries.end()) {
+        it->second.filling = false;
+        if (it->second.expire_us <= now_us) {
+            _size -= it->second.body.size();
+            _entries.erase(it);
+        }
+    }
+    mu.unlock();
+    _cond.notify_all();
+}
+
+void HttpResponseCache::EvictLocked(int64_t now_us) {
+    while (!_fill_order.empty()) {
+        const std::pair<std::string, int64_t>& front = _fill_order.front();
+        if (front.second > now_us && _size <= _options.max_size) {
+            break;
+        }
+        EntryMap::iterator it = _entries.find(front.first);
+        // Skip keys filled again after this one.
+        if (it != _entries.end() && it->second.expire_us == front.second) {
+            _size -= it->second.body.size();
+            if (it->second.filling) {
+                // Being filled by another request, keep the entry.
+                it->second.body.clear();
+                it->second.expire_us = 0;
+            } else {
+                _entries.erase(it);
+            }
+        }
+        _fill_order.pop_front();
+    }
+}
+
+size_t HttpResponseCache::size() const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    return _size;
+}
+
+int HttpResponseCache::Expose(const butil::StringPiece& prefix) {
+    if (_nhit.expose_as(prefix, "http_cache_hit") != 0) {
+        return -1;
+    }
+    if (_nmiss.expose_as(prefix, "http_cache_miss") != 0) {
+        return -1;
+    }
+    if (_ncoalesced.expose_as(prefix, "http_cache_coalesced") != 0) {
+        return -1;
+    }
+    if (_size_bvar.expose_as(prefix, "http_cache_size") != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+} // namespace brpc
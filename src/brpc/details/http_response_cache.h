@@ -0,0 +1,137 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_HTTP_RESPONSE_CACHE_H
+#define BRPC_HTTP_RESPONSE_CACHE_H
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "butil/iobuf.h"
+#include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
+#include "bvar/bvar.h"
+#include "brpc/http_header.h"
+
+namespace brpc {
+
+struct HttpResponseCacheOptions {
+    HttpResponseCacheOptions();
+
+    // Cached responses are served for at most so many milliseconds.
+    // default: 1000
+    int64_t ttl_ms;
+
+    // Max total size of cached bodies in bytes, responses cached earliest
+    // are evicted when the size is exceeded.
+    // default: 64MB
+    size_t max_size;
+
+    // Values of these request headers are parts of the key besides the
+    // URI and the body, e.g. "Accept" or "Authorization". Requests differing
+    // in other headers share the cached response.
+    // default: empty
+    std::vector<std::string> vary_headers;
+
+    // Concurrent requests missing the cache wait for the request which is
+    // calling the method (and filling the cache) for at most so many
+    // milliseconds, then call the method by themselves. Requests are not
+    // coalesced if this value is not positive.
+    // default: 1000
+    int64_t coalescing_timeout_ms;
+};
+
+// Responses of a http method, keyed by URI, selected headers and body of
+// requests. Only successful responses to GET are cached, see
+// ProcessHttpRequest() in policy/http_rpc_protocol.cpp.
+class HttpResponseCache {
+public:
+    explicit HttpResponseCache(const HttpResponseCacheOptions& options);
+    ~HttpResponseCache();
+
+    // Put the key of the request into `key'.
+    void MakeKey(const HttpHeader& header, const butil::IOBuf& body,
+                 std::string* key) const;
+
+    enum GetResult {
+        // Copied the cached response.
+        HIT,
+        // Not cached, the caller must Fill() or Abandon() the key after
+        // calling the method.
+        MISS_AND_FILL,
+        // Not cached and filled by another request, the caller calls the
+        // method without filling.
+        MISS
+    };
+    // Copy the response cached for `key' into `header', `body' and
+    // `compress_type' (applied to body before being sent).
+    GetResult Get(const std::string& key, HttpHeader* header,
+                  butil::IOBuf* body, int* compress_type);
+
+    void Fill(const std::string& key, const HttpHeader& header,
+              const butil::IOBuf& body, int compress_type);
+    void Abandon(const std::string& key);
+
+    // Expose internal vars.
+    // Return 0 on success, -1 otherwise.
+    int Expose(const butil::StringPiece& prefix);
+
+    int64_t hit_count() const { return _nhit.get_value(); }
+    int64_t miss_count() const { return _nmiss.get_value(); }
+    size_t size() const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(HttpResponseCache);
+
+    struct Entry {
+        Entry() : status_code(0), compress_type(0), expire_us(0), filling(false) {}
+        int status_code;
+        std::string content_type;
+        std::vector<std::pair<std::string, std::string> > headers;
+        butil::IOBuf body;
+        int compress_type;
+        int64_t expire_us;
+        bool filling;
+    };
+    typedef std::unordered_map<std::string, Entry> EntryMap;
+
+    // Remove expired entries and entries over max_size. Called with _mutex.
+    void EvictLocked(int64_t now_us);
+    static size_t get_size(void* arg);
+
+    const HttpResponseCacheOptions _options;
+    mutable bthread::Mutex _mutex;
+    // Signaled when a key is filled or abandoned.
+    bthread::ConditionVariable _cond;
+    EntryMap _entries;
+    // (key, expire_us) in the order of filling, which is the order of
+    // expiration as well.
+    std::deque<std::pair<std::string, int64_t> > _fill_order;
+    size_t _size;
+
+    bvar::Adder<int64_t> _nhit;
+    bvar::Adder<int64_t> _nmiss;
+    // Misses served by responses of other requests.
+    bvar::Adder<int64_t> _ncoalesced;
+    bvar::PassiveStatus<size_t> _size_bvar;
+};
+
+} // namespace brpc
+
+#endif // BRPC_HTTP_RESPONSE_CACHE_H
@@ -17,13 +17,21 @@
 
 
 #include <limits>
+#include <gflags/gflags.h>
 #include "butil/macros.h"
 #include "brpc/controller.h"
 #include "brpc/details/server_private_accessor.h"
 #include "brpc/details/method_status.h"
+#include "brpc/details/http_response_cache.h"
+#include "brpc/reloadable_flags.h"
 
 namespace brpc {
 
+DEFINE_bool(enable_method_phase_latency, false, "Record latencies of phases "
+            "(queue, parse, process, serialize, write) of processing requests "
+            "for each method, which costs more when the response is written");
+BRPC_VALIDATE_GFLAG(enable_method_phase_latency, PassValidate);
+
 static int cast_int(void* arg) {
     return *(int*)arg;
 }
@@ -41,13 +49,31 @@ MethodStatus::MethodStatus()
     , _nconcurrency_bvar(cast_int, &_nconcurrency)
     , _eps_bvar(&_nerror_bvar)
     , _max_concurrency_bvar(cast_cl, &_cl)
+    , _phase_status(NULL)
 {
 }
 
 MethodStatus::~MethodStatus() {
+    delete _phase_status.load(butil::memory_order_relaxed);
+}
+
+static void ExposePhases(MethodPhaseStatus* ps, const std::string& prefix) {
+    ps->queue.expose(prefix, "queue");
+    ps->parse.expose(prefix, "parse");
+    ps->process.expose(prefix, "process");
+    ps->serialize.expose(prefix, "serialize");
+    ps->write.expose(prefix, "write");
 }
 
 int MethodStatus::Expose(const butil::StringPiece& prefix) {
+    {
+        BAIDU_SCOPED_LOCK(_phase_mutex);
+        prefix.CopyToString(&_prefix);
+        MethodPhaseStatus* ps = _phase_status.load(butil::memory_order_relaxed);
+        if (ps != NULL) {
+            ExposePhases(ps, _prefix);
+        }
+    }
     if (_nconcurrency_bvar.expose_as(prefix, "concurrency") != 0) {
         return -1;
     }
@@ -65,6 +91,11 @@ int MethodStatus::Expose(const butil::StringPiece& prefix) {
             return -1;
         }
     }
+    if (_http_response_cache) {
+        if (_http_response_cache->Expose(prefix) != 0) {
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -136,6 +167,21 @@ void MethodStatus::Describe(
     OutputValue(os, "max_latency: ", _latency_rec.max_latency_name(),
                 _latency_rec.max_latency(), options, false);
 
+    // Phases
+    const MethodPhaseStatus* ps = _phase_status.load(butil::memory_order_acquire);
+    if (ps != NULL) {
+        OutputValue(os, "queue_latency: ", ps->queue.latency_name(),
+                    ps->queue.latency(), options, false);
+        OutputValue(os, "parse_latency: ", ps->parse.latency_name(),
+                    ps->parse.latency(), options, false);
+        OutputValue(os, "process_latency: ", ps->process.latency_name(),
+                    ps->process.latency(), options, false);
+        OutputValue(os, "serialize_latency: ", ps->serialize.latency_name(),
+                    ps->serialize.latency(), options, false);
+        OutputValue(os, "write_latency: ", ps->write.latency_name(),
+                    ps->write.latency(), options, false);
+    }
+
     // Concurrency
     OutputValue(os, "concurrency: ", _nconcurrency_bvar.name(),
                 _nconcurrency, options, false);
@@ -145,10 +191,36 @@ void MethodStatus::Describe(
     }
 }
 
+void MethodStatus::OnPhasesEnded(const ServerPhaseTimes& t) {
+    MethodPhaseStatus* ps = _phase_status.load(butil::memory_order_acquire);
+    if (ps == NULL) {
+        BAIDU_SCOPED_LOCK(_phase_mutex);
+        ps = _phase_status.load(butil::memory_order_relaxed);
+        if (ps == NULL) {
+            ps = new MethodPhaseStatus;
+            if (!_prefix.empty()) {
+                ExposePhases(ps, _prefix);
+            }
+            _phase_status.store(ps, butil::memory_order_release);
+        }
+    }
+    ps->queue << t.start_parse_us - t.received_us;
+    ps->parse << t.start_callback_us - t.start_parse_us;
+    ps->process << t.start_send_us - t.start_callback_us;
+    ps->serialize << t.start_write_us - t.start_send_us;
+    if (t.sent_us != 0) {
+        ps->write << t.sent_us - t.start_write_us;
+    }
+}
+
 void MethodStatus::SetConcurrencyLimiter(ConcurrencyLimiter* cl) {
     _cl.reset(cl);
 }
 
+void MethodStatus::SetHttpResponseCache(HttpResponseCache* cache) {
+    _http_response_cache.reset(cache);
+}
+
 int HandleResponseWritten(bthread_id_t id, void* data, int /*error_code*/) {
     auto args = static_cast<ResponseWriteInfo*>(data);
     args->sent_us = butil::cpuwide_time_us();
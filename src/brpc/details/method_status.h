@@ -20,6 +20,7 @@
 #define  BRPC_METHOD_STATUS_H
 
 #include "butil/macros.h"                  // DISALLOW_COPY_AND_ASSIGN
+#include "butil/synchronization/lock.h"
 #include "bvar/bvar.h"                    // vars
 #include "brpc/describable.h"
 #include "brpc/concurrency_limiter.h"
@@ -29,6 +30,38 @@ namespace brpc {
 
 class Controller;
 class Server;
+class HttpResponseCache;
+
+// Timestamps(cpuwide microseconds) of phases in processing a request at
+// server-side.
+struct ServerPhaseTimes {
+    // The request was cut from the socket.
+    int64_t received_us;
+    // The bthread processing the request started parsing it.
+    int64_t start_parse_us;
+    // User's callback was called.
+    int64_t start_callback_us;
+    // done->Run() was called, the response started being serialized.
+    int64_t start_send_us;
+    // The response was about to be written into the socket.
+    int64_t start_write_us;
+    // The response was written into the kernel.
+    int64_t sent_us;
+};
+
+// Latencies of phases in processing requests of a method.
+struct MethodPhaseStatus {
+    // Waiting for a bthread to process the request.
+    bvar::LatencyRecorder queue;
+    // Parsing the request until calling user's callback.
+    bvar::LatencyRecorder parse;
+    // Running user's callback until done->Run().
+    bvar::LatencyRecorder process;
+    // Serializing and packing the response.
+    bvar::LatencyRecorder serialize;
+    // Writing the response into the kernel.
+    bvar::LatencyRecorder write;
+};
 // Record accessing stats of a method.
 class MethodStatus : public Describable {
 public:
@@ -48,6 +81,11 @@ public:
     // did the time keeping and the cost is better saved. 
     void OnResponded(int error_code, int64_t latency_us);
 
+    // Call this after the response was written when
+    // -enable_method_phase_latency is on. Latencies of phases are recorded
+    // into recorders created and exposed on first call.
+    void OnPhasesEnded(const ServerPhaseTimes& times);
+
     // Expose internal vars.
     // Return 0 on success, -1 otherwise.
     int Expose(const butil::StringPiece& prefix);
@@ -58,6 +96,9 @@ public:
     // Current max_concurrency of the method.
     int MaxConcurrency() const { return _cl ? _cl->MaxConcurrency() : 0; }
 
+    // Cache of http responses of the method, NULL if it's not enabled.
+    HttpResponseCache* http_response_cache() const { return _http_response_cache.get(); }
+
 private:
 friend class Server;
     DISALLOW_COPY_AND_ASSIGN(MethodStatus);
@@ -66,13 +107,21 @@ friend class Server;
     // before the server is started. 
     void SetConcurrencyLimiter(ConcurrencyLimiter* cl);
 
+    // Same as above.
+    void SetHttpResponseCache(HttpResponseCache* cache);
+
     std::unique_ptr<ConcurrencyLimiter> _cl;
+    std::unique_ptr<HttpResponseCache> _http_response_cache;
     butil::atomic<int> _nconcurrency;
     bvar::Adder<int64_t>  _nerror_bvar;
     bvar::LatencyRecorder _latency_rec;
     bvar::PassiveStatus<int>  _nconcurrency_bvar;
     bvar::PerSecond<bvar::Adder<int64_t>> _eps_bvar;
     bvar::PassiveStatus<int32_t> _max_concurrency_bvar;
+    // Protecting _prefix and creation of _phase_status.
+    butil::Mutex _phase_mutex;
+    std::string _prefix;
+    butil::atomic<MethodPhaseStatus*> _phase_status;
 };
 
 struct ResponseWriteInfo {
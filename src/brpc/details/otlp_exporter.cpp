@@ -0,0 +1,382 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <limits>
+#include <memory>
+#include <gflags/gflags.h>
+#include "butil/atomicops.h"
+#include "butil/macros.h"
+#include "butil/time.h"
+#include "butil/logging.h"
+#include "butil/iobuf.h"
+#include "butil/string_printf.h"
+#include "butil/strings/string_piece.h"
+#include "butil/strings/string_util.h"
+#include "bthread/bthread.h"
+#include "bvar/bvar.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/adaptive_protocol_type.h"   // ProtocolTypeToString
+#include "brpc/errno.pb.h"
+#include "brpc/span.h"
+#include "brpc/otlp_trace.pb.h"
+#include "brpc/reloadable_flags.h"
+#include "brpc/builtin/common.h"             // GetProgramName
+#include "brpc/details/otlp_exporter.h"
+
+namespace brpc {
+
+DEFINE_string(otlp_collector, "", "Post spans of rpcz to this OTLP/HTTP "
+              "collector, e.g. http://127.0.0.1:4318 or list://ip1:port,ip2:port. "
+              "Empty means not exporting. Notice that -enable_rpcz must be on");
+DEFINE_string(otlp_service_name, "", "service.name of exported spans, name of "
+              "the program if this flag is empty");
+DEFINE_int32(otlp_export_interval_ms, 1000,
+             "Post pending spans at most every so many milliseconds");
+BRPC_VALIDATE_GFLAG(otlp_export_interval_ms, PositiveInteger);
+DEFINE_int32(otlp_export_max_batch, 512, "Post at most so many spans in one "
+             "request, also post immediately when so many spans are pending");
+BRPC_VALIDATE_GFLAG(otlp_export_max_batch, PositiveInteger);
+DEFINE_int32(otlp_export_timeout_ms, 3000, "Timeout of posting spans");
+DEFINE_double(otlp_sample_ratio, 1.0, "Export traces with this probability "
+              "decided by trace ids, so that processes of a trace agree");
+DEFINE_int64(otlp_tail_min_latency_us, -1, "Traces not sampled by "
+             "-otlp_sample_ratio are still exported when their local root "
+             "spans take at least so many microseconds, negative to disable");
+DEFINE_bool(otlp_tail_keep_error, true, "Traces not sampled by "
+            "-otlp_sample_ratio are still exported when any local span failed");
+
+static const char* const OTLP_TRACES_PATH = "/v1/traces";
+
+// Spans waiting for being posted.
+static bvar::Adder<int64_t>* g_pending = NULL;
+// Spans dropped since too many spans are pending.
+static bvar::Adder<int64_t>* g_dropped = NULL;
+// Spans posted.
+static bvar::Adder<int64_t>* g_exported = NULL;
+// Spans failed to be posted.
+static bvar::Adder<int64_t>* g_failed = NULL;
+
+// Single-producer-single-consumer ring of converted spans. The producer is
+// the only thread dumping spans(see bvar::Collector) and the consumer is
+// the exporting bthread, neither of them waits for the other.
+class SpanRing {
+public:
+    static const size_t CAPACITY = 8192;  // power of 2
+
+    SpanRing() : _head(0), _tail(0) {}
+
+    bool Push(otlp::Span* span) {
+        const size_t tail = _tail.load(butil::memory_order_relaxed);
+        if (tail - _head.load(butil::memory_order_acquire) >= CAPACITY) {
+            return false;
+        }
+        _slots[tail & (CAPACITY - 1)] = span;
+        _tail.store(tail + 1, butil::memory_order_release);
+        return true;
+    }
+
+    otlp::Span* Pop() {
+        const size_t head = _head.load(butil::memory_order_relaxed);
+        if (head == _tail.load(butil::memory_order_acquire)) {
+            return NULL;
+        }
+        otlp::Span* span = _slots[head & (CAPACITY - 1)];
+        _head.store(head + 1, butil::memory_order_release);
+        return span;
+    }
+
+    size_t size() const {
+        return _tail.load(butil::memory_order_acquire) -
+            _head.load(butil::memory_order_acquire);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SpanRing);
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _head;
+    BAIDU_CACHELINE_ALIGNMENT butil::atomic<size_t> _tail;
+    BAIDU_CACHELINE_ALIGNMENT otlp::Span* _slots[CAPACITY];
+};
+
+static SpanRing* g_ring = NULL;
+static pthread_once_t g_start_exporter_once = PTHREAD_ONCE_INIT;
+
+bool IsOtlpExportEnabled() {
+    return !FLAGS_otlp_collector.empty();
+}
+
+static void AddAttribute(google::protobuf::RepeatedPtrField<otlp::KeyValue>* attrs,
+                         const char* key, const std::string& value) {
+    otlp::KeyValue* kv = attrs->Add();
+    kv->set_key(key);
+    kv->mutable_value()->set_string_value(value);
+}
+
+static void AddAttribute(google::protobuf::RepeatedPtrField<otlp::KeyValue>* attrs,
+                         const char* key, int64_t value) {
+    otlp::KeyValue* kv = attrs->Add();
+    kv->set_key(key);
+    kv->mutable_value()->set_int_value(value);
+}
+
+static void AppendBigEndian(std::string* out, uint64_t v) {
+    char buf[8];
+    for (int i = 7; i >= 0; --i) {
+        buf[i] = (char)(v & 0xFF);
+        v >>= 8;
+    }
+    out->append(buf, sizeof(buf));
+}
+
+void SpanToOtlp(const Span* span, otlp::Span* out) {
+    std::string* trace_id = out->mutable_trace_id();
+    trace_id->clear();
+    AppendBigEndian(trace_id, span->trace_id_high());
+    AppendBigEndian(trace_id, span->trace_id());
+    out->mutable_span_id()->clear();
+    AppendBigEndian(out->mutable_span_id(), span->span_id());
+    if (span->parent_span_id() != 0) {
+        out->mutable_parent_span_id()->clear();
+        AppendBigEndian(out->mutable_parent_span_id(), span->parent_span_id());
+    }
+    out->set_name(span->full_method_name());
+    switch (span->type()) {
+    case SPAN_TYPE_SERVER:
+        out->set_kind(otlp::Span::SPAN_KIND_SERVER);
+        break;
+    case SPAN_TYPE_CLIENT:
+        out->set_kind(otlp::Span::SPAN_KIND_CLIENT);
+        break;
+    default:
+        out->set_kind(otlp::Span::SPAN_KIND_INTERNAL);
+        break;
+    }
+    out->set_start_time_unix_nano(span->GetStartRealTimeUs() * 1000L);
+    out->set_end_time_unix_nano(span->GetEndRealTimeUs() * 1000L);
+
+    google::protobuf::RepeatedPtrField<otlp::KeyValue>* attrs =
+        out->mutable_attributes();
+    AddAttribute(attrs, "rpc.system", std::string("brpc"));
+    const ProtocolType protocol = span->protocol();
+    if (protocol != PROTOCOL_UNKNOWN) {
+        AddAttribute(attrs, "rpc.brpc.protocol",
+                     std::string(ProtocolTypeToString(protocol)));
+    }
+    if (span->remote_side().port != 0) {
+        AddAttribute(attrs, "net.peer.ip",
+                     std::string(butil::ip2str(span->remote_side().ip).c_str()));
+        AddAttribute(attrs, "net.peer.port", (int64_t)span->remote_side().port);
+    }
+    if (span->log_id() != 0) {
+        AddAttribute(attrs, "rpc.brpc.log_id", (int64_t)span->log_id());
+    }
+    AddAttribute(attrs, "rpc.brpc.request_size", (int64_t)span->request_size());
+    AddAttribute(attrs, "rpc.brpc.response_size", (int64_t)span->response_size());
+    if (span->error_code() != 0) {
+        AddAttribute(attrs, "rpc.brpc.error_code", (int64_t)span->error_code());
+        otlp::Status* status = out->mutable_status();
+        status->set_code(otlp::Status::STATUS_CODE_ERROR);
+        status->set_message(berror(span->error_code()));
+    }
+
+    SpanInfoExtractor extractor(span->info().c_str());
+    int64_t anno_time = 0;
+    std::string anno;
+    while (extractor.PopAnnotation(std::numeric_limits<int64_t>::max(),
+                                   &anno_time, &anno)) {
+        otlp::Span::Event* event = out->add_events();
+        event->set_time_unix_nano(anno_time * 1000L);
+        butil::TrimWhitespaceASCII(anno, butil::TRIM_TRAILING, event->mutable_name());
+    }
+}
+
+static otlp::ExportTraceServiceRequest* NewRequest() {
+    otlp::ExportTraceServiceRequest* req = new otlp::ExportTraceServiceRequest;
+    otlp::ResourceSpans* rs = req->add_resource_spans();
+    google::protobuf::RepeatedPtrField<otlp::KeyValue>* attrs =
+        rs->mutable_resource()->mutable_attributes();
+    AddAttribute(attrs, "service.name", FLAGS_otlp_service_name.empty() ?
+                 std::string(GetProgramName()) : FLAGS_otlp_service_name);
+    AddAttribute(attrs, "telemetry.sdk.name", std::string("brpc"));
+    rs->add_scope_spans()->mutable_scope()->set_name("brpc");
+    return req;
+}
+
+static int InitCollectorChannel(Channel* channel) {
+    ChannelOptions options;
+    options.protocol = PROTOCOL_HTTP;
+    options.timeout_ms = FLAGS_otlp_export_timeout_ms;
+    options.max_retry = 0;
+    const butil::StringPiece collector(FLAGS_otlp_collector);
+    const char* lb = "";
+    if (collector.find("://") != butil::StringPiece::npos &&
+        !collector.starts_with("http://") &&
+        !collector.starts_with("https://")) {
+        lb = "rr";
+    }
+    return channel->Init(FLAGS_otlp_collector.c_str(), lb, &options);
+}
+
+// Post spans in `req' and clear them.
+static void PostSpans(Channel* channel, otlp::ExportTraceServiceRequest* req) {
+    google::protobuf::RepeatedPtrField<otlp::Span>* spans =
+        req->mutable_resource_spans(0)->mutable_scope_spans(0)->mutable_spans();
+    const int nspan = spans->size();
+    // Not calling TraceService which is posted to /ServiceName/MethodName
+    // by http channels.
+    Controller cntl;
+    cntl.http_request().uri() = OTLP_TRACES_PATH;
+    cntl.http_request().set_method(HTTP_METHOD_POST);
+    cntl.http_request().set_content_type("application/x-protobuf");
+    butil::IOBufAsZeroCopyOutputStream wrapper(&cntl.request_attachment());
+    if (!req->SerializeToZeroCopyStream(&wrapper)) {
+        *g_failed << nspan;
+        LOG(ERROR) << "Fail to serialize " << nspan << " spans";
+        spans->Clear();
+        return;
+    }
+    channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        *g_failed << nspan;
+        LOG_EVERY_SECOND(WARNING) << "Fail to post " << nspan << " spans to "
+                                  << FLAGS_otlp_collector << ": " << cntl.ErrorText();
+    } else {
+        // Partial success is optional.
+        otlp::ExportTraceServiceResponse res;
+        butil::IOBufAsZeroCopyInputStream res_wrapper(cntl.response_attachment());
+        res.ParseFromZeroCopyStream(&res_wrapper);
+        const int64_t rejected = res.partial_success().rejected_spans();
+        *g_exported << nspan - rejected;
+        *g_failed << rejected;
+    }
+    spans->Clear();
+}
+
+// Channel to the collector, NULL if it can't be initialized, e.g. the
+// naming service is not ready yet, in which case it's retried every second.
+static Channel* NewCollectorChannel() {
+    std::unique_ptr<Channel> channel(new Channel);
+    if (InitCollectorChannel(channel.get()) != 0) {
+        LOG_EVERY_SECOND(ERROR) << "Fail to init channel to -otlp_collector="
+                                << FLAGS_otlp_collector << ", spans are dropped";
+        return NULL;
+    }
+    return channel.release();
+}
+
+static void* RunExporter(void*) {
+    std::unique_ptr<Channel> channel(NewCollectorChannel());
+    int64_t last_init_us = butil::gettimeofday_us();
+    std::unique_ptr<otlp::ExportTraceServiceRequest> req(NewRequest());
+    google::protobuf::RepeatedPtrField<otlp::Span>* spans =
+        req->mutable_resource_spans(0)->mutable_scope_spans(0)->mutable_spans();
+    int64_t last_post_us = butil::gettimeofday_us();
+    while (true) {
+        const int64_t interval_us = FLAGS_otlp_export_interval_ms * 1000L;
+        bthread_usleep(std::min<int64_t>(interval_us, 50000));
+        const size_t max_batch = FLAGS_otlp_export_max_batch;
+        const int64_t now = butil::gettimeofday_us();
+        if (g_ring->size() < max_batch && now < last_post_us + interval_us) {
+            continue;
+        }
+        last_post_us = now;
+        if (channel == NULL && now >= last_init_us + 1000000L) {
+            last_init_us = now;
+            channel.reset(NewCollectorChannel());
+        }
+        otlp::Span* span = NULL;
+        if (channel == NULL) {
+            // Don't keep spans which may never be posted.
+            while ((span = g_ring->Pop()) != NULL) {
+                *g_pending << -1;
+                *g_failed << 1;
+                delete span;
+            }
+            continue;
+        }
+        while ((span = g_ring->Pop()) != NULL) {
+            *g_pending << -1;
+            spans->AddAllocated(span);
+            if ((size_t)spans->size() >= max_batch) {
+                PostSpans(channel.get(), req.get());
+            }
+        }
+        if (!spans->empty()) {
+            PostSpans(channel.get(), req.get());
+        }
+    }
+    return NULL;
+}
+
+static void StartExporter() {
+    g_pending = new bvar::Adder<int64_t>("rpcz_otlp_pending_count");
+    g_dropped = new bvar::Adder<int64_t>("rpcz_otlp_dropped_count");
+    g_exported = new bvar::Adder<int64_t>("rpcz_otlp_exported_count");
+    g_failed = new bvar::Adder<int64_t>("rpcz_otlp_failed_count");
+    g_ring = new SpanRing;
+    bthread_t th;
+    CHECK_EQ(0, bthread_start_background(&th, NULL, RunExporter, NULL));
+}
+
+static bool IsSampledByRatio(uint64_t trace_id) {
+    const double ratio = FLAGS_otlp_sample_ratio;
+    if (ratio >= 1.0) {
+        return true;
+    }
+    if (ratio <= 0) {
+        return false;
+    }
+    // Ids are generated with fast_rand, mix them anyway in case that they
+    // come from other systems.
+    const uint64_t h = trace_id * 0x9E3779B97F4A7C15ULL;
+    return (h >> 11) < (uint64_t)(ratio * (1ULL << 53));
+}
+
+void ExportSpans(const Span* root) {
+    if (root->type() == SPAN_TYPE_CLIENT && root->local_parent() == NULL &&
+        root->full_method_name() == OTLP_TRACES_PATH) {
+        // Spans of posting spans, exporting them causes endless posting.
+        return;
+    }
+    bool sampled = IsSampledByRatio(root->trace_id());
+    if (!sampled && FLAGS_otlp_tail_min_latency_us >= 0) {
+        sampled = (root->GetEndRealTimeUs() - root->GetStartRealTimeUs() >=
+                   FLAGS_otlp_tail_min_latency_us);
+    }
+    if (!sampled && FLAGS_otlp_tail_keep_error) {
+        root->traversal(const_cast<Span*>(root), [&sampled](Span* s) {
+            sampled = sampled || (s->error_code() != 0);
+        });
+    }
+    if (!sampled) {
+        return;
+    }
+    pthread_once(&g_start_exporter_once, StartExporter);
+    root->traversal(const_cast<Span*>(root), [](Span* s) {
+        otlp::Span* out = new otlp::Span;
+        SpanToOtlp(s, out);
+        if (g_ring->Push(out)) {
+            *g_pending << 1;
+        } else {
+            *g_dropped << 1;
+            delete out;
+        }
+    });
+}
+
+} // namespace brpc
@@ -0,0 +1,45 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_OTLP_EXPORTER_H
+#define BRPC_OTLP_EXPORTER_H
+
+// Users are not supposed to include this file.
+
+namespace brpc {
+
+class Span;
+namespace otlp {
+class Span;
+}
+
+// True if -otlp_collector is set.
+bool IsOtlpExportEnabled();
+
+// Fill `out' with fields of `span' excluding its children.
+void SpanToOtlp(const Span* span, otlp::Span* out);
+
+// Called by the thread dumping spans before `root' and spans created
+// locally under it are destroyed. If the trace is sampled, spans are
+// converted and queued to be posted to -otlp_collector in batches, or
+// dropped when too many spans are pending.
+void ExportSpans(const Span* root);
+
+} // namespace brpc
+
+#endif // BRPC_OTLP_EXPORTER_H
@@ -0,0 +1,199 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <vector>
+#include <google/protobuf/descriptor.h>
+#include "bvar/bvar.h"
+#include "brpc/channel.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/details/request_coalescer.h"
+
+namespace brpc {
+
+// RPCs sharing calls of others.
+static bvar::Adder<int64_t>* g_ncoalesced = NULL;
+// Calls shared by coalesced RPCs.
+static bvar::Adder<int64_t>* g_nshared_call = NULL;
+static pthread_once_t s_create_vars_once = PTHREAD_ONCE_INIT;
+
+static void CreateVars() {
+    g_ncoalesced = new bvar::Adder<int64_t>("rpc_client_coalesced_count");
+    g_nshared_call = new bvar::Adder<int64_t>("rpc_client_coalescing_call_count");
+}
+
+class RequestCoalescer::Flight : public google::protobuf::Closure {
+public:
+    struct Waiter {
+        Controller* cntl;
+        CallId id;
+        google::protobuf::Message* response;
+    };
+
+    Flight(RequestCoalescer* owner, const std::string& key)
+        : _owner(owner), _key(key) {}
+
+    void Run() override;
+
+    butil::intrusive_ptr<RequestCoalescer> _owner;
+    const std::string _key;
+    Controller _cntl;
+    std::unique_ptr<google::protobuf::Message> _response;
+    // Protected by _owner->_mutex.
+    std::vector<Waiter> _waiters;
+};
+
+RequestCoalescer::RequestCoalescer() {
+    CHECK_EQ(0, pthread_once(&s_create_vars_once, CreateVars));
+}
+
+RequestCoalescer::~RequestCoalescer() {
+    // Every flight references this object.
+    CHECK(_flights.empty());
+}
+
+bool RequestCoalescer::CanCoalesce(const Controller* cntl) {
+    return cntl->_sender == NULL &&
+        !cntl->has_flag(Controller::FLAGS_COALESCED_CALL) &&
+        !cntl->is_response_read_progressively() &&
+        cntl->_request_streams.empty() &&
+        cntl->_grpc_stream == NULL;
+}
+
+void RequestCoalescer::MakeKey(const google::protobuf::MethodDescriptor* method,
+                               const Controller* cntl, std::string* key) {
+    // Different methods never share calls since responses are of different
+    // types. Fields are prefixed with sizes to be unambiguous.
+    key->clear();
+    if (method) {
+        key->append(method->full_name());
+    }
+    key->push_back('\0');
+    if (!cntl->_coalescing_key.empty()) {
+        key->push_back('k');
+        key->append(cntl->_coalescing_key);
+        return;
+    }
+    key->push_back('r');
+    if (cntl->has_http_request()) {
+        const HttpHeader& h = cntl->http_request();
+        key->append(HttpMethod2Str(h.method()));
+        key->push_back(' ');
+        key->append(h.uri().path());
+        key->push_back('?');
+        key->append(h.uri().query());
+        for (HttpHeader::HeaderIterator it = h.HeaderBegin();
+             it != h.HeaderEnd(); ++it) {
+            key->push_back('\0');
+            key->append(it->first);
+            key->push_back(':');
+            key->append(it->second);
+        }
+        key->push_back('\0');
+    }
+    const size_t buf_size = cntl->_request_buf.size();
+    key->append((const char*)&buf_size, sizeof(buf_size));
+    cntl->_request_buf.append_to(key);
+    cntl->_request_attachment.append_to(key);
+}
+
+void RequestCoalescer::Join(Channel* channel,
+                            const google::protobuf::MethodDescriptor* method,
+                            Controller* cntl,
+                            const google::protobuf::Message* request,
+                            google::protobuf::Message* response,
+                            const butil::IOBuf& request_attachment) {
+    std::string key;
+    MakeKey(method, cntl, &key);
+    const Flight::Waiter waiter = { cntl, cntl->current_id(), response };
+    Flight* flight = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        Flight*& f = _flights[key];
+        if (f != NULL) {
+            f->_waiters.push_back(waiter);
+            *g_ncoalesced << 1;
+            return;
+        }
+        f = new Flight(this, key);
+        f->_waiters.push_back(waiter);
+        flight = f;
+    }
+    *g_nshared_call << 1;
+
+    // Inherit options of the RPC creating the call, and since the RPC has
+    // been set up by channel, these options are set explicitly.
+    Controller* sub_cntl = &flight->_cntl;
+    sub_cntl->add_flag(Controller::FLAGS_COALESCED_CALL);
+    sub_cntl->set_timeout_ms(cntl->timeout_ms());
+    sub_cntl->set_max_retry(cntl->max_retry());
+    sub_cntl->set_backup_request_ms(cntl->backup_request_ms());
+    sub_cntl->_backup_request_policy = cntl->_backup_request_policy;
+    sub_cntl->set_connection_type(cntl->connection_type());
+    sub_cntl->set_type_of_service(cntl->_tos);
+    sub_cntl->set_request_compress_type(cntl->request_compress_type());
+    sub_cntl->set_log_id(cntl->log_id());
+    if (cntl->has_request_code()) {
+        sub_cntl->set_request_code(cntl->request_code());
+    }
+    sub_cntl->request_attachment() = request_attachment;
+    if (cntl->has_http_request()) {
+        sub_cntl->http_request() = cntl->http_request();
+    }
+    if (response) {
+        flight->_response.reset(response->New());
+    }
+    // NOTE: done of an asynchronous RPC never runs in CallMethod, the flight
+    // can't end before call_id of `cntl' is unlocked.
+    channel->CallMethod(method, sub_cntl, request,
+                        flight->_response.get(), flight);
+}
+
+void RequestCoalescer::Flight::Run() {
+    std::vector<Waiter> waiters;
+    {
+        BAIDU_SCOPED_LOCK(_owner->_mutex);
+        _owner->_flights.erase(_key);
+        waiters.swap(_waiters);
+    }
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        const Waiter& w = waiters[i];
+        Controller* cntl = NULL;
+        if (bthread_id_lock(w.id, (void**)&cntl) != 0) {
+            // The RPC was timedout or canceled.
+            continue;
+        }
+        const int saved_error = cntl->ErrorCode();
+        cntl->_remote_side = _cntl.remote_side();
+        cntl->_local_side = _cntl.local_side();
+        if (_cntl.has_http_response()) {
+            cntl->http_response() = _cntl.http_response();
+        }
+        if (_cntl.Failed()) {
+            cntl->SetFailed(_cntl.ErrorCode(), "%s", _cntl.ErrorText().c_str());
+        } else {
+            if (w.response) {
+                w.response->CopyFrom(*_response);
+            }
+            cntl->response_attachment() = _cntl.response_attachment();
+        }
+        ControllerPrivateAccessor(cntl).OnResponse(w.id, saved_error);
+    }
+    delete this;
+}
+
+} // namespace brpc
@@ -0,0 +1,73 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_REQUEST_COALESCER_H
+#define BRPC_REQUEST_COALESCER_H
+
+#include <string>
+#include <unordered_map>
+#include <google/protobuf/service.h>
+#include <google/protobuf/message.h>
+#include "butil/synchronization/lock.h"
+#include "brpc/shared_object.h"
+#include "brpc/controller.h"
+
+namespace brpc {
+
+class Channel;
+
+// Shares one call among identical in-flight RPCs of a channel, enabled by
+// ChannelOptions.coalesce_requests.
+// Every RPC waits for the shared call as if the call were its own: it has
+// its own timeout and can be canceled, after which the response of the
+// shared call is ignored. The shared call is issued with the options (e.g.
+// timeout, retrying, backup request) of the RPC creating it.
+class RequestCoalescer : public SharedObject {
+public:
+    RequestCoalescer();
+    ~RequestCoalescer();
+
+    // True if the RPC controlled by `cntl' can be coalesced.
+    static bool CanCoalesce(const Controller* cntl);
+
+    // Called by Channel::CallMethod with serialized request and locked
+    // call_id of `cntl' instead of issuing the RPC, which ends when the
+    // shared call ends. A new call is issued over `channel' with `request'
+    // and `request_attachment' (before serialization) when there's no
+    // identical call in flight.
+    void Join(Channel* channel,
+              const google::protobuf::MethodDescriptor* method,
+              Controller* cntl,
+              const google::protobuf::Message* request,
+              google::protobuf::Message* response,
+              const butil::IOBuf& request_attachment);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(RequestCoalescer);
+    class Flight;
+
+    static void MakeKey(const google::protobuf::MethodDescriptor* method,
+                        const Controller* cntl, std::string* key);
+
+    butil::Mutex _mutex;
+    std::unordered_map<std::string, Flight*> _flights;
+};
+
+} // namespace brpc
+
+#endif // BRPC_REQUEST_COALESCER_H
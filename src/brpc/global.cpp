@@ -437,7 +437,7 @@ static void GlobalInitializeOrDieImpl() {
                                ProcessHttpRequest, ProcessHttpResponse,
                                VerifyHttpRequest, ParseHttpServerAddress,
                                GetHttpMethodName,
-                               CONNECTION_TYPE_POOLED_AND_SHORT,
+                               CONNECTION_TYPE_ALL,
                                "http" };
     if (RegisterProtocol(PROTOCOL_HTTP, http_protocol) != 0) {
         exit(1);
@@ -0,0 +1,549 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include "brpc/grpc_stream.h"
+
+#include <gflags/gflags.h>
+#include "butil/macros.h"
+#include "butil/sys_byteorder.h"
+#include "brpc/log.h"
+#include "brpc/errno.pb.h"
+#include "brpc/socket.h"
+#include "brpc/controller.h"
+#include "brpc/details/controller_private_accessor.h"
+#include "brpc/policy/http2_rpc_protocol.h"
+
+namespace brpc {
+
+DECLARE_bool(usercode_in_pthread);
+
+// Compressed-flag and length before each message.
+static const size_t GRPC_PREFIX_SIZE = 5;
+
+GrpcStream::GrpcStream(bool server_side)
+    : _server_side(server_side)
+    , _socket_id(INVALID_SOCKET_ID)
+    , _h2_stream_id(0)
+    , _connected(false)
+    , _close_requested(false)
+    , _closed_sent(false)
+    , _remote_window_left(0)
+    , _accepted(false)
+    , _consumer_stopped(false)
+    , _remote_closed(false)
+    , _input_credited(0)
+    , _precredited(0)
+    , _failed(false) {
+}
+
+GrpcStream::~GrpcStream() {
+}
+
+int GrpcStream::Write(const google::protobuf::Message& message) {
+    butil::IOBuf buf;
+    butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+    if (!message.SerializeToZeroCopyStream(&wrapper)) {
+        LOG(WARNING) << "Fail to serialize " << message.GetTypeName();
+        return EINVAL;
+    }
+    return Write(buf);
+}
+
+int GrpcStream::Write(const butil::IOBuf& message) {
+    char prefix[GRPC_PREFIX_SIZE];
+    prefix[0] = 0;  // not compressed
+    const uint32_t length = butil::HostToNet32(message.size());
+    memcpy(prefix + 1, &length, sizeof(length));
+
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_failed || _close_requested) {
+        return EINVAL;
+    }
+    if (_options.max_buf_size > 0 &&
+        _pending.size() >= (size_t)_options.max_buf_size) {
+        return EAGAIN;
+    }
+    _pending.append(prefix, sizeof(prefix));
+    _pending.append(message);
+    if (!_connected) {
+        // Sent after the headers.
+        return 0;
+    }
+    SocketUniquePtr sock;
+    if (Socket::Address(_socket_id, &sock) != 0) {
+        SetFailedLocked(EFAILEDSOCKET, "The connection was closed", false);
+        return EINVAL;
+    }
+    FlushLocked(sock.get(), NULL);
+    return _failed ? EINVAL : 0;
+}
+
+int GrpcStream::Wait(const timespec* due_time) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    while (!_failed && !_close_requested && _options.max_buf_size > 0 &&
+           _pending.size() >= (size_t)_options.max_buf_size) {
+        if (due_time == NULL) {
+            _cond.wait(mu);
+        } else if (_cond.wait_until(mu, *due_time) == ETIMEDOUT) {
+            return ETIMEDOUT;
+        }
+    }
+    return (_failed || _close_requested) ? EINVAL : 0;
+}
+
+int GrpcStream::Close(const butil::Status& status) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_failed) {
+        return EINVAL;
+    }
+    if (_close_requested) {
+        return 0;
+    }
+    if (!_server_side && !status.ok()) {
+        // Clients can't end streams with a status, cancel it instead.
+        SetFailedLocked(ECANCELED, status.error_str(), true);
+        return 0;
+    }
+    _close_requested = true;
+    _close_status = status;
+    _cond.notify_all();
+    if (_connected) {
+        SocketUniquePtr sock;
+        if (Socket::Address(_socket_id, &sock) != 0) {
+            SetFailedLocked(EFAILEDSOCKET, "The connection was closed", false);
+            return EINVAL;
+        }
+        FlushLocked(sock.get(), NULL);
+    }
+    return 0;
+}
+
+int GrpcStream::Accept(const GrpcStreamOptions& options) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_accepted) {
+        return -1;
+    }
+    _options = options;
+    if (_options.messages_in_batch == 0) {
+        _options.messages_in_batch = 1;
+    }
+    bthread::ExecutionQueueOptions q_opt;
+    q_opt.bthread_attr
+        = FLAGS_usercode_in_pthread ? BTHREAD_ATTR_PTHREAD : BTHREAD_ATTR_NORMAL;
+    if (bthread::execution_queue_start(&_consumer, &q_opt, Consume, this) != 0) {
+        LOG(FATAL) << "Fail to create ExecutionQueue";
+        return -1;
+    }
+    // Released in Consume() after the queue is stopped.
+    AddRefManually();
+    _accepted = true;
+    if (_failed) {
+        StopConsumerLocked();
+    } else {
+        DeliverInputLocked();
+    }
+    return 0;
+}
+
+void GrpcStream::Bind(SocketId socket_id, int h2_stream_id) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    _socket_id = socket_id;
+    _h2_stream_id = h2_stream_id;
+}
+
+void GrpcStream::SetConnected(Socket* sock, int64_t remote_window_size,
+                              bool end_stream, butil::IOBuf* out) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_connected) {
+        return;
+    }
+    _connected = true;
+    if (_failed) {
+        // Failed before the headers were sent.
+        if (!end_stream) {
+            WriteResetLocked(sock, out);
+        }
+        return;
+    }
+    _remote_window_left = remote_window_size;
+    if (end_stream) {
+        _close_requested = true;
+        _closed_sent = true;
+        _pending.clear();
+        _cond.notify_all();
+        return;
+    }
+    if (!_closed_sent) {
+        policy::H2Context* ctx =
+            static_cast<policy::H2Context*>(sock->parsing_context());
+        ctx->AddGrpcStream(_h2_stream_id, this);
+    }
+    FlushLocked(sock, out);
+}
+
+void GrpcStream::OnReceivedData(butil::IOBuf* data, int64_t precredited) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_failed || _consumer_stopped) {
+        // Nobody reads the data, return the credits directly.
+        SendWindowUpdateLocked((int64_t)data->size() - precredited);
+        data->clear();
+        return;
+    }
+    _input.append(butil::IOBuf::Movable(*data));
+    _input_credited += precredited;
+    _precredited += precredited;
+    if (_accepted) {
+        DeliverInputLocked();
+    }
+}
+
+void GrpcStream::OnRemoteClosed(const butil::Status& status) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_remote_closed || _failed) {
+        return;
+    }
+    _remote_closed = true;
+    _remote_status = status;
+    if (!_server_side) {
+        // The server ended the stream, nothing can be written anymore.
+        _pending.clear();
+        if (_connected && !_closed_sent) {
+            SocketUniquePtr sock;
+            if (Socket::Address(_socket_id, &sock) == 0) {
+                WriteResetLocked(sock.get(), NULL);
+            }
+        }
+        _close_requested = true;
+        _closed_sent = true;
+        UnregisterLocked();
+        _cond.notify_all();
+    }
+    if (_accepted) {
+        DeliverInputLocked();
+    }
+}
+
+void GrpcStream::OnH2StreamClosed(int error_code, const std::string& error_text) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_failed || (_remote_closed && _closed_sent)) {
+        return;
+    }
+    if (_closed_sent) {
+        // Nothing to send, the remote side just stopped writing as well.
+        mu.unlock();
+        return OnRemoteClosed(butil::Status());
+    }
+    SetFailedLocked(error_code, error_text, false);
+}
+
+void GrpcStream::OnWindowUpdate(int64_t diff) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    _remote_window_left += diff;
+    if (_connected && !_failed && !_pending.empty()) {
+        SocketUniquePtr sock;
+        if (Socket::Address(_socket_id, &sock) == 0) {
+            FlushLocked(sock.get(), NULL);
+        }
+    }
+}
+
+void GrpcStream::Flush() {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (_connected && !_failed && !_pending.empty()) {
+        SocketUniquePtr sock;
+        if (Socket::Address(_socket_id, &sock) == 0) {
+            FlushLocked(sock.get(), NULL);
+        }
+    }
+}
+
+void GrpcStream::OnRPCReturned(Controller* cntl) {
+    if (cntl->Failed()) {
+        return SetFailed(cntl->ErrorCode(), cntl->ErrorText());
+    }
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    if (!_connected && !_failed) {
+        SetFailedLocked(EREQUEST, "gRPC streams must be created over h2:grpc", false);
+        mu.unlock();
+        cntl->SetFailed(EREQUEST, "gRPC streams must be created over h2:grpc");
+    }
+}
+
+void GrpcStream::SetFailed(int error_code, const std::string& error_text) {
+    std::unique_lock<bthread::Mutex> mu(_mutex);
+    SetFailedLocked(error_code, error_text, true);
+}
+
+void GrpcStream::SetFailedLocked(int error_code, const std::string& error_text,
+                                 bool reset) {
+    if (_failed || (_remote_closed && _closed_sent)) {
+        return;
+    }
+    _failed = true;
+    _error.set_error(error_code, "%s", error_text.c_str());
+    _pending.clear();
+    if (reset && _connected && !_closed_sent) {
+        SocketUniquePtr sock;
+        if (Socket::Address(_socket_id, &sock) == 0) {
+            WriteResetLocked(sock.get(), NULL);
+        }
+    }
+    UnregisterLocked();
+    // Return credits of data that will never be delivered.
+    const int64_t dropped = (int64_t)_input.size() - _input_credited;
+    _input.clear();
+    _input_credited = 0;
+    SendWindowUpdateLocked(dropped);
+    if (_accepted) {
+        StopConsumerLocked();
+    }
+    _cond.notify_all();
+}
+
+void GrpcStream::DeliverInputLocked() {
+    while (_input.size() >= GRPC_PREFIX_SIZE) {
+        char prefix[GRPC_PREFIX_SIZE];
+        _input.copy_to(prefix, sizeof(prefix));
+        if (prefix[0] != 0) {
+            return SetFailedLocked(_server_side ? EREQUEST : ERESPONSE,
+                                   "Compressed messages are not supported in gRPC streams",
+                                   true);
+        }
+        uint32_t length = 0;
+        memcpy(&length, prefix + 1, sizeof(length));
+        length = butil::NetToHost32(length);
+        if (_input.size() < GRPC_PREFIX_SIZE + length) {
+            break;
+        }
+        const int64_t size = GRPC_PREFIX_SIZE + length;
+        _input_credited = std::max(_input_credited - size, (int64_t)0);
+        butil::IOBuf* msg = new butil::IOBuf;
+        _input.pop_front(GRPC_PREFIX_SIZE);
+        _input.cutn(msg, length);
+        if (bthread::execution_queue_execute(_consumer, msg) != 0) {
+            delete msg;
+            SendWindowUpdateLocked(size);
+        }
+    }
+    // A message larger than the window would never complete if its partial
+    // data is not credited, credit the data now and skip it when the message
+    // is consumed.
+    const int64_t uncredited = (int64_t)_input.size() - _input_credited;
+    if (uncredited > 0) {
+        _input_credited += uncredited;
+        _precredited += uncredited;
+        SendWindowUpdateLocked(uncredited);
+    }
+    if (_remote_closed) {
+        StopConsumerLocked();
+    }
+}
+
+void GrpcStream::StopConsumerLocked() {
+    if (!_consumer_stopped) {
+        _consumer_stopped = true;
+        bthread::execution_queue_stop(_consumer);
+    }
+}
+
+void GrpcStream::FlushLocked(Socket* sock, butil::IOBuf* out) {
+    policy::H2Context* ctx = static_cast<policy::H2Context*>(sock->parsing_context());
+    butil::IOBuf frames;
+    butil::IOBuf* buf = (out != NULL ? out : &frames);
+    const int64_t max_frame_size = ctx->remote_settings().max_frame_size;
+    while (!_pending.empty() && _remote_window_left > 0) {
+        const int64_t size = ctx->ConsumeRemoteWindow(
+            std::min(std::min((int64_t)_pending.size(), _remote_window_left),
+                     max_frame_size));
+        if (size <= 0) {
+            break;
+        }
+        _remote_window_left -= size;
+        // Clients half-close along with the last message.
+        const bool end_stream = (!_server_side && _close_requested &&
+                                 (size_t)size == _pending.size());
+        policy::AppendH2DataFrame(buf, &_pending, size, _h2_stream_id, end_stream);
+        if (end_stream) {
+            _closed_sent = true;
+        }
+    }
+    SocketMessagePtr<> trailers;
+    if (_pending.empty() && _close_requested && !_closed_sent) {
+        _closed_sent = true;
+        if (_server_side) {
+            trailers.reset(policy::H2UnsentTrailers::New(_h2_stream_id, _close_status));
+        } else {
+            policy::AppendH2DataFrame(buf, &_pending, 0, _h2_stream_id, true);
+        }
+    }
+    Socket::WriteOptions wopt;
+    wopt.ignore_eovercrowded = true;
+    // Written with _mutex held to keep the order of frames.
+    if ((!frames.empty() && sock->Write(&frames, &wopt) != 0) ||
+        (trailers != NULL && sock->Write(trailers, &wopt) != 0)) {
+        const int saved_errno = errno;
+        return SetFailedLocked(saved_errno, "Fail to write into the connection", false);
+    }
+    if (_closed_sent) {
+        UnregisterLocked();
+    }
+    if (_options.max_buf_size <= 0 ||
+        _pending.size() < (size_t)_options.max_buf_size) {
+        _cond.notify_all();
+    }
+}
+
+void GrpcStream::SendWindowUpdateLocked(int64_t size) {
+    if (size <= 0) {
+        return;
+    }
+    SocketUniquePtr sock;
+    if (Socket::Address(_socket_id, &sock) != 0) {
+        return;
+    }
+    policy::H2Context* ctx = static_cast<policy::H2Context*>(sock->parsing_context());
+    if (ctx == NULL) {
+        return;
+    }
+    if (!_remote_closed && !_failed) {
+        butil::IOBuf buf;
+        policy::AppendH2WindowUpdate(&buf, _h2_stream_id, size);
+        Socket::WriteOptions wopt;
+        wopt.ignore_eovercrowded = true;
+        if (sock->Write(&buf, &wopt) != 0) {
+            return;
+        }
+    }
+    ctx->DeferWindowUpdate(size);
+}
+
+void GrpcStream::WriteResetLocked(Socket* sock, butil::IOBuf* out) {
+    butil::IOBuf buf;
+    policy::AppendH2ResetStream(out != NULL ? out : &buf, _h2_stream_id,
+                                _remote_closed ? H2_NO_ERROR : H2_CANCEL);
+    if (!buf.empty()) {
+        Socket::WriteOptions wopt;
+        wopt.ignore_eovercrowded = true;
+        sock->Write(&buf, &wopt);
+    }
+    _closed_sent = true;
+}
+
+void GrpcStream::UnregisterLocked() {
+    if (!_connected) {
+        return;
+    }
+    SocketUniquePtr sock;
+    if (Socket::Address(_socket_id, &sock) != 0) {
+        return;
+    }
+    policy::H2Context* ctx = static_cast<policy::H2Context*>(sock->parsing_context());
+    if (ctx != NULL) {
+        ctx->RemoveGrpcStream(_h2_stream_id, this);
+    }
+}
+
+butil::Status GrpcStream::ClosedStatusLocked() const {
+    return _failed ? _error : _remote_status;
+}
+
+int GrpcStream::Consume(void* meta, bthread::TaskIterator<butil::IOBuf*>& iter) {
+    GrpcStream* s = static_cast<GrpcStream*>(meta);
+    if (iter.is_queue_stopped()) {
+        butil::Status status;
+        {
+            std::unique_lock<bthread::Mutex> mu(s->_mutex);
+            status = s->ClosedStatusLocked();
+        }
+        if (s->_options.handler != NULL) {
+            s->_options.handler->on_closed(s, status);
+        }
+        s->RemoveRefManually();
+        return 0;
+    }
+    DEFINE_SMALL_ARRAY(butil::IOBuf*, batch, s->_options.messages_in_batch, 256);
+    size_t n = 0;
+    int64_t consumed = 0;
+    for (; iter; ++iter) {
+        butil::IOBuf* msg = *iter;
+        consumed += GRPC_PREFIX_SIZE + msg->size();
+        batch[n++] = msg;
+        if (n == s->_options.messages_in_batch) {
+            s->HandleMessages(batch, n);
+            n = 0;
+        }
+    }
+    s->HandleMessages(batch, n);
+    // Return credits of consumed messages so that the remote side writes more.
+    std::unique_lock<bthread::Mutex> mu(s->_mutex);
+    const int64_t skipped = std::min(consumed, s->_precredited);
+    s->_precredited -= skipped;
+    s->SendWindowUpdateLocked(consumed - skipped);
+    return 0;
+}
+
+void GrpcStream::HandleMessages(butil::IOBuf* messages[], size_t size) {
+    if (size == 0) {
+        return;
+    }
+    if (_options.handler != NULL) {
+        _options.handler->on_received_messages(this, messages, size);
+    }
+    for (size_t i = 0; i < size; ++i) {
+        delete messages[i];
+    }
+}
+
+int GrpcStreamCreate(butil::intrusive_ptr<GrpcStream>* stream, Controller& cntl,
+                     const GrpcStreamOptions* options) {
+    ControllerPrivateAccessor accessor(&cntl);
+    if (accessor.grpc_stream() != NULL) {
+        LOG(ERROR) << "Can't create gRPC stream more than once";
+        return -1;
+    }
+    butil::intrusive_ptr<GrpcStream> s(new GrpcStream(false));
+    if (s->Accept(options ? *options : GrpcStreamOptions()) != 0) {
+        return -1;
+    }
+    // Messages can't be written again.
+    cntl.set_max_retry(0);
+    cntl.set_backup_request_ms(-1);
+    accessor.set_grpc_stream(s.get());
+    stream->swap(s);
+    return 0;
+}
+
+int GrpcStreamAccept(butil::intrusive_ptr<GrpcStream>* stream, Controller& cntl,
+                     const GrpcStreamOptions* options) {
+    GrpcStream* s = ControllerPrivateAccessor(&cntl).grpc_stream();
+    if (s == NULL) {
+        LOG(ERROR) << "The method is not a streaming method of gRPC";
+        return -1;
+    }
+    if (!s->is_server_side() || s->accepted()) {
+        LOG(ERROR) << "The stream was accepted";
+        return -1;
+    }
+    if (s->Accept(options ? *options : GrpcStreamOptions()) != 0) {
+        return -1;
+    }
+    stream->reset(s);
+    return 0;
+}
+
+} // namespace brpc
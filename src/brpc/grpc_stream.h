@@ -0,0 +1,246 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#ifndef BRPC_GRPC_STREAM_H
+#define BRPC_GRPC_STREAM_H
+
+#include <google/protobuf/message.h>
+#include "butil/iobuf.h"
+#include "butil/status.h"
+#include "bthread/execution_queue.h"
+#include "bthread/mutex.h"
+#include "bthread/condition_variable.h"
+#include "brpc/socket_id.h"
+#include "brpc/shared_object.h"
+
+namespace brpc {
+
+class Controller;
+class Socket;
+namespace policy {
+class H2Context;
+}
+
+class GrpcStream;
+
+// Streaming methods of gRPC ("rpc Chat(stream Req) returns (stream Res)")
+// over http2. The RPC carries the first message of the client as the request
+// and completes once the server accepts the stream and replies headers.
+// Afterwards both sides exchange serialized messages through GrpcStream
+// until the server ends the stream with a gRPC status:
+//
+//   [Client]                                  [Server]
+//   GrpcStreamCreate(&s, cntl, &opt)
+//   stub.Chat(&cntl, &first_req, &res, ...)   Chat(cntl, req, res, done):
+//                                               GrpcStreamAccept(&s, cntl, &opt)
+//                                               done->Run()
+//   s->Write(req2) ...                        s->Write(res1) ...
+//   s->Close()  // half-close                 on_closed(OK): s->Close(status)
+//   on_closed(status)
+//
+// Messages in both directions are flow-controlled by the http2 windows of
+// the stream: credits of received messages are returned after they're
+// consumed by the handler, thus a slow handler stops the remote side from
+// writing and Write() returns EAGAIN when too many messages are not sent.
+
+class GrpcStreamHandler {
+public:
+    virtual ~GrpcStreamHandler() = default;
+
+    // Called with messages written by the remote side, in the order they
+    // were written. `messages' are serialized protobufs without the gRPC
+    // prefixes, which are destroyed after this function returns.
+    virtual void on_received_messages(GrpcStream* stream,
+                                      butil::IOBuf* const messages[],
+                                      size_t size) = 0;
+
+    // Called once after all messages are received when the remote side
+    // stopped writing. `status' is OK when the client half-closed the
+    // stream (at the server side) or the server ended the stream with
+    // an OK gRPC status (at the client side), otherwise the stream was
+    // ended with an error, reset, or broken along with the connection.
+    virtual void on_closed(GrpcStream* stream, const butil::Status& status) = 0;
+};
+
+struct GrpcStreamOptions {
+    GrpcStreamOptions()
+        : handler(NULL)
+        , max_buf_size(2 * 1024 * 1024)
+        , messages_in_batch(128)
+    {}
+
+    // Handle messages from the remote side. Messages are dropped if it's NULL.
+    // default: NULL
+    GrpcStreamHandler* handler;
+
+    // The max size of messages written but not sent due to flow control of
+    // the remote side, Write() returns EAGAIN when the size exceeds.
+    // If |max_buf_size| <= 0, there's no limit of buf size
+    // default: 2097152 (2M)
+    int max_buf_size;
+
+    // Maximum messages in batch passed to handler->on_received_messages
+    // default: 128
+    size_t messages_in_batch;
+};
+
+class GrpcStream : public SharedObject {
+public:
+    // Write `message' to the remote side.
+    // Returns 0 on success, errno otherwise
+    // Errno:
+    //  - EAGAIN: buffered messages which can't be sent due to flow control
+    //            exceeds |max_buf_size|
+    //  - EINVAL: the stream was closed or failed
+    int Write(const google::protobuf::Message& message);
+    // Write a serialized message.
+    int Write(const butil::IOBuf& message);
+
+    // Wait until buffered messages are less than |max_buf_size| or the stream
+    // was closed.
+    // Returns 0 on success, errno otherwise
+    // Errno:
+    //  - ETIMEDOUT: |due_time| is not NULL and expired
+    //  - EINVAL: the stream was closed or failed during waiting
+    int Wait(const timespec* due_time);
+
+    // Stop writing after buffered messages are sent. Following Write() fail.
+    // [Client] Half-close the stream, or reset it if `status' is not OK.
+    // [Server] End the stream with `status' as the gRPC status.
+    // Can be called multiple times, only the first call takes effect.
+    // Returns 0 on success, EINVAL if the stream was failed.
+    int Close(const butil::Status& status = butil::Status());
+
+    bool is_server_side() const { return _server_side; }
+
+    // The stream id of http2, 0 before the request is sent.
+    int h2_stream_id() const { return _h2_stream_id; }
+
+public:
+    // Following methods are used by the http2 protocol.
+    explicit GrpcStream(bool server_side);
+    ~GrpcStream();
+
+    // Start delivering messages to `options'. Called once.
+    int Accept(const GrpcStreamOptions& options);
+    bool accepted() const { return _accepted; }
+
+    // Associate with the http2 stream `h2_stream_id' on socket `socket_id'.
+    void Bind(SocketId socket_id, int h2_stream_id);
+
+    // Headers of the stream were written to `socket' (or being appended into
+    // `out'), start sending messages with `remote_window_size' as the window.
+    // If `end_stream' is true, the local side does not write any message.
+    void SetConnected(Socket* socket, int64_t remote_window_size,
+                      bool end_stream, butil::IOBuf* out);
+
+    // Data of the http2 stream. The first `precredited' bytes have been
+    // credited to the remote side.
+    void OnReceivedData(butil::IOBuf* data, int64_t precredited);
+
+    // The remote side ended the http2 stream with `status'.
+    void OnRemoteClosed(const butil::Status& status);
+
+    // The http2 stream was reset or destroyed with the connection.
+    void OnH2StreamClosed(int error_code, const std::string& error_text);
+
+    // WINDOW_UPDATE or SETTINGS changed the window of this stream.
+    void OnWindowUpdate(int64_t diff);
+
+    // Send messages buffered due to flow control.
+    void Flush();
+
+    // [Client] The RPC carrying this stream ended.
+    void OnRPCReturned(Controller* cntl);
+
+    // Fail the stream, reset the http2 stream if it's connected.
+    void SetFailed(int error_code, const std::string& error_text);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(GrpcStream);
+
+    static int Consume(void* meta, bthread::TaskIterator<butil::IOBuf*>& iter);
+    void HandleMessages(butil::IOBuf* messages[], size_t size);
+
+    // Methods suffixed with Locked are called with _mutex held.
+    void DeliverInputLocked();
+    void StopConsumerLocked();
+    void FlushLocked(Socket* sock, butil::IOBuf* out);
+    void SetFailedLocked(int error_code, const std::string& error_text, bool reset);
+    void SendWindowUpdateLocked(int64_t size);
+    void WriteResetLocked(Socket* sock, butil::IOBuf* out);
+    void UnregisterLocked();
+    butil::Status ClosedStatusLocked() const;
+
+    const bool _server_side;
+    GrpcStreamOptions _options;
+    bthread::Mutex _mutex;
+    bthread::ConditionVariable _cond;
+
+    SocketId _socket_id;
+    int _h2_stream_id;
+
+    // Sending side
+    bool _connected;
+    bool _close_requested;
+    bool _closed_sent;
+    butil::Status _close_status;
+    int64_t _remote_window_left;
+    // gRPC-framed messages not sent yet.
+    butil::IOBuf _pending;
+
+    // Receiving side
+    bool _accepted;
+    bool _consumer_stopped;
+    bool _remote_closed;
+    butil::Status _remote_status;
+    bthread::ExecutionQueueId<butil::IOBuf*> _consumer;
+    // Received data not cut into messages yet.
+    butil::IOBuf _input;
+    // Bytes in _input that were credited to the remote side.
+    int64_t _input_credited;
+    // Bytes credited before being consumed, which are skipped when
+    // crediting consumed messages.
+    int64_t _precredited;
+
+    bool _failed;
+    butil::Status _error;
+};
+
+// [Called at the client side]
+// Create a stream along with `cntl' which is connected when the RPC of
+// a streaming gRPC method over "h2:grpc" succeeds. Retries and backup
+// requests of `cntl' are disabled. If `options' is NULL, the stream will be
+// created with default options.
+// Returns 0 on success, -1 otherwise
+int GrpcStreamCreate(butil::intrusive_ptr<GrpcStream>* stream, Controller& cntl,
+                     const GrpcStreamOptions* options);
+
+// [Called at the server side]
+// Accept the stream of a streaming gRPC method inside the method, messages
+// after the request are delivered to `options->handler'. The stream is
+// connected after `done' is run with `cntl' not failed, the response message
+// is not sent in which case. If the method is not streaming or the stream
+// was accepted, this function fails.
+// Returns 0 on success, -1 otherwise
+int GrpcStreamAccept(butil::intrusive_ptr<GrpcStream>* stream, Controller& cntl,
+                     const GrpcStreamOptions* options);
+
+} // namespace brpc
+
+#endif // BRPC_GRPC_STREAM_H
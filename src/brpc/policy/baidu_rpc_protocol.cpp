@@ -27,6 +27,7 @@
 #include "butil/memory/scope_guard.h"
 #include "json2pb/json_to_pb.h"
 #include "json2pb/pb_to_json.h"
+#include "bthread/unstable.h"                   // bthread_set_priority_self
 #include "brpc/controller.h"                    // Controller
 #include "brpc/socket.h"                        // Socket
 #include "brpc/server.h"                        // Server
@@ -50,6 +51,9 @@ void bthread_assign_data(void* data);
 
 
 namespace brpc {
+
+DECLARE_bool(enable_method_phase_latency);
+
 namespace policy {
 
 DEFINE_bool(baidu_protocol_use_fullname, true,
@@ -60,6 +64,7 @@ DEFINE_bool(baidu_std_protocol_deliver_timeout_ms, false,
             "If this flag is true, baidu_std puts timeout_ms in requests.");
 
 DECLARE_bool(pb_enum_as_number);
+DECLARE_bool(pb_json_sax_parsing);
 
 // Notes:
 // 1. 12-byte header [PRPC][body_size][meta_size]
@@ -272,8 +277,15 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
                      MethodStatus* method_status, int64_t received_us) {
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
+    // Phases are recorded only when user's callback was called.
+    const bool record_phases = (accessor.start_callback_us() != 0 &&
+                                method_status != NULL);
+    ServerPhaseTimes phases;
+    if (span || record_phases) {
+        phases.start_send_us = butil::cpuwide_time_us();
+    }
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(phases.start_send_us);
     }
     Socket* sock = accessor.get_sending_socket();
 
@@ -389,8 +401,13 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
     bthread_id_t response_id = INVALID_BTHREAD_ID;
     if (span) {
         span->set_response_size(res_buf.size());
+    }
+    if (span || record_phases) {
         CHECK_EQ(0, bthread_id_create(&response_id, &args, HandleResponseWritten));
     }
+    if (record_phases) {
+        phases.start_write_us = butil::cpuwide_time_us();
+    }
 
     // Send rpc response over stream even if server side failed to create
     // stream for some reason.
@@ -448,12 +465,21 @@ void SendRpcResponse(int64_t correlation_id, Controller* cntl,
         }
     }
 
-    if (span) {
+    if (span || record_phases) {
         bthread_id_join(response_id);
+    }
+    if (span) {
         // Do not care about the result of background writing.
         // TODO: this is not sent
         span->set_sent_us(args.sent_us);
     }
+    if (record_phases) {
+        phases.received_us = received_us;
+        phases.start_parse_us = accessor.start_parse_us();
+        phases.start_callback_us = accessor.start_callback_us();
+        phases.sent_us = args.sent_us;
+        method_status->OnPhasesEnded(phases);
+    }
 }
 
 namespace {
@@ -527,6 +553,7 @@ bool DeserializeRpcMessage(const butil::IOBuf& data, Controller& cntl,
             json2pb::Json2PbOptions options;
             options.base64_to_bytes = cntl.has_pb_bytes_to_base64();
             options.array_to_single_repeated = cntl.has_pb_single_repeated_to_array();
+            options.sax_parsing = FLAGS_pb_json_sax_parsing;
             std::string error;
             bool ok = json2pb::JsonToProtoMessage(input, message, options, &error);
             if (!ok) {
@@ -588,7 +615,8 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         sample->meta.set_attachment_size(meta.attachment_size());
         sample->meta.set_authentication_data(meta.authentication_data());
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
+        sample->meta.set_connection_id(socket->id());
+        SubmitSample(sample, start_parse_us);
     }
 
     std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
@@ -624,6 +652,7 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(PROTOCOL_BAIDU_STD)
         .set_begin_time_us(msg->received_us())
+        .set_start_parse_us(start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
 
     if (meta.has_stream_settings()) {
@@ -765,6 +794,11 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
                   butil::endpoint2str(socket->remote_side()).c_str());
               break;
             }
+            if (mp->bthread_priority) {
+                // The method is known after parsing, the priority takes effect
+                // when this bthread is put into runqueues again.
+                bthread_set_priority_self(mp->bthread_priority);
+            }
             // Switch to service-specific error.
             non_service_error.release();
             method_status = mp->status;
@@ -830,6 +864,9 @@ void ProcessRpcRequest(InputMessageBase* msg_base) {
         // optional, just release resource ASAP
         msg.reset();
 
+        if (FLAGS_enable_method_phase_latency) {
+            accessor.set_start_callback_us(butil::cpuwide_time_us());
+        }
         if (span) {
             span->set_start_callback_us(butil::cpuwide_time_us());
             span->AsParent();
@@ -20,6 +20,7 @@
 #include "brpc/details/controller_private_accessor.h"
 #include "brpc/server.h"
 #include "butil/base64.h"
+#include "butil/sys_byteorder.h"
 #include "brpc/log.h"
 
 namespace brpc {
@@ -42,9 +43,9 @@ DEFINE_int32(h2_client_max_frame_size,
              H2Settings::DEFAULT_MAX_FRAME_SIZE,
              "Size of the largest frame payload that client is willing to receive");
 
-DEFINE_bool(h2_hpack_encode_name, false,
+DEFINE_bool(h2_hpack_encode_name, true,
             "Encode name in HTTP2 headers with huffman encoding");
-DEFINE_bool(h2_hpack_encode_value, false,
+DEFINE_bool(h2_hpack_encode_value, true,
             "Encode value in HTTP2 headers with huffman encoding");
 
 static bool CheckStreamWindowSize(const char*, int32_t val) {
@@ -139,6 +140,34 @@ inline void SerializeFrameHead(void* out_buf, const H2FrameHead& h) {
                               h.flags, h.stream_id);
 }
 
+// Error code of GrpcStreams reset with `e'.
+static int H2ErrorToErrorCode(H2Error e) {
+    return (e == H2_CANCEL ? ECANCELED : EINTERNAL);
+}
+
+// Status of the gRPC stream ended with headers `h'.
+static butil::Status GetGrpcStatus(const HttpHeader& h) {
+    const std::string* grpc_status = h.GetHeader("grpc-status");
+    if (grpc_status == NULL) {
+        if (h.status_code() != HTTP_STATUS_OK) {
+            return butil::Status(EHTTP, "HTTP/2 %d", h.status_code());
+        }
+        return butil::Status(ERESPONSE, "Missing grpc-status");
+    }
+    const GrpcStatus status = (GrpcStatus)strtol(grpc_status->c_str(), NULL, 10);
+    if (status == GRPC_OK) {
+        return butil::Status();
+    }
+    const std::string* grpc_message = h.GetHeader("grpc-message");
+    if (grpc_message == NULL) {
+        return butil::Status(GrpcStatusToErrorCode(status), "%s",
+                             GrpcStatusToString(status));
+    }
+    std::string message_decoded;
+    PercentDecode(*grpc_message, &message_decoded);
+    return butil::Status(GrpcStatusToErrorCode(status), "%s", message_decoded.c_str());
+}
+
 static int WriteAck(Socket* s, const void* data, size_t n) {
     butil::IOBuf sendbuf;
     sendbuf.append(data, n);
@@ -323,6 +352,7 @@ inline H2Context::FrameHandler FindFrameHandler(H2FrameType type) {
 
 H2Context::H2Context(Socket* socket, const Server* server)
     : _socket(socket)
+    , _server(server)
     // Maximize the window size to make sending big request possible before
     // receving the remote settings.
     , _remote_window_left(H2Settings::MAX_WINDOW_SIZE)
@@ -358,12 +388,20 @@ H2Context::~H2Context() {
         delete it->second;
     }
     _pending_streams.clear();
+    for (GrpcStreamMap::iterator it = _grpc_streams.begin();
+         it != _grpc_streams.end(); ++it) {
+        it->second->OnH2StreamClosed(EFAILEDSOCKET, "The connection was closed");
+    }
+    _grpc_streams.clear();
 }
 
 int H2Context::Init() {
     if (_pending_streams.init(64, 70) != 0) {
         LOG(WARNING) << "Fail to init _pending_streams";
     }
+    if (_grpc_streams.init(8, 70) != 0) {
+        LOG(WARNING) << "Fail to init _grpc_streams";
+    }
     if (_hpacker.Init(_unack_local_settings.header_table_size) != 0) {
         LOG(WARNING) << "Fail to init _hpacker";
     }
@@ -422,6 +460,52 @@ H2StreamContext* H2Context::FindStream(int stream_id) {
     return NULL;
 }
 
+butil::intrusive_ptr<GrpcStream> H2Context::FindGrpcStream(int stream_id) {
+    std::unique_lock<butil::Mutex> mu(_grpc_stream_mutex);
+    butil::intrusive_ptr<GrpcStream>* ps = _grpc_streams.seek(stream_id);
+    if (ps) {
+        return *ps;
+    }
+    return NULL;
+}
+
+void H2Context::ListGrpcStreams(std::vector<butil::intrusive_ptr<GrpcStream> >* out) {
+    out->clear();
+    std::unique_lock<butil::Mutex> mu(_grpc_stream_mutex);
+    for (GrpcStreamMap::const_iterator it = _grpc_streams.begin();
+         it != _grpc_streams.end(); ++it) {
+        out->push_back(it->second);
+    }
+}
+
+void H2Context::AddGrpcStream(int stream_id, GrpcStream* stream) {
+    std::unique_lock<butil::Mutex> mu(_grpc_stream_mutex);
+    _grpc_streams[stream_id].reset(stream);
+}
+
+void H2Context::RemoveGrpcStream(int stream_id, GrpcStream* stream) {
+    butil::intrusive_ptr<GrpcStream> removed;
+    std::unique_lock<butil::Mutex> mu(_grpc_stream_mutex);
+    butil::intrusive_ptr<GrpcStream>* ps = _grpc_streams.seek(stream_id);
+    if (ps != NULL && ps->get() == stream) {
+        // Release the reference after unlocking.
+        removed.swap(*ps);
+        _grpc_streams.erase(stream_id);
+    }
+}
+
+int64_t H2Context::ConsumeRemoteWindow(int64_t max_size) {
+    int64_t left = _remote_window_left.load(butil::memory_order_relaxed);
+    while (left > 0) {
+        const int64_t size = std::min(left, max_size);
+        if (_remote_window_left.compare_exchange_weak(
+                left, left - size, butil::memory_order_relaxed)) {
+            return size;
+        }
+    }
+    return 0;
+}
+
 int H2Context::TryToInsertStream(int stream_id, H2StreamContext* ctx) {
     std::unique_lock<butil::Mutex> mu(_stream_mutex);
     if (_goaway_stream_id >= 0 && stream_id > _goaway_stream_id) {
@@ -642,7 +726,7 @@ H2ParseResult H2StreamContext::OnHeaders(
         if (frame_head.flags & H2_FLAGS_END_STREAM) {
             return OnEndStream();
         }
-        return MakeH2Message(NULL);
+        return OnEndHeaders();
     } else {
         if (frame_head.flags & H2_FLAGS_END_STREAM) {
             // Delay calling OnEndStream() in OnContinuation()
@@ -692,10 +776,99 @@ H2ParseResult H2StreamContext::OnContinuation(
         if (_stream_ended) {
             return OnEndStream();
         }
+        return OnEndHeaders();
+    }
+    return MakeH2Message(NULL);
+}
+
+H2ParseResult H2StreamContext::OnEndHeaders() {
+    if (_grpc_stream_dispatched) {
+        return MakeH2Message(NULL);
+    }
+    const HttpHeader& h = header();
+    if (_conn_ctx->is_server_side()) {
+        // Following messages of client-streaming methods are delivered to
+        // a GrpcStream, create it before receiving the data.
+        const Server* server = _conn_ctx->_server;
+        if (server != NULL && server->has_grpc_client_streaming_method() &&
+            _grpc_stream == NULL && !read_body_progressively() &&
+            IsGrpcClientStreamingRequest(h, server)) {
+            _grpc_stream.reset(new GrpcStream(true));
+            _grpc_stream->Bind(_conn_ctx->_socket->id(), _stream_id);
+        }
+        return MakeH2Message(NULL);
+    }
+    if (_grpc_stream != NULL && h.status_code() == HTTP_STATUS_OK) {
+        bool is_grpc_ct = false;
+        ParseContentType(h.content_type(), &is_grpc_ct);
+        if (is_grpc_ct) {
+            // The server accepted the stream, end the RPC with the headers.
+            return MakeH2Message(NewGrpcStreamHead());
+        }
     }
     return MakeH2Message(NULL);
 }
 
+H2StreamContext* H2StreamContext::NewGrpcStreamHead() {
+    H2StreamContext* head = new H2StreamContext(false);
+    head->Init(_conn_ctx, _stream_id);
+    head->header().Swap(header());
+    head->body().swap(body());
+    head->_correlation_id = _correlation_id;
+    head->_parsed_length = _parsed_length;
+    head->_grpc_stream = _grpc_stream;
+    head->_is_grpc_stream_head = true;
+    head->OnMessageComplete();
+    _parsed_length = 0;
+    _grpc_stream_dispatched = true;
+    return head;
+}
+
+H2StreamContext* H2StreamContext::SplitGrpcStreamHead(bool end_stream) {
+    butil::IOBuf& buf = body();
+    char prefix[5];
+    if (buf.copy_to(prefix, sizeof(prefix)) != sizeof(prefix)) {
+        return NULL;
+    }
+    uint32_t length = 0;
+    memcpy(&length, prefix + 1, sizeof(length));
+    const size_t first_size = sizeof(prefix) + butil::NetToHost32(length);
+    if (buf.size() < first_size) {
+        return NULL;
+    }
+    butil::IOBuf rest;
+    buf.cutn(&rest, first_size);
+    rest.swap(buf);
+    // Data after the first message is credited by the GrpcStream after
+    // being consumed, move them out from the deferred WINDOW_UPDATE of this
+    // stream. The part that was already credited is told to the stream.
+    int64_t precredited = 0;
+    const int64_t left = _deferred_window_update.fetch_sub(
+        rest.size(), butil::memory_order_relaxed) - (int64_t)rest.size();
+    if (left < 0) {
+        _deferred_window_update.fetch_add(-left, butil::memory_order_relaxed);
+        precredited = -left;
+    }
+    H2StreamContext* head = NULL;
+    if (!end_stream) {
+        head = NewGrpcStreamHead();
+        // Credit the first message now since the stream context is not
+        // removed until the stream ends.
+        const int64_t stream_wu = ReleaseDeferredWindowUpdate();
+        if (stream_wu > 0) {
+            char winbuf[FRAME_HEAD_SIZE + 4];
+            SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, stream_id());
+            SaveUint32(winbuf + FRAME_HEAD_SIZE, stream_wu);
+            if (WriteAck(_conn_ctx->_socket, winbuf, sizeof(winbuf)) != 0) {
+                LOG(WARNING) << "Fail to send WINDOW_UPDATE to " << *_conn_ctx->_socket;
+            }
+            _conn_ctx->DeferWindowUpdate(stream_wu);
+        }
+    }
+    _grpc_stream->OnReceivedData(&rest, precredited);
+    return head;
+}
+
 H2ParseResult H2Context::OnData(
     butil::IOBufBytesIterator& it, const H2FrameHead& frame_head) {
     uint32_t frag_size = frame_head.payload_size;
@@ -732,6 +905,14 @@ H2ParseResult H2StreamContext::OnData(
     butil::IOBuf data;
     it.append_and_forward(&data, frag_size);
     it.forward(pad_length);
+    if (_grpc_stream_dispatched) {
+        // Flow control of following messages is done by the GrpcStream.
+        _grpc_stream->OnReceivedData(&data, 0);
+        if (frame_head.flags & H2_FLAGS_END_STREAM) {
+            return OnEndStream();
+        }
+        return MakeH2Message(NULL);
+    }
     for (size_t i = 0; i < data.backing_block_num(); ++i) {
         const butil::StringPiece blk = data.backing_block(i);
         if (OnBody(blk.data(), blk.size()) != 0) {
@@ -772,7 +953,16 @@ H2ParseResult H2StreamContext::OnData(
             }
         }
     }
-    if (frame_head.flags & H2_FLAGS_END_STREAM) {
+    const bool end_stream = (frame_head.flags & H2_FLAGS_END_STREAM);
+    if (_grpc_stream != NULL && _conn_ctx->is_server_side()) {
+        // Process the first message of the client-streaming request as
+        // soon as it's complete.
+        H2StreamContext* head = SplitGrpcStreamHead(end_stream);
+        if (head != NULL) {
+            return MakeH2Message(head);
+        }
+    }
+    if (end_stream) {
         return OnEndStream();
     }
     return MakeH2Message(NULL);
@@ -787,6 +977,12 @@ H2ParseResult H2Context::OnResetStream(
     const H2Error h2_error = static_cast<H2Error>(LoadUint32(it));
     H2StreamContext* sctx = FindStream(frame_head.stream_id);
     if (sctx == NULL) {
+        // The stream may still be sending messages of a GrpcStream.
+        butil::intrusive_ptr<GrpcStream> gs = FindGrpcStream(frame_head.stream_id);
+        if (gs != NULL) {
+            gs->OnH2StreamClosed(H2ErrorToErrorCode(h2_error), H2ErrorToString(h2_error));
+            return MakeH2Message(NULL);
+        }
         RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
         return MakeH2Message(NULL);
     }
@@ -812,6 +1008,14 @@ H2ParseResult H2StreamContext::OnResetStream(
         LOG(ERROR) << "Fail to find stream_id=" << stream_id();
         return MakeH2Error(H2_PROTOCOL_ERROR);
     }
+    if (_grpc_stream_dispatched) {
+        // The RPC already ended, just fail the GrpcStream.
+        butil::intrusive_ptr<GrpcStream> gs;
+        gs.swap(_grpc_stream);
+        delete sctx;
+        gs->OnH2StreamClosed(H2ErrorToErrorCode(h2_error), H2ErrorToString(h2_error));
+        return MakeH2Message(NULL);
+    }
     if (_conn_ctx->is_client_side()) {
         sctx->header().set_status_code(H2ErrorToStatusCode(h2_error));
         return MakeH2Message(sctx);
@@ -841,6 +1045,23 @@ H2ParseResult H2StreamContext::OnEndStream() {
     }
     CHECK_EQ(sctx, this);
 
+    if (_grpc_stream_dispatched) {
+        // The remote side stopped writing messages.
+        butil::intrusive_ptr<GrpcStream> gs;
+        gs.swap(_grpc_stream);
+        const butil::Status status = (_conn_ctx->is_server_side() ?
+                                      butil::Status() : GetGrpcStatus(header()));
+        delete this;
+        gs->OnRemoteClosed(status);
+        return MakeH2Message(NULL);
+    }
+    if (_grpc_stream != NULL && !_is_grpc_stream_head) {
+        // The stream ended along with the RPC, e.g. the server did not
+        // accept the stream or the client only sent the request.
+        _grpc_stream->OnRemoteClosed(_conn_ctx->is_server_side() ?
+                                     butil::Status() : GetGrpcStatus(header()));
+        _is_grpc_stream_head = true;
+    }
     OnMessageComplete();
     return MakeH2Message(sctx);
 }
@@ -905,6 +1126,13 @@ H2ParseResult H2Context::OnSettings(
             }
         }
     }
+    if (window_diff) {
+        std::vector<butil::intrusive_ptr<GrpcStream> > grpc_streams;
+        ListGrpcStreams(&grpc_streams);
+        for (size_t i = 0; i < grpc_streams.size(); ++i) {
+            grpc_streams[i]->OnWindowUpdate(window_diff);
+        }
+    }
     // Respond with ack
     char headbuf[FRAME_HEAD_SIZE];
     SerializeFrameHead(headbuf, 0, H2_FRAME_SETTINGS, H2_FLAGS_ACK, 0);
@@ -1021,8 +1249,19 @@ H2ParseResult H2Context::OnWindowUpdate(
             LOG(ERROR) << "Invalid connection-level window_size_increment=" << inc;
             return MakeH2Error(H2_FLOW_CONTROL_ERROR);
         }
+        // GrpcStreams may be blocked by the connection-level window.
+        std::vector<butil::intrusive_ptr<GrpcStream> > grpc_streams;
+        ListGrpcStreams(&grpc_streams);
+        for (size_t i = 0; i < grpc_streams.size(); ++i) {
+            grpc_streams[i]->Flush();
+        }
         return MakeH2Message(NULL);
     } else {
+        butil::intrusive_ptr<GrpcStream> gs = FindGrpcStream(frame_head.stream_id);
+        if (gs != NULL) {
+            gs->OnWindowUpdate(inc);
+            return MakeH2Message(NULL);
+        }
         H2StreamContext* sctx = FindStream(frame_head.stream_id);
         if (sctx == NULL) {
             RPC_VLOG << "Fail to find stream_id=" << frame_head.stream_id;
@@ -1166,7 +1405,9 @@ H2StreamContext::H2StreamContext(bool read_body_progressively)
     , _stream_ended(false)
     , _remote_window_left(0)
     , _deferred_window_update(0)
-    , _correlation_id(INVALID_BTHREAD_ID.value) {
+    , _correlation_id(INVALID_BTHREAD_ID.value)
+    , _grpc_stream_dispatched(false)
+    , _is_grpc_stream_head(false) {
     header().set_version(2, 0);
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << 1;
@@ -1181,6 +1422,10 @@ void H2StreamContext::Init(H2Context* conn_ctx, int stream_id) {
 }
 
 H2StreamContext::~H2StreamContext() {
+    if (_grpc_stream != NULL && !_is_grpc_stream_head) {
+        // Reset or destroyed with the connection before the stream ended.
+        _grpc_stream->OnH2StreamClosed(EFAILEDSOCKET, "The http2 stream was closed");
+    }
 #ifndef NDEBUG
     get_h2_bvars()->h2_stream_context_count << -1;
 #endif
@@ -1312,12 +1557,13 @@ static void PackH2Message(butil::IOBuf* out,
                           butil::IOBuf& trailer_headers,
                           const butil::IOBuf& data,
                           int stream_id,
-                          H2Context* conn_ctx) {
+                          H2Context* conn_ctx,
+                          bool end_stream) {
     const H2Settings& remote_settings = conn_ctx->remote_settings();
     char headbuf[FRAME_HEAD_SIZE];
     H2FrameHead headers_head = {
         (uint32_t)headers.size(), H2_FRAME_HEADERS, 0, stream_id};
-    if (data.empty() && trailer_headers.empty()) {
+    if (data.empty() && trailer_headers.empty() && end_stream) {
         headers_head.flags |= H2_FLAGS_END_STREAM;
     }
     if (headers_head.payload_size <= remote_settings.max_frame_size) {
@@ -1350,7 +1596,7 @@ static void PackH2Message(butil::IOBuf* out,
         while (it.bytes_left()) {
             if (it.bytes_left() <= remote_settings.max_frame_size) {
                 data_head.payload_size = it.bytes_left();
-                if (trailer_headers.empty()) {
+                if (trailer_headers.empty() && end_stream) {
                     data_head.flags |= H2_FLAGS_END_STREAM;
                 }
             } else {
@@ -1379,6 +1625,29 @@ static void PackH2Message(butil::IOBuf* out,
     }
 }
 
+void AppendH2DataFrame(butil::IOBuf* out, butil::IOBuf* data, size_t size,
+                       int stream_id, bool end_stream) {
+    char headbuf[FRAME_HEAD_SIZE];
+    SerializeFrameHead(headbuf, size, H2_FRAME_DATA,
+                       (end_stream ? H2_FLAGS_END_STREAM : 0), stream_id);
+    out->append(headbuf, sizeof(headbuf));
+    data->cutn(out, size);
+}
+
+void AppendH2WindowUpdate(butil::IOBuf* out, int stream_id, uint32_t increment) {
+    char winbuf[FRAME_HEAD_SIZE + 4];
+    SerializeFrameHead(winbuf, 4, H2_FRAME_WINDOW_UPDATE, 0, stream_id);
+    SaveUint32(winbuf + FRAME_HEAD_SIZE, increment);
+    out->append(winbuf, sizeof(winbuf));
+}
+
+void AppendH2ResetStream(butil::IOBuf* out, int stream_id, H2Error h2_error) {
+    char rstbuf[FRAME_HEAD_SIZE + 4];
+    SerializeFrameHead(rstbuf, 4, H2_FRAME_RST_STREAM, 0, stream_id);
+    SaveUint32(rstbuf + FRAME_HEAD_SIZE, h2_error);
+    out->append(rstbuf, sizeof(rstbuf));
+}
+
 H2UnsentRequest* H2UnsentRequest::New(Controller* c) {
     const HttpHeader& h = c->http_request();
     const CommonStrings* const common = get_common_strings();
@@ -1548,6 +1817,16 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     }
 
     _sctx->Init(ctx, id);
+    GrpcStream* grpc_stream = ControllerPrivateAccessor(_cntl).grpc_stream();
+    const google::protobuf::MethodDescriptor* method = _cntl->method();
+    if (grpc_stream != NULL &&
+        (method == NULL ||
+         (!method->client_streaming() && !method->server_streaming()))) {
+        // The RPC goes on as an unary one.
+        grpc_stream->SetFailed(EREQUEST, "Not a streaming method");
+        grpc_stream = NULL;
+    }
+    _sctx->_grpc_stream = grpc_stream;
     // check flow control restriction
     if (!_cntl->request_attachment().empty()) {
         const int64_t data_size = _cntl->request_attachment().size();
@@ -1563,6 +1842,8 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
         return butil::Status(ELOGOFF, "the connection just issued GOAWAY");
     }
     _stream_id = _sctx->stream_id();
+    const int64_t stream_window_left =
+        _sctx->_remote_window_left.load(butil::memory_order_relaxed);
     // After calling TryToInsertStream, the ownership of _sctx is transferred to ctx
     _sctx.release();
 
@@ -1575,9 +1856,7 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
         options.index_policy = HPACK_NEVER_INDEX_HEADER;
     }
     
-    for (size_t i = 0; i < _size; ++i) {
-        hpacker.Encode(&appender, _list[i], options);
-    }
+    hpacker.EncodeHeaders(&appender, _list, _size, options);
     if (_cntl->has_http_request()) {
         const HttpHeader& h = _cntl->http_request();
         for (HttpHeader::HeaderIterator it = h.HeaderBegin();
@@ -1589,7 +1868,14 @@ H2UnsentRequest::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
     butil::IOBuf frag;
     appender.move_to(frag);
     butil::IOBuf dummy_buf;
-    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(), _stream_id, ctx);
+    // Client-streaming requests are followed by messages of the GrpcStream.
+    const bool end_stream = (grpc_stream == NULL || !method->client_streaming());
+    PackH2Message(out, frag, dummy_buf, _cntl->request_attachment(),
+                  _stream_id, ctx, end_stream);
+    if (grpc_stream != NULL) {
+        grpc_stream->Bind(socket->id(), _stream_id);
+        grpc_stream->SetConnected(socket, stream_window_left, end_stream, out);
+    }
     return butil::Status::OK();
 }
 
@@ -1637,11 +1923,13 @@ void H2UnsentRequest::Print(std::ostream& os) const {
 
 }
 
-H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc)
+H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc,
+                                   bool end_stream)
     : _size(0)
     , _stream_id(stream_id)
     , _http_response(c->release_http_response())
-    , _is_grpc(is_grpc) {
+    , _is_grpc(is_grpc)
+    , _end_stream(end_stream) {
     _data.swap(c->response_attachment());
     if (is_grpc) {
         _grpc_status = ErrorCodeToGrpcStatus(c->ErrorCode());
@@ -1649,7 +1937,8 @@ H2UnsentResponse::H2UnsentResponse(Controller* c, int stream_id, bool is_grpc)
     }
 }
 
-H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id, bool is_grpc) {
+H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id, bool is_grpc,
+                                        bool end_stream) {
     const HttpHeader* const h = &c->http_response();
     const CommonStrings* const common = get_common_strings();
     const bool need_content_type = !h->content_type().empty();
@@ -1657,7 +1946,8 @@ H2UnsentResponse* H2UnsentResponse::New(Controller* c, int stream_id, bool is_gr
         + (size_t)need_content_type;
     const size_t memsize = offsetof(H2UnsentResponse, _list) +
         sizeof(HPacker::Header) * maxsize;
-    H2UnsentResponse* msg = new (malloc(memsize)) H2UnsentResponse(c, stream_id, is_grpc);
+    H2UnsentResponse* msg = new (malloc(memsize)) H2UnsentResponse(
+        c, stream_id, is_grpc, end_stream);
     // :status
     if (h->status_code() == 200) {
         msg->push(common->H2_STATUS, common->STATUS_200);
@@ -1720,9 +2010,7 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
         options.index_policy = HPACK_NEVER_INDEX_HEADER;
     }
 
-    for (size_t i = 0; i < _size; ++i) {
-        hpacker.Encode(&appender, _list[i], options);
-    }
+    hpacker.EncodeHeaders(&appender, _list, _size, options);
     if (_http_response) {
         for (HttpHeader::HeaderIterator it = _http_response->HeaderBegin();
              it != _http_response->HeaderEnd(); ++it) {
@@ -1731,10 +2019,13 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
         }
     }
     butil::IOBuf frag;
-    appender.move_to(frag);
-
     butil::IOBuf trailer_frag;
-    if (_is_grpc) {
+    if (_is_grpc && _end_stream) {
+        // Responses without messages are sent as Trailers-Only, so that
+        // clients of streaming methods see the status along with headers.
+        if (!_data.empty()) {
+            appender.move_to(frag);
+        }
         HPacker::Header status_header("grpc-status",
                                       butil::string_printf("%d", _grpc_status));
         hpacker.Encode(&appender, status_header, options);
@@ -1742,10 +2033,12 @@ H2UnsentResponse::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
             HPacker::Header msg_header("grpc-message", _grpc_message);
             hpacker.Encode(&appender, msg_header, options);
         }
-        appender.move_to(trailer_frag);
+        appender.move_to(_data.empty() ? frag : trailer_frag);
+    } else {
+        appender.move_to(frag);
     }
 
-    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx);
+    PackH2Message(out, frag, trailer_frag, _data, _stream_id, ctx, _end_stream);
     return butil::Status::OK();
 }
 
@@ -1781,6 +2074,51 @@ void H2UnsentResponse::Print(std::ostream& os) const {
     os << butil::ToPrintable(_data, FLAGS_http_verbose_max_body_length);
 }
 
+H2UnsentTrailers::H2UnsentTrailers(int stream_id, const butil::Status& status)
+    : _stream_id(stream_id)
+    , _grpc_status(ErrorCodeToGrpcStatus(status.error_code())) {
+    if (!status.ok()) {
+        PercentEncode(status.error_str(), &_grpc_message);
+    }
+}
+
+H2UnsentTrailers* H2UnsentTrailers::New(int stream_id, const butil::Status& status) {
+    return new H2UnsentTrailers(stream_id, status);
+}
+
+butil::Status
+H2UnsentTrailers::AppendAndDestroySelf(butil::IOBuf* out, Socket* socket) {
+    DestroyingPtr<H2UnsentTrailers> destroy_self(this);
+    if (socket == NULL) {
+        return butil::Status::OK();
+    }
+    H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+    HPacker& hpacker = ctx->hpacker();
+    butil::IOBufAppender appender;
+    HPackOptions options;
+    options.encode_name = FLAGS_h2_hpack_encode_name;
+    options.encode_value = FLAGS_h2_hpack_encode_value;
+    if (ctx->remote_settings().header_table_size == 0) {
+        options.index_policy = HPACK_NEVER_INDEX_HEADER;
+    }
+    HPacker::Header status_header("grpc-status",
+                                  butil::string_printf("%d", _grpc_status));
+    hpacker.Encode(&appender, status_header, options);
+    if (!_grpc_message.empty()) {
+        HPacker::Header msg_header("grpc-message", _grpc_message);
+        hpacker.Encode(&appender, msg_header, options);
+    }
+    butil::IOBuf frag;
+    appender.move_to(frag);
+    butil::IOBuf dummy_buf;
+    PackH2Message(out, frag, dummy_buf, dummy_buf, _stream_id, ctx, true);
+    return butil::Status::OK();
+}
+
+size_t H2UnsentTrailers::EstimatedByteSize() {
+    return 16 + _grpc_message.size();
+}
+
 void PackH2Request(butil::IOBuf*,
                    SocketMessage** user_message,
                    uint64_t correlation_id,
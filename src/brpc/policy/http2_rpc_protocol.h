@@ -25,6 +25,7 @@
 #include "brpc/details/hpack.h"
 #include "brpc/stream_creator.h"
 #include "brpc/controller.h"
+#include "brpc/grpc_stream.h"
 
 #ifndef NDEBUG
 #include "bvar/bvar.h"
@@ -195,7 +196,10 @@ private:
 
 class H2UnsentResponse : public SocketMessage {
 public:
-    static H2UnsentResponse* New(Controller* c, int stream_id, bool is_grpc);
+    // If `end_stream' is false, only headers are sent and the stream is kept
+    // open for messages of a GrpcStream.
+    static H2UnsentResponse* New(Controller* c, int stream_id, bool is_grpc,
+                                 bool end_stream = true);
     void Destroy();
     void Print(std::ostream& os) const;
     // @SocketMessage
@@ -209,7 +213,7 @@ private:
     void push(const std::string& name, const std::string& value)
     { new (&_list[_size++]) HPacker::Header(name, value); }
 
-    H2UnsentResponse(Controller* c, int stream_id, bool is_grpc);
+    H2UnsentResponse(Controller* c, int stream_id, bool is_grpc, bool end_stream);
     ~H2UnsentResponse() {}
     H2UnsentResponse(const H2UnsentResponse&);
     void operator=(const H2UnsentResponse&);
@@ -220,11 +224,38 @@ private:
     std::unique_ptr<HttpHeader> _http_response;
     butil::IOBuf _data;
     bool _is_grpc;
+    bool _end_stream;
     GrpcStatus _grpc_status;
     std::string _grpc_message;
     HPacker::Header _list[0];
 };
 
+// Trailers ending the stream of a GrpcStream at the server side.
+class H2UnsentTrailers : public SocketMessage {
+public:
+    static H2UnsentTrailers* New(int stream_id, const butil::Status& status);
+    void Destroy() { delete this; }
+    // @SocketMessage
+    butil::Status AppendAndDestroySelf(butil::IOBuf* out, Socket*) override;
+    size_t EstimatedByteSize() override;
+
+private:
+    H2UnsentTrailers(int stream_id, const butil::Status& status);
+
+private:
+    int _stream_id;
+    GrpcStatus _grpc_status;
+    std::string _grpc_message;
+};
+
+// Append frames of a http2 stream into `out', used by GrpcStream.
+// Cut `size' bytes from `data' as DATA frames, which must be allowed by
+// flow control.
+void AppendH2DataFrame(butil::IOBuf* out, butil::IOBuf* data, size_t size,
+                       int stream_id, bool end_stream);
+void AppendH2WindowUpdate(butil::IOBuf* out, int stream_id, uint32_t increment);
+void AppendH2ResetStream(butil::IOBuf* out, int stream_id, H2Error h2_error);
+
 // Used in http_rpc_protocol.cpp
 class H2StreamContext : public HttpContext {
 public:
@@ -260,6 +291,12 @@ public:
 
     bool ConsumeWindowSize(int64_t size);
 
+    // The gRPC stream carried by this http2 stream.
+    GrpcStream* grpc_stream() const { return _grpc_stream.get(); }
+    // True if this is the first message of a gRPC stream whose following
+    // messages are delivered to grpc_stream() rather than this context.
+    bool is_grpc_stream_head() const { return _is_grpc_stream_head; }
+
 #if defined(BRPC_H2_STREAM_STATE)
     H2StreamState state() const { return _state; }
     void SetState(H2StreamState state);
@@ -276,6 +313,15 @@ friend class H2Context;
     butil::atomic<int64_t> _deferred_window_update;
     uint64_t _correlation_id;
     butil::IOBuf _remaining_header_fragment;
+    butil::intrusive_ptr<GrpcStream> _grpc_stream;
+    // Data of the stream is delivered to _grpc_stream directly.
+    bool _grpc_stream_dispatched;
+    bool _is_grpc_stream_head;
+
+private:
+    H2ParseResult OnEndHeaders();
+    H2StreamContext* NewGrpcStreamHead();
+    H2StreamContext* SplitGrpcStreamHead(bool end_stream);
 };
 
 StreamCreator* get_h2_global_stream_creator();
@@ -351,6 +397,15 @@ public:
     void DeferWindowUpdate(int64_t);
     int64_t ReleaseDeferredWindowUpdate();
 
+    // Take at most `max_size' bytes from the connection-level window.
+    // Returns bytes taken, 0 when the window is exhausted.
+    int64_t ConsumeRemoteWindow(int64_t max_size);
+
+    // gRPC streams sending messages on this connection, which are
+    // notified with WINDOW_UPDATE and RST_STREAM.
+    void AddGrpcStream(int stream_id, GrpcStream* stream);
+    void RemoveGrpcStream(int stream_id, GrpcStream* stream);
+
 private:
 friend class H2StreamContext;
 friend class H2UnsentRequest;
@@ -374,10 +429,13 @@ friend void InitFrameHandlers();
     void RemoveGoAwayStreams(int goaway_stream_id, std::vector<H2StreamContext*>* out_streams);
 
     H2StreamContext* FindStream(int stream_id);
+    butil::intrusive_ptr<GrpcStream> FindGrpcStream(int stream_id);
+    void ListGrpcStreams(std::vector<butil::intrusive_ptr<GrpcStream> >* out);
 
     // True if the connection is established by client, otherwise it's
     // accepted by server.
     Socket* _socket;
+    const Server* _server;
     butil::atomic<int64_t> _remote_window_left;
     H2ConnectionState _conn_state;
     int _last_received_stream_id;
@@ -394,6 +452,9 @@ friend void InitFrameHandlers();
     mutable butil::Mutex _stream_mutex;
     StreamMap _pending_streams;
     butil::atomic<int64_t> _deferred_window_update;
+    typedef butil::FlatMap<int, butil::intrusive_ptr<GrpcStream> > GrpcStreamMap;
+    mutable butil::Mutex _grpc_stream_mutex;
+    GrpcStreamMap _grpc_streams;
 };
 
 inline int H2Context::AllocateClientStreamId() {
@@ -20,14 +20,17 @@
 #include <google/protobuf/text_format.h>
 #include <gflags/gflags.h>
 #include <string>
+#include "bvar/bvar.h"
 #include "brpc/policy/http_rpc_protocol.h"
 #include "butil/unique_ptr.h"                       // std::unique_ptr
 #include "butil/string_splitter.h"                  // StringMultiSplitter
 #include "butil/string_printf.h"
 #include "butil/time.h"
 #include "butil/sys_byteorder.h"
+#include "butil/memory/singleton_on_pthread_once.h"
 #include "json2pb/pb_to_json.h"                     // ProtoMessageToJson
 #include "json2pb/json_to_pb.h"                     // JsonToProtoMessage
+#include "bthread/unstable.h"                       // bthread_set_priority_self
 #include "brpc/compress.h"
 #include "brpc/errno.pb.h"                          // ENOSERVICE, ENOMETHOD
 #include "brpc/controller.h"                        // Controller
@@ -42,6 +45,7 @@
 #include "brpc/policy/gzip_compress.h"
 #include "brpc/policy/http2_rpc_protocol.h"
 #include "brpc/details/usercode_backup_pool.h"
+#include "brpc/details/http_response_cache.h"
 #include "brpc/grpc.h"
 
 extern "C" {
@@ -53,6 +57,7 @@ namespace brpc {
 int is_failed_after_queries(const http_parser* parser);
 int is_failed_after_http_version(const http_parser* parser);
 DECLARE_bool(http_verbose);
+DECLARE_bool(enable_method_phase_latency);
 DECLARE_int32(http_verbose_max_body_length);
 // Defined in grpc.cpp
 int64_t ConvertGrpcTimeoutToUS(const std::string* grpc_timeout);
@@ -75,11 +80,78 @@ DEFINE_bool(pb_enum_as_number, false,
             "protobuf to json as numbers, affecting both client-side and "
             "server-side");
 
+DEFINE_bool(pb_json_sax_parsing, false,
+            "Convert json to protobuf while parsing instead of building a "
+            "json document first, saving memory and time for large json "
+            "bodies, affecting both client-side and server-side");
+
+DEFINE_int32(http_streaming_json_chunk_size, 65536,
+             "Send a http chunk when the streaming json response buffers so "
+             "many bytes, see Controller::set_pb_streaming_json()");
+
+DEFINE_int32(http_streaming_json_timeout_ms, 30000,
+             "Give up sending a streaming json response when the connection "
+             "stays too full to write for so many milliseconds, -1 means "
+             "no limit");
+
 DEFINE_string(request_id_header, "x-request-id", "The http header to mark a session");
 
 DEFINE_bool(use_http_error_code, false, "Whether set the x-bd-error-code header "
                                         "of http response to brpc error code");
 
+struct HttpPipelineBvars {
+    // Requests in flight on the connection when a pipelined response is
+    // received, including the request of the response.
+    bvar::IntRecorder depth;
+    bvar::Maxer<int64_t> max_depth_ever;
+    bvar::Window<bvar::Maxer<int64_t> > max_depth;
+    // Servers found closing connections after responses.
+    bvar::Adder<int64_t> fallback_count;
+
+    HttpPipelineBvars()
+        : max_depth("rpc_http_client_pipeline_max_depth", &max_depth_ever, 10)
+        , fallback_count("rpc_http_client_pipeline_fallback_count") {
+        depth.expose("rpc_http_client_pipeline_depth");
+    }
+};
+inline HttpPipelineBvars* get_http_pipeline_bvars() {
+    return butil::get_leaky_singleton<HttpPipelineBvars>();
+}
+
+// HTTP/1.1 requests over "single" connection are pipelined on the agent
+// socket of the main socket, so that servers closing the connection do not
+// fail the main socket. Requests which can't be pipelined are sent over
+// pooled connections instead: responses read progressively block following
+// responses, responses of HEAD have no body which the parser can't tell,
+// and servers closing connections after responses fail following requests.
+class HttpPipelineStreamCreator : public StreamCreator {
+protected:
+    StreamUserData* OnCreatingStream(SocketUniquePtr* inout,
+                                     Controller* cntl) override {
+        if (cntl->is_response_read_progressively() ||
+            cntl->http_request().method() == HTTP_METHOD_HEAD ||
+            (*inout)->pipelining_disabled()) {
+            // Leave the sending socket to Controller which gets a pooled
+            // connection and returns it to the pool (or fails it) on
+            // completion. Retries of the RPC use pooled connections as well.
+            cntl->set_connection_type(CONNECTION_TYPE_POOLED);
+            ControllerPrivateAccessor(cntl).clear_stream_creator();
+            return NULL;
+        }
+        SocketUniquePtr sock;
+        if ((*inout)->GetAgentSocket(&sock, NULL) != 0) {
+            cntl->SetFailed(EINTERNAL, "Fail to create agent socket");
+            return NULL;
+        }
+        sock->set_http_pipelined();
+        inout->swap(sock);
+        return NULL;
+    }
+    void DestroyStreamCreator(Controller*) override {
+        // A global singleton, don't delete it.
+    }
+};
+
 // Read user address from the header specified by -http_header_of_user_ip
 static bool GetUserAddressFromHeaderImpl(const HttpHeader& headers,
                                          butil::EndPoint* user_addr) {
@@ -280,6 +352,7 @@ static bool JsonToProtoMessage(const butil::IOBuf& body,
     json2pb::Json2PbOptions options;
     options.base64_to_bytes = cntl->has_pb_bytes_to_base64();
     options.array_to_single_repeated = cntl->has_pb_single_repeated_to_array();
+    options.sax_parsing = FLAGS_pb_json_sax_parsing;
     std::string error;
     bool ok = json2pb::JsonToProtoMessage(&wrapper, message, options, &error);
     if (!ok) {
@@ -291,7 +364,7 @@ static bool JsonToProtoMessage(const butil::IOBuf& body,
 }
 
 static bool ProtoMessageToJson(const google::protobuf::Message& message,
-                               butil::IOBufAsZeroCopyOutputStream* wrapper,
+                               google::protobuf::io::ZeroCopyOutputStream* wrapper,
                                Controller* cntl, int error_code) {
     json2pb::Pb2JsonOptions options;
     options.bytes_to_base64 = cntl->has_pb_bytes_to_base64();
@@ -311,6 +384,28 @@ static bool ProtoMessageToJson(const google::protobuf::Message& message,
     return ok;
 }
 
+// Convert `res' to json chunk by chunk into `pa' whose headers were written.
+static void WriteStreamingJson(const google::protobuf::Message& res,
+                               ProgressiveAttachment* pa,
+                               Controller* cntl, Socket* socket) {
+    ControllerPrivateAccessor(cntl).mark_progressive_writer_as_done();
+    ProgressiveAttachmentOutputStream stream(
+        pa, std::max(FLAGS_http_streaming_json_chunk_size, 1),
+        FLAGS_http_streaming_json_timeout_ms);
+    if (!ProtoMessageToJson(res, &stream, cntl, ERESPONSE)) {
+        // Headers were sent, close the connection to notify the client
+        // of the incomplete body.
+        socket->SetFailed();
+        return;
+    }
+    if (stream.Flush() != 0) {
+        const int errcode = errno;
+        cntl->SetFailed(errcode, "Fail to write streaming json into %s",
+                        socket->description().c_str());
+        socket->SetFailed();
+    }
+}
+
 static bool ProtoJsonToProtoMessage(const butil::IOBuf& body,
                                     google::protobuf::Message* message,
                                     Controller* cntl, int error_code) {
@@ -351,6 +446,8 @@ void ProcessHttpResponse(InputMessageBase* msg) {
     if (is_http2) {
         H2StreamContext* h2_sctx = static_cast<H2StreamContext*>(msg);
         cid_value = h2_sctx->correlation_id();
+    } else if (imsg_guard->pipelined_cid() != 0) {
+        cid_value = imsg_guard->pipelined_cid();
     } else {
         cid_value = socket->correlation_id();
     }
@@ -427,6 +524,11 @@ void ProcessHttpResponse(InputMessageBase* msg) {
                     break;
                 }
             }
+            if (static_cast<H2StreamContext*>(msg)->is_grpc_stream_head()) {
+                // The server accepted the GrpcStream, messages are
+                // delivered to the stream instead of the response.
+                break;
+            }
         }
 
         if (imsg_guard->read_body_progressively()) {
@@ -684,6 +786,10 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
             hreq.GetHeader(common->CONNECTION) == NULL) {
             hreq.SetHeader(common->CONNECTION, common->KEEP_ALIVE);
         }
+        if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
+            cntl->set_stream_creator(
+                butil::get_leaky_singleton<HttpPipelineStreamCreator>());
+        }
     } else {
         cntl->set_stream_creator(get_h2_global_stream_creator());
         if (is_grpc) {
@@ -725,6 +831,8 @@ void SerializeHttpRequest(butil::IOBuf* /*not used*/,
                            "%llu", (unsigned long long)span->span_id()));
         hreq.SetHeader("x-bd-parent-span-id", butil::string_printf(
                            "%llu", (unsigned long long)span->parent_span_id()));
+        // For servers traced by other systems.
+        hreq.SetHeader("traceparent", MakeTraceParent(span));
     }
 }
 
@@ -735,9 +843,6 @@ void PackHttpRequest(butil::IOBuf* buf,
                      Controller* cntl,
                      const butil::IOBuf& /*unused*/,
                      const Authenticator* auth) {
-    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
-        return cntl->SetFailed(EREQUEST, "http can't work with CONNECTION_TYPE_SINGLE");
-    }
     ControllerPrivateAccessor accessor(cntl);
     HttpHeader* header = &cntl->http_request();
     if (auth != NULL && header->GetHeader(common->AUTHORIZATION) == NULL) {
@@ -748,13 +853,22 @@ void PackHttpRequest(butil::IOBuf* buf,
         header->SetHeader(common->AUTHORIZATION, auth_data);
     }
 
-    // Store `correlation_id' into Socket since http server
-    // may not echo back this field. But we send it anyway.
-    accessor.get_sending_socket()->set_correlation_id(correlation_id);
+    if (cntl->connection_type() == CONNECTION_TYPE_SINGLE) {
+        // Pipelined with other requests on the connection, the response is
+        // matched with this request by the position, see ParseHttpMessage().
+        // Requests not suitable for pipelining were switched to pooled
+        // connections by HttpPipelineStreamCreator.
+        accessor.set_pipelined_count(1);
+    } else {
+        accessor.set_pipelined_count(0);
+        // Store `correlation_id' into Socket since http server
+        // may not echo back this field. But we send it anyway.
+        accessor.get_sending_socket()->set_correlation_id(correlation_id);
 
-    // Store http request method into Socket since http response parser needs it,
-    // and skips response body if request method is HEAD.
-    accessor.get_sending_socket()->set_http_request_method(header->method());
+        // Store http request method into Socket since http response parser needs it,
+        // and skips response body if request method is HEAD.
+        accessor.get_sending_socket()->set_http_request_method(header->method());
+    }
 
     MakeRawHttpRequest(buf, header, cntl->remote_side(),
                        &cntl->request_attachment());
@@ -779,18 +893,22 @@ public:
         , _messages(NULL)
         , _method_status(NULL)
         , _received_us(0)
-        , _h2_stream_id(-1) {}
+        , _h2_stream_id(-1)
+        , _response_cache(NULL) {}
 
     HttpResponseSender(HttpResponseSender&& s) noexcept
         : _cntl(std::move(s._cntl))
         , _messages(s._messages)
         , _method_status(s._method_status)
         , _received_us(s._received_us)
-        , _h2_stream_id(s._h2_stream_id) {
+        , _h2_stream_id(s._h2_stream_id)
+        , _response_cache(s._response_cache) {
+        _response_cache_key.swap(s._response_cache_key);
         s._messages = NULL;
         s._method_status = NULL;
         s._received_us = 0;
         s._h2_stream_id = -1;
+        s._response_cache = NULL;
     }
     ~HttpResponseSender();
 
@@ -798,6 +916,11 @@ public:
     void set_method_status(MethodStatus* ms) { _method_status = ms; }
     void set_received_us(int64_t t) { _received_us = t; }
     void set_h2_stream_id(int id) { _h2_stream_id = id; }
+    // Fill `cache' with the response if it's cacheable, or abandon `key'.
+    void set_response_cache(HttpResponseCache* cache, std::string* key) {
+        _response_cache = cache;
+        _response_cache_key.swap(*key);
+    }
 
 private:
     std::unique_ptr<Controller, LogErrorTextAndDelete> _cntl;
@@ -805,6 +928,8 @@ private:
     MethodStatus* _method_status;
     int64_t _received_us;
     int _h2_stream_id;
+    HttpResponseCache* _response_cache;
+    std::string _response_cache_key;
 };
 
 class HttpResponseSenderAsDone : public google::protobuf::Closure {
@@ -828,6 +953,10 @@ HttpResponseSender::~HttpResponseSender() {
         if (NULL != _messages) {
             _cntl->server()->options().rpc_pb_message_factory->Return(_messages);
         }
+        if (NULL != _response_cache) {
+            // Not filled, let other requests call the method.
+            _response_cache->Abandon(_response_cache_key);
+        }
     };
     Controller* cntl = _cntl.get();
     if (cntl == NULL) {
@@ -835,8 +964,15 @@ HttpResponseSender::~HttpResponseSender() {
     }
     ControllerPrivateAccessor accessor(cntl);
     Span* span = accessor.span();
+    // Phases are recorded only when user's callback was called.
+    const bool record_phases = (accessor.start_callback_us() != 0 &&
+                                _method_status != NULL);
+    ServerPhaseTimes phases;
+    if (span || record_phases) {
+        phases.start_send_us = butil::cpuwide_time_us();
+    }
     if (span) {
-        span->set_start_send_us(butil::cpuwide_time_us());
+        span->set_start_send_us(phases.start_send_us);
     }
     ConcurrencyRemover concurrency_remover(_method_status, cntl, _received_us);
     Socket* socket = accessor.get_sending_socket();
@@ -865,6 +1001,12 @@ HttpResponseSender::~HttpResponseSender() {
     const HttpContentType content_type = ParseContentType(*content_type_str, &is_grpc_ct);
     const bool is_http2 = req_header->is_http2();
     const bool is_grpc = (is_http2 && is_grpc_ct);
+    butil::intrusive_ptr<ProgressiveAttachment> streaming_json_pa;
+    // Send headers only and keep the http2 stream open for messages of the
+    // accepted GrpcStream, the response message is not sent.
+    GrpcStream* grpc_stream = accessor.grpc_stream();
+    const bool open_grpc_stream = (grpc_stream != NULL && grpc_stream->accepted() &&
+                                   is_grpc && !cntl->Failed());
 
     // Convert response to json/proto if needed.
     // Notice: Not check res->IsInitialized() which should be checked in the
@@ -874,10 +1016,23 @@ HttpResponseSender::~HttpResponseSender() {
         // ^ user did not fill the body yet.
         res->GetDescriptor()->field_count() > 0 &&
         // ^ a pb service
+        !open_grpc_stream &&
         !cntl->Failed()) {
         // ^ pb response in failed RPC is undefined, no need to convert.
         
         butil::IOBufAsZeroCopyOutputStream wrapper(&cntl->response_attachment());
+        bool streaming_json = false;
+        if (cntl->has_pb_streaming_json() &&
+            content_type == HTTP_CONTENT_JSON &&
+            !is_http2 &&
+            cntl->response_compress_type() == COMPRESS_TYPE_NONE &&
+            !cntl->has_progressive_writer() &&
+            res->IsInitialized()) {
+            // ^ Check initialization here since errors can't be reported
+            // once the headers are sent.
+            streaming_json_pa = cntl->CreateProgressiveAttachment();
+            streaming_json = (streaming_json_pa != NULL);
+        }
         if (content_type == HTTP_CONTENT_PROTO) {
             if (!res->SerializeToZeroCopyStream(&wrapper)) {
                 cntl->SetFailed(ERESPONSE, "Fail to serialize %s", res->GetTypeName().c_str());
@@ -888,9 +1043,23 @@ HttpResponseSender::~HttpResponseSender() {
             }
         } else if (content_type == HTTP_CONTENT_PROTO_JSON) {
             ProtoMessageToProtoJson(*res, &wrapper, cntl, ERESPONSE);
-        } else {
+        } else if (!streaming_json) {
             ProtoMessageToJson(*res, &wrapper, cntl, ERESPONSE);
-        }
+        } // else converted after headers are written.
+    }
+
+    if (_response_cache != NULL &&
+        !cntl->Failed() &&
+        res_header->status_code() == HTTP_STATUS_OK &&
+        !cntl->has_progressive_writer() &&
+        streaming_json_pa == NULL &&
+        grpc_stream == NULL &&
+        res_header->GetHeader("Set-Cookie") == NULL) {
+        // Cache the body before compression which depends on requests.
+        _response_cache->Fill(_response_cache_key, *res_header,
+                              cntl->response_attachment(),
+                              cntl->response_compress_type());
+        _response_cache = NULL;
     }
 
     // In HTTP 0.9, the server always closes the connection after sending the
@@ -996,18 +1165,21 @@ HttpResponseSender::~HttpResponseSender() {
     Socket::WriteOptions wopt;
     wopt.ignore_eovercrowded = true;
     bthread_id_t response_id = INVALID_BTHREAD_ID;
-    if (span) {
+    if (span || record_phases) {
         CHECK_EQ(0, bthread_id_create(&response_id, &args, HandleResponseWritten));
         wopt.id_wait = response_id;
         wopt.notify_on_success = true;
     }
     if (is_http2) {
-        if (is_grpc) {
+        if (open_grpc_stream) {
+            cntl->response_attachment().clear();
+        } else if (is_grpc && !cntl->Failed()) {
+            // Failed gRPC responses are sent without messages.
             // Append compressed and length before body
             AddGrpcPrefix(&cntl->response_attachment(), grpc_compressed);
         }
         SocketMessagePtr<H2UnsentResponse> h2_response(
-                H2UnsentResponse::New(cntl, _h2_stream_id, is_grpc));
+                H2UnsentResponse::New(cntl, _h2_stream_id, is_grpc, !open_grpc_stream));
         if (h2_response == NULL) {
             LOG(ERROR) << "Fail to make http2 response";
             errno = EINVAL;
@@ -1019,6 +1191,9 @@ HttpResponseSender::~HttpResponseSender() {
             if (span) {
                 span->set_response_size(h2_response->EstimatedByteSize());
             }
+            if (record_phases) {
+                phases.start_write_us = butil::cpuwide_time_us();
+            }
             rc = socket->Write(h2_response, &wopt);
         }
     } else {
@@ -1035,6 +1210,9 @@ HttpResponseSender::~HttpResponseSender() {
         if (span) {
             span->set_response_size(res_buf.size());
         }
+        if (record_phases) {
+            phases.start_write_us = butil::cpuwide_time_us();
+        }
         rc = socket->Write(&res_buf, &wopt);
     }
 
@@ -1043,15 +1221,44 @@ HttpResponseSender::~HttpResponseSender() {
         const int errcode = errno;
         PLOG_IF(WARNING, errcode != EPIPE) << "Fail to write into " << *socket;
         cntl->SetFailed(errcode, "Fail to write into %s", socket->description().c_str());
+        if (grpc_stream != NULL) {
+            grpc_stream->SetFailed(cntl->ErrorCode(), cntl->ErrorText());
+        }
         return;
     }
 
-    if (span) {
+    if (open_grpc_stream) {
+        H2Context* ctx = static_cast<H2Context*>(socket->parsing_context());
+        grpc_stream->SetConnected(socket, ctx->remote_settings().stream_window_size,
+                                  false, NULL);
+    } else if (grpc_stream != NULL) {
+        // The stream ended along with the response.
+        if (cntl->Failed()) {
+            grpc_stream->SetFailed(cntl->ErrorCode(), cntl->ErrorText());
+        } else {
+            grpc_stream->SetFailed(EREQUEST, "The stream was not accepted");
+        }
+    }
+
+    if (streaming_json_pa != NULL) {
+        WriteStreamingJson(*res, streaming_json_pa.get(), cntl, socket);
+    }
+
+    if (span || record_phases) {
         bthread_id_join(response_id);
+    }
+    if (span) {
         // Do not care about the result of background writing.
         // TODO: this is not sent
         span->set_sent_us(args.sent_us);
     }
+    if (record_phases) {
+        phases.received_us = _received_us;
+        phases.start_parse_us = accessor.start_parse_us();
+        phases.start_callback_us = accessor.start_callback_us();
+        phases.sent_us = args.sent_us;
+        _method_status->OnPhasesEnded(phases);
+    }
 }
 
 // Normalize the sub string of `uri_path' covered by `splitter' and
@@ -1175,6 +1382,33 @@ FindMethodPropertyByURI(const std::string& uri_path, const Server* server,
     return NULL;
 }
 
+// Match a complete response with the earliest pipelined request on `socket'.
+static void OnPipelinedResponse(HttpContext* http_imsg, Socket* socket) {
+    PipelinedInfo pi;
+    if (!socket->PopPipelinedInfo(&pi)) {
+        // Not pipelined.
+        return;
+    }
+    http_imsg->set_pipelined_cid(pi.id_wait.value);
+    HttpPipelineBvars* vars = get_http_pipeline_bvars();
+    const int64_t depth = socket->PipelinedInfoCount() + 1;
+    vars->depth << depth;
+    vars->max_depth_ever << depth;
+    if (http_should_keep_alive(&http_imsg->parser())) {
+        return;
+    }
+    // Following requests are failed when the server closes the connection,
+    // retries of them and later RPCs use pooled connections.
+    SocketUniquePtr main_socket;
+    if (Socket::Address(socket->main_socket_id(), &main_socket) == 0 &&
+        !main_socket->pipelining_disabled()) {
+        main_socket->disable_pipelining();
+        vars->fallback_count << 1;
+        LOG(WARNING) << "Stop pipelining http requests to "
+                     << socket->remote_side() << " which closes connections";
+    }
+}
+
 ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
                              bool read_eof, const void* arg) {
     HttpContext* http_imsg = 
@@ -1197,6 +1431,10 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
             LOG(FATAL) << "Fail to new HttpContext";
             return MakeParseError(PARSE_ERROR_NO_RESOURCE);
         }
+        if (socket->http_pipelined()) {
+            // Following responses may be in the same read.
+            http_imsg->set_stop_at_message_end(true);
+        }
         // Parsing http is costly, parsing an incomplete http message from the
         // beginning repeatedly should be avoided, otherwise the cost may reach
         // O(n^2) in the worst case. Save incomplete http messages in sockets
@@ -1241,6 +1479,9 @@ ParseResult ParseHttpMessage(butil::IOBuf *source, Socket *socket,
         source->pop_front(rc);
         if (http_imsg->Completed()) {
             CHECK_EQ(http_imsg, socket->release_parsing_context());
+            if (socket->http_pipelined()) {
+                OnPipelinedResponse(http_imsg, socket);
+            }
             const ParseResult result = MakeMessage(http_imsg);
             http_imsg->CheckProgressiveRead(arg, socket);
             if (socket->is_read_progressive()) {
@@ -1417,12 +1658,16 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     resp_sender.set_received_us(msg->received_us());
 
     const bool is_http2 = imsg_guard->header().is_http2();
+    int h2_stream_id = -1;
+    ControllerPrivateAccessor accessor(cntl);
     if (is_http2) {
         H2StreamContext* h2_sctx = static_cast<H2StreamContext*>(msg);
-        resp_sender.set_h2_stream_id(h2_sctx->stream_id());
+        h2_stream_id = h2_sctx->stream_id();
+        resp_sender.set_h2_stream_id(h2_stream_id);
+        // Messages after the request of client-streaming methods.
+        accessor.set_grpc_stream(h2_sctx->grpc_stream());
     }
 
-    ControllerPrivateAccessor accessor(cntl);
     HttpHeader& req_header = cntl->http_request();
     imsg_guard->header().Swap(req_header);
     butil::IOBuf& req_body = imsg_guard->body();
@@ -1441,6 +1686,7 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         .set_auth_context(socket->auth_context())
         .set_request_protocol(is_http2 ? PROTOCOL_H2 : PROTOCOL_HTTP)
         .set_begin_time_us(msg->received_us())
+        .set_start_parse_us(start_parse_us)
         .move_in_server_receiving_sock(socket_guard);
     
     // Read log-id. errno may be set when input to strtoull overflows.
@@ -1472,7 +1718,24 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     Span* span = NULL;
     const std::string& path = req_header.uri().path();
     const std::string* trace_id_str = req_header.GetHeader("x-bd-trace-id");
-    if (IsTraceable(trace_id_str)) {
+    // Clients not using brpc may carry W3C trace context instead.
+    uint64_t w3c_trace_id_high = 0;
+    uint64_t w3c_trace_id = 0;
+    uint64_t w3c_parent_id = 0;
+    bool w3c_sampled = false;
+    if (trace_id_str == NULL) {
+        const std::string* traceparent = req_header.GetHeader("traceparent");
+        if (traceparent != NULL &&
+            !ParseTraceParent(*traceparent, &w3c_trace_id_high, &w3c_trace_id,
+                              &w3c_parent_id, &w3c_sampled)) {
+            w3c_sampled = false;
+        }
+    }
+    if (w3c_sampled) {
+        span = Span::CreateServerSpan(
+            path, w3c_trace_id, 0, w3c_parent_id, msg->base_real_us());
+        span->set_trace_id_high(w3c_trace_id_high);
+    } else if (IsTraceable(trace_id_str)) {
         uint64_t trace_id = 0;
         if (trace_id_str) {
             trace_id = strtoull(trace_id_str->c_str(), NULL, 10);
@@ -1490,6 +1753,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
         }
         span = Span::CreateServerSpan(
             path, trace_id, span_id, parent_span_id, msg->base_real_us());
+    }
+    if (span) {
         accessor.set_span(span);
         span->set_log_id(cntl->log_id());
         span->set_remote_side(user_addr);
@@ -1570,6 +1835,11 @@ void ProcessHttpRequest(InputMessageBase *msg) {
                             butil::endpoint2str(socket->remote_side()).c_str());
             return;
         }
+        if (mp->bthread_priority) {
+            // The method is known after parsing, the priority takes effect
+            // when this bthread is put into runqueues again.
+            bthread_set_priority_self(mp->bthread_priority);
+        }
         if (!server_accessor.AddConcurrency(cntl)) {
             cntl->SetFailed(ELIMIT, "Reached server's max_concurrency=%d",
                             server->options().max_concurrency);
@@ -1593,6 +1863,37 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     google::protobuf::Service* svc = mp->service;
     const google::protobuf::MethodDescriptor* method = mp->method;
     accessor.set_method(method);
+    HttpResponseCache* response_cache =
+        (method_status ? method_status->http_response_cache() : NULL);
+    if (response_cache != NULL &&
+        req_header.method() == HTTP_METHOD_GET &&
+        !imsg_guard->read_body_progressively()) {
+        std::string key;
+        response_cache->MakeKey(req_header, req_body, &key);
+        int compress_type = COMPRESS_TYPE_NONE;
+        const HttpResponseCache::GetResult rc = response_cache->Get(
+            key, &cntl->http_response(), &cntl->response_attachment(),
+            &compress_type);
+        if (rc == HttpResponseCache::HIT) {
+            // Responded by resp_sender without calling the method.
+            cntl->set_response_compress_type((CompressType)compress_type);
+            return;
+        } else if (rc == HttpResponseCache::MISS_AND_FILL) {
+            resp_sender.set_response_cache(response_cache, &key);
+        }
+    }
+    if (is_http2 && method->server_streaming() && accessor.grpc_stream() == NULL) {
+        bool is_grpc_ct = false;
+        ParseContentType(req_header.content_type(), &is_grpc_ct);
+        if (is_grpc_ct) {
+            // The request is the only message from the client.
+            GrpcStream* s = new GrpcStream(true);
+            accessor.set_grpc_stream(s);
+            s->Bind(socket->id(), h2_stream_id);
+            s->OnRemoteClosed(butil::Status());
+        }
+    }
+    cntl->set_pb_streaming_json(mp->params.pb_streaming_json);
     RpcPBMessages* messages = server->options().rpc_pb_message_factory->Get(*svc, *method);;
     resp_sender.set_messages(messages);
     google::protobuf::Message* req = messages->Request();
@@ -1689,7 +1990,8 @@ void ProcessHttpRequest(InputMessageBase *msg) {
 
                 butil::EndPoint ep;
                 MakeRawHttpRequest(&sample->request, &req_header, ep, &req_body);
-                sample->submit(start_parse_us);
+                sample->meta.set_connection_id(socket->id());
+                SubmitSample(sample, start_parse_us);
             }
         }
     } else {
@@ -1704,6 +2006,9 @@ void ProcessHttpRequest(InputMessageBase *msg) {
     google::protobuf::Closure* done = new HttpResponseSenderAsDone(&resp_sender);
     imsg_guard.reset();  // optional, just release resource ASAP
 
+    if (FLAGS_enable_method_phase_latency) {
+        accessor.set_start_callback_us(butil::cpuwide_time_us());
+    }
     if (span) {
         span->set_start_callback_us(butil::cpuwide_time_us());
         span->AsParent();
@@ -1754,6 +2059,18 @@ const std::string& GetHttpMethodName(
     return !path.empty() ? path : common->DEFAULT_PATH;
 }
 
+bool IsGrpcClientStreamingRequest(const HttpHeader& header, const Server* server) {
+    bool is_grpc_ct = false;
+    ParseContentType(header.content_type(), &is_grpc_ct);
+    if (!is_grpc_ct) {
+        return false;
+    }
+    const Server::MethodProperty* const mp = FindMethodPropertyByURI(
+        header.uri().path(), server,
+        const_cast<std::string*>(&header.unresolved_path()));
+    return mp != NULL && mp->method->client_streaming();
+}
+
 void HttpContext::CheckProgressiveRead(const void* arg, Socket *socket) {
     if (arg == NULL || !((Server *)arg)->has_progressive_read_method()) {
         // arg == NULL indicates not in server-end
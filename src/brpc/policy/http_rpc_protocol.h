@@ -24,6 +24,7 @@
 #include "brpc/protocol.h"
 
 namespace brpc {
+class Server;
 namespace policy {
 
 // Put commonly used std::strings (or other constants that need memory
@@ -91,7 +92,8 @@ public:
                          HttpMethod request_method = HTTP_METHOD_GET)
         : InputMessageBase()
         , HttpMessage(read_body_progressively, request_method)
-        , _is_stage2(false) {
+        , _is_stage2(false)
+        , _pipelined_cid(0) {
         // add one ref for Destroy
         butil::intrusive_ptr<HttpContext>(this).detach();
     }
@@ -120,8 +122,14 @@ public:
 
     void CheckProgressiveRead(const void* arg, Socket *socket);
 
+    // [Client side] correlation_id of the pipelined request which this
+    // response is matched with, 0 if the request was not pipelined.
+    uint64_t pipelined_cid() const { return _pipelined_cid; }
+    void set_pipelined_cid(uint64_t cid) { _pipelined_cid = cid; }
+
 private:
     bool _is_stage2;
+    uint64_t _pipelined_cid;
 };
 
 // Implement functions required in protocol.h
@@ -157,6 +165,9 @@ enum HttpContentType {
 // set by gRPC.
 HttpContentType ParseContentType(butil::StringPiece content_type, bool* is_grpc_ct);
 
+// True if `header' is a gRPC request to a client-streaming method of `server'.
+bool IsGrpcClientStreamingRequest(const HttpHeader& header, const Server* server);
+
 } // namespace policy
 } // namespace brpc
 
@@ -21,6 +21,7 @@
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/io/coded_stream.h>
 #include "butil/time.h"
+#include "bthread/unstable.h"                    // bthread_set_priority_self
 #include "brpc/controller.h"                     // Controller
 #include "brpc/socket.h"                         // Socket
 #include "brpc/server.h"                         // Server
@@ -367,7 +368,8 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
             sample->meta.set_attachment_size(attachment_size);
         }
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
+        sample->meta.set_connection_id(socket->id());
+        SubmitSample(sample, start_parse_us);
     }
 
     std::unique_ptr<HuluController> cntl(new (std::nothrow) HuluController());
@@ -466,6 +468,11 @@ void ProcessHuluRequest(InputMessageBase* msg_base) {
             break;
         }
 
+        if (sp->bthread_priority) {
+            // The method is known after parsing, the priority takes effect
+            // when this bthread is put into runqueues again.
+            bthread_set_priority_self(sp->bthread_priority);
+        }
         // Switch to service-specific error.
         non_service_error.release();
         method_status = sp->status;
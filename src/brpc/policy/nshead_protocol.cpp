@@ -252,7 +252,8 @@ void ProcessNsheadRequest(InputMessageBase* msg_base) {
         sample->meta.set_protocol_type(PROTOCOL_NSHEAD);
         sample->meta.set_nshead(p, sizeof(nshead_t)); // nshead
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
+        sample->meta.set_connection_id(socket->id());
+        SubmitSample(sample, start_parse_us);
     }
 
     // Switch to service-specific error.
@@ -21,6 +21,7 @@
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include <google/protobuf/io/coded_stream.h>
 #include "butil/time.h"
+#include "bthread/unstable.h"               // bthread_set_priority_self
 #include "brpc/controller.h"                // Controller
 #include "brpc/socket.h"                    // Socket
 #include "brpc/server.h"                    // Server
@@ -338,7 +339,8 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
         sample->meta.set_compress_type(req_cmp_type);
         sample->meta.set_protocol_type(PROTOCOL_SOFA_PBRPC);
         sample->request = msg->payload;
-        sample->submit(start_parse_us);
+        sample->meta.set_connection_id(socket->id());
+        SubmitSample(sample, start_parse_us);
     }
 
     std::unique_ptr<Controller> cntl(new (std::nothrow) Controller);
@@ -417,6 +419,11 @@ void ProcessSofaRequest(InputMessageBase* msg_base) {
                             butil::endpoint2str(socket->remote_side()).c_str());
             break;
         }
+        if (sp->bthread_priority) {
+            // The method is known after parsing, the priority takes effect
+            // when this bthread is put into runqueues again.
+            bthread_set_priority_self(sp->bthread_priority);
+        }
         // Switch to service-specific error.
         non_service_error.release();
         method_status = sp->status;
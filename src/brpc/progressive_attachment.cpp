@@ -16,7 +16,9 @@
 // under the License.
 
 
+#include <algorithm>
 #include "butil/logging.h"
+#include "butil/time.h"
 #include "bthread/bthread.h"   // INVALID_BTHREAD_ID before bthread r32748
 #include "brpc/progressive_attachment.h"
 #include "brpc/socket.h"
@@ -257,5 +259,72 @@ void ProgressiveAttachment::NotifyOnStopped(google::protobuf::Closure* done) {
     }
     _httpsock->NotifyOnFailed(_notify_id);
 }
-    
+
+ProgressiveAttachmentOutputStream::ProgressiveAttachmentOutputStream(
+    ProgressiveAttachment* pa, size_t chunk_size, int64_t timeout_ms)
+    : _pa(pa)
+    , _chunk_size(chunk_size)
+    , _timeout_ms(timeout_ms)
+    , _error_code(0)
+    , _buf_stream(&_buf) {
+}
+
+ProgressiveAttachmentOutputStream::~ProgressiveAttachmentOutputStream() {
+}
+
+bool ProgressiveAttachmentOutputStream::Next(void** data, int* size) {
+    if (_error_code != 0) {
+        return false;
+    }
+    if (_buf.size() >= _chunk_size && Flush() != 0) {
+        return false;
+    }
+    return _buf_stream.Next(data, size);
+}
+
+void ProgressiveAttachmentOutputStream::BackUp(int count) {
+    _buf_stream.BackUp(count);
+}
+
+google::protobuf::int64 ProgressiveAttachmentOutputStream::ByteCount() const {
+    return _buf_stream.ByteCount();
+}
+
+int ProgressiveAttachmentOutputStream::Flush() {
+    if (_error_code != 0) {
+        errno = _error_code;
+        return -1;
+    }
+    if (_buf.empty()) {
+        return 0;
+    }
+    // Following Next() appends remaining space of the current block to _buf
+    // again, which is fine because the written part is already cut off.
+    butil::IOBuf chunk;
+    chunk.swap(_buf);
+    if (WriteChunk(chunk) != 0) {
+        _error_code = errno;
+        return -1;
+    }
+    return 0;
+}
+
+int ProgressiveAttachmentOutputStream::WriteChunk(const butil::IOBuf& chunk) {
+    const int64_t deadline_us = (_timeout_ms < 0 ? -1 :
+        butil::gettimeofday_us() + _timeout_ms * 1000L);
+    int64_t sleep_us = 1000;
+    while (_pa->Write(chunk) != 0) {
+        if (errno != EOVERCROWDED) {
+            return -1;
+        }
+        if (deadline_us >= 0 && butil::gettimeofday_us() >= deadline_us) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        bthread_usleep(sleep_us);
+        sleep_us = std::min(sleep_us * 2, (int64_t)100000);
+    }
+    return 0;
+}
+
 } // namespace brpc
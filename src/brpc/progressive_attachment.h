@@ -19,6 +19,7 @@
 #ifndef BRPC_PROGRESSIVE_ATTACHMENT_H
 #define BRPC_PROGRESSIVE_ATTACHMENT_H
 
+#include <google/protobuf/io/zero_copy_stream.h>
 #include "brpc/callback.h"
 #include "butil/atomicops.h"
 #include "butil/iobuf.h"
@@ -31,6 +32,7 @@ namespace brpc {
 
 class ProgressiveAttachment : public SharedObject {
 friend class Controller;
+friend class ControllerPrivateAccessor;
 public:
     // [Thread-safe]
     // Write `data' as one HTTP chunk to peer ASAP.
@@ -77,6 +79,50 @@ private:
     static const int RPC_FAILED;
 };
 
+// Write data into a ProgressiveAttachment through ZeroCopyOutputStream
+// interfaces, e.g. json2pb::ProtoMessageToJson(). Written data is buffered
+// and sent as one HTTP chunk whenever more than `chunk_size' bytes are
+// buffered, or when Flush() is called. If the connection is too full to
+// accept more data (EOVERCROWDED), writing waits for at most `timeout_ms'
+// milliseconds (-1 means no limit) so that memory held for a slow peer is
+// bounded by -socket_max_unwritten_bytes rather than by the whole content.
+// Waiting only makes sense after the RPC is done (http headers were sent),
+// otherwise nothing is written into the connection.
+class ProgressiveAttachmentOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+public:
+    ProgressiveAttachmentOutputStream(ProgressiveAttachment* pa,
+                                      size_t chunk_size,
+                                      int64_t timeout_ms);
+    // Buffered data not flushed is dropped.
+    ~ProgressiveAttachmentOutputStream();
+
+    // Interfaces of ZeroCopyOutputStream. Next() returns false after any
+    // failure of sending.
+    bool Next(void** data, int* size) override;
+    void BackUp(int count) override;
+    google::protobuf::int64 ByteCount() const override;
+
+    // Send all buffered data.
+    // Returns 0 on success, -1 otherwise and errno is set.
+    int Flush();
+
+    // The errno of the first failed sending, 0 if nothing failed.
+    int error_code() const { return _error_code; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(ProgressiveAttachmentOutputStream);
+
+    int WriteChunk(const butil::IOBuf& chunk);
+
+    butil::intrusive_ptr<ProgressiveAttachment> _pa;
+    size_t _chunk_size;
+    int64_t _timeout_ms;
+    int _error_code;
+    butil::IOBuf _buf;
+    butil::IOBufAsZeroCopyOutputStream _buf_stream;
+};
+
 } // namespace brpc
 
 
@@ -32,6 +32,7 @@ class FileEnumerator;
 namespace brpc {
 
 DECLARE_bool(rpc_dump);
+DECLARE_bool(rpc_dump_compact);
 
 // Randomly take samples of all requests and write into a file in batch in
 // a background thread.
@@ -41,11 +42,18 @@ DECLARE_bool(rpc_dump);
 //   If (sample) {
 //     sample->xxx = yyy;
 //     sample->request = ...;
-//     sample->Submit();
+//     SubmitSample(sample, start_parse_us);
 //   }
 //
 // In practice, sampled requests are just small fraction of all requests.
 // The overhead of sampling should be negligible for overall performance.
+//
+// By default samples are collected by bvar::Collector which writes them one
+// by one and limits the rate globally. With -rpc_dump_compact, samples are
+// taken at -rpc_dump_compact_sampling_ratio (or the ratio of the method in
+// -rpc_dump_method_sampling_ratios) and appended to a buffer of the calling
+// thread without locking, full buffers are compressed and written as blocks
+// by a background thread, which sustains much higher dump rates.
 
 class SampledRequest : public bvar::Collected {
 public:
@@ -61,17 +69,30 @@ public:
     }
 };
 
+SampledRequest* AskToBeSampledCompactly();
+
 // If this function returns non-NULL, the caller must fill the returned
 // object and submit it for later dumping by calling SubmitSample(). If
 // the caller ignores non-NULL return value, the object is leaked.
 inline SampledRequest* AskToBeSampled() {
     extern bvar::CollectorSpeedLimit g_rpc_dump_sl;
-    if (!FLAGS_rpc_dump || !bvar::is_collectable(&g_rpc_dump_sl)) {
+    if (!FLAGS_rpc_dump) {
+        return NULL;
+    }
+    if (FLAGS_rpc_dump_compact) {
+        return AskToBeSampledCompactly();
+    }
+    if (!bvar::is_collectable(&g_rpc_dump_sl)) {
         return NULL;
     }
     return new (std::nothrow) SampledRequest;
 }
 
+// Submit the sample returned by AskToBeSampled() for dumping, the sample
+// is owned by rpc_dump after this call. `cpuwide_us' is when the request
+// was received, which is saved as meta.received_us.
+void SubmitSample(SampledRequest* sample, int64_t cpuwide_us);
+
 // Read samples from dumped files in a directory.
 // Example:
 //   SampleIterator it("./rpc_dump_echo_server");
@@ -84,17 +105,23 @@ public:
     ~SampleIterator();
 
     // Read a sample. Order of samples are not guaranteed to be same with
-    // the order that they're stored in dumped files.
+    // the order that they're stored in dumped files. Both requests dumped
+    // one by one and compressed blocks of requests are readable.
     // Returns the sample which should be deleted by caller. NULL means
     // all dumped files are read.
     SampledRequest* Next();
 
 private:
     // Parse on request from the buf. Set `format_error' to true when
-    // the buf does not match the format.
-    static SampledRequest* Pop(butil::IOBuf& buf, bool* format_error);
+    // the buf does not match the format. If the buf begins with a block and
+    // `block' is not NULL, requests in the block are decompressed into
+    // `block' and the first one is returned.
+    static SampledRequest* Pop(butil::IOBuf& buf, butil::IOBuf* block,
+                               bool* format_error);
     
     butil::IOPortal _cur_buf;
+    // Remaining requests of the block being read.
+    butil::IOBuf _cur_block;
     int _cur_fd;
     butil::FileEnumerator* _enum;
     butil::FilePath _dir;
@@ -171,7 +171,8 @@ Server::MethodProperty::OpaqueParams::OpaqueParams()
     , allow_default_url(false)
     , allow_http_body_to_pb(true)
     , pb_bytes_to_base64(false)
-    , pb_single_repeated_to_array(false) {
+    , pb_single_repeated_to_array(false)
+    , pb_streaming_json(false) {
 }
 
 Server::MethodProperty::MethodProperty()
@@ -181,7 +182,8 @@ Server::MethodProperty::MethodProperty()
     , service(NULL)
     , method(NULL)
     , status(NULL)
-    , ignore_eovercrowded(false) {
+    , ignore_eovercrowded(false)
+    , bthread_priority(0) {
 }
 
 static timeval GetUptime(void* arg/*start_time*/) {
@@ -439,7 +441,8 @@ Server::Server(ProfilerLinker)
     , _eps_bvar(&_nerror_bvar)
     , _concurrency(0)
     , _concurrency_bvar(cast_no_barrier_int, &_concurrency)
-    , _has_progressive_read_method(false) {
+    , _has_progressive_read_method(false)
+    , _has_grpc_client_streaming_method(false) {
     BAIDU_CASSERT(offsetof(Server, _concurrency) % 64 == 0,
                   Server_concurrency_must_be_aligned_by_cacheline);
 }
@@ -1432,9 +1435,13 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
         mp.params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
         mp.params.pb_single_repeated_to_array = svc_opt.pb_single_repeated_to_array;
         mp.params.enable_progressive_read = svc_opt.enable_progressive_read;
+        mp.params.pb_streaming_json = svc_opt.pb_streaming_json;
         if (mp.params.enable_progressive_read) {
             _has_progressive_read_method = true;
         }
+        if (md->client_streaming()) {
+            _has_grpc_client_streaming_method = true;
+        }
         mp.service = service;
         mp.method = md;
         mp.status = new MethodStatus;
@@ -1523,6 +1530,7 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
                 params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
                 params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
                 params.pb_single_repeated_to_array = svc_opt.pb_single_repeated_to_array;
+                params.pb_streaming_json = svc_opt.pb_streaming_json;
                 if (!_global_restful_map->AddMethod(
                         mappings[i].path, service, params,
                         mappings[i].method_name, mp->status)) {
@@ -1562,6 +1570,7 @@ int Server::AddServiceInternal(google::protobuf::Service* service,
             params.allow_http_body_to_pb = svc_opt.allow_http_body_to_pb;
             params.pb_bytes_to_base64 = svc_opt.pb_bytes_to_base64;
             params.pb_single_repeated_to_array = svc_opt.pb_single_repeated_to_array;
+            params.pb_streaming_json = svc_opt.pb_streaming_json;
             if (!m->AddMethod(mappings[i].path, service, params,
                               mappings[i].method_name, mp->status)) {
                 LOG(ERROR) << "Fail to map `" << mappings[i].path << "' to `"
@@ -1623,6 +1632,7 @@ ServiceOptions::ServiceOptions()
 #endif
     , pb_single_repeated_to_array(false)
     , enable_progressive_read(false)
+    , pb_streaming_json(false)
     {}
 
 int Server::AddService(google::protobuf::Service* service,
@@ -2357,6 +2367,50 @@ bool Server::IgnoreEovercrowdedOf(const butil::StringPiece& full_method_name) co
     return mp->ignore_eovercrowded;
 }
 
+int Server::EnableHttpResponseCache(const butil::StringPiece& full_method_name,
+                                    const HttpResponseCacheOptions& options) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (IsRunning()) {
+        LOG(ERROR) << "EnableHttpResponseCache is only allowed before Server started";
+        return -1;
+    }
+    if (mp->status == NULL) {
+        LOG(ERROR) << "method=" << mp->method->full_name()
+                   << " does not support http response cache";
+        return -1;
+    }
+    if (options.ttl_ms <= 0) {
+        LOG(ERROR) << "Invalid ttl_ms=" << options.ttl_ms;
+        return -1;
+    }
+    mp->status->SetHttpResponseCache(new HttpResponseCache(options));
+    return 0;
+}
+
+int Server::SetBthreadPriorityOf(const butil::StringPiece& full_method_name,
+                                 bthread_attrflags_t priority) {
+    MethodProperty* mp = _method_map.seek(full_method_name);
+    if (mp == NULL) {
+        LOG(ERROR) << "Fail to find method=" << full_method_name;
+        return -1;
+    }
+    if (IsRunning()) {
+        LOG(ERROR) << "SetBthreadPriorityOf is only allowed before Server started";
+        return -1;
+    }
+    if (priority != 0 && priority != BTHREAD_PRIORITY_HIGH &&
+        priority != BTHREAD_PRIORITY_LOW) {
+        LOG(ERROR) << "Invalid priority=" << priority;
+        return -1;
+    }
+    mp->bthread_priority = priority;
+    return 0;
+}
+
 bool Server::AcceptRequest(Controller* cntl) const {
     const Interceptor* interceptor = _options.interceptor;
     if (!interceptor) {
@@ -45,6 +45,7 @@
 #include "brpc/concurrency_limiter.h"
 #include "brpc/baidu_master_service.h"
 #include "brpc/rpc_pb_message_factory.h"
+#include "brpc/details/http_response_cache.h"  // HttpResponseCacheOptions
 
 namespace brpc {
 
@@ -356,6 +357,12 @@ struct ServiceOptions {
     // enable server end progressive reading, mainly for http server
     // Default: false.
     bool enable_progressive_read;
+
+    // Convert pb responses of methods in the service to json progressively
+    // and send them in http chunks, see Controller::set_pb_streaming_json()
+    // for details. Methods returning huge repeated fields benefit from this.
+    // Default: false.
+    bool pb_streaming_json;
 };
 
 // Represent ports inside [min_port, max_port]
@@ -407,6 +414,7 @@ public:
             bool pb_bytes_to_base64;
             bool pb_single_repeated_to_array;
             bool enable_progressive_read;
+            bool pb_streaming_json;
             OpaqueParams();
         };
         OpaqueParams params;
@@ -423,6 +431,9 @@ public:
         // while other methods(ignore_eovercrowded=false) keep returning eovercrowded.
         // currently only valid for baidu_master_service, baidu_rpc, http_rpc, hulu_pbrpc and sofa_pbrpc protocols 
         bool ignore_eovercrowded;
+        // Priority of bthreads running the method, 0, BTHREAD_PRIORITY_HIGH
+        // or BTHREAD_PRIORITY_LOW.
+        bthread_attrflags_t bthread_priority;
 
         MethodProperty();
     };
@@ -604,6 +615,31 @@ public:
     bool& IgnoreEovercrowdedOf(const butil::StringPiece& full_method_name);
     bool IgnoreEovercrowdedOf(const butil::StringPiece& full_method_name) const;
 
+    // Cache responses of the method accessed by http GET for
+    // `options.ttl_ms', see brpc/details/http_response_cache.h for details.
+    // Requests hitting the cache are responded without calling the method,
+    // concurrent requests missing the cache wait for the one calling the
+    // method instead of calling it again. Only successful responses are
+    // cached, excluding ones read or written progressively or with cookies.
+    // Example:
+    //   brpc::HttpResponseCacheOptions opt;
+    //   opt.ttl_ms = 2000;
+    //   server.EnableHttpResponseCache("example.QueryService.Get", opt);
+    // Note: This interface can ONLY be called before the server is started.
+    // Returns 0 on success, -1 otherwise.
+    int EnableHttpResponseCache(const butil::StringPiece& full_method_name,
+                                const HttpResponseCacheOptions& options);
+
+    // Run requests to the method in bthreads of `priority', namely
+    // BTHREAD_PRIORITY_HIGH for latency-critical methods or
+    // BTHREAD_PRIORITY_LOW for batch ones sharing workers with others.
+    // Currently only valid for baidu_rpc, http_rpc, hulu_pbrpc and
+    // sofa_pbrpc protocols.
+    // Note: This interface can ONLY be called before the server is started.
+    // Returns 0 on success, -1 otherwise.
+    int SetBthreadPriorityOf(const butil::StringPiece& full_method_name,
+                             bthread_attrflags_t priority);
+
     int Concurrency() const {
         return butil::subtle::NoBarrier_Load(&_concurrency);
     };
@@ -615,6 +651,11 @@ public:
         return this->_has_progressive_read_method;
     }
 
+    // True if any method is declared as `rpc M(stream Req) returns (...)'.
+    bool has_grpc_client_streaming_method() const {
+        return this->_has_grpc_client_streaming_method;
+    }
+
 private:
 friend class StatusService;
 friend class ProtobufsService;
@@ -794,6 +835,7 @@ friend class Controller;
     bvar::PassiveStatus<int32_t> _concurrency_bvar;
 
     bool _has_progressive_read_method;
+    bool _has_grpc_client_streaming_method;
 };
 
 // Get the data attached to current searching thread. The data is created by
@@ -492,7 +492,9 @@ Socket::Socket(Forbidden f)
     , _total_streams_unconsumed_size(0)
     , _ninflight_app_health_check(0)
     , _tcp_user_timeout_ms(-1)
-    , _http_request_method(HTTP_METHOD_GET) {
+    , _http_request_method(HTTP_METHOD_GET)
+    , _pipelining_disabled(false)
+    , _http_pipelined(false) {
     CreateVarsOnce();
     pthread_mutex_init(&_id_wait_list_mutex, NULL);
     _epollout_butex = bthread::butex_create_checked<butil::atomic<int> >();
@@ -741,6 +743,8 @@ int Socket::OnCreated(const SocketOptions& options) {
     _last_readtime_us.store(cpuwide_now, butil::memory_order_relaxed);
     reset_parsing_context(options.initial_parsing_context);
     _correlation_id = 0;
+    _pipelining_disabled.store(false, butil::memory_order_relaxed);
+    _http_pipelined.store(false, butil::memory_order_relaxed);
     _health_check_interval_s = options.health_check_interval_s;
     _hc_option = options.hc_option;
     _is_hc_related_ref_held = false;
@@ -536,6 +536,23 @@ public:
     bool PopPipelinedInfo(PipelinedInfo* info);
     // Undo previous PopPipelinedInfo
     void GivebackPipelinedInfo(const PipelinedInfo&);
+    // Number of PipelinedInfo pushed but not popped yet.
+    size_t PipelinedInfoCount();
+
+    // [Client side] The server closes connections after responses thus
+    // requests can't be pipelined on this socket. RPCs with "single"
+    // connection to this server use pooled connections instead.
+    void disable_pipelining()
+    { _pipelining_disabled.store(true, butil::memory_order_relaxed); }
+    bool pipelining_disabled() const
+    { return _pipelining_disabled.load(butil::memory_order_relaxed); }
+
+    // [Client side] HTTP/1.1 requests are pipelined on this socket, so the
+    // responses are matched with PipelinedInfo.
+    void set_http_pipelined()
+    { _http_pipelined.store(true, butil::memory_order_relaxed); }
+    bool http_pipelined() const
+    { return _http_pipelined.load(butil::memory_order_relaxed); }
 
     void set_preferred_index(int index) { _preferred_index = index; }
     int preferred_index() const { return _preferred_index; }
@@ -986,6 +1003,8 @@ private:
     int _tcp_user_timeout_ms;
 
     HttpMethod _http_request_method;
+    butil::atomic<bool> _pipelining_disabled;
+    butil::atomic<bool> _http_pipelined;
     HealthCheckOption _hc_option;
 };
 
@@ -131,6 +131,11 @@ inline void Socket::GivebackPipelinedInfo(const PipelinedInfo& pi) {
     }
 }
 
+inline size_t Socket::PipelinedInfoCount() {
+    BAIDU_SCOPED_LOCK(_pipeline_mutex);
+    return _pipeline_q != NULL ? _pipeline_q->size() : 0;
+}
+
 inline bool Socket::ValidFileDescriptor(int fd) {
     return fd >= 0 && fd != STREAM_FAKE_FD;
 }
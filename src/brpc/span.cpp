@@ -17,11 +17,15 @@
 
 
 #include <netinet/in.h>
+#include <algorithm>
 #include <functional>
+#include <unordered_map>
 #include <gflags/gflags.h>
 #include <leveldb/db.h>
 #include <leveldb/comparator.h>
 #include "bthread/bthread.h"
+#include "bthread/unstable.h"                        // bthread_timer_add
+#include "bvar/latency_recorder.h"
 #include "butil/scoped_lock.h"
 #include "butil/thread_local.h"
 #include "butil/string_printf.h"
@@ -34,6 +38,7 @@
 #include "brpc/shared_object.h"
 #include "brpc/reloadable_flags.h"
 #include "brpc/span.h"
+#include "brpc/details/otlp_exporter.h"
 
 #define BRPC_SPAN_INFO_SEP "\1"
 
@@ -64,6 +69,24 @@ DEFINE_bool(rpcz_keep_span_db, false, "Don't remove DB of rpcz at program's exit
 DEFINE_int64(rpcz_save_span_min_latency_us, 0, "The minimum latency microseconds of span saved");
 BRPC_VALIDATE_GFLAG(rpcz_save_span_min_latency_us, NonNegativeInteger);
 
+DEFINE_bool(rpcz_tail_sampling, false, "Trace all RPCs and save spans of "
+            "RPCs which are slow or failed only, see -rpcz_tail_latency_percentile");
+BRPC_VALIDATE_GFLAG(rpcz_tail_sampling, PassValidate);
+
+DEFINE_double(rpcz_tail_latency_percentile, 0.99, "With -rpcz_tail_sampling, "
+              "save spans of RPCs slower than this percentile of recent "
+              "latencies of the same method. Latencies are also required to be "
+              "no less than -rpcz_save_span_min_latency_us");
+BRPC_VALIDATE_GFLAG(rpcz_tail_latency_percentile, PassValidate);
+
+DEFINE_int32(rpcz_tail_hold_ms, 1000, "With -rpcz_tail_sampling, spans not "
+             "chosen are held for so many milliseconds and saved if other "
+             "spans of the same trace are chosen during the time");
+BRPC_VALIDATE_GFLAG(rpcz_tail_hold_ms, NonNegativeInteger);
+
+DEFINE_bool(rpcz_save_span_db, true, "Save spans into DB of rpcz (for /rpcz), "
+            "turn off to export spans to -otlp_collector only");
+
 struct IdGen {
     bool init;
     uint16_t seq;
@@ -133,12 +156,14 @@ Span* Span::CreateClientSpan(const std::string& full_method_name,
     Span* parent = (Span*)bthread::tls_bls.rpcz_parent_span;
     if (parent) {
         span->_trace_id = parent->trace_id();
+        span->_trace_id_high = parent->trace_id_high();
         span->_parent_span_id = parent->span_id();
         span->_local_parent = parent;
         span->_next_client = parent->_client_list;
         parent->_client_list = span;
     } else {
         span->_trace_id = GenerateTraceId();
+        span->_trace_id_high = 0;
         span->_parent_span_id = 0;
         span->_local_parent = NULL;
     }
@@ -178,6 +203,7 @@ Span* Span::CreateBthreadSpan(const std::string& full_method_name,
     span->_info.clear();
 
     span->_trace_id = parent->trace_id();
+    span->_trace_id_high = parent->trace_id_high();
     span->_parent_span_id = parent->span_id();
     span->_local_parent = parent;
     span->_next_client = parent->_client_list;
@@ -202,6 +228,7 @@ Span* Span::CreateServerSpan(
         return NULL;
     }
     span->_trace_id = (trace_id ? trace_id : GenerateTraceId());
+    span->_trace_id_high = 0;
     span->_span_id = (span_id ? span_id : GenerateSpanId());
     span->_parent_span_id = parent_span_id;
     span->_log_id = 0;
@@ -314,6 +341,57 @@ int64_t Span::GetEndRealTimeUs() const {
     return result;
 }
 
+std::string MakeTraceParent(const Span* span) {
+    // version-trace_id-parent_id-flags, the span is always sampled.
+    return butil::string_printf("00-%016llx%016llx-%016llx-01",
+                                (unsigned long long)span->trace_id_high(),
+                                (unsigned long long)span->trace_id(),
+                                (unsigned long long)span->span_id());
+}
+
+static bool ParseHex64(const char* s, uint64_t* out) {
+    uint64_t v = 0;
+    for (int i = 0; i < 16; ++i) {
+        const char c = s[i];
+        if (c >= '0' && c <= '9') {
+            v = (v << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            v = (v << 4) | (c - 'a' + 10);
+        } else {
+            return false;
+        }
+    }
+    *out = v;
+    return true;
+}
+
+bool ParseTraceParent(const std::string& value, uint64_t* trace_id_high,
+                      uint64_t* trace_id, uint64_t* parent_id, bool* sampled) {
+    // Later versions may append fields after flags.
+    const char* s = value.c_str();
+    if (value.size() < 55 || s[2] != '-' || s[35] != '-' || s[52] != '-' ||
+        (value.size() > 55 && s[55] != '-') ||
+        (s[0] == 'f' && s[1] == 'f')/*invalid version*/) {
+        return false;
+    }
+    uint64_t flags = 0;
+    char flags_buf[16];
+    memset(flags_buf, '0', sizeof(flags_buf));
+    flags_buf[14] = s[53];
+    flags_buf[15] = s[54];
+    if (!ParseHex64(s + 3, trace_id_high) ||
+        !ParseHex64(s + 19, trace_id) ||
+        !ParseHex64(s + 36, parent_id) ||
+        !ParseHex64(flags_buf, &flags)) {
+        return false;
+    }
+    if ((*trace_id_high == 0 && *trace_id == 0) || *parent_id == 0) {
+        return false;
+    }
+    *sampled = (flags & 1);
+    return true;
+}
+
 SpanInfoExtractor::SpanInfoExtractor(const char* info)
     : _sp(info, *BRPC_SPAN_INFO_SEP) {
 }
@@ -469,9 +547,274 @@ inline int GetSpanDB(butil::intrusive_ptr<SpanDB>* db) {
     return -1;
 }
 
+static void Span2Brief(const Span* span, BriefSpan* brief) {
+    const int64_t start_time = span->GetStartRealTimeUs();
+    brief->set_trace_id(span->trace_id());
+    brief->set_span_id(span->span_id());
+    brief->set_log_id(span->log_id());
+    brief->set_type(span->type());
+    brief->set_error_code(span->error_code());
+    brief->set_request_size(span->request_size());
+    brief->set_response_size(span->response_size());
+    brief->set_start_real_us(start_time);
+    brief->set_latency_us(span->GetEndRealTimeUs() - start_time);
+    brief->set_full_method_name(span->full_method_name());
+}
+
+// Chooses spans to save after RPCs end: spans of RPCs that failed, were
+// slower than recent -rpcz_tail_latency_percentile of the method, or
+// matched the filter set by SetRpczTailFilter(). Spans not chosen are held
+// in a ring of the submitting thread for a while in case that other spans
+// of the same trace are chosen, e.g. the trace fans out to this server.
+struct TailMethodLatency {
+    bvar::LatencyRecorder latency;
+    // 0 means unknown.
+    butil::atomic<int64_t> threshold_us;
+    butil::atomic<int64_t> next_update_us;
+
+    TailMethodLatency() : threshold_us(0), next_update_us(0) {}
+};
+typedef std::unordered_map<std::string, TailMethodLatency*> TailMethodMap;
+
+struct HeldSpan {
+    Span* span;
+    int64_t submit_us;
+};
+static const size_t HOLD_CAPACITY = 256;
+struct HeldSpans {
+    // Held spans are added by the owning thread and released by the owning
+    // thread or the periodic drain, which rarely contend.
+    pthread_mutex_t mutex;
+    HeldSpan spans[HOLD_CAPACITY];
+    size_t head;
+    size_t size;
+
+    HeldSpans() : head(0), size(0) { pthread_mutex_init(&mutex, NULL); }
+    ~HeldSpans() { pthread_mutex_destroy(&mutex); }
+};
+
+class TailSampler {
+public:
+    static void Submit(Span* span, int64_t cpuwide_time_us);
+
+private:
+    static bool ShouldKeep(Span* root);
+    static TailMethodLatency* GetMethodLatency(const std::string& method);
+    static void MarkTraceKept(uint64_t trace_id);
+    static bool IsTraceKept(uint64_t trace_id);
+    static void Hold(Span* span, int64_t cpuwide_time_us);
+    // Save or destroy held spans which are expired, or all of them if
+    // `all' is true.
+    static void Release(HeldSpans* held, bool all);
+    static void ReleaseAll(void* arg);
+    // Release expired spans held by all threads periodically, so that
+    // spans held by idle threads are not kept longer than
+    // -rpcz_tail_hold_ms.
+    static void StartDrain();
+    static void Drain(void*);
+};
+
+// Methods beyond this number share one threshold.
+static const size_t MAX_TAIL_SAMPLED_METHODS = 1024;
+static pthread_mutex_t g_tail_methods_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TailMethodMap* g_tail_methods = NULL;
+static TailMethodLatency* g_tail_other_method = NULL;
+static BAIDU_THREAD_LOCAL TailMethodMap* tls_tail_methods = NULL;
+static BAIDU_THREAD_LOCAL HeldSpans* tls_held_spans = NULL;
+static pthread_mutex_t g_held_spans_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<HeldSpans*>* g_held_spans = NULL;
+static pthread_once_t g_tail_drain_once = PTHREAD_ONCE_INIT;
+// Recently chosen traces, lossy.
+static butil::atomic<uint64_t> g_kept_traces[1024];
+static butil::atomic<SpanFilter*> g_tail_filter(NULL);
+static bvar::Adder<int64_t> g_tail_kept("rpcz_tail_kept_count");
+static bvar::Adder<int64_t> g_tail_dropped("rpcz_tail_dropped_count");
+
+void SetRpczTailFilter(SpanFilter* filter) {
+    g_tail_filter.store(filter, butil::memory_order_release);
+}
+
+TailMethodLatency*
+TailSampler::GetMethodLatency(const std::string& method) {
+    if (tls_tail_methods == NULL) {
+        tls_tail_methods = new TailMethodMap;
+        butil::thread_atexit([](void* arg) { delete (TailMethodMap*)arg; },
+                             tls_tail_methods);
+    }
+    TailMethodMap::const_iterator it = tls_tail_methods->find(method);
+    if (it != tls_tail_methods->end()) {
+        return it->second;
+    }
+    TailMethodLatency* m = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_tail_methods_mutex);
+        if (g_tail_methods == NULL) {
+            g_tail_methods = new TailMethodMap;
+            g_tail_other_method = new TailMethodLatency;
+        }
+        TailMethodLatency*& m2 = (*g_tail_methods)[method];
+        if (m2 == NULL) {
+            if (g_tail_methods->size() > MAX_TAIL_SAMPLED_METHODS) {
+                g_tail_methods->erase(method);
+                m = g_tail_other_method;
+            } else {
+                m2 = new TailMethodLatency;
+                m = m2;
+            }
+        } else {
+            m = m2;
+        }
+    }
+    if (tls_tail_methods->size() < MAX_TAIL_SAMPLED_METHODS) {
+        (*tls_tail_methods)[method] = m;
+    }
+    return m;
+}
+
+void TailSampler::MarkTraceKept(uint64_t trace_id) {
+    g_kept_traces[trace_id % arraysize(g_kept_traces)].store(
+        trace_id, butil::memory_order_relaxed);
+}
+
+bool TailSampler::IsTraceKept(uint64_t trace_id) {
+    return g_kept_traces[trace_id % arraysize(g_kept_traces)].load(
+        butil::memory_order_relaxed) == trace_id;
+}
+
+bool TailSampler::ShouldKeep(Span* root) {
+    const int64_t latency_us =
+        root->GetEndRealTimeUs() - root->GetStartRealTimeUs();
+    TailMethodLatency* m = GetMethodLatency(root->full_method_name());
+    m->latency << latency_us;
+    // Computing percentiles is slow, update the threshold every second.
+    const int64_t now = butil::gettimeofday_us();
+    int64_t next_update_us = m->next_update_us.load(butil::memory_order_relaxed);
+    if (now >= next_update_us &&
+        m->next_update_us.compare_exchange_strong(
+            next_update_us, now + 1000000L, butil::memory_order_relaxed)) {
+        m->threshold_us.store(
+            m->latency.latency_percentile(FLAGS_rpcz_tail_latency_percentile),
+            butil::memory_order_relaxed);
+    }
+    const int64_t threshold_us = m->threshold_us.load(butil::memory_order_relaxed);
+    if (threshold_us > 0 &&
+        latency_us >= std::max(threshold_us, FLAGS_rpcz_save_span_min_latency_us)) {
+        return true;
+    }
+    bool failed = false;
+    root->traversal(root, [&failed](Span* s) {
+        failed = failed || (s->error_code() != 0);
+    });
+    if (failed) {
+        return true;
+    }
+    SpanFilter* filter = g_tail_filter.load(butil::memory_order_acquire);
+    if (filter != NULL) {
+        BriefSpan brief;
+        Span2Brief(root, &brief);
+        return filter->Keep(brief);
+    }
+    return false;
+}
+
+void TailSampler::Release(HeldSpans* held, bool all) {
+    const int64_t expire_us = butil::cpuwide_time_us() - FLAGS_rpcz_tail_hold_ms * 1000L;
+    while (held->size > 0) {
+        HeldSpan& h = held->spans[held->head];
+        if (!all && held->size < HOLD_CAPACITY && h.submit_us > expire_us) {
+            break;
+        }
+        if (IsTraceKept(h.span->trace_id())) {
+            g_tail_kept << 1;
+            h.span->submit(h.submit_us);
+        } else {
+            g_tail_dropped << 1;
+            h.span->destroy();
+        }
+        held->head = (held->head + 1) % HOLD_CAPACITY;
+        --held->size;
+    }
+}
+
+void TailSampler::ReleaseAll(void* arg) {
+    HeldSpans* held = (HeldSpans*)arg;
+    {
+        // Not visible to Drain() after being removed.
+        BAIDU_SCOPED_LOCK(g_held_spans_mutex);
+        g_held_spans->erase(std::find(g_held_spans->begin(),
+                                      g_held_spans->end(), held));
+    }
+    Release(held, true);
+    delete held;
+}
+
+void TailSampler::Drain(void*) {
+    {
+        BAIDU_SCOPED_LOCK(g_held_spans_mutex);
+        for (size_t i = 0; i < g_held_spans->size(); ++i) {
+            HeldSpans* held = (*g_held_spans)[i];
+            BAIDU_SCOPED_LOCK(held->mutex);
+            Release(held, false);
+        }
+    }
+    StartDrain();
+}
+
+void TailSampler::StartDrain() {
+    // Check twice within the hold time.
+    const int interval_ms = std::min(
+        std::max(FLAGS_rpcz_tail_hold_ms / 2, 10), 1000);
+    bthread_timer_t timer;
+    if (bthread_timer_add(&timer, butil::milliseconds_from_now(interval_ms),
+                          Drain, NULL) != 0) {
+        LOG(ERROR) << "Fail to add timer to release held spans";
+    }
+}
+
+void TailSampler::Hold(Span* span, int64_t cpuwide_time_us) {
+    HeldSpans* held = tls_held_spans;
+    if (held == NULL) {
+        held = new HeldSpans;
+        {
+            BAIDU_SCOPED_LOCK(g_held_spans_mutex);
+            if (g_held_spans == NULL) {
+                g_held_spans = new std::vector<HeldSpans*>;
+            }
+            g_held_spans->push_back(held);
+        }
+        tls_held_spans = held;
+        butil::thread_atexit(ReleaseAll, held);
+        pthread_once(&g_tail_drain_once, StartDrain);
+    }
+    BAIDU_SCOPED_LOCK(held->mutex);
+    // Release the oldest one if the ring is full.
+    Release(held, false);
+    HeldSpan& h = held->spans[(held->head + held->size) % HOLD_CAPACITY];
+    h.span = span;
+    h.submit_us = cpuwide_time_us;
+    ++held->size;
+}
+
+void TailSampler::Submit(Span* span, int64_t cpuwide_time_us) {
+    if (ShouldKeep(span)) {
+        MarkTraceKept(span->trace_id());
+        g_tail_kept << 1;
+        span->submit(cpuwide_time_us);
+    } else if (FLAGS_rpcz_tail_hold_ms > 0) {
+        Hold(span, cpuwide_time_us);
+    } else {
+        g_tail_dropped << 1;
+        span->destroy();
+    }
+}
+
 void Span::Submit(Span* span, int64_t cpuwide_time_us) {
     if (span->local_parent() == NULL) {
-        span->submit(cpuwide_time_us);
+        if (FLAGS_rpcz_tail_sampling) {
+            TailSampler::Submit(span, cpuwide_time_us);
+        } else {
+            span->submit(cpuwide_time_us);
+        }
     }
 }
 
@@ -579,23 +922,15 @@ leveldb::Status SpanDB::Index(const Span* span, std::string* value_buf) {
     // fails, the entry in time_db will be finally removed when it's out
     // of time window.
 
-    const int64_t start_time = span->GetStartRealTimeUs();
-    const int64_t latency_us = span->GetEndRealTimeUs() - start_time;
-    // if latency_us < FLAGS_rpcz_save_span_min_latency_us, don't save this span
-    if (latency_us < FLAGS_rpcz_save_span_min_latency_us) {
+    BriefSpan brief;
+    Span2Brief(span, &brief);
+    const int64_t start_time = brief.start_real_us();
+    // if latency_us < FLAGS_rpcz_save_span_min_latency_us, don't save this span.
+    // Spans are already chosen by TailSampler with -rpcz_tail_sampling.
+    if (!FLAGS_rpcz_tail_sampling &&
+        brief.latency_us() < FLAGS_rpcz_save_span_min_latency_us) {
         return leveldb::Status::OK();
     }
-    BriefSpan brief;
-    brief.set_trace_id(span->trace_id());
-    brief.set_span_id(span->span_id());
-    brief.set_log_id(span->log_id());
-    brief.set_type(span->type());
-    brief.set_error_code(span->error_code());
-    brief.set_request_size(span->request_size());
-    brief.set_response_size(span->response_size());
-    brief.set_start_real_us(start_time);
-    brief.set_latency_us(latency_us);
-    brief.set_full_method_name(span->full_method_name());
     if (!brief.SerializeToString(value_buf)) {
         return leveldb::Status::InvalidArgument(
             leveldb::Slice("Fail to serialize BriefSpan"));
@@ -703,6 +1038,13 @@ leveldb::Status SpanDB::RemoveSpansBefore(int64_t tm) {
 
 // Write span into leveldb.
 void Span::dump_and_destroy(size_t /*round*/) {
+    if (IsOtlpExportEnabled()) {
+        ExportSpans(this);
+    }
+    if (!FLAGS_rpcz_save_span_db) {
+        destroy();
+        return;
+    }
     StartIndexingIfNeeded();
 
     std::string value_buf;
@@ -41,11 +41,14 @@ extern __thread bthread::LocalStorage tls_bls;
 namespace brpc {
 
 DECLARE_bool(enable_rpcz);
+DECLARE_bool(rpcz_tail_sampling);
 
 // Collect information required by /rpcz and tracing system whose idea is
 // described in http://static.googleusercontent.com/media/research.google.com/en//pubs/archive/36356.pdf
 class Span : public bvar::Collected {
 friend class SpanDB;
+friend void ExportSpans(const Span* root);
+friend class TailSampler;
     struct Forbidden {};
 public:
     // Call CreateServerSpan/CreateClientSpan instead.
@@ -93,6 +96,8 @@ public:
     int64_t GetStartRealTimeUs() const;
     int64_t GetEndRealTimeUs() const;
 
+    // Higher 64 bits of 128-bit trace ids from W3C trace context.
+    void set_trace_id_high(uint64_t id) { _trace_id_high = id; }
     void set_log_id(uint64_t cid) { _log_id = cid; }
     void set_base_cid(bthread_id_t id) { _base_cid = id; }
     void set_ending_cid(bthread_id_t id) { _ending_cid = id; }
@@ -121,6 +126,7 @@ public:
     }
 
     uint64_t trace_id() const { return _trace_id; }
+    uint64_t trace_id_high() const { return _trace_id_high; }
     uint64_t parent_span_id() const { return _parent_span_id; }
     uint64_t span_id() const { return _span_id; }
     uint64_t log_id() const { return _log_id; }
@@ -157,6 +163,7 @@ private:
     }
 
     uint64_t _trace_id;
+    uint64_t _trace_id_high;
     uint64_t _span_id;
     uint64_t _parent_span_id;
     uint64_t _log_id;
@@ -198,6 +205,14 @@ private:
     butil::StringSplitter _sp;
 };
 
+// W3C trace context, see https://www.w3.org/TR/trace-context/
+// Value of `traceparent' header for calls of `span'.
+std::string MakeTraceParent(const Span* span);
+// Parse value of `traceparent' header, returns false if it's invalid.
+// `parent_id' is the span_id of the caller.
+bool ParseTraceParent(const std::string& value, uint64_t* trace_id_high,
+                      uint64_t* trace_id, uint64_t* parent_id, bool* sampled);
+
 // These two functions can be used for composing TRACEPRINT as well as hiding
 // span implementations.
 bool CanAnnotateSpan();
@@ -210,6 +225,11 @@ public:
     virtual bool Keep(const BriefSpan&) = 0;
 };
 
+// Spans of RPCs matching `filter' are always saved when -rpcz_tail_sampling
+// is on. `filter' must be valid during the lifetime of the program, NULL
+// to clear.
+void SetRpczTailFilter(SpanFilter* filter);
+
 class SpanDB;
     
 // Find a span by its trace_id and span_id, serialize it into `span'.
@@ -234,10 +254,13 @@ void ListSpans(SpanDB* db, int64_t before_this_time, size_t max_scan,
 
 // Check this function first before creating a span.
 // If rpcz of upstream is enabled, local rpcz is enabled automatically.
+// With -rpcz_tail_sampling, every RPC is traced and spans are sampled
+// after RPCs end.
 inline bool IsTraceable(bool is_upstream_traced) {
     extern bvar::CollectorSpeedLimit g_span_sl;
     return is_upstream_traced ||
-        (FLAGS_enable_rpcz && bvar::is_collectable(&g_span_sl));
+        (FLAGS_enable_rpcz && (FLAGS_rpcz_tail_sampling ||
+                               bvar::is_collectable(&g_span_sl)));
 }
 
 inline void* CreateBthreadSpan() {
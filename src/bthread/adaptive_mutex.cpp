@@ -0,0 +1,308 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#include <algorithm>
+#include <map>
+#include <system_error>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/reloadable_flags.h"
+#include "bvar/bvar.h"
+#include "bvar/latency_recorder.h"
+#include "bthread/butex.h"
+#include "bthread/processor.h"                   // cpu_relax
+#include "bthread/task_group.h"
+#include "bthread/adaptive_mutex.h"
+
+namespace bthread {
+
+DEFINE_int32(bthread_adaptive_mutex_max_spin, 256,
+             "Max times that a contended bthread::AdaptiveMutex spins before "
+             "parking, 0 to park immediately");
+BUTIL_VALIDATE_GFLAG(bthread_adaptive_mutex_max_spin,
+                     butil::NonNegativeInteger);
+
+EXTERN_BAIDU_VOLATILE_THREAD_LOCAL(TaskGroup*, tls_task_group);
+
+struct AdaptiveMutexSiteStats {
+    explicit AdaptiveMutexSiteStats(const std::string& name)
+        : wait(name + "_lock_wait")
+        , spin_acquired(name + "_lock_spin_acquired")
+        , parked(name + "_lock_parked") {}
+
+    bvar::LatencyRecorder wait;
+    bvar::Adder<int64_t> spin_acquired;
+    bvar::Adder<int64_t> parked;
+};
+
+// Stats are shared by mutexes of the same site and never deleted.
+static AdaptiveMutexSiteStats* get_site_stats(const std::string& name) {
+    static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static std::map<std::string, AdaptiveMutexSiteStats*>* s_stats = NULL;
+    BAIDU_SCOPED_LOCK(s_mutex);
+    if (s_stats == NULL) {
+        s_stats = new std::map<std::string, AdaptiveMutexSiteStats*>;
+    }
+    AdaptiveMutexSiteStats*& stats = (*s_stats)[name];
+    if (stats == NULL) {
+        stats = new AdaptiveMutexSiteStats(name);
+    }
+    return stats;
+}
+
+AdaptiveMutexOptions::AdaptiveMutexOptions()
+    : fifo_handoff(false) {}
+
+// A parked locker in FIFO mode, on the stack of the locker.
+struct AdaptiveMutex::Waiter {
+    Waiter* next;
+    // Set to 1 when the ownership is handed to this waiter.
+    butil::atomic<unsigned>* butex;
+};
+
+AdaptiveMutex::AdaptiveMutex()
+    : AdaptiveMutex(AdaptiveMutexOptions()) {}
+
+AdaptiveMutex::AdaptiveMutex(const AdaptiveMutexOptions& options)
+    : _butex(butex_create_checked<butil::atomic<unsigned> >())
+    , _owner_meta(NULL)
+    , _owner_tid(INVALID_BTHREAD)
+    , _spin(0)
+    , _fifo_handoff(options.fifo_handoff)
+    , _waiter_head(NULL)
+    , _waiter_tail(NULL)
+    , _stats(options.name.empty() ? NULL : get_site_stats(options.name)) {
+    if (NULL == _butex) {
+        throw std::system_error(std::error_code(ENOMEM, std::system_category()),
+                                "AdaptiveMutex constructor failed");
+    }
+    _butex->store(0, butil::memory_order_relaxed);
+}
+
+AdaptiveMutex::~AdaptiveMutex() {
+    butex_destroy(_butex);
+}
+
+void AdaptiveMutex::set_owner() {
+    TaskGroup* g = BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_task_group);
+    if (NULL != g && !g->is_current_main_task()) {
+        TaskMeta* m = g->current_task();
+        _owner_tid.store(m->tid, butil::memory_order_relaxed);
+        _owner_meta.store(m, butil::memory_order_relaxed);
+    } else {
+        _owner_meta.store(NULL, butil::memory_order_relaxed);
+    }
+}
+
+bool AdaptiveMutex::owner_is_running() const {
+    TaskMeta* m = _owner_meta.load(butil::memory_order_relaxed);
+    if (NULL == m) {
+        // Owned by a pthread, whether it's running is unknown.
+        return true;
+    }
+    // TaskMeta is never freed, but may be reused by another bthread, in
+    // which case the owner just changed and is likely running.
+    if (m->tid != _owner_tid.load(butil::memory_order_relaxed)) {
+        return true;
+    }
+    // The owner is blocked on a butex (another lock, condition, IO...),
+    // which rarely ends within the spinning.
+    return NULL == m->current_waiter.load(butil::memory_order_relaxed);
+}
+
+bool AdaptiveMutex::spin_lock() {
+    const int max_spin = FLAGS_bthread_adaptive_mutex_max_spin;
+    if (max_spin <= 0) {
+        return false;
+    }
+    // Don't delay other bthreads ready in this worker.
+    TaskGroup* g = BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_task_group);
+    if (NULL != g && g->rq_size() != 0) {
+        return false;
+    }
+    // Like adaptive mutex of glibc: spin at most twice of the spins needed
+    // recently, which follows the lengths of critical sections.
+    const int spin = _spin.load(butil::memory_order_relaxed);
+    const int limit = std::min(max_spin, spin * 2 + 10);
+    bool locked = false;
+    int i = 0;
+    for (; i < limit; ++i) {
+        const unsigned state = _butex->load(butil::memory_order_relaxed);
+        if (0 == state) {
+            if (try_lock()) {
+                locked = true;
+                break;
+            }
+        } else if ((_fifo_handoff && (state & CONTENDED)) ||
+                   !owner_is_running()) {
+            // In FIFO mode, the lock won't be released before parked
+            // lockers get it, spinning is useless.
+            break;
+        }
+        cpu_relax();
+    }
+    _spin.store(spin + (i - spin) / 8, butil::memory_order_relaxed);
+    return locked;
+}
+
+int AdaptiveMutex::park(const struct timespec* abstime) {
+    const unsigned contended = LOCKED | CONTENDED;
+    while (_butex->exchange(contended, butil::memory_order_acquire) & LOCKED) {
+        if (butex_wait(_butex, contended, abstime) < 0 &&
+            errno != EWOULDBLOCK && errno != EINTR/*note*/) {
+            // A mutex lock should ignore interruptions in general since
+            // user code is unlikely to check the return value.
+            return errno;
+        }
+    }
+    set_owner();
+    return 0;
+}
+
+int AdaptiveMutex::park_fifo(const struct timespec* abstime) {
+    Waiter w;
+    w.next = NULL;
+    w.butex = butex_create_checked<butil::atomic<unsigned> >();
+    if (NULL == w.butex) {
+        return ENOMEM;
+    }
+    w.butex->store(0, butil::memory_order_relaxed);
+    {
+        BAIDU_SCOPED_LOCK(_waiter_mutex);
+        // CONTENDED is only set or cleared with _waiter_mutex held and the
+        // lock is never released while it's set, so an unlocker either sees
+        // CONTENDED and wakes the head waiter, or releases the lock before
+        // we set CONTENDED, in which case the CAS below fails and retries.
+        unsigned state = _butex->load(butil::memory_order_relaxed);
+        while (true) {
+            if (0 == state) {
+                if (_butex->compare_exchange_weak(
+                        state, LOCKED, butil::memory_order_acquire,
+                        butil::memory_order_relaxed)) {
+                    butex_destroy(w.butex);
+                    set_owner();
+                    return 0;
+                }
+            } else if (state & CONTENDED) {
+                break;
+            } else if (_butex->compare_exchange_weak(
+                           state, state | CONTENDED,
+                           butil::memory_order_relaxed,
+                           butil::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (_waiter_tail) {
+            _waiter_tail->next = &w;
+        } else {
+            _waiter_head = &w;
+        }
+        _waiter_tail = &w;
+    }
+    int rc = 0;
+    while (0 == w.butex->load(butil::memory_order_acquire)) {
+        if (butex_wait(w.butex, 0, abstime) < 0 && errno == ETIMEDOUT) {
+            BAIDU_SCOPED_LOCK(_waiter_mutex);
+            if (w.butex->load(butil::memory_order_acquire)) {
+                // Got the ownership just before timeout.
+                break;
+            }
+            Waiter* prev = NULL;
+            for (Waiter* p = _waiter_head; p != &w; prev = p, p = p->next) {}
+            if (prev) {
+                prev->next = w.next;
+            } else {
+                _waiter_head = w.next;
+            }
+            if (_waiter_tail == &w) {
+                _waiter_tail = prev;
+            }
+            if (NULL == _waiter_head) {
+                _butex->fetch_and(~CONTENDED, butil::memory_order_relaxed);
+            }
+            rc = ETIMEDOUT;
+            break;
+        }
+    }
+    // CAUTION: the unlocker may still be waking the butex, which is safe
+    // since butexes are never freed, check comments before butex_create.
+    butex_destroy(w.butex);
+    if (0 == rc) {
+        set_owner();
+    }
+    return rc;
+}
+
+int AdaptiveMutex::lock_contended(const struct timespec* abstime) {
+    const int64_t start_ns = _stats ? butil::cpuwide_time_ns() : 0;
+    if (spin_lock()) {
+        if (_stats) {
+            _stats->wait << (butil::cpuwide_time_ns() - start_ns) / 1000;
+            _stats->spin_acquired << 1;
+        }
+        return 0;
+    }
+    const int rc = _fifo_handoff ? park_fifo(abstime) : park(abstime);
+    if (_stats) {
+        _stats->wait << (butil::cpuwide_time_ns() - start_ns) / 1000;
+        _stats->parked << 1;
+    }
+    return rc;
+}
+
+void AdaptiveMutex::unlock_fifo() {
+    butil::atomic<unsigned>* granted = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_waiter_mutex);
+        Waiter* w = _waiter_head;
+        if (NULL == w) {
+            // The last waiter timed out.
+            _butex->store(0, butil::memory_order_release);
+            return;
+        }
+        _waiter_head = w->next;
+        if (NULL == _waiter_head) {
+            _waiter_tail = NULL;
+            _butex->store(LOCKED, butil::memory_order_release);
+        }
+        // Keep LOCKED, the ownership is passed to `w'.
+        granted = w->butex;
+        granted->store(1, butil::memory_order_release);
+    }
+    butex_wake(granted);
+}
+
+void AdaptiveMutex::unlock() {
+    _owner_meta.store(NULL, butil::memory_order_relaxed);
+    if (_fifo_handoff) {
+        unsigned expected = LOCKED;
+        if (!_butex->compare_exchange_strong(expected, 0,
+                                             butil::memory_order_release,
+                                             butil::memory_order_relaxed)) {
+            unlock_fifo();
+        }
+        return;
+    }
+    const unsigned prev = _butex->exchange(0, butil::memory_order_release);
+    if (prev & CONTENDED) {
+        butex_wake(_butex);
+    }
+}
+
+}  // namespace bthread
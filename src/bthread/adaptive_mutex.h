@@ -0,0 +1,123 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+#ifndef  BTHREAD_ADAPTIVE_MUTEX_H
+#define  BTHREAD_ADAPTIVE_MUTEX_H
+
+#include <string>
+#include "butil/atomicops.h"
+#include "bthread/types.h"
+#include "bthread/mutex.h"
+
+namespace bthread {
+
+struct TaskMeta;
+struct AdaptiveMutexSiteStats;
+
+struct AdaptiveMutexOptions {
+    AdaptiveMutexOptions();
+
+    // When the mutex is unlocked with waiters, pass the ownership to the
+    // longest waiter directly instead of releasing it and letting everyone
+    // (including new comers that are spinning) compete again. This bounds
+    // the waiting time of each locker at the cost of throughput, since the
+    // next owner has to be scheduled before entering the critical section.
+    // Default: false
+    bool fifo_handoff;
+
+    // Name of the locking site. Mutexes sharing a name share the statistics
+    // which are exposed as bvars:
+    //   <name>_lock_wait_*          latencies(us) of contended locking
+    //   <name>_lock_spin_acquired   contended lockings done by spinning
+    //   <name>_lock_parked          contended lockings done by parking
+    // Empty means no statistics.
+    // Default: ""
+    std::string name;
+};
+
+// A mutex for both bthreads and pthreads. A contended locker spins while
+// the owner is running and parks (butex_wait) otherwise, the number of
+// spins adapts to the lengths of critical sections, and is capped by
+// -bthread_adaptive_mutex_max_spin. Compared to bthread::Mutex, it spins
+// longer under contention, optionally hands off ownership in FIFO order
+// and reports per-site contentions.
+class AdaptiveMutex {
+public:
+    AdaptiveMutex();
+    explicit AdaptiveMutex(const AdaptiveMutexOptions& options);
+    ~AdaptiveMutex();
+
+    void lock() {
+        if (!try_lock()) {
+            lock_contended(NULL);
+        }
+    }
+    bool try_lock() {
+        unsigned expected = 0;
+        if (_butex->compare_exchange_strong(expected, LOCKED,
+                                           butil::memory_order_acquire,
+                                           butil::memory_order_relaxed)) {
+            set_owner();
+            return true;
+        }
+        return false;
+    }
+    // Returns false when `abstime' is reached before getting the lock.
+    bool timed_lock(const struct timespec* abstime) {
+        return try_lock() || 0 == lock_contended(abstime);
+    }
+    void unlock();
+
+    bool fifo_handoff() const { return _fifo_handoff; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveMutex);
+
+    struct Waiter;
+
+    static const unsigned LOCKED = 1;
+    // Someone may be parked, unlocker should wake it up.
+    static const unsigned CONTENDED = 2;
+
+    void set_owner();
+    bool owner_is_running() const;
+    bool spin_lock();
+    int lock_contended(const struct timespec* abstime);
+    int park(const struct timespec* abstime);
+    int park_fifo(const struct timespec* abstime);
+    void unlock_fifo();
+
+    // butex, combination of LOCKED and CONTENDED.
+    butil::atomic<unsigned>* _butex;
+    // The bthread holding the lock, NULL for pthreads.
+    butil::atomic<TaskMeta*> _owner_meta;
+    butil::atomic<bthread_t> _owner_tid;
+    // Estimated spins to get the lock.
+    butil::atomic<int> _spin;
+    bool _fifo_handoff;
+    // Queue of parked lockers in FIFO mode.
+    internal::FastPthreadMutex _waiter_mutex;
+    Waiter* _waiter_head;
+    Waiter* _waiter_tail;
+    AdaptiveMutexSiteStats* _stats;
+};
+
+}  // namespace bthread
+
+#endif  // BTHREAD_ADAPTIVE_MUTEX_H
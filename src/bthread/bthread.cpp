@@ -59,6 +59,8 @@ DEFINE_int32(bthread_concurrency_by_tag, 8 + BTHREAD_EPOLL_THREAD_NUM,
              "Number of pthread workers of FLAGS_bthread_current_tag");
 BUTIL_VALIDATE_GFLAG(bthread_concurrency_by_tag, validate_bthread_concurrency_by_tag);
 
+DECLARE_int32(bthread_time_slice_us);
+
 static bool never_set_bthread_concurrency = true;
 
 BAIDU_CASSERT(sizeof(TaskControl*) == sizeof(butil::atomic<TaskControl*>), atomic_size_match);
@@ -179,6 +181,15 @@ std::string stack_trace(bthread_t tid) {
 }
 #endif // BRPC_BTHREAD_TRACER
 
+void print_sched_stats(std::ostream& os) {
+    TaskControl* c = get_task_control();
+    if (NULL == c) {
+        os << "TaskControl has not been created";
+        return;
+    }
+    c->print_sched_stats(os);
+}
+
 static int add_workers_for_each_tag(int num) {
     int added = 0;
     auto c = get_task_control();
@@ -188,6 +199,26 @@ static int add_workers_for_each_tag(int num) {
     return added;
 }
 
+// Remove workers from tags with most workers.
+static int remove_workers_for_each_tag(int num) {
+    int removed = 0;
+    auto c = get_task_control();
+    for (auto i = 0; i < num; ++i) {
+        bthread_tag_t tag = BTHREAD_TAG_DEFAULT;
+        for (int t = tag + 1; t < FLAGS_task_group_ntags; ++t) {
+            if (c->concurrency(t) > c->concurrency(tag)) {
+                tag = t;
+            }
+        }
+        const int n = c->remove_workers(1, tag);
+        if (n == 0) {
+            break;
+        }
+        removed += n;
+    }
+    return removed;
+}
+
 static bool validate_bthread_min_concurrency(const char*, int32_t val) {
     if (val <= 0) {
         return true;
@@ -250,6 +281,11 @@ start_from_non_worker(bthread_t* __restrict tid,
         //    inserting into the same TaskGroup maximizes the batch.
         // 2. bthread_flush() needs to know which TaskGroup to flush.
         auto g = tls_task_group_nosignal;
+        if (NULL != g && g->retiring()) {
+            // Don't keep feeding a worker asked to quit.
+            g->flush_nosignal_tasks_remote();
+            g = NULL;
+        }
         if (NULL == g) {
             g = c->choose_one_group(tag);
             tls_task_group_nosignal = g;
@@ -411,16 +447,18 @@ int bthread_setconcurrency(int num) {
         if (bthread::never_set_bthread_concurrency) {
             bthread::never_set_bthread_concurrency = false;
         }
+        BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
+        bthread::TaskControl* c = bthread::get_task_control();
+        if (c != NULL && num < c->concurrency()) {
+            // Workers created on demand are more than the new maximum.
+            bthread::remove_workers_for_each_tag(c->concurrency() - num);
+        }
         bthread::FLAGS_bthread_concurrency = num;
         return 0;
     }
     bthread::TaskControl* c = bthread::get_task_control();
-    if (c != NULL) {
-        if (num < c->concurrency()) {
-            return EPERM;
-        } else if (num == c->concurrency()) {
-            return 0;
-        }
+    if (c != NULL && num == c->concurrency()) {
+        return 0;
     }
     BAIDU_SCOPED_LOCK(bthread::g_task_control_mutex);
     c = bthread::get_task_control();
@@ -443,6 +481,11 @@ int bthread_setconcurrency(int num) {
         // Create more workers if needed.
         auto added = bthread::add_workers_for_each_tag(num - bthread::FLAGS_bthread_concurrency);
         bthread::FLAGS_bthread_concurrency += added;
+    } else if (num < bthread::FLAGS_bthread_concurrency) {
+        // Idle workers quit soon, busy ones quit after running out of tasks
+        // in their queues.
+        auto removed = bthread::remove_workers_for_each_tag(bthread::FLAGS_bthread_concurrency - num);
+        bthread::FLAGS_bthread_concurrency -= removed;
     }
     return (num == bthread::FLAGS_bthread_concurrency ? 0 : EPERM);
 }
@@ -495,6 +538,22 @@ int bthread_about_to_quit() {
     return EPERM;
 }
 
+int bthread_set_priority_self(bthread_attrflags_t priority) {
+    if (priority != 0 && priority != BTHREAD_PRIORITY_HIGH &&
+        priority != BTHREAD_PRIORITY_LOW) {
+        return EINVAL;
+    }
+    bthread::TaskGroup* g = bthread::tls_task_group;
+    if (g == NULL || g->is_current_main_task()) {
+        return EPERM;
+    }
+    bthread::TaskMeta* current_task = g->current_task();
+    current_task->attr.flags =
+        (current_task->attr.flags &
+         ~(BTHREAD_PRIORITY_HIGH | BTHREAD_PRIORITY_LOW)) | priority;
+    return 0;
+}
+
 int bthread_timer_add(bthread_timer_t* id, timespec abstime,
                       void (*on_timer)(void*), void* arg) {
     bthread::TaskControl* c = bthread::get_or_new_task_control();
@@ -546,6 +605,16 @@ int bthread_yield(void) {
     return sched_yield();
 }
 
+int bthread_maybe_yield(void) {
+    bthread::TaskGroup* g = bthread::BAIDU_GET_VOLATILE_THREAD_LOCAL(tls_task_group);
+    if (NULL != g && !g->is_current_pthread_task() &&
+        g->current_run_ns() > bthread::FLAGS_bthread_time_slice_us * 1000L) {
+        bthread::TaskGroup::yield(&g);
+        return 1;
+    }
+    return 0;
+}
+
 int bthread_set_worker_startfn(void (*start_fn)()) {
     if (start_fn == NULL) {
         return EINVAL;
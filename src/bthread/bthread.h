@@ -155,14 +155,18 @@ extern int bthread_getconcurrency(void);
 
 // Set number of worker pthreads to `num'. After a successful call,
 // bthread_getconcurrency() shall return new set number, but workers may
-// take some time to quit or create.
-// NOTE: currently concurrency cannot be reduced after any bthread created.
+// take some time to quit or create. When reducing concurrency, workers are
+// removed from tags with most workers and at least one worker is kept in
+// each tag, a removed worker quits after running tasks left in its queues.
 extern int bthread_setconcurrency(int num);
 
 // Get number of worker pthreads by tag
 extern int bthread_getconcurrency_by_tag(bthread_tag_t tag);
 
 // Set number of worker pthreads to `num' for specified tag
+// NOTE: concurrency of a tag can't be reduced by this function, which is
+// called by servers sharing the workers. Reduce it with bthread_setconcurrency
+// or -bthread_autoscale_interval_s.
 extern int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag);
 
 // Yield processor to another bthread. 
@@ -170,6 +174,13 @@ extern int bthread_setconcurrency_by_tag(int num, bthread_tag_t tag);
 // even if bthread_yield() is called, suspended threads may still starve.
 extern int bthread_yield(void);
 
+// Yield processor to another bthread if the calling bthread has been running
+// for more than -bthread_time_slice_us since it was switched in, otherwise
+// return immediately. Cheap enough to be called frequently in long
+// computations so that they don't hold up other bthreads of the worker.
+// Returns 1 if yielded, 0 otherwise (always 0 in pthreads).
+extern int bthread_maybe_yield(void);
+
 // Suspend current thread for at least `microseconds'
 // Interruptible by bthread_interrupt().
 extern int bthread_usleep(uint64_t microseconds);
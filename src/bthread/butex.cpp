@@ -37,6 +37,7 @@
 #include "bthread/timer_thread.h"
 #include "bthread/butex.h"
 #include "bthread/mutex.h"
+#include "bthread/offcpu_profiler.h"
 
 // This file implements butex.h
 // Provides futex-like semantics which is sequenced wait and wake operations
@@ -656,7 +657,9 @@ static int butex_wait_from_pthread(TaskGroup* g, Butex* b, int expected_value,
     return rc;
 }
 
-int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prepend) {
+static int butex_wait_impl(void* arg, int expected_value,
+                           const timespec* abstime, bool prepend,
+                           int offcpu_reason) {
     Butex* b = container_of(static_cast<butil::atomic<int>*>(arg), Butex, value);
     if (b->value.load(butil::memory_order_relaxed) != expected_value) {
         errno = EWOULDBLOCK;
@@ -697,12 +700,14 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prep
     num_waiters << 1;
 #endif
 
+    OffCpuWait* offcpu_wait = offcpu_wait_begin(offcpu_reason);
     // release fence matches with acquire fence in interrupt_and_consume_waiters
     // in task_group.cpp to guarantee visibility of `interrupted'.
     bbw.task_meta->current_waiter.store(&bbw, butil::memory_order_release);
     WaitForButexArgs args{ &bbw, prepend };
     g->set_remained(wait_for_butex, &args);
     TaskGroup::sched(&g);
+    offcpu_wait_end(offcpu_wait);
 
     // erase_from_butex_and_wakeup (called by TimerThread) is possibly still
     // running and using bbw. The chance is small, just spin until it's done.
@@ -738,6 +743,14 @@ int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prep
     return 0;
 }
 
+int butex_wait(void* arg, int expected_value, const timespec* abstime, bool prepend) {
+    return butex_wait_impl(arg, expected_value, abstime, prepend, OFFCPU_BUTEX);
+}
+
+int butex_wait_fd(void* arg, int expected_value, const timespec* abstime) {
+    return butex_wait_impl(arg, expected_value, abstime, false, OFFCPU_FD);
+}
+
 }  // namespace bthread
 
 namespace butil {
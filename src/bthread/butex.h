@@ -85,6 +85,10 @@ int butex_wait(void* butex, int expected_value,
                const timespec* abstime,
                bool prepend = false);
 
+// Same as butex_wait, but sampled waits are attributed to fd waits in the
+// off-cpu profiler.
+int butex_wait_fd(void* butex, int expected_value, const timespec* abstime);
+
 }  // namespace bthread
 
 #endif  // BTHREAD_BUTEX_H
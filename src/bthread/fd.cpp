@@ -265,7 +265,7 @@ public:
         }
 #endif
         while (butex->load(butil::memory_order_relaxed) == expected_val) {
-            if (butex_wait(butex, expected_val, abstime) < 0 &&
+            if (butex_wait_fd(butex, expected_val, abstime) < 0 &&
                 errno != EWOULDBLOCK && errno != EINTR) {
                 return -1;
             }
@@ -553,7 +553,6 @@ void CheckBthreadScheSafety() {
 #else
 #define ADD_TLS_PTHREAD_LOCK_COUNT ((void)0)
 #define SUB_TLS_PTHREAD_LOCK_COUNT ((void)0)
-void CheckBthreadScheSafety() {}
 #endif // BRPC_DEBUG_BTHREAD_SCHE_SAFETY
 
 // Speed up with TLS:
@@ -0,0 +1,158 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+
+#include <string.h>
+#include <unordered_map>
+#include <gflags/gflags.h>
+#include "butil/debug/stack_trace.h"
+#include "butil/macros.h"
+#include "butil/reloadable_flags.h"
+#include "butil/scoped_lock.h"
+#include "butil/synchronization/lock.h"
+#include "butil/thread_local.h"
+#include "butil/time.h"
+#include "bthread/offcpu_profiler.h"
+
+namespace bthread {
+
+DEFINE_int32(bthread_offcpu_sample_period, 16,
+             "Record one of every so many blocking waits of bthreads in "
+             "each worker when the off-cpu profiler is running");
+BUTIL_VALIDATE_GFLAG(bthread_offcpu_sample_period, butil::PositiveInteger);
+
+// Skip offcpu_wait_begin_slow() which is always on top.
+static const int SKIPPED_STACK_FRAMES = 1;
+static const int MAX_STACK_FRAMES = 32;
+// Limit memory of stacks recorded in one profiling.
+static const size_t MAX_RECORDED_STACKS = 65536;
+
+struct OffCpuWait {
+    int reason;
+    int period;
+    int64_t start_us;
+    int nframes;
+    void* stack[MAX_STACK_FRAMES];
+};
+
+struct OffCpuStat {
+    int64_t count;
+    int64_t wait_us;
+};
+
+butil::atomic<bool> g_offcpu_profiling(false);
+
+static butil::Mutex g_offcpu_mutex;
+// Keyed by the reason followed by the stack.
+static std::unordered_map<std::string, OffCpuStat>* g_offcpu_stacks = NULL;
+static BAIDU_THREAD_LOCAL int tls_offcpu_countdown = 0;
+
+const char* OffCpuReasonToString(int reason) {
+    switch (reason) {
+    case OFFCPU_BUTEX: return "butex";
+    case OFFCPU_USLEEP: return "usleep";
+    case OFFCPU_FD: return "fd";
+    }
+    return "unknown";
+}
+
+OffCpuWait* offcpu_wait_begin_slow(int reason) {
+    if (--tls_offcpu_countdown > 0) {
+        return NULL;
+    }
+    const int period = FLAGS_bthread_offcpu_sample_period;
+    tls_offcpu_countdown = period;
+    OffCpuWait* w = new (std::nothrow) OffCpuWait;
+    if (w == NULL) {
+        return NULL;
+    }
+    w->reason = reason;
+    w->period = period;
+    butil::debug::StackTrace stack(true);
+    size_t nframes = 0;
+    const void* const* addresses = stack.Addresses(&nframes);
+    w->nframes = 0;
+    for (size_t i = SKIPPED_STACK_FRAMES;
+         i < nframes && w->nframes < MAX_STACK_FRAMES; ++i) {
+        w->stack[w->nframes++] = const_cast<void*>(addresses[i]);
+    }
+    w->start_us = butil::cpuwide_time_us();
+    return w;
+}
+
+void offcpu_wait_end_slow(OffCpuWait* w) {
+    const int64_t wait_us = butil::cpuwide_time_us() - w->start_us;
+    std::string key;
+    key.reserve(sizeof(int) + sizeof(void*) * w->nframes);
+    key.append((const char*)&w->reason, sizeof(int));
+    key.append((const char*)w->stack, sizeof(void*) * w->nframes);
+    {
+        BAIDU_SCOPED_LOCK(g_offcpu_mutex);
+        // Stopped during the wait.
+        if (g_offcpu_stacks != NULL &&
+            (g_offcpu_stacks->size() < MAX_RECORDED_STACKS ||
+             g_offcpu_stacks->count(key))) {
+            OffCpuStat& stat = (*g_offcpu_stacks)[key];
+            stat.count += w->period;
+            stat.wait_us += wait_us * w->period;
+        }
+    }
+    delete w;
+}
+
+bool OffCpuProfilerStart() {
+    BAIDU_SCOPED_LOCK(g_offcpu_mutex);
+    if (g_offcpu_stacks != NULL) {
+        return false;
+    }
+    g_offcpu_stacks = new std::unordered_map<std::string, OffCpuStat>;
+    g_offcpu_profiling.store(true, butil::memory_order_relaxed);
+    return true;
+}
+
+void OffCpuProfilerStop(std::vector<OffCpuStack>* stacks) {
+    std::unordered_map<std::string, OffCpuStat>* recorded = NULL;
+    {
+        BAIDU_SCOPED_LOCK(g_offcpu_mutex);
+        g_offcpu_profiling.store(false, butil::memory_order_relaxed);
+        recorded = g_offcpu_stacks;
+        g_offcpu_stacks = NULL;
+    }
+    stacks->clear();
+    if (recorded == NULL) {
+        return;
+    }
+    stacks->reserve(recorded->size());
+    for (auto it = recorded->begin(); it != recorded->end(); ++it) {
+        const std::string& key = it->first;
+        OffCpuStack s;
+        memcpy(&s.reason, key.data(), sizeof(int));
+        s.count = it->second.count;
+        s.wait_us = it->second.wait_us;
+        s.pcs.resize((key.size() - sizeof(int)) / sizeof(void*));
+        if (!s.pcs.empty()) {
+            memcpy(&s.pcs[0], key.data() + sizeof(int),
+                   sizeof(void*) * s.pcs.size());
+        }
+        stacks->push_back(s);
+    }
+    delete recorded;
+}
+
+}  // namespace bthread
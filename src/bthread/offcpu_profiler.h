@@ -0,0 +1,80 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// bthread - An M:N threading library to make applications more concurrent.
+
+
+#ifndef BTHREAD_OFFCPU_PROFILER_H
+#define BTHREAD_OFFCPU_PROFILER_H
+
+#include <stdint.h>
+#include <vector>
+#include "butil/atomicops.h"
+
+namespace bthread {
+
+// Why a bthread was off cpu.
+enum OffCpuReason {
+    OFFCPU_BUTEX = 0,    // mutex, condition, join, RPC ...
+    OFFCPU_USLEEP = 1,   // bthread_usleep
+    OFFCPU_FD = 2,       // bthread_fd_wait/bthread_fd_timedwait
+    OFFCPU_REASON_NUM
+};
+
+const char* OffCpuReasonToString(int reason);
+
+// A blocking wait aggregated by stack.
+struct OffCpuStack {
+    int reason;
+    // Estimated number of waits and total waiting time, namely the sampled
+    // ones multiplied by -bthread_offcpu_sample_period.
+    int64_t count;
+    int64_t wait_us;
+    // Returned by backtrace(), leaf first.
+    std::vector<void*> pcs;
+};
+
+// Start recording stacks and durations of sampled blocking waits of
+// bthreads. Returns false if the profiler is already running.
+bool OffCpuProfilerStart();
+
+// Stop recording and get the waits aggregated since OffCpuProfilerStart().
+void OffCpuProfilerStop(std::vector<OffCpuStack>* stacks);
+
+struct OffCpuWait;
+extern butil::atomic<bool> g_offcpu_profiling;
+OffCpuWait* offcpu_wait_begin_slow(int reason);
+void offcpu_wait_end_slow(OffCpuWait* w);
+
+// Called by bthreads before and after being suspended. Just a relaxed load
+// when the profiler is off. Returns NULL if the wait is not sampled.
+inline OffCpuWait* offcpu_wait_begin(int reason) {
+    if (!g_offcpu_profiling.load(butil::memory_order_relaxed)) {
+        return NULL;
+    }
+    return offcpu_wait_begin_slow(reason);
+}
+
+inline void offcpu_wait_end(OffCpuWait* w) {
+    if (w != NULL) {
+        offcpu_wait_end_slow(w);
+    }
+}
+
+}  // namespace bthread
+
+#endif  // BTHREAD_OFFCPU_PROFILER_H
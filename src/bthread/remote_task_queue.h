@@ -70,6 +70,9 @@ public:
     }
 
     size_t capacity() const { return _tasks.capacity(); }
+
+    // Not locked, the result may be stale.
+    size_t volatile_size() const { return _tasks.size(); }
     
 private:
 friend class TaskGroup;
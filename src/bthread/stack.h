@@ -76,6 +76,10 @@ void return_stack(ContextualStack*);
 // Jump from stack `from' to stack `to'. `from' must be the stack of callsite
 // (to save contexts before jumping)
 void jump_stack(ContextualStack* from, ContextualStack* to);
+// Prefetch registers saved on the top of stack `s' which will be restored by
+// a following jump_stack(..., s). Issue it as early as possible so that the
+// cache misses overlap with other work before jumping.
+void prefetch_stack(const ContextualStack* s);
 
 }  // namespace bthread
 
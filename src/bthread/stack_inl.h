@@ -212,6 +212,23 @@ inline void return_stack(ContextualStack* s) {
     }
 }
 
+// Bytes of registers saved by bthread_jump_fcontext on top of the stack.
+#if defined(__aarch64__)
+static const size_t SAVED_CONTEXT_SIZE = 0xb0;
+#else
+static const size_t SAVED_CONTEXT_SIZE = 0x50;
+#endif
+
+inline void prefetch_stack(const ContextualStack* s) {
+    const char* top = static_cast<const char*>(s->context);
+    if (NULL == top) {
+        return;
+    }
+    for (size_t off = 0; off < SAVED_CONTEXT_SIZE; off += BAIDU_CACHELINE_SIZE) {
+        __builtin_prefetch(top + off, 0, 3);
+    }
+}
+
 inline void jump_stack(ContextualStack* from, ContextualStack* to) {
     bthread_jump_fcontext(&from->context, to->context, 0/*not skip remained*/);
 }
@@ -23,6 +23,7 @@
 #include "butil/scoped_lock.h"             // BAIDU_SCOPED_LOCK
 #include "butil/errno.h"                   // berror
 #include "butil/logging.h"
+#include "butil/reloadable_flags.h"
 #include "butil/threading/platform_thread.h"
 #include "butil/third_party/murmurhash3/murmurhash3.h"
 #include "bthread/sys_futex.h"            // futex_wake_private
@@ -41,11 +42,44 @@ DEFINE_int32(task_group_runqueue_capacity, 4096,
 DEFINE_int32(task_group_yield_before_idle, 0,
              "TaskGroup yields so many times before idle");
 DEFINE_int32(task_group_ntags, 1, "TaskGroup will be grouped by number ntags");
+DEFINE_int32(bthread_watchdog_interval_ms, 0,
+             "Check every so many milliseconds for bthreads running longer "
+             "than -bthread_time_slice_us without switching out and log them "
+             "with stacks if built with BRPC_BTHREAD_TRACER, 0 to disable");
+BUTIL_VALIDATE_GFLAG(bthread_watchdog_interval_ms, butil::NonNegativeInteger);
+DEFINE_int32(bthread_autoscale_interval_s, 0,
+             "Adjust number of workers of each tag every so many seconds "
+             "according to its cpu usage and delay of runqueues in the "
+             "interval, 0 to disable");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_interval_s, butil::NonNegativeInteger);
+DEFINE_int32(bthread_autoscale_min_concurrency, BTHREAD_MIN_CONCURRENCY,
+             "The autoscaler keeps at least so many workers in each tag");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_min_concurrency, butil::PositiveInteger);
+DEFINE_int32(bthread_autoscale_max_concurrency, 64,
+             "The autoscaler keeps at most so many workers in each tag");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_max_concurrency, butil::PositiveInteger);
+DEFINE_int32(bthread_autoscale_sched_delay_us, 1000,
+             "Add workers to a tag when the average delay from being ready "
+             "to running of bthreads exceeds this value");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_sched_delay_us, butil::PositiveInteger);
+DEFINE_int32(bthread_autoscale_high_usage_percent, 80,
+             "Add workers to a tag when its workers are busy for more than "
+             "this percentage of time");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_high_usage_percent, butil::PositiveInteger);
+DEFINE_int32(bthread_autoscale_low_usage_percent, 50,
+             "Remove a worker from a tag when its workers would still be busy "
+             "for less than this percentage of time without the worker");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_low_usage_percent, butil::PositiveInteger);
+DEFINE_int32(bthread_autoscale_down_checks, 3,
+             "Remove a worker from a tag only after it's found underused in so "
+             "many consecutive checks of the autoscaler");
+BUTIL_VALIDATE_GFLAG(bthread_autoscale_down_checks, butil::PositiveInteger);
 
 namespace bthread {
 
 DECLARE_int32(bthread_concurrency);
 DECLARE_int32(bthread_min_concurrency);
+DECLARE_int32(bthread_time_slice_us);
 
 extern pthread_mutex_t g_task_control_mutex;
 extern BAIDU_THREAD_LOCAL TaskGroup* tls_task_group;
@@ -109,9 +143,23 @@ void* TaskControl::worker_thread(void* arg) {
             << g->main_tid() << " idle=" << stat.cputime_ns / 1000000.0
             << "ms uptime=" << g->current_uptime_ns() / 1000000.0 << "ms";
     tls_task_group = NULL;
+    const bool retiring = g->retiring();
     g->destroy_self();
     c->_nworkers << -1;
-    c->tag_nworkers(g->tag()) << -1;
+    c->tag_nworkers(tag) << -1;
+    if (retiring) {
+        // Let the monitor join us, nothing after this.
+        BAIDU_SCOPED_LOCK(c->_modify_group_mutex);
+        auto& retired = c->_retired_workers;
+        auto it = std::find_if(retired.begin(), retired.end(), [](pthread_t t) {
+            return pthread_equal(t, pthread_self());
+        });
+        if (it != retired.end()) {
+            *it = retired.back();
+            retired.pop_back();
+            c->_quitted_workers.push_back(pthread_self());
+        }
+    }
     return NULL;
 }
 
@@ -155,6 +203,26 @@ static double get_cumulated_worker_time_from_this_with_tag(void* arg) {
     return c->get_cumulated_worker_time_with_tag(t);
 }
 
+static int64_t get_cumulated_steal_count_from_this_with_tag(void* arg) {
+    auto a = static_cast<CumulatedWithTagArgs*>(arg);
+    return a->c->get_cumulated_steal_count_with_tag(a->t);
+}
+
+static int64_t get_cumulated_steal_fail_count_from_this_with_tag(void* arg) {
+    auto a = static_cast<CumulatedWithTagArgs*>(arg);
+    return a->c->get_cumulated_steal_fail_count_with_tag(a->t);
+}
+
+static int64_t get_cumulated_park_count_from_this_with_tag(void* arg) {
+    auto a = static_cast<CumulatedWithTagArgs*>(arg);
+    return a->c->get_cumulated_park_count_with_tag(a->t);
+}
+
+static int64_t get_remote_rq_size_from_this_with_tag(void* arg) {
+    auto a = static_cast<CumulatedWithTagArgs*>(arg);
+    return a->c->get_remote_rq_size_with_tag(a->t);
+}
+
 static int64_t get_cumulated_switch_count_from_this(void *arg) {
     return static_cast<TaskControl*>(arg)->get_cumulated_switch_count();
 }
@@ -167,9 +235,12 @@ TaskControl::TaskControl()
     // NOTE: all fileds must be initialized before the vars.
     : _tagged_ngroup(FLAGS_task_group_ntags)
     , _tagged_groups(FLAGS_task_group_ntags)
+    , _tagged_retired_cputime_ns(FLAGS_task_group_ntags, 0)
+    , _tagged_nqueued(FLAGS_task_group_ntags * TASK_PRIORITY_NUM)
     , _init(false)
     , _stop(false)
     , _concurrency(0)
+    , _monitor_started(false)
     , _next_worker_id(0)
     , _nworkers("bthread_worker_count")
     , _pending_time(NULL)
@@ -183,6 +254,7 @@ TaskControl::TaskControl()
     , _signal_per_second(&_cumulated_signal_count)
     , _status(print_rq_sizes_in_the_tc, this)
     , _nbthreads("bthread_count")
+    , _last_autoscale_us(0)
     , _priority_queues(FLAGS_task_group_ntags)
     , _pl(FLAGS_task_group_ntags)
 {}
@@ -201,6 +273,10 @@ int TaskControl::init(int concurrency) {
     // task group group by tags
     for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
         _tagged_ngroup[i].store(0, std::memory_order_relaxed);
+        for (int p = 0; p < TASK_PRIORITY_NUM; ++p) {
+            _tagged_nqueued[i * TASK_PRIORITY_NUM + p].store(
+                0, std::memory_order_relaxed);
+        }
         auto tag_str = std::to_string(i);
         _tagged_nworkers.push_back(new bvar::Adder<int64_t>("bthread_worker_count", tag_str));
         _tagged_cumulated_worker_time.push_back(new bvar::PassiveStatus<double>(
@@ -208,6 +284,40 @@ int TaskControl::init(int concurrency) {
         _tagged_worker_usage_second.push_back(new bvar::PerSecond<bvar::PassiveStatus<double>>(
             "bthread_worker_usage", tag_str, _tagged_cumulated_worker_time[i], 1));
         _tagged_nbthreads.push_back(new bvar::Adder<int64_t>("bthread_count", tag_str));
+        _tagged_sched_latency.push_back(
+            new bvar::LatencyRecorder("bthread_sched", tag_str));
+        const char* const priority_names[TASK_PRIORITY_NUM] = {
+            "bthread_sched_high", "bthread_sched_normal", "bthread_sched_low" };
+        for (int j = 0; j < TASK_PRIORITY_NUM; ++j) {
+            _tagged_priority_sched_latency.push_back(
+                new bvar::LatencyRecorder(priority_names[j], tag_str));
+        }
+        _tagged_cumulated_steal_count.push_back(new bvar::PassiveStatus<int64_t>(
+            get_cumulated_steal_count_from_this_with_tag, new CumulatedWithTagArgs{this, i}));
+        _tagged_steal_second.push_back(new bvar::PerSecond<bvar::PassiveStatus<int64_t>>(
+            "bthread_steal_second", tag_str, _tagged_cumulated_steal_count[i]));
+        _tagged_cumulated_steal_fail_count.push_back(new bvar::PassiveStatus<int64_t>(
+            get_cumulated_steal_fail_count_from_this_with_tag, new CumulatedWithTagArgs{this, i}));
+        _tagged_steal_fail_second.push_back(new bvar::PerSecond<bvar::PassiveStatus<int64_t>>(
+            "bthread_steal_fail_second", tag_str, _tagged_cumulated_steal_fail_count[i]));
+        _tagged_cumulated_park_count.push_back(new bvar::PassiveStatus<int64_t>(
+            get_cumulated_park_count_from_this_with_tag, new CumulatedWithTagArgs{this, i}));
+        _tagged_park_second.push_back(new bvar::PerSecond<bvar::PassiveStatus<int64_t>>(
+            "bthread_park_second", tag_str, _tagged_cumulated_park_count[i]));
+        _tagged_nunpark.push_back(new bvar::Adder<int64_t>);
+        _tagged_unpark_second.push_back(new bvar::PerSecond<bvar::Adder<int64_t>>(
+            "bthread_unpark_second", tag_str, _tagged_nunpark[i]));
+        _tagged_remote_rq_size.push_back(new bvar::PassiveStatus<int64_t>(
+            "bthread_remote_rq_size", tag_str,
+            get_remote_rq_size_from_this_with_tag, new CumulatedWithTagArgs{this, i}));
+        _tagged_nslice_overrun.push_back(
+            new bvar::Adder<int64_t>("bthread_slice_overrun_count", tag_str));
+        _tagged_nscale_up.push_back(
+            new bvar::Adder<int64_t>("bthread_autoscale_up_count", tag_str));
+        _tagged_nscale_down.push_back(
+            new bvar::Adder<int64_t>("bthread_autoscale_down_count", tag_str));
+        _tagged_nidle_check.push_back(0);
+        _tagged_autoscale_worker_time.push_back(0);
         if (_priority_queues[i].init(BTHREAD_MAX_CONCURRENCY) != 0) {
             LOG(FATAL) << "Fail to init _priority_q";
             return -1;
@@ -237,6 +347,13 @@ int TaskControl::init(int concurrency) {
             return -1;
         }
     }
+    _last_autoscale_us = butil::cpuwide_time_us();
+    const int rc = pthread_create(&_monitor, NULL, monitor_thread, this);
+    if (rc) {
+        LOG(ERROR) << "Fail to create monitor thread: " << berror(rc);
+        return -1;
+    }
+    _monitor_started = true;
     _worker_usage_second.expose("bthread_worker_usage");
     _switch_per_second.expose("bthread_switch_second");
     _signal_per_second.expose("bthread_signal_second");
@@ -262,10 +379,14 @@ int TaskControl::add_workers(int num, bthread_tag_t tag) {
     if (num <= 0) {
         return 0;
     }
-    try {
-        _workers.resize(_concurrency + num);
-    } catch (...) {
-        return 0;
+    {
+        // Reserve so that push_back() below cannot fail.
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        try {
+            _workers.reserve(_workers.size() + num);
+        } catch (...) {
+            return 0;
+        }
     }
     const int old_concurency = _concurrency.load(butil::memory_order_relaxed);
     for (int i = 0; i < num; ++i) {
@@ -273,20 +394,96 @@ int TaskControl::add_workers(int num, bthread_tag_t tag) {
         // _concurrency before create a worker.
         _concurrency.fetch_add(1);
         auto arg = new WorkerThreadArgs(this, tag);
-        const int rc = pthread_create(
-                &_workers[i + old_concurency], NULL, worker_thread, arg);
+        pthread_t worker;
+        const int rc = pthread_create(&worker, NULL, worker_thread, arg);
         if (rc) {
             delete arg;
             PLOG(WARNING) << "Fail to create _workers[" << i + old_concurency << "]";
             _concurrency.fetch_sub(1, butil::memory_order_release);
             break;
         }
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        _workers.push_back(worker);
     }
-    // Cannot fail
-    _workers.resize(_concurrency.load(butil::memory_order_relaxed));
     return _concurrency.load(butil::memory_order_relaxed) - old_concurency;
 }
 
+int TaskControl::remove_workers(int num, bthread_tag_t tag) {
+    // Workers just created may not have added their groups yet.
+    for (int i = 0; i < 1000; ++i) {
+        size_t ngroup = 0;
+        for (size_t t = 0; t < _tagged_ngroup.size(); ++t) {
+            ngroup += tag_ngroup(t).load(butil::memory_order_relaxed);
+        }
+        if ((int)ngroup >= concurrency()) {
+            break;
+        }
+        usleep(1000);
+    }
+    std::vector<TaskGroup*> retired;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_stop) {
+            return 0;
+        }
+        auto& groups = tag_group(tag);
+        size_t ngroup = tag_ngroup(tag).load(butil::memory_order_relaxed);
+        while ((int)retired.size() < num && ngroup > 1) {
+            // Prefer workers running their main tasks, which are idle
+            // probably. The current task is changed by the worker without
+            // synchronization, but it's just a hint.
+            size_t victim = ngroup - 1;
+            for (size_t i = 0; i < ngroup; ++i) {
+                if (groups[i]->is_current_main_task()) {
+                    victim = i;
+                    break;
+                }
+            }
+            TaskGroup* g = groups[victim];
+            // See comments in _destroy_group. Nobody can steal tasks from
+            // `g' after this, so the worker has to run tasks left in its
+            // queues before quitting, and push_rq() puts new tasks into
+            // other groups.
+            groups[victim] = groups[ngroup - 1];
+            tag_ngroup(tag).store(--ngroup, butil::memory_order_release);
+            g->_retiring.store(true, butil::memory_order_release);
+            // Keep the cumulated worker time monotonic, time spent on
+            // running the remaining tasks is not counted.
+            _tagged_retired_cputime_ns[tag] += g->_cumulated_cputime_ns;
+            retired.push_back(g);
+            for (size_t i = 0; i < _workers.size(); ++i) {
+                if (pthread_equal(_workers[i], g->_worker)) {
+                    _workers[i] = _workers.back();
+                    _workers.pop_back();
+                    _retired_workers.push_back(g->_worker);
+                    break;
+                }
+            }
+        }
+    }
+    for (TaskGroup* g : retired) {
+        _concurrency.fetch_sub(1, butil::memory_order_release);
+        // Wake up the worker if it's parked. ParkingLot can't wake up a
+        // specific waiter, wake up all.
+        g->_pl->signal(BTHREAD_MAX_CONCURRENCY);
+    }
+    return retired.size();
+}
+
+void TaskControl::requeue_tasks_of(TaskGroup* g) {
+    bthread_t tid;
+    while (g->_remote_rq.pop(&tid) ||
+           g->steal_prioritized(TASK_PRIORITY_HIGH, &tid) ||
+           g->_rq.steal(&tid) ||
+           g->steal_prioritized(TASK_PRIORITY_LOW, &tid)) {
+        if (tag_ngroup(g->tag()).load(butil::memory_order_acquire) == 0) {
+            // Stopping.
+            return;
+        }
+        choose_one_group(g->tag())->ready_to_run_remote(TaskGroup::address_meta(tid));
+    }
+}
+
 TaskGroup* TaskControl::choose_one_group(bthread_tag_t tag) {
     CHECK(tag >= BTHREAD_TAG_DEFAULT && tag < FLAGS_task_group_ntags);
     auto& groups = tag_group(tag);
@@ -323,13 +520,30 @@ void TaskControl::stop_and_join() {
             _tagged_ngroup.begin(), _tagged_ngroup.end(),
             [](butil::atomic<size_t>& index) { index.store(0, butil::memory_order_relaxed); });
     }
+    // Join the monitor before touching _workers which may be modified by the
+    // autoscaler.
+    if (_monitor_started) {
+        pthread_join(_monitor, NULL);
+        _monitor_started = false;
+    }
     for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
         for (auto& pl : _pl[i]) {
             pl.stop();
         }
     }
 
-    for (auto worker: _workers) {
+    std::vector<pthread_t> workers;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        workers.swap(_workers);
+        workers.insert(workers.end(), _retired_workers.begin(),
+                       _retired_workers.end());
+        _retired_workers.clear();
+        workers.insert(workers.end(), _quitted_workers.begin(),
+                       _quitted_workers.end());
+        _quitted_workers.clear();
+    }
+    for (auto worker: workers) {
         // Interrupt blocking operations.
 #ifdef BRPC_BTHREAD_TRACER
         // TaskTracer has registered signal handler for SIGURG.
@@ -339,11 +553,148 @@ void TaskControl::stop_and_join() {
 #endif // BRPC_BTHREAD_TRACER
     }
     // Join workers
-    for (auto worker : _workers) {
+    for (auto worker : workers) {
         pthread_join(worker, NULL);
     }
 }
 
+void* TaskControl::monitor_thread(void* arg) {
+    butil::PlatformThread::SetName("bthread_monitor");
+    TaskControl* c = static_cast<TaskControl*>(arg);
+    int64_t last_watchdog_us = butil::cpuwide_time_us();
+    int64_t last_autoscale_us = last_watchdog_us;
+    while (true) {
+        // Sleep at most 100ms each time to notice changes of the flags and
+        // stopping of TaskControl in time.
+        const int watchdog_ms = FLAGS_bthread_watchdog_interval_ms;
+        usleep((watchdog_ms > 0 && watchdog_ms < 100 ? watchdog_ms : 100) * 1000L);
+        {
+            BAIDU_SCOPED_LOCK(c->_modify_group_mutex);
+            if (c->_stop) {
+                break;
+            }
+        }
+        const int64_t now_us = butil::cpuwide_time_us();
+        if (watchdog_ms > 0 && now_us - last_watchdog_us >= watchdog_ms * 1000L) {
+            last_watchdog_us = now_us;
+            c->report_long_running_tasks(FLAGS_bthread_time_slice_us * 1000L);
+        }
+        const int autoscale_s = FLAGS_bthread_autoscale_interval_s;
+        if (autoscale_s > 0 &&
+            now_us - last_autoscale_us >= autoscale_s * 1000000L) {
+            last_autoscale_us = now_us;
+            c->autoscale(autoscale_s);
+        }
+        c->join_quitted_workers();
+    }
+    return NULL;
+}
+
+void TaskControl::join_quitted_workers() {
+    std::vector<pthread_t> quitted;
+    {
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        if (_quitted_workers.empty()) {
+            return;
+        }
+        quitted.swap(_quitted_workers);
+    }
+    for (auto worker : quitted) {
+        pthread_join(worker, NULL);
+    }
+}
+
+void TaskControl::autoscale(int interval_s) {
+    BAIDU_SCOPED_LOCK(g_task_control_mutex);
+    const int64_t now_us = butil::cpuwide_time_us();
+    const double elapsed_s = std::max(now_us - _last_autoscale_us, (int64_t)1) / 1000000.0;
+    _last_autoscale_us = now_us;
+    for (int tag = 0; tag < FLAGS_task_group_ntags; ++tag) {
+        // Both are averaged in the interval.
+        const double worker_time = get_cumulated_worker_time_with_tag(tag);
+        const double usage =
+            (worker_time - _tagged_autoscale_worker_time[tag]) / elapsed_s;
+        _tagged_autoscale_worker_time[tag] = worker_time;
+        const int n = concurrency(tag);
+        if (n <= 0) {
+            continue;
+        }
+        const int64_t delay_us = tag_sched_latency(tag).latency(interval_s);
+        if (delay_us > FLAGS_bthread_autoscale_sched_delay_us ||
+            usage * 100 > n * FLAGS_bthread_autoscale_high_usage_percent) {
+            _tagged_nidle_check[tag] = 0;
+            const int num = std::min(std::max(n / 4, 1),
+                                     FLAGS_bthread_autoscale_max_concurrency - n);
+            if (num <= 0) {
+                continue;
+            }
+            const int added = add_workers(num, tag);
+            FLAGS_bthread_concurrency += added;
+            *_tagged_nscale_up[tag] << added;
+            LOG(INFO) << "Added " << added << " workers to tag=" << tag
+                      << " which had " << n << " workers, usage=" << usage
+                      << " sched_delay=" << delay_us << "us";
+        } else if (delay_us < FLAGS_bthread_autoscale_sched_delay_us &&
+                   // Still underused without one worker, so that the
+                   // worker is not added back soon.
+                   usage * 100 < (n - 1) * FLAGS_bthread_autoscale_low_usage_percent &&
+                   n > FLAGS_bthread_autoscale_min_concurrency &&
+                   concurrency() > BTHREAD_MIN_CONCURRENCY) {
+            if (++_tagged_nidle_check[tag] < FLAGS_bthread_autoscale_down_checks) {
+                continue;
+            }
+            _tagged_nidle_check[tag] = 0;
+            const int removed = remove_workers(1, tag);
+            FLAGS_bthread_concurrency -= removed;
+            *_tagged_nscale_down[tag] << removed;
+            LOG(INFO) << "Removed " << removed << " workers from tag=" << tag
+                      << " which had " << n << " workers, usage=" << usage
+                      << " sched_delay=" << delay_us << "us";
+        } else {
+            _tagged_nidle_check[tag] = 0;
+        }
+    }
+}
+
+void TaskControl::report_long_running_tasks(int64_t slice_ns) {
+    for (size_t tag = 0; tag < _tagged_groups.size(); ++tag) {
+        const size_t ngroup = tag_ngroup(tag).load(butil::memory_order_acquire);
+        auto& groups = tag_group(tag);
+        for (size_t i = 0; i < ngroup; ++i) {
+            TaskGroup* g = groups[i];
+            if (NULL == g) {
+                continue;
+            }
+            // The worker switches tasks without synchronizing with us. Skip
+            // the group if a task was switched in during reading, it will be
+            // checked next time.
+            const int64_t last_run_ns = *(volatile int64_t*)&g->_last_run_ns;
+            const TaskMeta* m = *(TaskMeta* volatile*)&g->_cur_meta;
+            const bthread_t tid = m->tid;
+            if (last_run_ns != *(volatile int64_t*)&g->_last_run_ns ||
+                tid == g->main_tid() ||
+                last_run_ns == g->_watchdog_reported_run_ns) {
+                continue;
+            }
+            const int64_t run_ns = butil::cpuwide_time_ns() - last_run_ns;
+            if (run_ns < slice_ns) {
+                continue;
+            }
+            // Report once for each run.
+            g->_watchdog_reported_run_ns = last_run_ns;
+            LOG(WARNING) << "bthread=" << tid << " has been running for "
+                         << run_ns / 1000000 << "ms without switching out, "
+                         << "holding up worker=" << g->tid() << " of tag="
+                         << tag
+#ifdef BRPC_BTHREAD_TRACER
+                         << ", stack:\n" << _task_tracer.Trace(tid);
+#else
+                         ;
+#endif // BRPC_BTHREAD_TRACER
+        }
+    }
+}
+
 TaskControl::~TaskControl() {
     // NOTE: g_task_control is not destructed now because the situation
     //       is extremely racy.
@@ -382,6 +733,19 @@ void TaskControl::delete_task_group(void* arg) {
     delete(TaskGroup*)arg;
 }
 
+struct RetiredGroup {
+    TaskControl* c;
+    TaskGroup* g;
+};
+
+void TaskControl::delete_retired_task_group(void* arg) {
+    RetiredGroup* r = static_cast<RetiredGroup*>(arg);
+    // Tasks pushed by ones choosing the group before it was removed.
+    r->c->requeue_tasks_of(r->g);
+    delete r->g;
+    delete r;
+}
+
 int TaskControl::_destroy_group(TaskGroup* g) {
     if (NULL == g) {
         LOG(ERROR) << "Param[g] is NULL";
@@ -424,7 +788,13 @@ int TaskControl::_destroy_group(TaskGroup* g) {
     // access the removed group concurrently. We use simple strategy here:
     // Schedule a function which deletes the TaskGroup after
     // FLAGS_task_group_delete_delay seconds
-    if (erased) {
+    if (g->retiring()) {
+        // Removed by remove_workers() already.
+        requeue_tasks_of(g);
+        get_global_timer_thread()->schedule(
+            delete_retired_task_group, new RetiredGroup{this, g},
+            butil::microseconds_from_now(FLAGS_task_group_delete_delay * 1000000L));
+    } else if (erased) {
         get_global_timer_thread()->schedule(
             delete_task_group, g,
             butil::microseconds_from_now(FLAGS_task_group_delete_delay * 1000000L));
@@ -450,17 +820,29 @@ bool TaskControl::steal_task(bthread_t* tid, size_t* seed, size_t offset) {
     bool stolen = false;
     size_t s = *seed;
     auto& groups = tag_group(tag);
-    for (size_t i = 0; i < ngroup; ++i, s += offset) {
-        TaskGroup* g = groups[s % ngroup];
-        // g is possibly NULL because of concurrent _destroy_group
-        if (g) {
-            if (g->_rq.steal(tid)) {
-                stolen = true;
-                break;
-            }
-            if (g->_remote_rq.pop(tid)) {
-                stolen = true;
-                break;
+    // Look for higher priorities in all groups first. Tasks pushed by
+    // non-workers are treated as ones without priority.
+    for (int p = TASK_PRIORITY_HIGH; !stolen && p < TASK_PRIORITY_NUM; ++p) {
+        const TaskPriority priority = (TaskPriority)p;
+        if (priority != TASK_PRIORITY_NORMAL && !has_queued_task(tag, priority)) {
+            // Don't scan all groups for the levels without tasks, which are
+            // never used by most programs.
+            continue;
+        }
+        s = *seed;
+        for (size_t i = 0; i < ngroup; ++i, s += offset) {
+            TaskGroup* g = groups[s % ngroup];
+            // g is possibly NULL because of concurrent _destroy_group
+            if (g) {
+                if (priority == TASK_PRIORITY_NORMAL ? g->_rq.steal(tid) :
+                    g->steal_prioritized(priority, tid)) {
+                    stolen = true;
+                    break;
+                }
+                if (priority == TASK_PRIORITY_NORMAL && g->_remote_rq.pop(tid)) {
+                    stolen = true;
+                    break;
+                }
             }
         }
     }
@@ -481,15 +863,21 @@ void TaskControl::signal_task(int num_task, bthread_tag_t tag) {
     }
     auto& pl = tag_pl(tag);
     int start_index = butil::fmix64(pthread_numeric_id()) % PARKING_LOT_NUM;
-    num_task -= pl[start_index].signal(1);
+    int nwakeup = pl[start_index].signal(1);
+    num_task -= nwakeup;
     if (num_task > 0) {
         for (int i = 1; i < PARKING_LOT_NUM && num_task > 0; ++i) {
             if (++start_index >= PARKING_LOT_NUM) {
                 start_index = 0;
             }
-            num_task -= pl[start_index].signal(1);
+            const int n = pl[start_index].signal(1);
+            num_task -= n;
+            nwakeup += n;
         }
     }
+    if (nwakeup > 0) {
+        *_tagged_nunpark[tag] << nwakeup;
+    }
     if (num_task > 0 &&
         FLAGS_bthread_min_concurrency > 0 &&    // test min_concurrency for performance
         _concurrency.load(butil::memory_order_relaxed) < FLAGS_bthread_concurrency) {
@@ -513,7 +901,7 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
         // ngroup < _ngroup: just ignore _groups[_ngroup ... ngroup-1]
         int i = 0;
         for_each_task_group([&](TaskGroup* g) {
-            nums[i] = (g ? g->_rq.volatile_size() : 0);
+            nums[i] = (g ? g->rq_size() : 0);
             ++i;
         });
     }
@@ -522,6 +910,52 @@ void TaskControl::print_rq_sizes(std::ostream& os) {
     }
 }
 
+void TaskControl::print_sched_stats(std::ostream& os) {
+    if (!_init.load(butil::memory_order_acquire)) {
+        os << "TaskControl is not initialized";
+        return;
+    }
+    for (int i = 0; i < FLAGS_task_group_ntags; ++i) {
+        bvar::LatencyRecorder& sched_latency = tag_sched_latency(i);
+        os << "[tag=" << i << "]\n"
+           << "worker_count: " << tag_nworkers(i).get_value() << '\n'
+           << "bthread_count: " << tag_nbthreads(i).get_value() << '\n'
+           << "worker_usage: " << _tagged_worker_usage_second[i]->get_value() << '\n'
+           << "sched_latency(us): avg=" << sched_latency.latency()
+           << " p90=" << sched_latency.latency_percentile(0.9)
+           << " p99=" << sched_latency.latency_percentile(0.99)
+           << " p999=" << sched_latency.latency_percentile(0.999)
+           << " max=" << sched_latency.max_latency()
+           << " sampled=" << sched_latency.count() << '\n';
+        const char* const priority_names[TASK_PRIORITY_NUM] = {
+            "high", "normal", "low" };
+        for (int j = 0; j < TASK_PRIORITY_NUM; ++j) {
+            bvar::LatencyRecorder& lr = tag_sched_latency(i, (TaskPriority)j);
+            os << "sched_latency_" << priority_names[j] << "(us): avg="
+               << lr.latency() << " p99=" << lr.latency_percentile(0.99)
+               << " max=" << lr.max_latency() << " sampled=" << lr.count()
+               << '\n';
+        }
+        os
+           << "steal_second: " << _tagged_steal_second[i]->get_value() << '\n'
+           << "steal_fail_second: " << _tagged_steal_fail_second[i]->get_value() << '\n'
+           << "park_second: " << _tagged_park_second[i]->get_value() << '\n'
+           << "unpark_second: " << _tagged_unpark_second[i]->get_value() << '\n'
+           << "priority_rq_size: " << _priority_queues[i].volatile_size() << '\n';
+        BAIDU_SCOPED_LOCK(_modify_group_mutex);
+        const size_t ngroup = tag_ngroup(i).load(butil::memory_order_relaxed);
+        auto& groups = tag_group(i);
+        os << "rq_size(local/remote):";
+        for (size_t j = 0; j < ngroup; ++j) {
+            if (groups[j]) {
+                os << ' ' << groups[j]->rq_size() << '/'
+                   << groups[j]->remote_rq_size();
+            }
+        }
+        os << "\n\n";
+    }
+}
+
 double TaskControl::get_cumulated_worker_time() {
     int64_t cputime_ns = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
@@ -530,12 +964,16 @@ double TaskControl::get_cumulated_worker_time() {
             cputime_ns += g->_cumulated_cputime_ns;
         }
     });
+    for (size_t i = 0; i < _tagged_retired_cputime_ns.size(); ++i) {
+        cputime_ns += _tagged_retired_cputime_ns[i];
+    }
     return cputime_ns / 1000000000.0;
 }
 
 double TaskControl::get_cumulated_worker_time_with_tag(bthread_tag_t tag) {
     int64_t cputime_ns = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    cputime_ns += _tagged_retired_cputime_ns[tag];
     const size_t ngroup = tag_ngroup(tag).load(butil::memory_order_relaxed);
     auto& groups = tag_group(tag);
     for (size_t i = 0; i < ngroup; ++i) {
@@ -546,6 +984,30 @@ double TaskControl::get_cumulated_worker_time_with_tag(bthread_tag_t tag) {
     return cputime_ns / 1000000000.0;
 }
 
+int64_t TaskControl::get_cumulated_steal_count_with_tag(bthread_tag_t tag) {
+    return sum_of_task_groups_with_tag(tag, [](TaskGroup* g) {
+        return (int64_t)g->_nsteal;
+    });
+}
+
+int64_t TaskControl::get_cumulated_steal_fail_count_with_tag(bthread_tag_t tag) {
+    return sum_of_task_groups_with_tag(tag, [](TaskGroup* g) {
+        return (int64_t)g->_nsteal_fail;
+    });
+}
+
+int64_t TaskControl::get_cumulated_park_count_with_tag(bthread_tag_t tag) {
+    return sum_of_task_groups_with_tag(tag, [](TaskGroup* g) {
+        return (int64_t)g->_npark;
+    });
+}
+
+int64_t TaskControl::get_remote_rq_size_with_tag(bthread_tag_t tag) {
+    return sum_of_task_groups_with_tag(tag, [](TaskGroup* g) {
+        return (int64_t)g->remote_rq_size();
+    });
+}
+
 int64_t TaskControl::get_cumulated_switch_count() {
     int64_t c = 0;
     BAIDU_SCOPED_LOCK(_modify_group_mutex);
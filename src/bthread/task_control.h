@@ -78,8 +78,16 @@ public:
 
     void print_rq_sizes(std::ostream& os);
 
+    // Print scheduling statistics of each tag and runqueue sizes of each
+    // group, shown in /bthreads.
+    void print_sched_stats(std::ostream& os);
+
     double get_cumulated_worker_time();
     double get_cumulated_worker_time_with_tag(bthread_tag_t tag);
+    int64_t get_cumulated_steal_count_with_tag(bthread_tag_t tag);
+    int64_t get_cumulated_steal_fail_count_with_tag(bthread_tag_t tag);
+    int64_t get_cumulated_park_count_with_tag(bthread_tag_t tag);
+    int64_t get_remote_rq_size_with_tag(bthread_tag_t tag);
     int64_t get_cumulated_switch_count();
     int64_t get_cumulated_signal_count();
 
@@ -87,6 +95,13 @@ public:
     // Return the number of workers actually added, which may be less than |num|
     int add_workers(int num, bthread_tag_t tag);
 
+    // [Not thread safe] Ask `num' workers of `tag' to quit, at least one
+    // worker is kept. Idle workers are preferred. A worker stops taking new
+    // tasks immediately and quits after running tasks left in its queues,
+    // tasks pushed to it afterwards are moved to other workers.
+    // Return the number of workers actually removed.
+    int remove_workers(int num, bthread_tag_t tag);
+
     // Choose one TaskGroup (randomly right now).
     // If this method is called after init(), it never returns NULL.
     TaskGroup* choose_one_group(bthread_tag_t tag);
@@ -101,6 +116,34 @@ public:
         _priority_queues[tag].push(tid);
     }
 
+    // Number of bthreads in local runqueues of `priority' of all workers of
+    // `tag', maintained only for priorities other than TASK_PRIORITY_NORMAL
+    // so that steal_task() can skip the levels never used.
+    void add_queued_task(bthread_tag_t tag, TaskPriority priority, int64_t n) {
+        _tagged_nqueued[tag * TASK_PRIORITY_NUM + priority].fetch_add(
+            n, butil::memory_order_relaxed);
+    }
+    bool has_queued_task(bthread_tag_t tag, TaskPriority priority) const {
+        return _tagged_nqueued[tag * TASK_PRIORITY_NUM + priority].load(
+            butil::memory_order_relaxed) > 0;
+    }
+
+    // Time from being put into a runqueue to running of sampled bthreads.
+    bvar::LatencyRecorder& tag_sched_latency(bthread_tag_t tag) {
+        return *_tagged_sched_latency[tag];
+    }
+    // Same as above, but only of bthreads of `priority'.
+    bvar::LatencyRecorder& tag_sched_latency(bthread_tag_t tag,
+                                             TaskPriority priority) {
+        return *_tagged_priority_sched_latency[tag * TASK_PRIORITY_NUM + priority];
+    }
+
+    // Times of bthreads running longer than -bthread_time_slice_us without
+    // switching out.
+    bvar::Adder<int64_t>& tag_slice_overrun(bthread_tag_t tag) {
+        return *_tagged_nslice_overrun[tag];
+    }
+
 private:
     typedef std::array<TaskGroup*, BTHREAD_MAX_CONCURRENCY> TaggedGroups;
     static const int PARKING_LOT_NUM = 4;
@@ -123,9 +166,25 @@ private:
 
     static void* worker_thread(void* task_control);
 
+    // Check for bthreads that hold their workers for too long every
+    // -bthread_watchdog_interval_ms milliseconds and adjust concurrency of
+    // tags every -bthread_autoscale_interval_s seconds.
+    static void* monitor_thread(void* task_control);
+    void report_long_running_tasks(int64_t slice_ns);
+    void autoscale(int interval_s);
+
+    // Move tasks left in `g' whose worker quitted to other groups.
+    void requeue_tasks_of(TaskGroup* g);
+    static void delete_retired_task_group(void* arg);
+    // Join retired workers which quitted.
+    void join_quitted_workers();
+
     template <typename F>
     void for_each_task_group(F const& f);
 
+    template <typename F>
+    int64_t sum_of_task_groups_with_tag(bthread_tag_t tag, F const& f);
+
     bvar::LatencyRecorder& exposed_pending_time();
     bvar::LatencyRecorder* create_exposed_pending_time();
     bvar::Adder<int64_t>& tag_nworkers(bthread_tag_t tag);
@@ -133,12 +192,24 @@ private:
 
     std::vector<butil::atomic<size_t>> _tagged_ngroup;
     std::vector<TaggedGroups> _tagged_groups;
+    // Active time of workers removed by remove_workers().
+    std::vector<int64_t> _tagged_retired_cputime_ns;
+    // Indexed by tag * TASK_PRIORITY_NUM + priority.
+    std::vector<butil::atomic<int64_t>> _tagged_nqueued;
     butil::Mutex _modify_group_mutex;
 
     butil::atomic<bool> _init;  // if not init, bvar will case coredump
     bool _stop;
     butil::atomic<int> _concurrency;
+    // Workers are in one of the lists below until being joined, all
+    // protected by _modify_group_mutex.
     std::vector<pthread_t> _workers;
+    // Removed by remove_workers() and quitting after running tasks left.
+    std::vector<pthread_t> _retired_workers;
+    // Retired workers which quitted, joined by the monitor.
+    std::vector<pthread_t> _quitted_workers;
+    pthread_t _monitor;
+    bool _monitor_started;
     butil::atomic<int> _next_worker_id;
 
     bvar::Adder<int64_t> _nworkers;
@@ -157,6 +228,28 @@ private:
     std::vector<bvar::PassiveStatus<double>*> _tagged_cumulated_worker_time;
     std::vector<bvar::PerSecond<bvar::PassiveStatus<double>>*> _tagged_worker_usage_second;
     std::vector<bvar::Adder<int64_t>*> _tagged_nbthreads;
+    std::vector<bvar::LatencyRecorder*> _tagged_sched_latency;
+    std::vector<bvar::LatencyRecorder*> _tagged_priority_sched_latency;
+    std::vector<bvar::PassiveStatus<int64_t>*> _tagged_cumulated_steal_count;
+    std::vector<bvar::PerSecond<bvar::PassiveStatus<int64_t>>*> _tagged_steal_second;
+    std::vector<bvar::PassiveStatus<int64_t>*> _tagged_cumulated_steal_fail_count;
+    std::vector<bvar::PerSecond<bvar::PassiveStatus<int64_t>>*> _tagged_steal_fail_second;
+    std::vector<bvar::PassiveStatus<int64_t>*> _tagged_cumulated_park_count;
+    std::vector<bvar::PerSecond<bvar::PassiveStatus<int64_t>>*> _tagged_park_second;
+    // Workers woken up by signal_task().
+    std::vector<bvar::Adder<int64_t>*> _tagged_nunpark;
+    std::vector<bvar::PerSecond<bvar::Adder<int64_t>>*> _tagged_unpark_second;
+    std::vector<bvar::PassiveStatus<int64_t>*> _tagged_remote_rq_size;
+    std::vector<bvar::Adder<int64_t>*> _tagged_nslice_overrun;
+    // Workers added and removed by the autoscaler.
+    std::vector<bvar::Adder<int64_t>*> _tagged_nscale_up;
+    std::vector<bvar::Adder<int64_t>*> _tagged_nscale_down;
+    // Consecutive checks of the autoscaler finding a tag underused.
+    std::vector<int> _tagged_nidle_check;
+    // Cumulated worker time of tags and the time at the last check of the
+    // autoscaler, to get usages in the interval.
+    std::vector<double> _tagged_autoscale_worker_time;
+    int64_t _last_autoscale_us;
     std::vector<WorkStealingQueue<bthread_t>> _priority_queues;
 
     std::vector<TaggedParkingLot> _pl;
@@ -197,6 +290,21 @@ inline void TaskControl::for_each_task_group(F const& f) {
     }
 }
 
+template <typename F>
+inline int64_t TaskControl::sum_of_task_groups_with_tag(bthread_tag_t tag,
+                                                        F const& f) {
+    int64_t sum = 0;
+    BAIDU_SCOPED_LOCK(_modify_group_mutex);
+    const size_t ngroup = tag_ngroup(tag).load(butil::memory_order_relaxed);
+    auto& groups = tag_group(tag);
+    for (size_t i = 0; i < ngroup; ++i) {
+        if (groups[i]) {
+            sum += f(groups[i]);
+        }
+    }
+    return sum;
+}
+
 }  // namespace bthread
 
 #endif  // BTHREAD_TASK_CONTROL_H
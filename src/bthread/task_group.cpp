@@ -36,6 +36,7 @@
 #include "bthread/task_control.h"
 #include "bthread/task_group.h"
 #include "bthread/timer_thread.h"
+#include "bthread/offcpu_profiler.h"
 
 namespace bthread {
 
@@ -54,6 +55,26 @@ DEFINE_bool(bthread_enable_cpu_clock_stat, false,
             "Enable CPU clock statistics for bthread");
 BUTIL_VALIDATE_GFLAG(bthread_enable_cpu_clock_stat, butil::PassValidate);
 
+DEFINE_int32(bthread_sched_latency_sample_period, 32,
+             "Record the time from being ready to running of one of every so "
+             "many bthreads put into runqueues by each thread in "
+             "/vars/bthread_sched_<tag>_latency, 0 to disable");
+BUTIL_VALIDATE_GFLAG(bthread_sched_latency_sample_period,
+                     butil::NonNegativeInteger);
+
+DEFINE_int32(bthread_priority_starvation_period, 16,
+             "One of every so many pops from local runqueues of a worker "
+             "prefers lower priorities so that they're not starved by "
+             "bthreads with BTHREAD_PRIORITY_HIGH");
+BUTIL_VALIDATE_GFLAG(bthread_priority_starvation_period, butil::PositiveInteger);
+
+DEFINE_int32(bthread_time_slice_us, 10000,
+             "A bthread running longer than this without switching out holds "
+             "up other bthreads of its worker. Such runs are counted in "
+             "/vars/bthread_slice_overrun_count_<tag> and bthread_maybe_yield() "
+             "yields after so many microseconds");
+BUTIL_VALIDATE_GFLAG(bthread_time_slice_us, butil::PositiveInteger);
+
 BAIDU_VOLATILE_THREAD_LOCAL(TaskGroup*, tls_task_group, NULL);
 // Sync with TaskMeta::local_storage when a bthread is created or destroyed.
 // During running, the two fields may be inconsistent, use tls_bls as the
@@ -67,7 +88,7 @@ extern void return_keytable(bthread_keytable_pool_t*, KeyTable*);
 // overhead of creation keytable, may be removed later.
 BAIDU_VOLATILE_THREAD_LOCAL(void*, tls_unique_user_ptr, NULL);
 
-const TaskStatistics EMPTY_STAT = { 0, 0, 0 };
+const TaskStatistics EMPTY_STAT = { 0, 0, 0, 0 };
 
 const size_t OFFSET_TABLE[] = {
 #include "bthread/offset_inl.list"
@@ -127,6 +148,10 @@ bool TaskGroup::wait_task(bthread_t* tid) {
         if (_last_pl_state.stopped()) {
             return false;
         }
+        if (_retiring.load(butil::memory_order_acquire)) {
+            return pop_rq(tid) || _remote_rq.pop(tid);
+        }
+        ++_npark;
         _pl->wait(_last_pl_state);
         if (steal_task(tid)) {
             return true;
@@ -136,9 +161,13 @@ bool TaskGroup::wait_task(bthread_t* tid) {
         if (st.stopped()) {
             return false;
         }
+        if (_retiring.load(butil::memory_order_acquire)) {
+            return pop_rq(tid) || _remote_rq.pop(tid);
+        }
         if (steal_task(tid)) {
             return true;
         }
+        ++_npark;
         _pl->wait(st);
 #endif
     } while (true);
@@ -187,18 +216,25 @@ TaskGroup::TaskGroup(TaskControl* c)
     , _last_run_ns(butil::cpuwide_time_ns())
     , _cumulated_cputime_ns(0)
     , _nswitch(0)
+    , _nsteal(0)
+    , _nsteal_fail(0)
+    , _npark(0)
     , _last_context_remained(NULL)
     , _last_context_remained_arg(NULL)
     , _pl(NULL)
     , _main_stack(NULL)
     , _main_tid(0)
+    , _npop_since_aging(0)
     , _remote_num_nosignal(0)
     , _remote_nsignaled(0)
 #ifndef NDEBUG
     , _sched_recursive_guard(0)
 #endif
     , _tag(BTHREAD_TAG_DEFAULT)
-    , _tid(-1) {
+    , _tid(-1)
+    , _worker(pthread_self())
+    , _retiring(false)
+    , _watchdog_reported_run_ns(0) {
     _steal_seed = butil::fast_rand();
     _steal_offset = OFFSET_TABLE[_steal_seed % ARRAY_SIZE(OFFSET_TABLE)];
     CHECK(c);
@@ -246,6 +282,12 @@ int TaskGroup::init(size_t runqueue_capacity) {
         LOG(FATAL) << "Fail to init _rq";
         return -1;
     }
+    // Bthreads with priorities are usually less than others.
+    if (_high_rq.init(runqueue_capacity / 2) != 0 ||
+        _low_rq.init(runqueue_capacity / 2) != 0) {
+        LOG(FATAL) << "Fail to init _high_rq or _low_rq";
+        return -1;
+    }
     if (_remote_rq.init(runqueue_capacity / 2) != 0) {
         LOG(FATAL) << "Fail to init _remote_rq";
         return -1;
@@ -603,18 +645,52 @@ TaskStatistics TaskGroup::main_stat() const {
     return m ? m->stat : EMPTY_STAT;
 }
 
-void TaskGroup::ending_sched(TaskGroup** pg) {
-    TaskGroup* g = *pg;
-    bthread_t next_tid = 0;
-    // Find next task to run, if none, switch to idle thread of the group.
+static inline bool pop_local(WorkStealingQueue<bthread_t>& rq, bthread_t* tid) {
+    // Skip empty runqueues of other priorities without the fence in pop().
+    if (rq.volatile_size() == 0) {
+        return false;
+    }
 #ifndef BTHREAD_FAIR_WSQ
     // When BTHREAD_FAIR_WSQ is defined, profiling shows that cpu cost of
     // WSQ::steal() in example/multi_threaded_echo_c++ changes from 1.9%
     // to 2.9%
-    const bool popped = g->_rq.pop(&next_tid);
+    return rq.pop(tid);
 #else
-    const bool popped = g->_rq.steal(&next_tid);
+    return rq.steal(tid);
 #endif
+}
+
+bool TaskGroup::pop_prioritized(TaskPriority priority, bthread_t* tid) {
+    if (pop_local(rq_of(priority), tid)) {
+        _control->add_queued_task(_tag, priority, -1);
+        return true;
+    }
+    return false;
+}
+
+bool TaskGroup::steal_prioritized(TaskPriority priority, bthread_t* tid) {
+    if (rq_of(priority).steal(tid)) {
+        _control->add_queued_task(_tag, priority, -1);
+        return true;
+    }
+    return false;
+}
+
+bool TaskGroup::pop_rq(bthread_t* tid) {
+    if (++_npop_since_aging >= FLAGS_bthread_priority_starvation_period) {
+        _npop_since_aging = 0;
+        return pop_prioritized(TASK_PRIORITY_LOW, tid) || pop_local(_rq, tid) ||
+            pop_prioritized(TASK_PRIORITY_HIGH, tid);
+    }
+    return pop_prioritized(TASK_PRIORITY_HIGH, tid) || pop_local(_rq, tid) ||
+        pop_prioritized(TASK_PRIORITY_LOW, tid);
+}
+
+void TaskGroup::ending_sched(TaskGroup** pg) {
+    TaskGroup* g = *pg;
+    bthread_t next_tid = 0;
+    // Find next task to run, if none, switch to idle thread of the group.
+    const bool popped = g->pop_rq(&next_tid);
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
@@ -655,11 +731,7 @@ void TaskGroup::sched(TaskGroup** pg) {
     TaskGroup* g = *pg;
     bthread_t next_tid = 0;
     // Find next task to run, if none, switch to idle thread of the group.
-#ifndef BTHREAD_FAIR_WSQ
-    const bool popped = g->_rq.pop(&next_tid);
-#else
-    const bool popped = g->_rq.steal(&next_tid);
-#endif
+    const bool popped = g->pop_rq(&next_tid);
     if (!popped && !g->steal_task(&next_tid)) {
         // Jump to main task if there's no task to run.
         next_tid = g->_main_tid;
@@ -667,8 +739,6 @@ void TaskGroup::sched(TaskGroup** pg) {
     sched_to(pg, next_tid);
 }
 
-extern void CheckBthreadScheSafety();
-
 void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta, bool cur_ending) {
     TaskGroup* g = *pg;
 #ifndef NDEBUG
@@ -682,6 +752,11 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta, bool cur_ending) {
     void* saved_unique_user_ptr = tls_unique_user_ptr;
 
     TaskMeta* const cur_meta = g->_cur_meta;
+    // Registers of next_meta are restored right after the bookkeeping below,
+    // start loading them now.
+    if (next_meta->stack != NULL && next_meta->stack != cur_meta->stack) {
+        prefetch_stack(next_meta->stack);
+    }
     const int64_t now = butil::cpuwide_time_ns();
     const int64_t elp_ns = now - g->_last_run_ns;
     g->_last_run_ns = now;
@@ -699,9 +774,21 @@ void TaskGroup::sched_to(TaskGroup** pg, TaskMeta* next_meta, bool cur_ending) {
     
     if (cur_meta->tid != g->main_tid()) {
         g->_cumulated_cputime_ns += elp_ns;
+        if (elp_ns > cur_meta->stat.max_run_ns) {
+            cur_meta->stat.max_run_ns = elp_ns;
+        }
+        if (elp_ns > FLAGS_bthread_time_slice_us * 1000L) {
+            g->_control->tag_slice_overrun(g->_tag) << 1;
+        }
     }
     ++cur_meta->stat.nswitch;
     ++ g->_nswitch;
+    if (next_meta->ready_ns != 0) {
+        const int64_t delay_us = (now - next_meta->ready_ns) / 1000;
+        g->_control->tag_sched_latency(g->_tag) << delay_us;
+        g->_control->tag_sched_latency(g->_tag, next_meta->priority()) << delay_us;
+        next_meta->ready_ns = 0;
+    }
     // Switch to the task
     if (__builtin_expect(next_meta != cur_meta, 1)) {
         g->_cur_meta = next_meta;
@@ -782,11 +869,28 @@ void TaskGroup::destroy_self() {
 }
 
 
+static BAIDU_THREAD_LOCAL int tls_sched_latency_countdown = 0;
+
+void TaskGroup::mark_ready(TaskMeta* meta) {
+    const int period = FLAGS_bthread_sched_latency_sample_period;
+    if (period <= 0) {
+        return;
+    }
+    // Also sample when the period is just shortened.
+    if (--tls_sched_latency_countdown > 0 &&
+        tls_sched_latency_countdown < period) {
+        return;
+    }
+    tls_sched_latency_countdown = period;
+    meta->ready_ns = butil::cpuwide_time_ns();
+}
+
 void TaskGroup::ready_to_run(TaskMeta* meta, bool nosignal) {
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_READY, meta);
 #endif // BRPC_BTHREAD_TRACER
-    push_rq(meta->tid);
+    mark_ready(meta);
+    push_rq(meta);
     if (nosignal) {
         ++_num_nosignal;
     } else {
@@ -810,6 +914,7 @@ void TaskGroup::ready_to_run_remote(TaskMeta* meta, bool nosignal) {
 #ifdef BRPC_BTHREAD_TRACER
     _control->_task_tracer.set_status(TASK_STATUS_READY, meta);
 #endif // BRPC_BTHREAD_TRACER
+    mark_ready(meta);
     _remote_rq._mutex.lock();
     while (!_remote_rq.push_locked(meta->tid)) {
         flush_nosignal_tasks_remote_locked(_remote_rq._mutex);
@@ -867,11 +972,13 @@ void TaskGroup::ready_to_run_in_worker_ignoresignal(void* args_in) {
     tls_task_group->_control->_task_tracer.set_status(
         TASK_STATUS_READY, args->meta);
 #endif // BRPC_BTHREAD_TRACER
-    return tls_task_group->push_rq(args->meta->tid);
+    mark_ready(args->meta);
+    return tls_task_group->push_rq(args->meta);
 }
 
 void TaskGroup::priority_to_run(void* args_in) {
     ReadyToRunArgs* args = static_cast<ReadyToRunArgs*>(args_in);
+    mark_ready(args->meta);
     return tls_task_group->control()->push_priority_queue(args->tag, args->meta->tid);
 }
 
@@ -880,14 +987,16 @@ struct SleepArgs {
     bthread_t tid;
     TaskMeta* meta;
     TaskGroup* group;
+    // Don't access `group' in the timer thread, which may be removed by
+    // TaskControl::remove_workers() during sleeping.
+    TaskControl* control;
+    bthread_tag_t tag;
 };
 
 static void ready_to_run_from_timer_thread(void* arg) {
     CHECK(tls_task_group == NULL);
     const SleepArgs* e = static_cast<const SleepArgs*>(arg);
-    auto g = e->group;
-    auto tag = g->tag();
-    g->control()->choose_one_group(tag)->ready_to_run_remote(e->meta);
+    e->control->choose_one_group(e->tag)->ready_to_run_remote(e->meta);
 }
 
 void TaskGroup::_add_sleep_event(void* void_args) {
@@ -945,9 +1054,12 @@ int TaskGroup::usleep(TaskGroup** pg, uint64_t timeout_us) {
     TaskGroup* g = *pg;
     // We have to schedule timer after we switched to next bthread otherwise
     // the timer may wake up(jump to) current still-running context.
-    SleepArgs e = { timeout_us, g->current_tid(), g->current_task(), g };
+    SleepArgs e = { timeout_us, g->current_tid(), g->current_task(), g,
+                    g->control(), g->tag() };
+    OffCpuWait* offcpu_wait = offcpu_wait_begin(OFFCPU_USLEEP);
     g->set_remained(_add_sleep_event, &e);
     sched(pg);
+    offcpu_wait_end(offcpu_wait);
     g = *pg;
     if (e.meta->sleep_failed) {
         // Fail to schedule timer, return error.
@@ -1070,7 +1182,7 @@ void print_task(std::ostream& os, bthread_t tid) {
     bthread_attr_t attr = BTHREAD_ATTR_NORMAL;
     bool has_tls = false;
     int64_t cpuwide_start_ns = 0;
-    TaskStatistics stat = {0, 0, 0};
+    TaskStatistics stat = {0, 0, 0, 0};
     TaskStatus status = TASK_STATUS_UNKNOWN;
     bool traced = false;
     pid_t worker_tid = 0;
@@ -1107,6 +1219,7 @@ void print_task(std::ostream& os, bthread_t tid) {
            << "\nuptime_ns=" << butil::cpuwide_time_ns() - cpuwide_start_ns
            << "\ncputime_ns=" << stat.cputime_ns
            << "\nnswitch=" << stat.nswitch
+           << "\nmax_run_ns=" << stat.max_run_ns
 #ifdef BRPC_BTHREAD_TRACER
            << "\nstatus=" << status
            << "\ntraced=" << traced
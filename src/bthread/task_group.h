@@ -47,6 +47,14 @@ private:
     void* _value;
 };
 
+// Complain if the bthread is being suspended while holding pthread locks.
+// Defined in mutex.cpp which counts the pthread locks, or a no-op otherwise.
+#if BRPC_DEBUG_BTHREAD_SCHE_SAFETY
+void CheckBthreadScheSafety();
+#else
+inline void CheckBthreadScheSafety() {}
+#endif // BRPC_DEBUG_BTHREAD_SCHE_SAFETY
+
 // Thread-local group of tasks.
 // Notice that most methods involving context switching are static otherwise
 // pointer `this' may change after wakeup. The **pg parameters in following
@@ -141,6 +149,10 @@ public:
     int64_t current_uptime_ns() const
     { return butil::cpuwide_time_ns() - _cur_meta->cpuwide_start_ns; }
 
+    // Time in nanoseconds since current task was switched in.
+    int64_t current_run_ns() const
+    { return butil::cpuwide_time_ns() - _last_run_ns; }
+
     // True iff current task is the one running run_main_task()
     bool is_current_main_task() const { return current_tid() == _main_tid; }
     // True iff current task is in pthread-mode.
@@ -178,17 +190,27 @@ public:
     // Get the meta associate with the task.
     static TaskMeta* address_meta(bthread_t tid);
 
-    // Push a task into _rq, if _rq is full, retry after some time. This
-    // process make go on indefinitely.
-    void push_rq(bthread_t tid);
+    // Push a task into the local runqueue of its priority, if the runqueue
+    // is full, retry after some time. This process make go on indefinitely.
+    void push_rq(TaskMeta* meta);
 
-    // Returns size of local run queue.
+    // Returns size of local run queues.
     size_t rq_size() const {
-        return _rq.volatile_size();
+        return _high_rq.volatile_size() + _rq.volatile_size() +
+            _low_rq.volatile_size();
+    }
+
+    // Returns size of the queue of tasks pushed by non-workers.
+    size_t remote_rq_size() const {
+        return _remote_rq.volatile_size();
     }
 
     bthread_tag_t tag() const { return _tag; }
 
+    // True if the worker of this group was asked to quit by
+    // TaskControl::remove_workers().
+    bool retiring() const { return _retiring.load(butil::memory_order_relaxed); }
+
     pid_t tid() const { return _tid; }
 
     int64_t current_task_cpu_clock_ns() {
@@ -238,12 +260,42 @@ friend class TaskControl;
         if (_remote_rq.pop(tid)) {
             return true;
         }
+        if (_retiring.load(butil::memory_order_relaxed)) {
+            // Don't take more tasks, the worker quits after running out of
+            // tasks in its own queues.
+            return false;
+        }
 #ifndef BTHREAD_DONT_SAVE_PARKING_STATE
         _last_pl_state = _pl->get_state();
 #endif
-        return _control->steal_task(tid, &_steal_seed, _steal_offset);
+        if (_control->steal_task(tid, &_steal_seed, _steal_offset)) {
+            ++_nsteal;
+            return true;
+        }
+        ++_nsteal_fail;
+        return false;
     }
 
+    // Remember when `meta' is put into a runqueue if it's sampled.
+    static void mark_ready(TaskMeta* meta);
+
+    WorkStealingQueue<bthread_t>& rq_of(TaskPriority priority) {
+        switch (priority) {
+        case TASK_PRIORITY_HIGH: return _high_rq;
+        case TASK_PRIORITY_LOW: return _low_rq;
+        default: return _rq;
+        }
+    }
+
+    // Pop a task from local runqueues, higher priorities first.
+    bool pop_rq(bthread_t* tid);
+
+    // Pop/steal a task from the local runqueue of `priority' which is not
+    // TASK_PRIORITY_NORMAL, and update the number of queued tasks in
+    // TaskControl.
+    bool pop_prioritized(TaskPriority priority, bthread_t* tid);
+    bool steal_prioritized(TaskPriority priority, bthread_t* tid);
+
     void set_tag(bthread_tag_t tag) { _tag = tag; }
 
     void set_pl(ParkingLot* pl) { _pl = pl; }
@@ -261,6 +313,11 @@ friend class TaskControl;
     int64_t _last_cpu_clock_ns;
 
     size_t _nswitch;
+    // Tasks stolen from other groups and attempts that found nothing.
+    size_t _nsteal;
+    size_t _nsteal_fail;
+    // Times of parking this worker when there's no task to run.
+    size_t _npark;
     RemainedFn _last_context_remained;
     void* _last_context_remained_arg;
 
@@ -272,7 +329,13 @@ friend class TaskControl;
     size_t _steal_offset;
     ContextualStack* _main_stack;
     bthread_t _main_tid;
+    // Local runqueues of bthreads with BTHREAD_PRIORITY_HIGH, no priority
+    // and BTHREAD_PRIORITY_LOW respectively.
+    WorkStealingQueue<bthread_t> _high_rq;
     WorkStealingQueue<bthread_t> _rq;
+    WorkStealingQueue<bthread_t> _low_rq;
+    // Pops from local runqueues since lower priorities were preferred.
+    int _npop_since_aging;
     RemoteTaskQueue _remote_rq;
     int _remote_num_nosignal;
     int _remote_nsignaled;
@@ -283,6 +346,13 @@ friend class TaskControl;
 
     // Worker thread id.
     pid_t _tid;
+    // The worker pthread.
+    pthread_t _worker;
+    butil::atomic<bool> _retiring;
+
+    // _last_run_ns of the task last reported by the watchdog of TaskControl,
+    // only accessed by the watchdog.
+    int64_t _watchdog_reported_run_ns;
 };
 
 }  // namespace bthread
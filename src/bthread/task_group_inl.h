@@ -82,8 +82,18 @@ inline void TaskGroup::sched_to(TaskGroup** pg, bthread_t next_tid) {
     sched_to(pg, next_meta, false);
 }
 
-inline void TaskGroup::push_rq(bthread_t tid) {
-    while (!_rq.push(tid)) {
+inline void TaskGroup::push_rq(TaskMeta* meta) {
+    if (BAIDU_UNLIKELY(_retiring.load(butil::memory_order_relaxed))) {
+        // Nobody steals from a retiring group, run the task in others.
+        return _control->choose_one_group(_tag)->ready_to_run_remote(meta);
+    }
+    const TaskPriority priority = meta->priority();
+    WorkStealingQueue<bthread_t>& rq = rq_of(priority);
+    if (priority != TASK_PRIORITY_NORMAL) {
+        // Counted before being visible to stealers.
+        _control->add_queued_task(_tag, priority, 1);
+    }
+    while (!rq.push(meta->tid)) {
         // Created too many bthreads: a promising approach is to insert the
         // task into another TaskGroup, but we don't use it because:
         // * There're already many bthreads to run, inserting the bthread
@@ -92,7 +102,7 @@ inline void TaskGroup::push_rq(bthread_t tid) {
         //   are busy at creating bthreads (proved by test_input_messenger in
         //   brpc)
         flush_nosignal_tasks();
-        LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity=" << _rq.capacity();
+        LOG_EVERY_SECOND(ERROR) << "_rq is full, capacity=" << rq.capacity();
         // TODO(gejun): May cause deadlock when all workers are spinning here.
         // A better solution is to pop and run existing bthreads, however which
         // make set_remained()-callbacks do context switches and need extensive
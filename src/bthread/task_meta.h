@@ -35,6 +35,8 @@ struct TaskStatistics {
     int64_t cputime_ns;
     int64_t nswitch;
     int64_t cpu_usage_ns;
+    // Longest time in nanoseconds that the task ran without switching out.
+    int64_t max_run_ns;
 };
 
 class KeyTable;
@@ -61,6 +63,14 @@ enum TaskStatus {
     TASK_STATUS_END,
 };
 
+// Levels of local runqueues of TaskGroup, highest first.
+enum TaskPriority {
+    TASK_PRIORITY_HIGH = 0,
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_LOW,
+    TASK_PRIORITY_NUM
+};
+
 struct TaskMeta {
     // [Not Reset]
     butil::atomic<ButexWaiter*> current_waiter{NULL};
@@ -101,6 +111,9 @@ struct TaskMeta {
     // Statistics
     int64_t cpuwide_start_ns{0};
     TaskStatistics stat{};
+    // When this task was put into a runqueue, only set for the ones sampled
+    // by -bthread_sched_latency_sample_period and cleared when it runs.
+    int64_t ready_ns{0};
 
     // bthread local storage, sync with tls_bls (defined in task_group.cpp)
     // when the bthread is created or destroyed.
@@ -143,6 +156,14 @@ public:
     StackType stack_type() const {
         return static_cast<StackType>(attr.stack_type);
     }
+
+    TaskPriority priority() const {
+        if (attr.flags & BTHREAD_PRIORITY_HIGH) {
+            return TASK_PRIORITY_HIGH;
+        }
+        return (attr.flags & BTHREAD_PRIORITY_LOW) ? TASK_PRIORITY_LOW
+                                                   : TASK_PRIORITY_NORMAL;
+    }
 };
 
 }  // namespace bthread
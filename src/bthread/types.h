@@ -54,6 +54,12 @@ static const bthread_attrflags_t BTHREAD_NOSIGNAL = 32;
 static const bthread_attrflags_t BTHREAD_NEVER_QUIT = 64;
 static const bthread_attrflags_t BTHREAD_INHERIT_SPAN = 128;
 static const bthread_attrflags_t BTHREAD_GLOBAL_PRIORITY = 256;
+// Runnable bthreads with BTHREAD_PRIORITY_HIGH run before other bthreads in
+// runqueues of the same tag, and ones with BTHREAD_PRIORITY_LOW after others.
+// Lower priorities are still run periodically to avoid starvation, see
+// -bthread_priority_starvation_period.
+static const bthread_attrflags_t BTHREAD_PRIORITY_HIGH = 512;
+static const bthread_attrflags_t BTHREAD_PRIORITY_LOW = 1024;
 
 // Key of thread-local data, created by bthread_key_create.
 typedef struct {
@@ -43,6 +43,13 @@ extern void bthread_flush();
 // worker pthreads are not notified.
 extern int bthread_about_to_quit();
 
+// Change priority of the calling bthread to `priority' which is one of 0
+// (no priority), BTHREAD_PRIORITY_HIGH and BTHREAD_PRIORITY_LOW. The new
+// priority takes effect next time the bthread is put into a runqueue.
+// Returns 0 on success, EINVAL for invalid `priority', EPERM if the caller
+// is not a bthread.
+extern int bthread_set_priority_self(bthread_attrflags_t priority);
+
 // Run `on_timer(arg)' at or after real-time `abstime'. Put identifier of the
 // timer into *id.
 // Return 0 on success, errno otherwise.
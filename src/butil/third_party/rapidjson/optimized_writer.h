@@ -55,6 +55,13 @@ public:
         return WriteString(str, length);
     }
 
+    //! Write a key which is already quoted and escaped, e.g. "\"name\"".
+    bool RawKey(const Ch* json, size_t length) {
+        Base::Prefix(kStringType);
+        Base::os_->Puts(json, length);
+        return true;
+    }
+
 protected:
     bool WriteString(const Ch* str, SizeType length)  {
         //if TargetEncoding support Unicode 
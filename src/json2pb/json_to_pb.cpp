@@ -23,6 +23,7 @@
 #include <time.h>
 #include <typeinfo>
 #include <limits> 
+#include <memory>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
@@ -35,6 +36,7 @@
 #include "json2pb/protobuf_map.h"
 #include "json2pb/rapidjson.h"
 #include "json2pb/protobuf_type_resolver.h"
+#include "json2pb/message_codec.h"
 #include "butil/base64.h"
 #include "butil/iobuf.h"
 
@@ -66,7 +68,9 @@ Json2PbOptions::Json2PbOptions()
     : base64_to_bytes(true)
 #endif
     , array_to_single_repeated(false)
-    , allow_remaining_bytes_after_parsing(false) {
+    , allow_remaining_bytes_after_parsing(false)
+    , enable_codec_cache(true)
+    , sax_parsing(false) {
 }
 
 enum MatchType { 
@@ -310,41 +314,24 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         })
 
 
-static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
-                                  const google::protobuf::FieldDescriptor* field,
-                                  google::protobuf::Message* message,
-                                  const Json2PbOptions& options,
-                                  std::string* err) {
-    if (value.IsNull()) {
-        if (field->is_required()) {
-            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
-            return false;
-        }
-        return true;
-    }
-        
-    if (field->is_repeated()) {
-        if (!value.IsArray()) {
-            J2PERROR(err, "Invalid value for repeated field: %s",
-                     field->full_name().c_str());
-            return false;
-        }
-    } 
-
+// Convert `item' to `field' of `message', `item' is an element of the json
+// array when `repeated' is true, otherwise the value of `field' itself.
+static bool JsonItemToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& item,
+                                 const google::protobuf::FieldDescriptor* field,
+                                 google::protobuf::Message* message,
+                                 const Json2PbOptions& options,
+                                 std::string* err,
+                                 bool repeated) {
     const google::protobuf::Reflection* reflection = message->GetReflection();
     switch (field->cpp_type()) {
 #define CASE_FIELD_TYPE(cpptype, method, jsontype)                      \
         case google::protobuf::FieldDescriptor::CPPTYPE_##cpptype: {                      \
-            if (field->is_repeated()) {                                 \
-                const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();          \
-                for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) { \
-                    const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];       \
-                    if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) { \
-                        reflection->Add##method(message, field, item.Get##jsontype()); \
-                    }                                                   \
+            if (TYPE_MATCH == J2PCHECKTYPE(item, cpptype, jsontype)) {  \
+                if (repeated) {                                         \
+                    reflection->Add##method(message, field, item.Get##jsontype()); \
+                } else {                                                \
+                    reflection->Set##method(message, field, item.Get##jsontype()); \
                 }                                                       \
-            } else if (TYPE_MATCH == J2PCHECKTYPE(value, cpptype, jsontype)) { \
-                reflection->Set##method(message, field, value.Get##jsontype()); \
             }                                                           \
             break;                                                      \
         }                                                               \
@@ -355,92 +342,20 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
 #undef CASE_FIELD_TYPE
 
     case google::protobuf::FieldDescriptor::CPPTYPE_INT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_int64_type(item, true, message, field, reflection,
-                                        err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_int64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_int64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_UINT64:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size;
-                 ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (!convert_uint64_type(item, true, message, field, reflection,
-                                         err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_uint64_type(value, false, message, field, reflection,
-                                       err)) {
-            return false;
-        }
-        break;
+        return convert_uint64_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_FLOAT:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_float_type(item, true, message, field,
-                                        reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_float_type(value, false, message, field,
-                                       reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_float_type(item, repeated, message, field, reflection, err);
 
     case google::protobuf::FieldDescriptor::CPPTYPE_DOUBLE: 
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_double_type(item, true, message, field,
-                                         reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_double_type(value, false, message, field,
-                                        reflection, err)) {
-            return false;
-        }
-        break;
+        return convert_double_type(item, repeated, message, field, reflection, err);
         
     case google::protobuf::FieldDescriptor::CPPTYPE_STRING:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
-                    std::string str(item.GetString(), item.GetStringLength());
-                    if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
-                        options.base64_to_bytes) {
-                        std::string str_decoded;
-                        if (!butil::Base64Decode(str, &str_decoded)) {
-                            J2PERROR_WITH_PB(message, err, "Fail to decode base64 string=%s", str.c_str());
-                            return false;
-                        }
-                        str = str_decoded;
-                    }
-                    reflection->AddString(message, field, str);
-                }  
-            }
-        } else if (TYPE_MATCH == J2PCHECKTYPE(value, string, String)) {
-            std::string str(value.GetString(), value.GetStringLength());
+        if (TYPE_MATCH == J2PCHECKTYPE(item, string, String)) { 
+            std::string str(item.GetString(), item.GetStringLength());
             if (field->type() == google::protobuf::FieldDescriptor::TYPE_BYTES &&
                 options.base64_to_bytes) {
                 std::string str_decoded;
@@ -450,43 +365,58 @@ static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
                 }
                 str = str_decoded;
             }
-            reflection->SetString(message, field, str);
+            if (repeated) {
+                reflection->AddString(message, field, str);
+            } else {
+                reflection->SetString(message, field, str);
+            }
         }
         break;
 
     case google::protobuf::FieldDescriptor::CPPTYPE_ENUM:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value & item = value[index];
-                if (!convert_enum_type(item, true, message, field,
-                                       reflection, err)) {
-                    return false;
-                }
-            }
-        } else if (!convert_enum_type(value, false, message, field,
-                                      reflection, err)) {
-            return false;
+        return convert_enum_type(item, repeated, message, field, reflection, err);
+        
+    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
+        if (repeated) {
+            if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
+                return JsonValueToProtoMessage(
+                    item, reflection->AddMessage(message, field), options, err);
+            } 
+        } else {
+            return JsonValueToProtoMessage(
+                item, reflection->MutableMessage(message, field), options, err);
         }
         break;
+    }
+    return true;
+}
+
+static bool JsonValueToProtoField(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
+                                  const google::protobuf::FieldDescriptor* field,
+                                  google::protobuf::Message* message,
+                                  const Json2PbOptions& options,
+                                  std::string* err) {
+    if (value.IsNull()) {
+        if (field->is_required()) {
+            J2PERROR(err, "Missing required field: %s", field->full_name().c_str());
+            return false;
+        }
+        return true;
+    }
         
-    case google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE:
-        if (field->is_repeated()) {
-            const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
-            for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
-                const BUTIL_RAPIDJSON_NAMESPACE::Value& item = value[index];
-                if (TYPE_MATCH == J2PCHECKTYPE(item, message, Object)) { 
-                    if (!JsonValueToProtoMessage(
-                            item, reflection->AddMessage(message, field), options, err)) {
-                        return false;
-                    }
-                } 
-            }
-        } else if (!JsonValueToProtoMessage(
-            value, reflection->MutableMessage(message, field), options, err)) {
+    if (!field->is_repeated()) {
+        return JsonItemToProtoField(value, field, message, options, err, false);
+    }
+    if (!value.IsArray()) {
+        J2PERROR(err, "Invalid value for repeated field: %s",
+                 field->full_name().c_str());
+        return false;
+    }
+    const BUTIL_RAPIDJSON_NAMESPACE::SizeType size = value.Size();
+    for (BUTIL_RAPIDJSON_NAMESPACE::SizeType index = 0; index < size; ++index) {
+        if (!JsonItemToProtoField(value[index], field, message, options, err, true)) {
             return false;
         }
-        break;
     }
     return true;
 }
@@ -522,6 +452,68 @@ bool JsonMapToProtoMap(const BUTIL_RAPIDJSON_NAMESPACE::Value& value,
     return true;
 }
 
+// Fields are still handled in the order of declaration and the first
+// member wins when names are duplicated, as JsonValueToProtoMessage does,
+// but each member is matched by one lookup into the codec.
+static bool JsonValueToProtoMessageWithCodec(
+    const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
+    const MessageCodec& codec,
+    google::protobuf::Message* message,
+    const Json2PbOptions& options,
+    std::string* err) {
+    const std::vector<FieldCodec>& fields = codec.fields();
+    if (json_value.IsArray()) {
+        if (fields.size() == 1 && fields.front().field->is_repeated()) {
+            return JsonValueToProtoField(json_value, fields.front().field,
+                                         message, options, err);
+        }
+        J2PERROR_WITH_PB(message, err, "the input json can't be array here");
+        return false;
+    }
+
+    const BUTIL_RAPIDJSON_NAMESPACE::Value* inline_values[32];
+    std::vector<const BUTIL_RAPIDJSON_NAMESPACE::Value*> heap_values;
+    const BUTIL_RAPIDJSON_NAMESPACE::Value** values = inline_values;
+    if (fields.size() > arraysize(inline_values)) {
+        heap_values.resize(fields.size());
+        values = &heap_values[0];
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        values[i] = NULL;
+    }
+    for (BUTIL_RAPIDJSON_NAMESPACE::Value::ConstMemberIterator
+             it = json_value.MemberBegin(); it != json_value.MemberEnd(); ++it) {
+        const int index = codec.FindField(it->name.GetString(),
+                                          it->name.GetStringLength());
+        if (index >= 0 && values[index] == NULL) {
+            values[index] = &it->value;
+        }
+    }
+
+    for (size_t i = 0; i < fields.size(); ++i) {
+        const FieldCodec& f = fields[i];
+        const BUTIL_RAPIDJSON_NAMESPACE::Value* value_ptr = values[i];
+        if (value_ptr == NULL) {
+            if (f.field->is_required()) {
+                J2PERROR(err, "Missing required field: %s", f.field->full_name().c_str());
+                return false;
+            }
+            continue;
+        }
+        if (f.is_map && value_ptr->IsObject()) {
+            // Try to parse json like {"key":value, ...} into protobuf map
+            if (!JsonMapToProtoMap(*value_ptr, f.field, message, options, err)) {
+                return false;
+            }
+        } else {
+            if (!JsonValueToProtoField(*value_ptr, f.field, message, options, err)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
                              google::protobuf::Message* message,
                              const Json2PbOptions& options,
@@ -534,6 +526,14 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
         return false;
     }
 
+    if (options.enable_codec_cache) {
+        const MessageCodec* codec = MessageCodec::Get(descriptor);
+        if (codec != NULL) {
+            return JsonValueToProtoMessageWithCodec(
+                json_value, *codec, message, options, err);
+        }
+    }
+
     const google::protobuf::Reflection* reflection = message->GetReflection();
     
     std::vector<const google::protobuf::FieldDescriptor*> fields;
@@ -614,6 +614,457 @@ bool JsonValueToProtoMessage(const BUTIL_RAPIDJSON_NAMESPACE::Value& json_value,
     return true;
 }
 
+// Fill protobuf messages with events of BUTIL_RAPIDJSON_NAMESPACE::Reader
+// directly instead of building a DOM of the whole json first. Values are
+// converted by the same functions as JsonValueToProtoMessage(), so results
+// are the same except that errors are reported in the order of json members
+// rather than fields. Messages without codecs (see message_codec.h) are
+// collected into a DOM and converted by JsonValueToProtoMessage().
+class ProtoMessageSaxHandler {
+public:
+    typedef char Ch;
+    typedef BUTIL_RAPIDJSON_NAMESPACE::Value Value;
+    typedef BUTIL_RAPIDJSON_NAMESPACE::SizeType SizeType;
+
+    ProtoMessageSaxHandler(google::protobuf::Message* root,
+                           const MessageCodec* root_codec,
+                           const Json2PbOptions& options,
+                           std::string* err)
+        : _root(root), _root_codec(root_codec)
+        , _options(options), _err(err), _failed(false) {}
+
+    // True if the parsing was stopped by a failed conversion rather than
+    // an invalid json.
+    bool failed() const { return _failed; }
+
+    bool Null() {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->Null();
+        }
+        return OnScalar(Value());
+    }
+    bool Bool(bool b) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->Bool(b);
+        }
+        return OnScalar(Value(b));
+    }
+    bool AddInt(int i) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->AddInt(i);
+        }
+        return OnScalar(Value(i));
+    }
+    bool AddUint(unsigned u) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->AddUint(u);
+        }
+        return OnScalar(Value(u));
+    }
+    bool AddInt64(int64_t i) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->AddInt64(i);
+        }
+        return OnScalar(Value(i));
+    }
+    bool AddUint64(uint64_t u) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->AddUint64(u);
+        }
+        return OnScalar(Value(u));
+    }
+    bool Double(double d) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->Double(d);
+        }
+        return OnScalar(Value(d));
+    }
+    bool String(const Ch* str, SizeType length, bool copy) {
+        if (!_frames.empty() && _frames.back().type == FRAME_DOM) {
+            return _doc->String(str, length, copy);
+        }
+        // Referencing `str' is fine since the value is consumed right now.
+        return OnScalar(Value(str, length));
+    }
+
+    bool StartObject();
+    bool Key(const Ch* str, SizeType length, bool copy);
+    bool EndObject(SizeType member_count);
+    bool StartArray();
+    bool EndArray(SizeType element_count);
+
+private:
+    enum FrameType {
+        FRAME_MESSAGE,   // members of a message
+        FRAME_MAP,       // members of a json object converted to a map field
+        FRAME_REPEATED,  // elements of a repeated field
+        FRAME_SKIP,      // an ignored value
+        FRAME_DOM,       // a message without codec, collected into _doc
+    };
+
+    struct Frame {
+        FrameType type;
+        google::protobuf::Message* message;
+        // FRAME_MESSAGE: field of the current member, NULL when the member
+        // is unknown or duplicated and its value is skipped.
+        // FRAME_MAP/FRAME_REPEATED: the field being filled.
+        const google::protobuf::FieldDescriptor* field;
+        const MessageCodec* codec;      // FRAME_MESSAGE
+        int field_index;                // FRAME_MESSAGE
+        size_t seen_offset;             // FRAME_MESSAGE
+        google::protobuf::Message* map_entry;                   // FRAME_MAP
+        const google::protobuf::FieldDescriptor* map_key;      // FRAME_MAP
+        const google::protobuf::FieldDescriptor* map_value;    // FRAME_MAP
+        int depth;                      // FRAME_SKIP/FRAME_DOM
+    };
+
+    // The field which the next value is converted to.
+    struct Target {
+        google::protobuf::Message* message;
+        const google::protobuf::FieldDescriptor* field;
+        // True if the value is an element of a repeated field.
+        bool element;
+        // True if the value may be a json object converted to a map field.
+        bool maybe_map;
+    };
+
+    bool Fail() {
+        _failed = true;
+        return false;
+    }
+
+    // Returns false if the value should be skipped.
+    bool GetTarget(Target* t) const {
+        const Frame& f = _frames.back();
+        switch (f.type) {
+        case FRAME_MESSAGE:
+            if (f.field == NULL) {
+                return false;
+            }
+            t->message = f.message;
+            t->field = f.field;
+            t->element = false;
+            t->maybe_map = f.codec->fields()[f.field_index].is_map;
+            return true;
+        case FRAME_MAP:
+            t->message = f.map_entry;
+            t->field = f.map_value;
+            t->element = false;
+            t->maybe_map = false;
+            return true;
+        case FRAME_REPEATED:
+            t->message = f.message;
+            t->field = f.field;
+            t->element = true;
+            t->maybe_map = false;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    bool OnScalar(const Value& value);
+    void PushMessage(google::protobuf::Message* message, const MessageCodec* codec);
+    void PushSubMessage(google::protobuf::Message* message);
+    void PushSkip();
+
+    google::protobuf::Message* _root;
+    const MessageCodec* _root_codec;
+    const Json2PbOptions& _options;
+    std::string* _err;
+    bool _failed;
+    std::vector<Frame> _frames;
+    // Whether fields of messages in _frames were seen, indexed by
+    // Frame::seen_offset + field index.
+    std::vector<char> _seen;
+    std::unique_ptr<BUTIL_RAPIDJSON_NAMESPACE::Document> _doc;
+};
+
+void ProtoMessageSaxHandler::PushMessage(google::protobuf::Message* message,
+                                         const MessageCodec* codec) {
+    Frame f;
+    memset(&f, 0, sizeof(f));
+    f.type = FRAME_MESSAGE;
+    f.message = message;
+    f.codec = codec;
+    f.seen_offset = _seen.size();
+    _seen.resize(_seen.size() + codec->fields().size(), 0);
+    _frames.push_back(f);
+}
+
+void ProtoMessageSaxHandler::PushSubMessage(google::protobuf::Message* message) {
+    const MessageCodec* codec = MessageCodec::Get(message->GetDescriptor());
+    if (codec != NULL) {
+        return PushMessage(message, codec);
+    }
+    Frame f;
+    memset(&f, 0, sizeof(f));
+    f.type = FRAME_DOM;
+    f.message = message;
+    f.depth = 1;
+    _frames.push_back(f);
+    _doc.reset(new BUTIL_RAPIDJSON_NAMESPACE::Document);
+    _doc->StartObject();
+}
+
+void ProtoMessageSaxHandler::PushSkip() {
+    Frame f;
+    memset(&f, 0, sizeof(f));
+    f.type = FRAME_SKIP;
+    f.depth = 1;
+    _frames.push_back(f);
+}
+
+bool ProtoMessageSaxHandler::OnScalar(const Value& value) {
+    if (_frames.empty()) {
+        J2PERROR_WITH_PB(_root, _err, "The input is not a json object");
+        return Fail();
+    }
+    Target t;
+    if (!GetTarget(&t)) {
+        return true;
+    }
+    const bool ok = t.element
+        ? JsonItemToProtoField(value, t.field, t.message, _options, _err, true)
+        : JsonValueToProtoField(value, t.field, t.message, _options, _err);
+    return ok || Fail();
+}
+
+bool ProtoMessageSaxHandler::StartObject() {
+    if (_frames.empty()) {
+        PushMessage(_root, _root_codec);
+        return true;
+    }
+    Frame& top = _frames.back();
+    if (top.type == FRAME_DOM) {
+        ++top.depth;
+        return _doc->StartObject();
+    }
+    if (top.type == FRAME_SKIP) {
+        ++top.depth;
+        return true;
+    }
+    Target t;
+    if (!GetTarget(&t)) {
+        PushSkip();
+        return true;
+    }
+    const google::protobuf::Reflection* reflection = t.message->GetReflection();
+    if (t.maybe_map) {
+        // Parse json like {"key":value, ...} into protobuf map
+        const FieldCodec& fc = top.codec->fields()[top.field_index];
+        Frame f;
+        memset(&f, 0, sizeof(f));
+        f.type = FRAME_MAP;
+        f.message = t.message;
+        f.field = t.field;
+        f.map_key = fc.map_key;
+        f.map_value = fc.map_value;
+        _frames.push_back(f);
+        return true;
+    }
+    if (t.field->cpp_type() == google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
+        if (t.element) {
+            PushSubMessage(reflection->AddMessage(t.message, t.field));
+            return true;
+        }
+        if (!t.field->is_repeated()) {
+            PushSubMessage(reflection->MutableMessage(t.message, t.field));
+            return true;
+        }
+    }
+    if (!t.element && t.field->is_repeated()) {
+        J2PERROR(_err, "Invalid value for repeated field: %s",
+                 t.field->full_name().c_str());
+        return Fail();
+    }
+    // An object for a non-message field, check it as JsonValueToProtoField()
+    // does and skip the object if the mismatch is tolerated.
+    const Value empty_object(BUTIL_RAPIDJSON_NAMESPACE::kObjectType);
+    if (!JsonItemToProtoField(empty_object, t.field, t.message,
+                              _options, _err, t.element)) {
+        return Fail();
+    }
+    PushSkip();
+    return true;
+}
+
+bool ProtoMessageSaxHandler::Key(const Ch* str, SizeType length, bool copy) {
+    Frame& top = _frames.back();
+    switch (top.type) {
+    case FRAME_MESSAGE: {
+        const int index = top.codec->FindField(str, length);
+        // The first member wins when names are duplicated, as FindMember()
+        // of rapidjson does.
+        if (index < 0 || _seen[top.seen_offset + index]) {
+            top.field = NULL;
+        } else {
+            _seen[top.seen_offset + index] = 1;
+            top.field = top.codec->fields()[index].field;
+            top.field_index = index;
+        }
+        return true;
+    }
+    case FRAME_MAP:
+        top.map_entry = top.message->GetReflection()->AddMessage(top.message, top.field);
+        top.map_entry->GetReflection()->SetString(
+            top.map_entry, top.map_key, std::string(str, length));
+        return true;
+    case FRAME_DOM:
+        return _doc->Key(str, length, copy);
+    default:
+        return true;
+    }
+}
+
+bool ProtoMessageSaxHandler::EndObject(SizeType member_count) {
+    Frame& top = _frames.back();
+    switch (top.type) {
+    case FRAME_MESSAGE: {
+        const std::vector<FieldCodec>& fields = top.codec->fields();
+        for (size_t i = 0; i < fields.size(); ++i) {
+            if (!_seen[top.seen_offset + i] && fields[i].field->is_required()) {
+                J2PERROR(_err, "Missing required field: %s",
+                         fields[i].field->full_name().c_str());
+                return Fail();
+            }
+        }
+        _seen.resize(top.seen_offset);
+        _frames.pop_back();
+        return true;
+    }
+    case FRAME_DOM: {
+        _doc->EndObject(member_count);
+        if (--top.depth != 0) {
+            return true;
+        }
+        _doc->FinalizeHandler();
+        google::protobuf::Message* message = top.message;
+        _frames.pop_back();
+        const bool ok = JsonValueToProtoMessage(*_doc, message, _options, _err);
+        _doc.reset();
+        return ok || Fail();
+    }
+    case FRAME_SKIP:
+        if (--top.depth == 0) {
+            _frames.pop_back();
+        }
+        return true;
+    default:
+        _frames.pop_back();
+        return true;
+    }
+}
+
+bool ProtoMessageSaxHandler::StartArray() {
+    if (_frames.empty()) {
+        const std::vector<FieldCodec>& fields = _root_codec->fields();
+        if (!_options.array_to_single_repeated) {
+            J2PERROR_WITH_PB(_root, _err, "The input is not a json object");
+            return Fail();
+        }
+        if (fields.size() != 1 || !fields.front().field->is_repeated()) {
+            J2PERROR_WITH_PB(_root, _err, "the input json can't be array here");
+            return Fail();
+        }
+        Frame f;
+        memset(&f, 0, sizeof(f));
+        f.type = FRAME_REPEATED;
+        f.message = _root;
+        f.field = fields.front().field;
+        _frames.push_back(f);
+        return true;
+    }
+    Frame& top = _frames.back();
+    if (top.type == FRAME_DOM) {
+        ++top.depth;
+        return _doc->StartArray();
+    }
+    if (top.type == FRAME_SKIP) {
+        ++top.depth;
+        return true;
+    }
+    Target t;
+    if (!GetTarget(&t)) {
+        PushSkip();
+        return true;
+    }
+    if (!t.element && t.field->is_repeated()) {
+        Frame f;
+        memset(&f, 0, sizeof(f));
+        f.type = FRAME_REPEATED;
+        f.message = t.message;
+        f.field = t.field;
+        _frames.push_back(f);
+        return true;
+    }
+    // An array for a non-repeated field or an element, check it as
+    // JsonValueToProtoField() does and skip the array if the mismatch is
+    // tolerated.
+    const Value empty_array(BUTIL_RAPIDJSON_NAMESPACE::kArrayType);
+    if (!JsonItemToProtoField(empty_array, t.field, t.message,
+                              _options, _err, t.element)) {
+        return Fail();
+    }
+    PushSkip();
+    return true;
+}
+
+bool ProtoMessageSaxHandler::EndArray(SizeType element_count) {
+    Frame& top = _frames.back();
+    switch (top.type) {
+    case FRAME_DOM:
+        --top.depth;
+        return _doc->EndArray(element_count);
+    case FRAME_SKIP:
+        if (--top.depth == 0) {
+            _frames.pop_back();
+        }
+        return true;
+    default:
+        _frames.pop_back();
+        return true;
+    }
+}
+
+template <typename InputStream>
+static bool JsonToProtoMessageBySax(InputStream& is,
+                                    const MessageCodec* codec,
+                                    google::protobuf::Message* message,
+                                    const Json2PbOptions& options,
+                                    std::string* error,
+                                    size_t* parsed_offset) {
+    ProtoMessageSaxHandler handler(message, codec, options, error);
+    BUTIL_RAPIDJSON_NAMESPACE::Reader reader;
+    if (options.allow_remaining_bytes_after_parsing) {
+        reader.Parse<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag>(is, handler);
+        if (parsed_offset != nullptr) {
+            *parsed_offset = reader.GetErrorOffset();
+        }
+    } else {
+        reader.Parse<0>(is, handler);
+    }
+    if (handler.failed()) {
+        return false;
+    }
+    if (reader.HasParseError()) {
+        if (options.allow_remaining_bytes_after_parsing) {
+            if (reader.GetParseErrorCode() == BUTIL_RAPIDJSON_NAMESPACE::kParseErrorDocumentEmpty) {
+                // This is usual when parsing multiple jsons, don't waste time
+                // on setting the `empty error'
+                return false;
+            }
+        }
+        if (error) {
+            // Drop errors of tolerated mismatches before the invalid part.
+            error->clear();
+        }
+        J2PERROR_WITH_PB(message, error, "Invalid json: %s", BUTIL_RAPIDJSON_NAMESPACE::GetParseError_En(reader.GetParseErrorCode()));
+        return false;
+    }
+    return true;
+}
+
 inline bool JsonToProtoMessageInline(const std::string& json_string, 
                         google::protobuf::Message* message,
                         const Json2PbOptions& options,
@@ -622,6 +1073,14 @@ inline bool JsonToProtoMessageInline(const std::string& json_string,
     if (error) {
         error->clear();
     }
+    if (options.sax_parsing) {
+        const MessageCodec* codec = MessageCodec::Get(message->GetDescriptor());
+        if (codec != NULL) {
+            BUTIL_RAPIDJSON_NAMESPACE::StringStream is(json_string.c_str());
+            return JsonToProtoMessageBySax(is, codec, message, options,
+                                           error, parsed_offset);
+        }
+    }
     BUTIL_RAPIDJSON_NAMESPACE::Document d;
     if (options.allow_remaining_bytes_after_parsing) {
         d.Parse<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag>(json_string.c_str());
@@ -670,6 +1129,13 @@ bool JsonToProtoMessage(ZeroCopyStreamReader* reader,
     if (error) {
         error->clear();
     }
+    if (options.sax_parsing) {
+        const MessageCodec* codec = MessageCodec::Get(message->GetDescriptor());
+        if (codec != NULL) {
+            return JsonToProtoMessageBySax(*reader, codec, message, options,
+                                           error, parsed_offset);
+        }
+    }
     BUTIL_RAPIDJSON_NAMESPACE::Document d;
     if (options.allow_remaining_bytes_after_parsing) {
         d.ParseStream<BUTIL_RAPIDJSON_NAMESPACE::kParseStopWhenDoneFlag, BUTIL_RAPIDJSON_NAMESPACE::UTF8<>>(*reader);
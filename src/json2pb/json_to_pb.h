@@ -42,6 +42,24 @@ struct Json2PbOptions {
     // Allow more bytes remaining in the input after parsing the first json
     // object. Useful when the input contains more than one json object.
     bool allow_remaining_bytes_after_parsing;
+
+    // Match json members with fields by the perfect-hashed tables compiled
+    // once per message type and cached (see message_codec.h) instead of
+    // searching members for every field. Results are the same either way.
+    // Message types with extensions or not in the generated pool are always
+    // converted without the cache.
+    // Default: true
+    bool enable_codec_cache;
+
+    // Fill the message while parsing the json (SAX) instead of building a
+    // rapidjson document of the whole input first, which saves the memory
+    // and time of the document for large inputs. Conversion rules are the
+    // same, but errors are reported in the order of json members and the
+    // message may be partially filled when the input turns out to be an
+    // invalid json. Uses the codecs of message_codec.h regardless of
+    // `enable_codec_cache', messages without codecs are converted as usual.
+    // Default: false
+    bool sax_parsing;
 };
 
 // Convert `json' to protobuf `message' according to `options'.
@@ -0,0 +1,195 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include "butil/containers/doubly_buffered_data.h"
+#include "butil/containers/flat_map.h"
+#include "butil/memory/singleton_on_pthread_once.h"
+#include "butil/thread_local.h"
+#include "json2pb/encode_decode.h"
+#include "json2pb/protobuf_map.h"
+#include "json2pb/rapidjson.h"
+#include "json2pb/message_codec.h"
+
+namespace json2pb {
+
+typedef butil::FlatMap<const google::protobuf::Descriptor*,
+                       const MessageCodec*> CodecMap;
+typedef butil::DoublyBufferedData<CodecMap> DBCodecMap;
+
+// Serializes creations of codecs so that each descriptor gets exactly one.
+static pthread_mutex_t s_codec_creation_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Seeds tried for each table size before doubling the table.
+static const uint32_t MAX_SEED_TRIES = 32;
+// Give up searching for a perfect hash when the table is this many times
+// larger than #fields, colliding keys are resolved by linear probing.
+static const size_t MAX_TABLE_SIZE_RATIO = 16;
+
+// Codecs are never destroyed, remember recently used ones in a small
+// direct-mapped thread-local table to skip reading the global map when
+// converting nested messages.
+static const size_t TLS_CODEC_CACHE_SIZE = 64;
+struct TLSCodecCache {
+    const google::protobuf::Descriptor* descriptors[TLS_CODEC_CACHE_SIZE];
+    const MessageCodec* codecs[TLS_CODEC_CACHE_SIZE];
+};
+static BAIDU_THREAD_LOCAL TLSCodecCache tls_codec_cache;
+
+inline size_t TLSCodecCacheIndex(const google::protobuf::Descriptor* descriptor) {
+    return ((uintptr_t)descriptor >> 4) & (TLS_CODEC_CACHE_SIZE - 1);
+}
+
+static bool AddCodec(CodecMap& m, const MessageCodec* codec) {
+    if (!m.initialized() && m.init(64) != 0) {
+        return false;
+    }
+    m[codec->descriptor()] = codec;
+    return true;
+}
+
+static std::string EscapeJsonName(const std::string& name) {
+    BUTIL_RAPIDJSON_NAMESPACE::StringBuffer buffer;
+    BUTIL_RAPIDJSON_NAMESPACE::OptimizedWriter<
+        BUTIL_RAPIDJSON_NAMESPACE::StringBuffer> writer(buffer);
+    writer.String(name.data(), name.size(), false);
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
+
+MessageCodec::MessageCodec(const google::protobuf::Descriptor* descriptor)
+    : _descriptor(descriptor)
+    , _has_map_field(false)
+    , _seed(0)
+    , _mask(0) {
+    _fields.resize(descriptor->field_count());
+    std::string decoded_name;
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+        FieldCodec& f = _fields[i];
+        f.field = descriptor->field(i);
+        const std::string& orig_name = f.field->name();
+        f.json_name = decode_name(orig_name, decoded_name) ? decoded_name : orig_name;
+        f.escaped_json_name = EscapeJsonName(f.json_name);
+        f.is_map = IsProtobufMap(f.field);
+        if (f.is_map) {
+            f.map_key = f.field->message_type()->field(KEY_INDEX);
+            f.map_value = f.field->message_type()->field(VALUE_INDEX);
+            _has_map_field = true;
+        } else {
+            f.map_key = NULL;
+            f.map_value = NULL;
+        }
+    }
+    BuildIndex();
+}
+
+void MessageCodec::BuildIndex() {
+    const size_t nfield = _fields.size();
+    if (nfield == 0) {
+        return;
+    }
+    size_t table_size = 4;
+    while (table_size < nfield * 2) {
+        table_size *= 2;
+    }
+    std::vector<int> slots;
+    for (; table_size <= nfield * MAX_TABLE_SIZE_RATIO; table_size *= 2) {
+        for (uint32_t seed = 0; seed < MAX_SEED_TRIES; ++seed) {
+            slots.assign(table_size, -1);
+            bool collided = false;
+            for (size_t i = 0; i < nfield; ++i) {
+                const std::string& name = _fields[i].json_name;
+                int& slot = slots[Hash(name.data(), name.size(), seed) & (table_size - 1)];
+                if (slot >= 0) {
+                    collided = true;
+                    break;
+                }
+                slot = (int)i;
+            }
+            if (!collided) {
+                _seed = seed;
+                _mask = table_size - 1;
+                _slots.swap(slots);
+                return;
+            }
+        }
+    }
+    // No perfect hash found (e.g. duplicated json names), fall back to
+    // linear probing which FindField() also understands.
+    table_size /= 2;
+    _seed = 0;
+    _mask = table_size - 1;
+    _slots.assign(table_size, -1);
+    for (size_t i = 0; i < nfield; ++i) {
+        const std::string& name = _fields[i].json_name;
+        uint32_t h = Hash(name.data(), name.size(), _seed);
+        while (_slots[h & _mask] >= 0) {
+            ++h;
+        }
+        _slots[h & _mask] = (int)i;
+    }
+}
+
+const MessageCodec* MessageCodec::Get(const google::protobuf::Descriptor* descriptor) {
+    const size_t tls_index = TLSCodecCacheIndex(descriptor);
+    if (tls_codec_cache.descriptors[tls_index] == descriptor) {
+        return tls_codec_cache.codecs[tls_index];
+    }
+    const MessageCodec* codec = GetSlow(descriptor);
+    if (codec != NULL) {
+        tls_codec_cache.descriptors[tls_index] = descriptor;
+        tls_codec_cache.codecs[tls_index] = codec;
+    }
+    return codec;
+}
+
+const MessageCodec* MessageCodec::GetSlow(const google::protobuf::Descriptor* descriptor) {
+    if (descriptor->extension_range_count() != 0 ||
+        descriptor->file()->pool() != google::protobuf::DescriptorPool::generated_pool()) {
+        return NULL;
+    }
+    DBCodecMap* codecs = butil::get_leaky_singleton<DBCodecMap>();
+    {
+        DBCodecMap::ScopedPtr ptr;
+        if (codecs->Read(&ptr) != 0) {
+            return NULL;
+        }
+        const MessageCodec* const* codec = ptr->seek(descriptor);
+        if (codec != NULL) {
+            return *codec;
+        }
+    }
+    pthread_mutex_lock(&s_codec_creation_mutex);
+    const MessageCodec* codec = NULL;
+    {
+        DBCodecMap::ScopedPtr ptr;
+        if (codecs->Read(&ptr) == 0) {
+            const MessageCodec* const* p = ptr->seek(descriptor);
+            if (p != NULL) {
+                codec = *p;
+            }
+        }
+    }
+    if (codec == NULL) {
+        // Never deleted: generated descriptors live until the program exits.
+        codec = new MessageCodec(descriptor);
+        codecs->Modify(AddCodec, codec);
+    }
+    pthread_mutex_unlock(&s_codec_creation_mutex);
+    return codec;
+}
+
+} // namespace json2pb
@@ -0,0 +1,109 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef BRPC_JSON2PB_MESSAGE_CODEC_H
+#define BRPC_JSON2PB_MESSAGE_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <google/protobuf/descriptor.h>
+
+namespace json2pb {
+
+// Everything the converters need to know about a field, computed once.
+struct FieldCodec {
+    const google::protobuf::FieldDescriptor* field;
+    // Name of the field in json (decoded by decode_name()).
+    std::string json_name;
+    // `json_name' quoted and escaped as rapidjson writers do, so that it
+    // can be copied into the output directly.
+    std::string escaped_json_name;
+    // True if the field is convertable to/from a json object, see
+    // protobuf_map.h for details.
+    bool is_map;
+    const google::protobuf::FieldDescriptor* map_key;
+    const google::protobuf::FieldDescriptor* map_value;
+};
+
+// A flat table of fields of a message type with json names precomputed and
+// indexed by a perfect hash, shared by all conversions of that type.
+// Converting with a MessageCodec skips enumerating the descriptor, decoding
+// names and matching json members by linear search in every call.
+class MessageCodec {
+public:
+    // Get the codec of `descriptor' which is created on first call and
+    // never destroyed. Returns NULL when the message type is not cacheable:
+    // types with extension ranges (the set of known extensions may change at
+    // runtime) or types not in the generated pool (the descriptor may be
+    // destroyed along with its pool).
+    static const MessageCodec* Get(const google::protobuf::Descriptor* descriptor);
+
+    const google::protobuf::Descriptor* descriptor() const { return _descriptor; }
+
+    // Fields in the order of declaration.
+    const std::vector<FieldCodec>& fields() const { return _fields; }
+
+    // True if any field is convertable to a json object.
+    bool has_map_field() const { return _has_map_field; }
+
+    // Returns index in fields() of the field whose json name is
+    // `name[0..len)', -1 if not found.
+    int FindField(const char* name, size_t len) const {
+        if (_slots.empty()) {
+            return -1;
+        }
+        for (uint32_t h = Hash(name, len, _seed); ; ++h) {
+            const int index = _slots[h & _mask];
+            if (index < 0) {
+                return -1;
+            }
+            const std::string& json_name = _fields[index].json_name;
+            if (json_name.size() == len &&
+                memcmp(json_name.data(), name, len) == 0) {
+                return index;
+            }
+        }
+    }
+
+private:
+    explicit MessageCodec(const google::protobuf::Descriptor* descriptor);
+    void BuildIndex();
+    static const MessageCodec* GetSlow(const google::protobuf::Descriptor* descriptor);
+
+    static uint32_t Hash(const char* s, size_t len, uint32_t seed) {
+        // FNV-1a mixed with `seed'
+        uint32_t h = 2166136261u ^ seed;
+        for (size_t i = 0; i < len; ++i) {
+            h = (h ^ (unsigned char)s[i]) * 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    const google::protobuf::Descriptor* _descriptor;
+    std::vector<FieldCodec> _fields;
+    bool _has_map_field;
+    uint32_t _seed;
+    uint32_t _mask;
+    // Indexes into _fields, -1 for empty slots.
+    std::vector<int> _slots;
+};
+
+} // namespace json2pb
+
+#endif // BRPC_JSON2PB_MESSAGE_CODEC_H
@@ -29,6 +29,7 @@
 #include "json2pb/rapidjson.h"
 #include "json2pb/pb_to_json.h"
 #include "json2pb/protobuf_type_resolver.h"
+#include "json2pb/message_codec.h"
 #include "butil/iobuf.h"
 #include "butil/base64.h"
 
@@ -44,7 +45,23 @@ Pb2JsonOptions::Pb2JsonOptions()
 #endif
     , jsonify_empty_array(false)
     , always_print_primitive_fields(false)
-    , single_repeated_to_array(false) {
+    , single_repeated_to_array(false)
+    , enable_codec_cache(true) {
+}
+
+// Write the name of `f' as a json key.
+template <typename Handler>
+inline void WriteFieldName(Handler& handler, const FieldCodec& f) {
+    handler.Key(f.json_name.data(), f.json_name.size(), false);
+}
+
+// OptimizedWriter escapes strings in the same way as the precomputed
+// names, copy them directly.
+template <typename OutputStream>
+inline void WriteFieldName(
+    BUTIL_RAPIDJSON_NAMESPACE::OptimizedWriter<OutputStream>& handler,
+    const FieldCodec& f) {
+    handler.RawKey(f.escaped_json_name.data(), f.escaped_json_name.size());
 }
 
 class PbToJsonConverter {
@@ -57,6 +74,18 @@ public:
     const std::string& ErrorText() const { return _error; }
 
 private:
+    template <typename Handler>
+    bool _ConvertWithCodec(const google::protobuf::Message& message,
+                           const MessageCodec& codec,
+                           Handler& handler, bool root_msg);
+
+    template <typename Handler>
+    bool _PbMapToJson(const google::protobuf::Message& message,
+                      const google::protobuf::FieldDescriptor* map_desc,
+                      const google::protobuf::FieldDescriptor* key_desc,
+                      const google::protobuf::FieldDescriptor* value_desc,
+                      Handler& handler);
+
     template <typename Handler>
     bool _PbFieldToJson(const google::protobuf::Message& message,
                         const google::protobuf::FieldDescriptor* field,
@@ -70,6 +99,12 @@ template <typename Handler>
 bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handler& handler, bool root_msg) {
     const google::protobuf::Reflection* reflection = message.GetReflection();
     const google::protobuf::Descriptor* descriptor = message.GetDescriptor();
+    if (_option.enable_codec_cache) {
+        const MessageCodec* codec = MessageCodec::Get(descriptor);
+        if (codec != NULL) {
+            return _ConvertWithCodec(message, *codec, handler, root_msg);
+        }
+    }
 
     int ext_range_count = descriptor->extension_range_count();
     int field_count = descriptor->field_count();
@@ -147,29 +182,106 @@ bool PbToJsonConverter::Convert(const google::protobuf::Message& message, Handle
         const google::protobuf::FieldDescriptor* value_desc =
                 map_desc->message_type()->field(json2pb::VALUE_INDEX);
 
-        // Write a json object corresponding to hold protobuf map
-        // such as {"key": value, ...}
         const std::string& orig_name = map_desc->name();
         bool decoded = decode_name(orig_name, field_name_str);
         const std::string& name = decoded ? field_name_str : orig_name;
         handler.Key(name.data(), name.size(), false);
-        handler.StartObject();
-        std::string entry_name;
-        for (int j = 0; j < reflection->FieldSize(message, map_desc); ++j) {
-            const google::protobuf::Message& entry =
-                    reflection->GetRepeatedMessage(message, map_desc, j);
-            const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
-            entry_name = entry_reflection->GetStringReference(
-                entry, key_desc, &entry_name);
-            handler.Key(entry_name.data(), entry_name.size(), false);
-
-            // Fill in entries into this json object
-            if (!_PbFieldToJson(entry, value_desc, handler)) {
+        if (!_PbMapToJson(message, map_desc, key_desc, value_desc, handler)) {
+            return false;
+        }
+    }
+    // Hack: Pass 0 as parameter since Writer doesn't care this
+    handler.EndObject(0);
+    return true;
+}
+
+template <typename Handler>
+bool PbToJsonConverter::_ConvertWithCodec(const google::protobuf::Message& message,
+                                          const MessageCodec& codec,
+                                          Handler& handler, bool root_msg) {
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    const std::vector<FieldCodec>& fields = codec.fields();
+    const bool has_map_field = _option.enable_protobuf_map && codec.has_map_field();
+
+    if (root_msg && _option.single_repeated_to_array) {
+        if (!has_map_field && fields.size() == 1 && fields.front().field->is_repeated()) {
+            return _PbFieldToJson(message, fields.front().field, handler);
+        }
+    }
+
+    handler.StartObject();
+
+    // Fill in non-map fields
+    for (size_t i = 0; i < fields.size(); ++i) {
+        const FieldCodec& f = fields[i];
+        if (has_map_field && f.is_map) {
+            continue;
+        }
+        const google::protobuf::FieldDescriptor* field = f.field;
+        if (!field->is_repeated() && !reflection->HasField(message, field)) {
+            // Field that has not been set
+            if (field->is_required()) {
+                _error = "Missing required field: " + field->full_name();
                 return false;
             }
+            // Whether dumps default fields
+            if (!_option.always_print_primitive_fields) {
+                continue;
+            }
+        } else if (field->is_repeated()
+                   && reflection->FieldSize(message, field) == 0
+                   && !_option.jsonify_empty_array) {
+            // Repeated field that has no entry
+            continue;
+        }
+        WriteFieldName(handler, f);
+        if (!_PbFieldToJson(message, field, handler)) {
+            return false;
+        }
+    }
+
+    // Fill in map fields
+    if (has_map_field) {
+        for (size_t i = 0; i < fields.size(); ++i) {
+            const FieldCodec& f = fields[i];
+            if (!f.is_map) {
+                continue;
+            }
+            WriteFieldName(handler, f);
+            if (!_PbMapToJson(message, f.field, f.map_key, f.map_value, handler)) {
+                return false;
+            }
+        }
+    }
+    // Hack: Pass 0 as parameter since Writer doesn't care this
+    handler.EndObject(0);
+    return true;
+}
+
+// Write a json object corresponding to hold protobuf map
+// such as {"key": value, ...}
+template <typename Handler>
+bool PbToJsonConverter::_PbMapToJson(
+    const google::protobuf::Message& message,
+    const google::protobuf::FieldDescriptor* map_desc,
+    const google::protobuf::FieldDescriptor* key_desc,
+    const google::protobuf::FieldDescriptor* value_desc,
+    Handler& handler) {
+    const google::protobuf::Reflection* reflection = message.GetReflection();
+    handler.StartObject();
+    std::string entry_name;
+    for (int j = 0; j < reflection->FieldSize(message, map_desc); ++j) {
+        const google::protobuf::Message& entry =
+                reflection->GetRepeatedMessage(message, map_desc, j);
+        const google::protobuf::Reflection* entry_reflection = entry.GetReflection();
+        entry_name = entry_reflection->GetStringReference(
+            entry, key_desc, &entry_name);
+        handler.Key(entry_name.data(), entry_name.size(), false);
+
+        // Fill in entries into this json object
+        if (!_PbFieldToJson(entry, value_desc, handler)) {
+            return false;
         }
-        // Hack: Pass 0 as parameter since Writer doesn't care this
-        handler.EndObject(0);
     }
     // Hack: Pass 0 as parameter since Writer doesn't care this
     handler.EndObject(0);
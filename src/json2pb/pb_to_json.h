@@ -69,6 +69,13 @@ struct Pb2JsonOptions {
     // Convert the single repeated field to a json array when this option is turned on.
     // Default: false.
     bool single_repeated_to_array;
+
+    // Convert with field tables compiled once per message type and cached
+    // (see message_codec.h) instead of walking the descriptor in every call.
+    // Output is the same either way. Message types with extensions or not in
+    // the generated pool are always converted without the cache.
+    // Default: true
+    bool enable_codec_cache;
 };
 
 // Convert protobuf `messge' to `json' according to `options'.
@@ -20,6 +20,9 @@
 // Date: Mon Oct 19 17:17:36 CST 2015
 
 #include <set>
+#include <limits>
+#include <vector>
+#include <algorithm>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/compiler/code_generator.h>
@@ -265,6 +268,85 @@ static bool is_map_entry(const google::protobuf::Descriptor* d) {
     return true;
 }
 
+// Seeds tried for each table size before doubling the table.
+static const uint32_t MAX_SEED_TRIES = 64;
+// Give up searching for a perfect hash when the table is this many times
+// larger than #fields.
+static const size_t MAX_TABLE_SIZE_RATIO = 16;
+
+// Find a seed making hash_field_name() map idl names of fields of `d' to
+// distinct slots. Returns false if no such seed is found (e.g. duplicated
+// idl names), parsing code looks up FieldMap instead in which case.
+static bool find_perfect_hash(const google::protobuf::Descriptor* d,
+                              uint32_t* seed_out, std::vector<int>* slots_out) {
+    const size_t nfield = d->field_count();
+    if (nfield > (size_t)std::numeric_limits<int16_t>::max()) {
+        return false;
+    }
+    size_t table_size = 1;
+    while (table_size < nfield * 2) {
+        table_size *= 2;
+    }
+    std::vector<int> slots;
+    for (; table_size <= std::max(nfield, (size_t)1) * MAX_TABLE_SIZE_RATIO;
+         table_size *= 2) {
+        for (uint32_t seed = 0; seed < MAX_SEED_TRIES; ++seed) {
+            slots.assign(table_size, -1);
+            bool collided = false;
+            for (size_t i = 0; i < nfield; ++i) {
+                const std::string& name = get_idl_name(d->field(i));
+                int& slot = slots[hash_field_name(name.data(), name.size(), seed)
+                                  & (table_size - 1)];
+                if (slot >= 0) {
+                    collided = true;
+                    break;
+                }
+                slot = (int)i;
+            }
+            if (!collided) {
+                *seed_out = seed;
+                slots_out->swap(slots);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool generate_field_table(const google::protobuf::Descriptor* d,
+                                 const std::vector<int>& slots,
+                                 uint32_t seed,
+                                 google::protobuf::io::Printer& impl) {
+    const std::string var_name = mcpack2pb::to_var_name(d->full_name());
+    impl.Print("static const ::mcpack2pb::FieldName g_$vmsg$_field_names[] = {\n"
+               , "vmsg", var_name);
+    for (int i = 0; i < d->field_count(); ++i) {
+        const std::string& name = get_idl_name(d->field(i));
+        impl.Print("  { \"$field$\", $size$ },\n"
+                   , "field", name
+                   , "size", butil::string_printf("%lu", (unsigned long)name.size()));
+    }
+    if (d->field_count() == 0) {
+        impl.Print("  { \"\", 0 }\n");
+    }
+    impl.Print("};\n"
+               "static const int16_t g_$vmsg$_field_slots[] = {"
+               , "vmsg", var_name);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        impl.Print(i % 16 == 0 ? "\n  $index$," : " $index$,"
+                   , "index", butil::string_printf("%d", slots[i]));
+    }
+    impl.Print(
+        "\n};\n"
+        "static const ::mcpack2pb::FieldNameTable g_$vmsg$_field_table = {\n"
+        "  $seed$, $mask$, g_$vmsg$_field_slots, g_$vmsg$_field_names\n"
+        "};\n"
+        , "vmsg", var_name
+        , "seed", butil::string_printf("%u", seed)
+        , "mask", butil::string_printf("%lu", (unsigned long)(slots.size() - 1)));
+    return !impl.failed();
+}
+
 static bool generate_parsing(const google::protobuf::Descriptor* d,
                              std::set<std::string> & ref_msgs,
                              std::set<std::string> & ref_maps,
@@ -587,28 +669,74 @@ static bool generate_parsing(const google::protobuf::Descriptor* d,
         } // else
     }
 
+    uint32_t seed = 0;
+    std::vector<int> slots;
+    if (find_perfect_hash(d, &seed, &slots)) {
+        // Find fields by the perfect hash and call setters directly.
+        if (!generate_field_table(d, slots, seed, impl)) {
+            return false;
+        }
+        impl.Print(
+            "bool parse_$vmsg$_body_internal(\n"
+            "    ::google::protobuf::Message* msg,\n"
+            "    ::mcpack2pb::UnparsedValue& value) {\n"
+            "  ::mcpack2pb::ObjectIterator it(value);\n"
+            "  for (; it != NULL; ++it) {\n"
+            "    bool ok = false;\n"
+            "    switch (::mcpack2pb::find_field(g_$vmsg$_field_table, it->name)) {\n"
+            , "vmsg", var_name);
+        for (int i = 0; i < d->field_count(); ++i) {
+            impl.Print(
+                "    case $index$:\n"
+                "      ok = set_$vmsg$_$lcfield$(msg, it->value);\n"
+                "      break;\n"
+                , "index", butil::string_printf("%d", i)
+                , "vmsg", var_name
+                , "lcfield", d->field(i)->lowercase_name());
+        }
+        impl.Print(
+            "    default:\n"
+            "      if (!FLAGS_mcpack2pb_absent_field_is_error) {\n"
+            "        continue;\n"
+            "      }\n"
+            "      LOG(ERROR) << \"No field=\" << it->name << \" (\"\n"
+            "                 << it->value << \") in $msg$\";\n"
+            "      return false;\n"
+            "    }\n"
+            "    if (!ok) {\n"
+            "      return false;\n"
+            "    }\n"
+            "  }\n"
+            "  return value.stream()->good();\n"
+            "}\n"
+            , "msg", d->full_name());
+    } else {
+        impl.Print(
+            "bool parse_$vmsg$_body_internal(\n"
+            "    ::google::protobuf::Message* msg,\n"
+            "    ::mcpack2pb::UnparsedValue& value) {\n"
+            "  ::mcpack2pb::ObjectIterator it(value);\n"
+            "  for (; it != NULL; ++it) {\n"
+            "    ::mcpack2pb::SetFieldFn* fn = g_$vmsg$_fields->seek(it->name);\n"
+            "    if (!fn) {\n"
+            "      if (!FLAGS_mcpack2pb_absent_field_is_error) {\n"
+            "        continue;\n"
+            "      } else {\n"
+            "        LOG(ERROR) << \"No field=\" << it->name << \" (\"\n"
+            "                   << it->value << \") in $msg$\";\n"
+            "        return false;\n"
+            "      }\n"
+            "    }\n"
+            "    if (!(*fn)(msg, it->value)) {\n"
+            "      return false;\n"
+            "    }\n"
+            "  }\n"
+            "  return value.stream()->good();\n"
+            "}\n"
+            , "vmsg", var_name
+            , "msg", d->full_name());
+    }
     impl.Print(
-        "bool parse_$vmsg$_body_internal(\n"
-        "    ::google::protobuf::Message* msg,\n"
-        "    ::mcpack2pb::UnparsedValue& value) {\n"
-        "  ::mcpack2pb::ObjectIterator it(value);\n"
-        "  for (; it != NULL; ++it) {\n"
-        "    ::mcpack2pb::SetFieldFn* fn = g_$vmsg$_fields->seek(it->name);\n"
-        "    if (!fn) {\n"
-        "      if (!FLAGS_mcpack2pb_absent_field_is_error) {\n"
-        "        continue;\n"
-        "      } else {\n"
-        "        LOG(ERROR) << \"No field=\" << it->name << \" (\"\n"
-        "                   << it->value << \") in $msg$\";\n"
-        "        return false;\n"
-        "      }\n"
-        "    }\n"
-        "    if (!(*fn)(msg, it->value)) {\n"
-        "      return false;\n"
-        "    }\n"
-        "  }\n"
-        "  return value.stream()->good();\n"
-        "}\n"
         "bool parse_$vmsg$_body(\n"
         "    ::google::protobuf::Message* msg,\n"
         "    ::google::protobuf::io::ZeroCopyInputStream* input,\n"
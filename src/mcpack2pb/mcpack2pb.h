@@ -22,6 +22,8 @@
 #ifndef MCPACK2PB_MCPACK_MCPACK2PB_H
 #define MCPACK2PB_MCPACK_MCPACK2PB_H
 
+#include <stdint.h>
+#include <string.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 #include "butil/containers/flat_map.h"
@@ -37,6 +39,46 @@ typedef bool (*SetFieldFn)(::google::protobuf::Message* msg,
 // Mapping from filed name to its parsing&setting function.
 typedef butil::FlatMap<butil::StringPiece, SetFieldFn> FieldMap;
 
+// Perfect-hashed table of field names generated by protoc-gen-mcpack, so
+// that parsing code maps names to fields without hashing into a FieldMap
+// and calls the setters directly rather than through SetFieldFn.
+struct FieldName {
+    const char* data;
+    size_t size;
+};
+struct FieldNameTable {
+    uint32_t seed;
+    // #slots - 1, #slots is power of 2.
+    uint32_t mask;
+    // Index into `names' for each slot, -1 for empty slots.
+    const int16_t* slots;
+    const FieldName* names;
+};
+
+// The hash function of FieldNameTable. As seeds and slots are computed by
+// protoc-gen-mcpack, generated code must be regenerated if this changes.
+inline uint32_t hash_field_name(const char* name, size_t size, uint32_t seed) {
+    // FNV-1a mixed with `seed'
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < size; ++i) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+// Returns index of the field named `name' in `table', -1 if not found.
+inline int find_field(const FieldNameTable& table, const butil::StringPiece& name) {
+    const int index =
+        table.slots[hash_field_name(name.data(), name.size(), table.seed) & table.mask];
+    if (index >= 0) {
+        const FieldName& fn = table.names[index];
+        if (fn.size == name.size() && memcmp(fn.data, name.data(), fn.size) == 0) {
+            return index;
+        }
+    }
+    return -1;
+}
+
 enum SerializationFormat {
     FORMAT_COMPACK,
     FORMAT_MCPACK_V2
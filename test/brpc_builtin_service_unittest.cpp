@@ -53,6 +53,7 @@
 #include "brpc/builtin/memory_service.h"
 #include "brpc/builtin/common.h"
 #include "brpc/builtin/bad_method_service.h"
+#include "brpc/builtin/hotspots_service.h"
 #include "echo.pb.h"
 #include "brpc/grpc_health_check.pb.h"
 #include "json2pb/pb_to_json.h"
@@ -862,6 +863,8 @@ TEST_F(BuiltinServiceTest, bthreads) {
         service.default_method(&cntl, &req, &res, &done);
         EXPECT_FALSE(cntl.Failed());
         CheckContent(cntl, "Use /bthreads/<bthread_id>");
+        CheckContent(cntl, "sched_latency(us)");
+        CheckContent(cntl, "steal_second");
     }    
     {
         ClosureChecker done;
@@ -912,6 +915,28 @@ TEST_F(BuiltinServiceTest, bthreads) {
 #endif // BRPC_BTHREAD_TRACER
 }
 
+void* sleepy_bthread(void*) {
+    for (int i = 0; i < 10; ++i) {
+        bthread_usleep(50000);
+    }
+    return NULL;
+}
+
+TEST_F(BuiltinServiceTest, hotspots_offcpu) {
+    brpc::HotspotsService service;
+    bthread_t th;
+    EXPECT_EQ(0, bthread_start_background(&th, NULL, sleepy_bthread, NULL));
+    ClosureChecker done;
+    brpc::Controller cntl;
+    SetUpController(&cntl, false);
+    cntl.http_request().uri().SetQuery("seconds", "1");
+    service.offcpu(&cntl, NULL, NULL, &done);
+    EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    CheckContent(cntl, " waits of bthreads blocked for ");
+    CheckContent(cntl, "[usleep];");
+    bthread_join(th, NULL);
+}
+
 TEST_F(BuiltinServiceTest, sockets) {
     brpc::SocketsService service;
     brpc::SocketsRequest req;
@@ -28,6 +28,7 @@
 #include "butil/macros.h"
 #include "butil/logging.h"
 #include "butil/files/temp_file.h"
+#include "bvar/variable.h"
 #include "brpc/socket.h"
 #include "brpc/acceptor.h"
 #include "brpc/server.h"
@@ -38,6 +39,7 @@
 #include "brpc/details/load_balancer_with_naming.h"
 #include "brpc/parallel_channel.h"
 #include "brpc/selective_channel.h"
+#include "brpc/caching_channel.h"
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
 #include "echo.pb.h"
@@ -147,10 +149,14 @@ private:
 };
 
 class MyEchoService : public ::test::EchoService {
+public:
+    MyEchoService() : ncalled(0) {}
+
     void Echo(google::protobuf::RpcController* cntl_base,
               const ::test::EchoRequest* req,
               ::test::EchoResponse* res,
               google::protobuf::Closure* done) {
+        ncalled.fetch_add(1, butil::memory_order_relaxed);
         brpc::Controller* cntl =
             static_cast<brpc::Controller*>(cntl_base);
         std::shared_ptr<CallAfterRpcObject> str_test(new CallAfterRpcObject());
@@ -188,6 +194,8 @@ class MyEchoService : public ::test::EchoService {
         EXPECT_TRUE(nullptr != request);
         EXPECT_TRUE(nullptr != response);
     }
+
+    butil::atomic<int> ncalled;
 };
 
 pthread_once_t register_mock_protocol = PTHREAD_ONCE_INIT;
@@ -2093,6 +2101,215 @@ protected:
         StopAndJoin();
     }
 
+    void TestCoalescing(bool single_server, bool short_connection) {
+        std::cout << " *** single=" << single_server
+                  << " short=" << short_connection << std::endl;
+        ASSERT_EQ(0, StartAccept(_ep));
+        brpc::ChannelOptions opt;
+        opt.max_retry = 0;
+        opt.timeout_ms = 1000;
+        opt.coalesce_requests = true;
+        if (short_connection) {
+            opt.connection_type = brpc::CONNECTION_TYPE_SHORT;
+        }
+        brpc::Channel channel;
+        if (single_server) {
+            ASSERT_EQ(0, channel.Init(_ep, &opt));
+        } else {
+            ASSERT_EQ(0, channel.Init(_naming_url.c_str(), "rR", &opt));
+        }
+
+        const size_t N = 6;
+        brpc::Controller cntls[N];
+        test::EchoRequest reqs[N];
+        test::EchoResponse res[N];
+        for (size_t i = 0; i < N; ++i) {
+            reqs[i].set_message(__FUNCTION__);
+            reqs[i].set_sleep_us(100000); // 100ms
+        }
+        // Different requests are not coalesced.
+        reqs[N - 1].set_message("another");
+        // A separately timedout RPC.
+        cntls[1].set_timeout_ms(20);
+        // Same as the first one with the user-specified key.
+        cntls[2].set_coalescing_key("key");
+        cntls[3].set_coalescing_key("key");
+        reqs[3].set_message("ignored");
+
+        const int ncalled = _svc.ncalled.load();
+        const std::string coalesced_before =
+            bvar::Variable::describe_exposed("rpc_client_coalesced_count");
+        brpc::CallId ids[N];
+        for (size_t i = 0; i < N; ++i) {
+            ids[i] = cntls[i].call_id();
+            ::test::EchoService::Stub(&channel).Echo(
+                &cntls[i], &reqs[i], &res[i], brpc::DoNothing());
+        }
+        // Canceled RPC ends without affecting others.
+        brpc::StartCancel(ids[4]);
+        bthread_id_join(ids[4]);
+        EXPECT_EQ(ECANCELED, cntls[4].ErrorCode()) << cntls[4].ErrorText();
+        bthread_id_join(ids[1]);
+        EXPECT_EQ(brpc::ERPCTIMEDOUT, cntls[1].ErrorCode()) << cntls[1].ErrorText();
+        for (size_t i = 0; i < N; ++i) {
+            bthread_id_join(ids[i]);
+        }
+        EXPECT_FALSE(cntls[0].Failed()) << cntls[0].ErrorText();
+        EXPECT_EQ("received " + std::string(__FUNCTION__), res[0].message());
+        EXPECT_FALSE(cntls[2].Failed()) << cntls[2].ErrorText();
+        EXPECT_FALSE(cntls[3].Failed()) << cntls[3].ErrorText();
+        EXPECT_EQ("received " + std::string(__FUNCTION__), res[2].message());
+        EXPECT_EQ(res[2].message(), res[3].message());
+        EXPECT_FALSE(cntls[5].Failed()) << cntls[5].ErrorText();
+        EXPECT_EQ("received another", res[5].message());
+        // Calls of #0, #2 and #5 (creating the shared calls).
+        EXPECT_EQ(ncalled + 3, _svc.ncalled.load());
+        const std::string coalesced_after =
+            bvar::Variable::describe_exposed("rpc_client_coalesced_count");
+        EXPECT_EQ(atoi(coalesced_before.c_str()) + 3,
+                  atoi(coalesced_after.c_str()));
+
+        // Not coalesced after the shared call ends.
+        brpc::Controller cntl;
+        test::EchoResponse res2;
+        reqs[0].set_sleep_us(0);
+        CallMethod(&channel, &cntl, &reqs[0], &res2, false);
+        EXPECT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        EXPECT_EQ(ncalled + 4, _svc.ncalled.load());
+        StopAndJoin();
+    }
+
+    class CacheEvenCodes : public brpc::CachePolicy {
+    public:
+        bool DoCache(const google::protobuf::MethodDescriptor*,
+                     const brpc::Controller*,
+                     const google::protobuf::Message* req_base) const {
+            const test::EchoRequest* req =
+                static_cast<const test::EchoRequest*>(req_base);
+            return req->code() % 2 == 0;
+        }
+        int64_t GetTtlMs(const brpc::Controller*,
+                         const google::protobuf::Message*,
+                         int64_t default_ttl_ms) const {
+            return default_ttl_ms;
+        }
+    };
+
+    void TestCaching(bool async) {
+        std::cout << " *** async=" << async << std::endl;
+        ASSERT_EQ(0, StartAccept(_ep));
+        brpc::Channel* subchan = new brpc::Channel;
+        SetUpChannel(subchan, true, false);
+        CacheEvenCodes policy;
+        brpc::CachingChannelOptions opt;
+        opt.ttl_ms = 100;
+        opt.cache_policy = &policy;
+        brpc::CachingChannel channel;
+        ASSERT_EQ(0, channel.Init(subchan, brpc::OWNS_CHANNEL, &opt));
+
+        const int ncalled = _svc.ncalled.load();
+        test::EchoRequest req;
+        req.set_message(__FUNCTION__);
+        for (int i = 0; i < 3; ++i) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            cntl.request_attachment().append("attachment");
+            CallMethod(&channel, &cntl, &req, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            EXPECT_EQ("received " + std::string(__FUNCTION__), res.message());
+        }
+        EXPECT_EQ(ncalled + 1, _svc.ncalled.load());
+        EXPECT_EQ(1u, channel.cached_count());
+
+        // Different attachment is a different request.
+        {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            CallMethod(&channel, &cntl, &req, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            EXPECT_EQ(ncalled + 2, _svc.ncalled.load());
+            EXPECT_EQ(2u, channel.cached_count());
+        }
+
+        // Not cached according to the policy.
+        test::EchoRequest req2(req);
+        req2.set_code(1);
+        for (int i = 0; i < 2; ++i) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            CallMethod(&channel, &cntl, &req2, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            ASSERT_EQ(1, res.code_list_size());
+        }
+        EXPECT_EQ(ncalled + 4, _svc.ncalled.load());
+
+        // Failed RPCs are not cached.
+        test::EchoRequest req3(req);
+        req3.set_server_fail(brpc::EINTERNAL);
+        for (int i = 0; i < 2; ++i) {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            CallMethod(&channel, &cntl, &req3, &res, async);
+            ASSERT_EQ(brpc::EINTERNAL, cntl.ErrorCode());
+        }
+        EXPECT_EQ(ncalled + 6, _svc.ncalled.load());
+        EXPECT_EQ(2u, channel.cached_count());
+
+        // Invalidated.
+        butil::IOBuf attachment;
+        attachment.append("attachment");
+        channel.Invalidate(test::EchoService::descriptor()->method(0),
+                           &req, attachment);
+        EXPECT_EQ(1u, channel.cached_count());
+        channel.InvalidateMethod(test::EchoService::descriptor()->method(0));
+        EXPECT_EQ(0u, channel.cached_count());
+        EXPECT_EQ(0u, channel.cached_size());
+        {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            CallMethod(&channel, &cntl, &req, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            EXPECT_EQ(ncalled + 7, _svc.ncalled.load());
+        }
+        // Expired.
+        bthread_usleep(150000);
+        {
+            brpc::Controller cntl;
+            test::EchoResponse res;
+            CallMethod(&channel, &cntl, &req, &res, async);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            EXPECT_EQ(ncalled + 8, _svc.ncalled.load());
+        }
+        StopAndJoin();
+    }
+
+    void TestCachingEviction() {
+        ASSERT_EQ(0, StartAccept(_ep));
+        brpc::Channel subchan;
+        SetUpChannel(&subchan, true, false);
+        brpc::CachingChannelOptions opt;
+        opt.max_size = 400;
+        brpc::CachingChannel channel;
+        ASSERT_EQ(0, channel.Init(&subchan, brpc::DOESNT_OWN_CHANNEL, &opt));
+        const int ncalled = _svc.ncalled.load();
+        for (int i = 0; i < 20; ++i) {
+            brpc::Controller cntl;
+            test::EchoRequest req;
+            test::EchoResponse res;
+            req.set_message(std::string(50, 'a' + i % 10));
+            CallMethod(&channel, &cntl, &req, &res, false);
+            ASSERT_EQ(0, cntl.ErrorCode()) << cntl.ErrorText();
+            EXPECT_LE(channel.cached_size(), opt.max_size);
+        }
+        // The 10 distinct requests can't be cached together, the least
+        // recently used ones are always evicted.
+        EXPECT_EQ(ncalled + 20, _svc.ncalled.load());
+        EXPECT_LT(0u, channel.cached_count());
+        channel.InvalidateAll();
+        EXPECT_EQ(0u, channel.cached_count());
+        StopAndJoin();
+    }
+
     butil::EndPoint _ep;
     butil::TempFile _server_list;                                        
     std::string _naming_url;
@@ -2622,6 +2839,21 @@ TEST_F(ChannelTest, timeout) {
     }
 }
 
+TEST_F(ChannelTest, coalesce_requests) {
+    for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
+        for (int j = 0; j <= 1; ++j) { // Flag ShortConnection
+            TestCoalescing(i, j);
+        }
+    }
+}
+
+TEST_F(ChannelTest, caching_channel) {
+    for (int i = 0; i <= 1; ++i) { // Flag Asynchronous
+        TestCaching(i);
+    }
+    TestCachingEviction();
+}
+
 TEST_F(ChannelTest, timeout_parallel) {
     for (int i = 0; i <= 1; ++i) { // Flag SingleServer 
         for (int j = 0; j <= 1; ++j) { // Flag Asynchronous
@@ -0,0 +1,156 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <sstream>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "bthread/bthread.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/details/continuous_profiler.h"
+
+namespace brpc {
+DECLARE_int32(continuous_profiling_hz);
+DECLARE_bool(continuous_profiling_save_to_disk);
+}
+
+namespace {
+
+volatile uint64_t g_sink = 0;
+
+void __attribute__((noinline)) ContinuousProfilerBusyLoop(int64_t ms) {
+    const int64_t end_us = butil::gettimeofday_us() + ms * 1000;
+    while (butil::gettimeofday_us() < end_us) {
+        for (int i = 0; i < 10000; ++i) {
+            g_sink = g_sink * 31 + i;
+        }
+    }
+}
+
+void* BusyBthread(void*) {
+    ContinuousProfilerBusyLoop(300);
+    return NULL;
+}
+
+class ContinuousProfilerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        brpc::FLAGS_continuous_profiling_save_to_disk = false;
+        brpc::FLAGS_continuous_profiling_hz = 1000;
+        ASSERT_EQ(0, brpc::StartContinuousProfiler());
+    }
+    void TearDown() override {
+        brpc::StopContinuousProfiler();
+    }
+};
+
+TEST_F(ContinuousProfilerTest, sample_pthreads_and_bthreads) {
+    ContinuousProfilerBusyLoop(300);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, BusyBthread, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    brpc::FlushContinuousProfiler();
+
+    const int64_t now_s = butil::gettimeofday_s();
+    brpc::FoldedProfile profile;
+    ASSERT_LE(1, brpc::GetContinuousProfile(now_s - 120, now_s + 1, &profile));
+    ASSERT_LT(0, profile.nsample);
+    bool found_pthread = false;
+    bool found_bthread = false;
+    for (brpc::FoldedStacks::const_iterator it = profile.stacks.begin();
+         it != profile.stacks.end(); ++it) {
+        if (it->first.compare(0, 9, "[pthread]") == 0) {
+            found_pthread = true;
+        } else if (it->first.compare(0, 9, "[bthread:") == 0) {
+            found_bthread = true;
+        }
+    }
+    ASSERT_TRUE(found_pthread);
+    ASSERT_TRUE(found_bthread);
+
+    std::vector<std::pair<int64_t, int64_t> > ranges;
+    brpc::ListContinuousProfiles(&ranges);
+    ASSERT_FALSE(ranges.empty());
+    ASSERT_EQ(60, ranges.back().second - ranges.back().first);
+}
+
+TEST_F(ContinuousProfilerTest, pause_and_resume) {
+    brpc::PauseContinuousProfiler();
+    brpc::FlushContinuousProfiler();
+    const int64_t now_s = butil::gettimeofday_s();
+    brpc::FoldedProfile before;
+    brpc::GetContinuousProfile(now_s - 120, now_s + 1, &before);
+    ContinuousProfilerBusyLoop(200);
+    brpc::FoldedProfile paused;
+    brpc::GetContinuousProfile(now_s - 120, now_s + 1, &paused);
+    // Samples may be moved into history at the turn of minute, but no
+    // new samples.
+    ASSERT_EQ(before.nsample, paused.nsample);
+    brpc::ResumeContinuousProfiler();
+    ContinuousProfilerBusyLoop(200);
+    brpc::FoldedProfile resumed;
+    brpc::GetContinuousProfile(now_s - 120, now_s + 2, &resumed);
+    ASSERT_LT(paused.nsample, resumed.nsample);
+}
+
+TEST(ContinuousProfilerPrintTest, print_folded_stacks) {
+    brpc::FoldedStacks stacks;
+    stacks["[pthread];main;foo"] = 3;
+    stacks["[pthread];main;bar"] = 5;
+    std::ostringstream os;
+    brpc::PrintFoldedStacks(os, stacks, NULL);
+    ASSERT_EQ("[pthread];main;bar 5\n[pthread];main;foo 3\n", os.str());
+
+    brpc::FoldedStacks base;
+    base["[pthread];main;foo"] = 7;
+    base["[pthread];main;baz"] = 1;
+    os.str("");
+    brpc::PrintFoldedStacks(os, stacks, &base);
+    ASSERT_EQ("[pthread];main;bar 0 5\n"
+              "[pthread];main;foo 7 3\n"
+              "[pthread];main;baz 1 0\n", os.str());
+}
+
+TEST_F(ContinuousProfilerTest, hotspots_page) {
+    brpc::Server server;
+    ASSERT_EQ(0, server.Start("127.0.0.1:0", NULL));
+    ContinuousProfilerBusyLoop(200);
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    ASSERT_EQ(0, channel.Init(server.listen_address(), &options));
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/hotspots/continuous?start=-120&base_start=-240";
+    channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    const std::string body = cntl.response_attachment().to_string();
+    ASSERT_NE(std::string::npos, body.find(" compared with ")) << body;
+    ASSERT_NE(std::string::npos, body.find("\n[pthread];")) << body;
+
+    brpc::Controller cntl2;
+    cntl2.http_request().uri() = "/hotspots/continuous?display_type=dot";
+    channel.CallMethod(NULL, &cntl2, NULL, NULL, NULL);
+    ASSERT_TRUE(cntl2.Failed());
+    server.Stop(0);
+    server.Join();
+}
+
+} // namespace
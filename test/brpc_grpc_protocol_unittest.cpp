@@ -22,6 +22,8 @@
 #include "brpc/server.h"
 #include "brpc/channel.h"
 #include "brpc/grpc.h"
+#include "brpc/grpc_stream.h"
+#include "bthread/countdown_event.h"
 #include "butil/time.h"
 #include "grpc.pb.h"
 
@@ -47,6 +49,50 @@ const std::string g_req = "wyt";
 const int64_t g_timeout_ms = 1000;
 const std::string g_protocol = "h2:grpc";
 
+// Replies each request with a response, ends the stream when the client
+// half-closes.
+class EchoStreamHandler : public brpc::GrpcStreamHandler {
+public:
+    void on_received_messages(brpc::GrpcStream* stream,
+                              butil::IOBuf* const messages[],
+                              size_t size) override {
+        for (size_t i = 0; i < size; ++i) {
+            test::GrpcRequest req;
+            EXPECT_TRUE(req.ParseFromString(messages[i]->to_string()));
+            test::GrpcResponse res;
+            res.set_message(g_prefix + req.message());
+            EXPECT_EQ(0, stream->Write(res));
+        }
+    }
+    void on_closed(brpc::GrpcStream* stream, const butil::Status& status) override {
+        EXPECT_TRUE(status.ok()) << status;
+        EXPECT_EQ(0, stream->Close());
+        delete this;
+    }
+};
+
+class CollectStreamHandler : public brpc::GrpcStreamHandler {
+public:
+    CollectStreamHandler() : closed(1) {}
+    void on_received_messages(brpc::GrpcStream*,
+                              butil::IOBuf* const messages[],
+                              size_t size) override {
+        for (size_t i = 0; i < size; ++i) {
+            test::GrpcResponse res;
+            EXPECT_TRUE(res.ParseFromString(messages[i]->to_string()));
+            responses.push_back(res.message());
+        }
+    }
+    void on_closed(brpc::GrpcStream*, const butil::Status& s) override {
+        status = s;
+        closed.signal();
+    }
+
+    std::vector<std::string> responses;
+    butil::Status status;
+    bthread::CountdownEvent closed;
+};
+
 class MyGrpcService : public ::test::GrpcService {
 public:
     void Method(::google::protobuf::RpcController* cntl_base,
@@ -86,6 +132,50 @@ public:
         res->set_message(g_prefix + req->message());
         return;
     }
+
+    void ServerStream(::google::protobuf::RpcController* cntl_base,
+                      const ::test::GrpcRequest* req,
+                      ::test::GrpcResponse*,
+                      ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        butil::intrusive_ptr<brpc::GrpcStream> stream;
+        if (brpc::GrpcStreamAccept(&stream, *cntl, NULL) != 0) {
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        // Buffered until the stream is connected by done->Run().
+        for (int i = 0; i < 3; ++i) {
+            test::GrpcResponse res;
+            res.set_message(g_prefix + req->message() + butil::string_printf("%d", i));
+            EXPECT_EQ(0, stream->Write(res));
+        }
+        if (req->return_error()) {
+            EXPECT_EQ(0, stream->Close(butil::Status(brpc::EINTERNAL, "%s", g_prefix.c_str())));
+        } else {
+            EXPECT_EQ(0, stream->Close());
+        }
+    }
+
+    void BidiStream(::google::protobuf::RpcController* cntl_base,
+                    const ::test::GrpcRequest* req,
+                    ::test::GrpcResponse*,
+                    ::google::protobuf::Closure* done) {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        brpc::GrpcStreamOptions opt;
+        opt.handler = new EchoStreamHandler;
+        opt.max_buf_size = 0;
+        butil::intrusive_ptr<brpc::GrpcStream> stream;
+        if (brpc::GrpcStreamAccept(&stream, *cntl, &opt) != 0) {
+            delete opt.handler;
+            cntl->SetFailed("Fail to accept stream");
+            return;
+        }
+        test::GrpcResponse res;
+        res.set_message(g_prefix + req->message());
+        EXPECT_EQ(0, stream->Write(res));
+    }
 };
 
 class GrpcTest : public ::testing::Test {
@@ -272,4 +362,98 @@ TEST_F(GrpcTest, GrpcTimeOut) {
     }
 }
 
-} // namespace 
+TEST_F(GrpcTest, server_streaming) {
+    for (int i = 0; i < 2; ++i) {
+        const bool return_error = (i == 1);
+        test::GrpcRequest req;
+        test::GrpcResponse res;
+        brpc::Controller cntl;
+        req.set_message(g_req);
+        req.set_gzip(false);
+        req.set_return_error(return_error);
+        CollectStreamHandler handler;
+        brpc::GrpcStreamOptions opt;
+        opt.handler = &handler;
+        butil::intrusive_ptr<brpc::GrpcStream> stream;
+        ASSERT_EQ(0, brpc::GrpcStreamCreate(&stream, cntl, &opt));
+        test::GrpcService_Stub stub(&_channel);
+        stub.ServerStream(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        handler.closed.wait();
+        ASSERT_EQ(3u, handler.responses.size());
+        for (int j = 0; j < 3; ++j) {
+            EXPECT_EQ(g_prefix + g_req + butil::string_printf("%d", j),
+                      handler.responses[j]);
+        }
+        if (return_error) {
+            EXPECT_EQ(brpc::EINTERNAL, handler.status.error_code());
+            EXPECT_EQ(g_prefix, handler.status.error_str());
+        } else {
+            EXPECT_TRUE(handler.status.ok()) << handler.status;
+        }
+        // The server ended the stream.
+        EXPECT_EQ(EINVAL, stream->Write(req));
+    }
+}
+
+TEST_F(GrpcTest, bidi_streaming) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    CollectStreamHandler handler;
+    brpc::GrpcStreamOptions opt;
+    opt.handler = &handler;
+    butil::intrusive_ptr<brpc::GrpcStream> stream;
+    ASSERT_EQ(0, brpc::GrpcStreamCreate(&stream, cntl, &opt));
+    test::GrpcService_Stub stub(&_channel);
+    stub.BidiStream(&cntl, &req, &res, NULL);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    // Large messages are blocked by windows of http2 in both directions.
+    const int N = 64;
+    const std::string big(32 * 1024, 'x');
+    for (int i = 0; i < N; ++i) {
+        test::GrpcRequest req2 = req;
+        req2.set_message(big + butil::string_printf("%d", i));
+        int rc = 0;
+        while ((rc = stream->Write(req2)) == EAGAIN) {
+            ASSERT_EQ(0, stream->Wait(NULL));
+        }
+        ASSERT_EQ(0, rc);
+    }
+    ASSERT_EQ(0, stream->Close());
+    EXPECT_EQ(EINVAL, stream->Write(req));
+    handler.closed.wait();
+    EXPECT_TRUE(handler.status.ok()) << handler.status;
+    ASSERT_EQ((size_t)N + 1, handler.responses.size());
+    EXPECT_EQ(g_prefix + g_req, handler.responses[0]);
+    for (int i = 0; i < N; ++i) {
+        EXPECT_EQ(g_prefix + big + butil::string_printf("%d", i),
+                  handler.responses[i + 1]);
+    }
+}
+
+TEST_F(GrpcTest, stream_of_unary_method) {
+    test::GrpcRequest req;
+    test::GrpcResponse res;
+    brpc::Controller cntl;
+    req.set_message(g_req);
+    req.set_gzip(false);
+    req.set_return_error(false);
+    CollectStreamHandler handler;
+    brpc::GrpcStreamOptions opt;
+    opt.handler = &handler;
+    butil::intrusive_ptr<brpc::GrpcStream> stream;
+    ASSERT_EQ(0, brpc::GrpcStreamCreate(&stream, cntl, &opt));
+    test::GrpcService_Stub stub(&_channel);
+    stub.Method(&cntl, &req, &res, NULL);
+    // The RPC is done as usual while the stream fails.
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    EXPECT_EQ(g_prefix + g_req, res.message());
+    handler.closed.wait();
+    EXPECT_EQ(brpc::EREQUEST, handler.status.error_code());
+}
+
+} // namespace
@@ -21,7 +21,9 @@
 
 #include <gtest/gtest.h>
 #include "brpc/details/hpack.h"
+#include "butil/fast_rand.h"
 #include "butil/logging.h"
+#include "butil/time.h"
 
 class HPackTest : public testing::Test {
 };
@@ -548,3 +550,159 @@ TEST_F(HPackTest, responses_with_huffman) {
     }
     ASSERT_TRUE(buf.buf().empty());
 }
+
+TEST_F(HPackTest, huffman_of_all_bytes) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.index_policy = brpc::HPACK_NEVER_INDEX_HEADER;
+    options.encode_name = true;
+    options.encode_value = true;
+    for (int len = 0; len < 600; len += 7) {
+        brpc::HPacker::Header h;
+        h.name = "x-value";
+        for (int i = 0; i < len; ++i) {
+            // Mostly printable characters which are shorter after encoding.
+            h.value.push_back((i % 11 == 0) ? (char)butil::fast_rand_less_than(256)
+                              : (char)(' ' + butil::fast_rand_less_than(95)));
+        }
+        butil::IOBufAppender buf;
+        p1.Encode(&buf, h, options);
+        brpc::HPacker::Header h2;
+        ASSERT_GT(p2.Decode(&buf.buf(), &h2), 0);
+        ASSERT_EQ(h.name, h2.name);
+        ASSERT_EQ(h.value, h2.value);
+        ASSERT_TRUE(buf.buf().empty());
+    }
+    // Binary values longer after huffman encoding are sent as they are.
+    brpc::HPacker::Header h("x-bin", std::string(8, (char)0xff));
+    options.encode_name = false;
+    butil::IOBufAppender buf;
+    p1.Encode(&buf, h, options);
+    ASSERT_EQ(1 + 1 + h.name.size() + 1 + h.value.size(), buf.buf().size());
+    brpc::HPacker::Header h2;
+    ASSERT_GT(p2.Decode(&buf.buf(), &h2), 0);
+    ASSERT_EQ(h.value, h2.value);
+}
+
+TEST_F(HPackTest, invalid_huffman_padding) {
+    brpc::HPacker p;
+    ASSERT_EQ(0, p.Init(4096));
+    // "a"(00011) padded with 0 instead of 1.
+    const uint8_t zero_padding[] = { 0x00, 0x01, 'x', 0x81, 0x18 };
+    butil::IOBuf buf;
+    buf.append(zero_padding, sizeof(zero_padding));
+    brpc::HPacker::Header h;
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    // "a" followed by a whole byte of padding.
+    const uint8_t long_padding[] = { 0x00, 0x01, 'x', 0x82, 0x1f, 0xff };
+    buf.clear();
+    buf.append(long_padding, sizeof(long_padding));
+    ASSERT_EQ(-1, p.Decode(&buf, &h));
+    const uint8_t valid[] = { 0x00, 0x01, 'x', 0x81, 0x1f };
+    buf.clear();
+    buf.append(valid, sizeof(valid));
+    ASSERT_EQ((ssize_t)sizeof(valid), p.Decode(&buf, &h));
+    ASSERT_EQ("x", h.name);
+    ASSERT_EQ("a", h.value);
+}
+
+TEST_F(HPackTest, encode_headers) {
+    // The small table evicts entries referenced by remembered sets.
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(256));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(256));
+    brpc::HPackOptions options;
+    options.encode_name = true;
+    options.encode_value = true;
+    std::vector<brpc::HPacker::Header> set1;
+    set1.push_back(brpc::HPacker::Header(":method", "POST"));
+    set1.push_back(brpc::HPacker::Header(":path", "/test.EchoService/Echo"));
+    set1.push_back(brpc::HPacker::Header("content-type", "application/grpc"));
+    set1.push_back(brpc::HPacker::Header("te", "trailers"));
+    std::vector<brpc::HPacker::Header> set2 = set1;
+    set2[1].value = "/test.EchoService/Echo2";
+    for (int i = 0; i < 100; ++i) {
+        std::vector<brpc::HPacker::Header> headers = (i % 3 ? set1 : set2);
+        if (i % 7 == 0) {
+            // Adds a new entry into the table.
+            headers.push_back(brpc::HPacker::Header(
+                "x-request-id", butil::string_printf("%d", i)));
+        }
+        butil::IOBufAppender buf;
+        p1.EncodeHeaders(&buf, &headers[0], headers.size(), options);
+        for (size_t j = 0; j < headers.size(); ++j) {
+            brpc::HPacker::Header h;
+            ASSERT_GT(p2.Decode(&buf.buf(), &h), 0) << "i=" << i;
+            ASSERT_EQ(headers[j].name, h.name);
+            ASSERT_EQ(headers[j].value, h.value);
+        }
+        ASSERT_TRUE(buf.buf().empty());
+    }
+}
+
+TEST_F(HPackTest, encode_decode_perf) {
+    brpc::HPacker p1;
+    ASSERT_EQ(0, p1.Init(4096));
+    brpc::HPacker p2;
+    ASSERT_EQ(0, p2.Init(4096));
+    brpc::HPackOptions options;
+    options.encode_name = true;
+    options.encode_value = true;
+    // Requests of gRPC with some metadata.
+    std::vector<brpc::HPacker::Header> headers;
+    headers.push_back(brpc::HPacker::Header(":method", "POST"));
+    headers.push_back(brpc::HPacker::Header(":scheme", "http"));
+    headers.push_back(brpc::HPacker::Header(":path", "/helloworld.Greeter/SayHello"));
+    headers.push_back(brpc::HPacker::Header(":authority", "127.0.0.1:50051"));
+    headers.push_back(brpc::HPacker::Header("content-type", "application/grpc"));
+    headers.push_back(brpc::HPacker::Header("user-agent", "brpc/1.0 curl/7.0"));
+    headers.push_back(brpc::HPacker::Header("te", "trailers"));
+    headers.push_back(brpc::HPacker::Header("grpc-timeout", "1000m"));
+    headers.push_back(brpc::HPacker::Header("x-tenant", "search-frontend-online"));
+    headers.push_back(brpc::HPacker::Header("x-auth-token",
+                                            "Bearer eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9"));
+    const int N = 100000;
+    butil::IOBufAppender buf;
+    butil::Timer tm;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        for (size_t j = 0; j < headers.size(); ++j) {
+            p1.Encode(&buf, headers[j], options);
+        }
+    }
+    tm.stop();
+    const int64_t encode_ns = tm.n_elapsed() / N;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        p1.EncodeHeaders(&buf, &headers[0], headers.size(), options);
+    }
+    tm.stop();
+    const int64_t encode_headers_ns = tm.n_elapsed() / N;
+    buf.buf().clear();
+
+    // Literals without indexing are Huffman-encoded and decoded every time.
+    brpc::HPacker p3;
+    ASSERT_EQ(0, p3.Init(4096));
+    options.index_policy = brpc::HPACK_NOT_INDEX_HEADER;
+    for (size_t j = 0; j < headers.size(); ++j) {
+        p3.Encode(&buf, headers[j], options);
+    }
+    const butil::IOBuf encoded = buf.buf();
+    brpc::HPacker::Header h;
+    tm.start();
+    for (int i = 0; i < N; ++i) {
+        butil::IOBufBytesIterator it(encoded);
+        for (size_t j = 0; j < headers.size(); ++j) {
+            ASSERT_GT(p2.Decode(it, &h), 0);
+        }
+    }
+    tm.stop();
+    LOG(INFO) << "Encode=" << encode_ns << "ns EncodeHeaders=" << encode_headers_ns
+              << "ns Decode=" << tm.n_elapsed() / N << "ns per request of "
+              << headers.size() << " headers, " << encoded.size()
+              << " bytes with huffman encoding";
+}
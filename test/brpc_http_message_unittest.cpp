@@ -273,6 +273,45 @@ TEST(HttpMessageTest, parse_http_head_response) {
     ASSERT_EQ("chunked", *transfer_encoding);
 }
 
+TEST(HttpMessageTest, stop_at_message_end) {
+    const std::string response1 =
+        "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc";
+    const std::string response2 =
+        "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\ndef";
+    const std::string responses = response1 + "\r\n" + response2;
+
+    // Not stopped by default, which is the behavior of servers.
+    {
+        brpc::HttpMessage http_message;
+        ASSERT_EQ((ssize_t)responses.size(),
+                  http_message.ParseFromArray(responses.data(), responses.size()));
+    }
+    {
+        brpc::HttpMessage http_message;
+        http_message.set_stop_at_message_end(true);
+        // The line break between messages is consumed.
+        ASSERT_EQ((ssize_t)response1.size() + 2,
+                  http_message.ParseFromArray(responses.data(), responses.size()));
+        ASSERT_TRUE(http_message.Completed());
+        ASSERT_EQ("abc", http_message.body().to_string());
+    }
+    {
+        butil::IOBuf buf;
+        buf.append(responses);
+        brpc::HttpMessage http_message;
+        http_message.set_stop_at_message_end(true);
+        ASSERT_EQ((ssize_t)response1.size() + 2, http_message.ParseFromIOBuf(buf));
+        ASSERT_TRUE(http_message.Completed());
+        ASSERT_EQ("abc", http_message.body().to_string());
+        buf.pop_front(response1.size() + 2);
+        brpc::HttpMessage http_message2;
+        http_message2.set_stop_at_message_end(true);
+        ASSERT_EQ((ssize_t)response2.size(), http_message2.ParseFromIOBuf(buf));
+        ASSERT_TRUE(http_message2.Completed());
+        ASSERT_EQ("def", http_message2.body().to_string());
+    }
+}
+
 TEST(HttpMessageTest, parse_http_cookie) {
     const char* http_request =
         "GET /CloudApiControl HTTP/1.1\r\n"
@@ -41,7 +41,10 @@
 #include "butil/files/scoped_file.h"
 #include "butil/fd_guard.h"
 #include "butil/file_util.h"
+#include "butil/string_printf.h"
+#include "bvar/variable.h"
 #include "brpc/socket.h"
+#include "brpc/socket_map.h"
 #include "brpc/acceptor.h"
 #include "brpc/server.h"
 #include "brpc/channel.h"
@@ -61,6 +64,9 @@ DECLARE_string(rpc_dump_dir);
 DECLARE_int32(rpc_dump_max_requests_in_one_file);
 DECLARE_bool(allow_chunked_length);
 extern bvar::CollectorSpeedLimit g_rpc_dump_sl;
+namespace policy {
+DECLARE_int32(http_streaming_json_chunk_size);
+}
 }
 
 int main(int argc, char* argv[]) {
@@ -1671,6 +1677,277 @@ TEST_F(HttpTest, http2_handle_goaway_streams) {
     }
 }
 
+// Read requests from `fd' until `count' requests without body are received.
+static std::string ReadHttpRequests(int fd, int count) {
+    std::string data;
+    char buf[4096];
+    int received = 0;
+    while (received < count) {
+        const ssize_t nr = ::read(fd, buf, sizeof(buf));
+        if (nr <= 0) {
+            break;
+        }
+        data.append(buf, nr);
+        received = 0;
+        for (size_t pos = data.find("\r\n\r\n"); pos != std::string::npos;
+             pos = data.find("\r\n\r\n", pos + 4)) {
+            ++received;
+        }
+    }
+    return data;
+}
+
+TEST_F(HttpTest, http_pipelining) {
+    const butil::EndPoint ep(butil::IP_ANY, 5962);
+    butil::fd_guard listenfd(butil::tcp_listen(ep));
+    ASSERT_GT(listenfd, 0);
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    options.connection_type = "single";
+    options.max_retry = 0;
+    ASSERT_EQ(0, channel.Init(ep, &options));
+
+    const int N = 8;
+    brpc::Controller cntls[N];
+    for (int i = 0; i < N; ++i) {
+        cntls[i].set_timeout_ms(-1);
+        cntls[i].http_request().uri() = "/echo?i=" + std::to_string(i);
+        channel.CallMethod(NULL, &cntls[i], NULL, NULL, brpc::DoNothing());
+    }
+
+    // All requests are sent over one connection before any response.
+    butil::fd_guard servfd(accept(listenfd, NULL, NULL));
+    ASSERT_GT(servfd, 0);
+    const std::string requests = ReadHttpRequests(servfd, N);
+    size_t last_pos = 0;
+    for (int i = 0; i < N; ++i) {
+        const size_t pos = requests.find("/echo?i=" + std::to_string(i) + " ");
+        ASSERT_NE(std::string::npos, pos);
+        ASSERT_LE(last_pos, pos);
+        last_pos = pos;
+    }
+    // Responses in the order of requests.
+    std::string responses;
+    for (int i = 0; i < N; ++i) {
+        const std::string body = "response-" + std::to_string(i);
+        butil::string_appendf(&responses,
+                              "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n\r\n%s",
+                              body.size(), body.c_str());
+    }
+    ASSERT_EQ((ssize_t)responses.size(),
+              ::write(servfd, responses.data(), responses.size()));
+    for (int i = 0; i < N; ++i) {
+        brpc::Join(cntls[i].call_id());
+        ASSERT_FALSE(cntls[i].Failed()) << cntls[i].ErrorText();
+        ASSERT_EQ(brpc::CONNECTION_TYPE_SINGLE, cntls[i].connection_type());
+        ASSERT_EQ("response-" + std::to_string(i),
+                  cntls[i].response_attachment().to_string());
+    }
+
+    // The server closes the connection after the response, following RPCs
+    // fall back to pooled connections.
+    {
+        brpc::Controller cntl;
+        cntl.http_request().uri() = "/echo";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, brpc::DoNothing());
+        ReadHttpRequests(servfd, 1);
+        const std::string response =
+            "HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 5\r\n\r\nclose";
+        ASSERT_EQ((ssize_t)response.size(),
+                  ::write(servfd, response.data(), response.size()));
+        brpc::Join(cntl.call_id());
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ("close", cntl.response_attachment().to_string());
+    }
+    ASSERT_EQ("1", bvar::Variable::describe_exposed(
+                  "rpc_http_client_pipeline_fallback_count"));
+    {
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(100);
+        cntl.http_request().uri() = "/echo";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_EQ(brpc::CONNECTION_TYPE_POOLED, cntl.connection_type());
+    }
+}
+
+class CountingDownloadService : public ::test::DownloadService {
+public:
+    CountingDownloadService() : ncalls(0) {}
+    void Download(::google::protobuf::RpcController* cntl_base,
+                  const ::test::HttpRequest*,
+                  ::test::HttpResponse*,
+                  ::google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        const int n = ncalls.fetch_add(1) + 1;
+        const std::string* sleep_ms_str =
+            cntl->http_request().uri().GetQuery("sleep_ms");
+        if (sleep_ms_str) {
+            bthread_usleep(strtol(sleep_ms_str->data(), NULL, 10) * 1000);
+        }
+        if (cntl->http_request().uri().GetQuery("fail")) {
+            cntl->SetFailed("failed on purpose");
+            return;
+        }
+        cntl->http_response().set_content_type("text/plain");
+        cntl->http_response().SetHeader("x-call", std::to_string(n));
+        cntl->response_attachment().append(std::to_string(n));
+    }
+    butil::atomic<int> ncalls;
+};
+
+static std::string HttpGet(brpc::Channel* channel, const std::string& uri,
+                           const char* accept = NULL,
+                           brpc::HttpMethod method = brpc::HTTP_METHOD_GET) {
+    brpc::Controller cntl;
+    cntl.http_request().uri() = uri;
+    cntl.http_request().set_method(method);
+    if (accept) {
+        cntl.http_request().SetHeader("Accept", accept);
+    }
+    channel->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        return "E" + std::to_string(cntl.ErrorCode());
+    }
+    const std::string* call = cntl.http_response().GetHeader("x-call");
+    EXPECT_TRUE(call != NULL);
+    EXPECT_EQ(cntl.response_attachment().to_string(), (call ? *call : ""));
+    return cntl.response_attachment().to_string();
+}
+
+static void* ConcurrentHttpGet(void* arg) {
+    std::pair<brpc::Channel*, std::string>* p =
+        static_cast<std::pair<brpc::Channel*, std::string>*>(arg);
+    p->second = HttpGet(p->first, "/cached/b?sleep_ms=100");
+    return NULL;
+}
+
+TEST_F(HttpTest, http_response_cache) {
+    const int port = 8924;
+    CountingDownloadService svc;
+    brpc::Server server;
+    ASSERT_EQ(0, server.AddService(&svc, brpc::SERVER_DOESNT_OWN_SERVICE,
+                                   "/cached/* => Download"));
+    brpc::HttpResponseCacheOptions cache_opt;
+    cache_opt.ttl_ms = 500;
+    cache_opt.vary_headers.push_back("Accept");
+    ASSERT_EQ(-1, server.EnableHttpResponseCache("test.DownloadService.NotExist",
+                                                 cache_opt));
+    ASSERT_EQ(0, server.EnableHttpResponseCache("test.DownloadService.Download",
+                                                cache_opt));
+    ASSERT_EQ(0, server.Start(port, nullptr));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    options.timeout_ms = 2000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+
+    ASSERT_EQ("1", HttpGet(&channel, "/cached/a"));
+    ASSERT_EQ("1", HttpGet(&channel, "/cached/a"));
+    // Different queries, headers in vary_headers and methods
+    ASSERT_EQ("2", HttpGet(&channel, "/cached/a?x=1"));
+    ASSERT_EQ("3", HttpGet(&channel, "/cached/a", "text/plain"));
+    ASSERT_EQ("3", HttpGet(&channel, "/cached/a", "text/plain"));
+    ASSERT_EQ("4", HttpGet(&channel, "/cached/a", NULL, brpc::HTTP_METHOD_POST));
+    ASSERT_EQ("1", HttpGet(&channel, "/cached/a"));
+    ASSERT_EQ(4, svc.ncalls.load());
+
+    // Failed responses are not cached.
+    ASSERT_EQ("E" + std::to_string(brpc::EHTTP), HttpGet(&channel, "/cached/a?fail"));
+    ASSERT_EQ("E" + std::to_string(brpc::EHTTP), HttpGet(&channel, "/cached/a?fail"));
+    ASSERT_EQ(6, svc.ncalls.load());
+
+    // Concurrent misses are coalesced.
+    const int N = 5;
+    bthread_t th[N];
+    std::pair<brpc::Channel*, std::string> args[N];
+    for (int i = 0; i < N; ++i) {
+        args[i].first = &channel;
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, ConcurrentHttpGet, &args[i]));
+    }
+    for (int i = 0; i < N; ++i) {
+        bthread_join(th[i], NULL);
+        ASSERT_EQ("7", args[i].second);
+    }
+    ASSERT_EQ(7, svc.ncalls.load());
+
+    // Expired.
+    bthread_usleep(600 * 1000);
+    ASSERT_EQ("8", HttpGet(&channel, "/cached/a"));
+    ASSERT_EQ("8", HttpGet(&channel, "/cached/a"));
+    ASSERT_EQ(8, svc.ncalls.load());
+
+    ASSERT_EQ(0, server.Stop(0));
+    ASSERT_EQ(0, server.Join());
+}
+
+TEST_F(HttpTest, http_pipelining_fallback_to_pooled) {
+    const butil::EndPoint ep(butil::IP_ANY, 5963);
+    butil::fd_guard listenfd(butil::tcp_listen(ep));
+    ASSERT_GT(listenfd, 0);
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_HTTP;
+    options.connection_type = "single";
+    options.max_retry = 0;
+    ASSERT_EQ(0, channel.Init(ep, &options));
+    brpc::SocketId main_id;
+    ASSERT_EQ(0, brpc::SocketMapFind(brpc::SocketMapKey(ep), &main_id));
+    brpc::SocketUniquePtr main_ptr;
+    ASSERT_EQ(0, brpc::Socket::Address(main_id, &main_ptr));
+
+    // HEAD is sent over a pooled connection, which is closed rather than
+    // leaked when the RPC fails without response.
+    {
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(100);
+        cntl.http_request().set_method(brpc::HTTP_METHOD_HEAD);
+        cntl.http_request().uri() = "/head";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, NULL);
+        ASSERT_TRUE(cntl.Failed());
+        ASSERT_EQ(brpc::ERPCTIMEDOUT, cntl.ErrorCode());
+        ASSERT_EQ(brpc::CONNECTION_TYPE_POOLED, cntl.connection_type());
+    }
+    {
+        butil::fd_guard servfd(accept(listenfd, NULL, NULL));
+        ASSERT_GT(servfd, 0);
+        struct timeval tv = { 5, 0 };
+        ASSERT_EQ(0, setsockopt(servfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)));
+        const std::string request = ReadHttpRequests(servfd, 1);
+        ASSERT_EQ(0u, request.find("HEAD /head ")) << request;
+        char buf[64];
+        ASSERT_EQ(0, ::read(servfd, buf, sizeof(buf)));
+    }
+    std::vector<brpc::SocketId> pooled;
+    main_ptr->ListPooledSockets(&pooled);
+    ASSERT_TRUE(pooled.empty());
+
+    // Returned to the pool after a successful one.
+    {
+        brpc::Controller cntl;
+        cntl.set_timeout_ms(-1);
+        cntl.http_request().set_method(brpc::HTTP_METHOD_HEAD);
+        cntl.http_request().uri() = "/head";
+        channel.CallMethod(NULL, &cntl, NULL, NULL, brpc::DoNothing());
+        butil::fd_guard servfd(accept(listenfd, NULL, NULL));
+        ASSERT_GT(servfd, 0);
+        ReadHttpRequests(servfd, 1);
+        const std::string response =
+            "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n";
+        ASSERT_EQ((ssize_t)response.size(),
+                  ::write(servfd, response.data(), response.size()));
+        brpc::Join(cntl.call_id());
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+        ASSERT_EQ(brpc::CONNECTION_TYPE_POOLED, cntl.connection_type());
+    }
+    main_ptr->ListPooledSockets(&pooled);
+    ASSERT_EQ(1u, pooled.size());
+}
+
 TEST_F(HttpTest, spring_protobuf_content_type) {
     const int port = 8923;
     brpc::Server server;
@@ -2080,4 +2357,95 @@ TEST_F(HttpTest, http_expect) {
     ASSERT_EQ(imsg_guard->header().status_code(), brpc::HTTP_STATUS_OK);
 }
 
+class StreamingJsonService : public ::test::EchoService {
+public:
+    void Echo(::google::protobuf::RpcController* cntl_base,
+              const ::test::EchoRequest* req,
+              ::test::EchoResponse* res,
+              ::google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        // Marked per call.
+        cntl->set_pb_streaming_json(true);
+        res->set_message(req->message());
+        for (int i = 0; i < req->code(); ++i) {
+            res->add_code_list(i);
+        }
+    }
+
+    void ComboEcho(::google::protobuf::RpcController*,
+                   const ::test::ComboRequest* req,
+                   ::test::ComboResponse* res,
+                   ::google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        for (int i = 0; i < req->requests_size(); ++i) {
+            ::test::EchoResponse* sub_res = res->add_responses();
+            sub_res->set_message(req->requests(i).message());
+            sub_res->add_code_list(i);
+        }
+    }
+};
+
+TEST_F(HttpTest, streaming_json_response) {
+    const int32_t saved_chunk_size = brpc::policy::FLAGS_http_streaming_json_chunk_size;
+    brpc::policy::FLAGS_http_streaming_json_chunk_size = 1024;
+    const int port = 8924;
+    StreamingJsonService svc;
+    brpc::Server server;
+    brpc::ServiceOptions svc_opt;
+    svc_opt.ownership = brpc::SERVER_DOESNT_OWN_SERVICE;
+    svc_opt.pb_streaming_json = true;
+    EXPECT_EQ(0, server.AddService(&svc, svc_opt));
+    EXPECT_EQ(0, server.Start(port, nullptr));
+
+    brpc::Channel channel;
+    brpc::ChannelOptions options;
+    options.protocol = "http";
+    options.timeout_ms = 10000;
+    ASSERT_EQ(0, channel.Init(butil::EndPoint(butil::my_ip(), port), &options));
+    test::EchoService_Stub stub(&channel);
+
+    // Marked by ServiceOptions.
+    const int N = 20000;
+    test::ComboRequest combo_req;
+    for (int i = 0; i < N; ++i) {
+        combo_req.add_requests()->set_message("hello");
+    }
+    test::ComboResponse combo_res;
+    brpc::Controller cntl;
+    stub.ComboEcho(&cntl, &combo_req, &combo_res, nullptr);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    const std::string* te = cntl.http_response().GetHeader("Transfer-Encoding");
+    ASSERT_TRUE(te != NULL);
+    ASSERT_EQ("chunked", *te);
+    ASSERT_EQ(N, combo_res.responses_size());
+    for (int i = 0; i < N; ++i) {
+        ASSERT_EQ("hello", combo_res.responses(i).message());
+        ASSERT_EQ(i, combo_res.responses(i).code_list(0));
+    }
+
+    // Marked by Controller.
+    test::EchoRequest req;
+    test::EchoResponse res;
+    req.set_message(EXP_REQUEST);
+    req.set_code(N);
+    cntl.Reset();
+    stub.Echo(&cntl, &req, &res, nullptr);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_EQ(EXP_REQUEST, res.message());
+    ASSERT_EQ(N, res.code_list_size());
+    ASSERT_EQ(N - 1, res.code_list(N - 1));
+
+    // Not for protobuf content.
+    cntl.Reset();
+    cntl.http_request().set_content_type("application/proto");
+    res.Clear();
+    stub.Echo(&cntl, &req, &res, nullptr);
+    ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+    ASSERT_TRUE(cntl.http_response().GetHeader("Transfer-Encoding") == NULL);
+    ASSERT_EQ(N, res.code_list_size());
+
+    brpc::policy::FLAGS_http_streaming_json_chunk_size = saved_chunk_size;
+}
+
 } //namespace
@@ -0,0 +1,244 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <vector>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/string_printf.h"
+#include "butil/synchronization/lock.h"
+#include "brpc/server.h"
+#include "brpc/channel.h"
+#include "brpc/controller.h"
+#include "brpc/span.h"
+#include "brpc/otlp_trace.pb.h"
+#include "brpc/details/otlp_exporter.h"
+#include "echo.pb.h"
+
+namespace brpc {
+DECLARE_string(otlp_collector);
+DECLARE_int32(otlp_export_interval_ms);
+DECLARE_double(otlp_sample_ratio);
+DECLARE_bool(otlp_tail_keep_error);
+}
+
+namespace {
+
+// Stand-in of OTLP collectors.
+class MyCollector : public brpc::otlp::TraceService {
+public:
+    void Export(google::protobuf::RpcController*,
+                const brpc::otlp::ExportTraceServiceRequest* req,
+                brpc::otlp::ExportTraceServiceResponse*,
+                google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (int i = 0; i < req->resource_spans_size(); ++i) {
+            const brpc::otlp::ResourceSpans& rs = req->resource_spans(i);
+            for (int j = 0; j < rs.scope_spans_size(); ++j) {
+                for (int k = 0; k < rs.scope_spans(j).spans_size(); ++k) {
+                    _spans.push_back(rs.scope_spans(j).spans(k));
+                }
+            }
+        }
+    }
+
+    // Wait for a span of `trace_id' for at most 5 seconds.
+    bool WaitSpan(const std::string& trace_id, brpc::otlp::Span* span) {
+        for (int i = 0; i < 500; ++i) {
+            if (FindSpan(trace_id, span)) {
+                return true;
+            }
+            bthread_usleep(10000);
+        }
+        return false;
+    }
+
+    bool FindSpan(const std::string& trace_id, brpc::otlp::Span* span) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (size_t i = 0; i < _spans.size(); ++i) {
+            if (_spans[i].trace_id() == trace_id) {
+                span->CopyFrom(_spans[i]);
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    butil::Mutex _mutex;
+    std::vector<brpc::otlp::Span> _spans;
+};
+
+class EchoServiceImpl : public test::EchoService {
+public:
+    void Echo(google::protobuf::RpcController* cntl_base,
+              const test::EchoRequest* req,
+              test::EchoResponse* res,
+              google::protobuf::Closure* done) override {
+        brpc::ClosureGuard done_guard(done);
+        brpc::Controller* cntl = static_cast<brpc::Controller*>(cntl_base);
+        if (req->server_fail()) {
+            cntl->SetFailed(req->server_fail(), "Server fail");
+            return;
+        }
+        res->set_message(req->message());
+    }
+};
+
+std::string BigEndian(uint64_t high, uint64_t low) {
+    std::string s;
+    for (int i = 56; i >= 0; i -= 8) {
+        s.push_back((char)(high >> i));
+    }
+    for (int i = 56; i >= 0; i -= 8) {
+        s.push_back((char)(low >> i));
+    }
+    return s;
+}
+
+// The exporter connects to -otlp_collector once, all tests share one server.
+brpc::Server* g_server = NULL;
+MyCollector* g_collector = NULL;
+butil::EndPoint g_ep;
+
+class OtlpExporterTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        if (g_server != NULL) {
+            return;
+        }
+        g_server = new brpc::Server;
+        g_collector = new MyCollector;
+        ASSERT_EQ(0, g_server->AddService(g_collector, brpc::SERVER_OWNS_SERVICE,
+                                          "/v1/traces => Export"));
+        ASSERT_EQ(0, g_server->AddService(new EchoServiceImpl,
+                                          brpc::SERVER_OWNS_SERVICE));
+        ASSERT_EQ(0, g_server->Start("127.0.0.1:0", NULL));
+        g_ep = g_server->listen_address();
+        brpc::FLAGS_otlp_collector = butil::endpoint2str(g_ep).c_str();
+        brpc::FLAGS_otlp_export_interval_ms = 20;
+    }
+
+    // Call Echo with W3C trace context as if the client was traced by other
+    // systems.
+    void CallWithTraceParent(uint64_t trace_id_high, uint64_t trace_id,
+                             uint64_t parent_id, int server_fail) {
+        brpc::ChannelOptions opt;
+        opt.protocol = brpc::PROTOCOL_HTTP;
+        brpc::Channel channel;
+        ASSERT_EQ(0, channel.Init(g_ep, &opt));
+        brpc::Controller cntl;
+        cntl.http_request().SetHeader("traceparent", butil::string_printf(
+            "00-%016llx%016llx-%016llx-01", (unsigned long long)trace_id_high,
+            (unsigned long long)trace_id, (unsigned long long)parent_id));
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        if (server_fail) {
+            req.set_server_fail(server_fail);
+        }
+        test::EchoService_Stub stub(&channel);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_EQ(server_fail != 0, cntl.Failed());
+    }
+};
+
+TEST(TraceParentTest, make_and_parse) {
+    uint64_t high = 0;
+    uint64_t trace_id = 0;
+    uint64_t parent_id = 0;
+    bool sampled = false;
+    ASSERT_TRUE(brpc::ParseTraceParent(
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_EQ(0x4bf92f3577b34da6ULL, high);
+    ASSERT_EQ(0xa3ce929d0e0e4736ULL, trace_id);
+    ASSERT_EQ(0x00f067aa0ba902b7ULL, parent_id);
+    ASSERT_TRUE(sampled);
+
+    ASSERT_TRUE(brpc::ParseTraceParent(
+        "01-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-00-future",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_FALSE(sampled);
+
+    // Wrong length, upper case, all-zero ids and invalid version.
+    ASSERT_FALSE(brpc::ParseTraceParent(
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-1",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_FALSE(brpc::ParseTraceParent(
+        "00-4BF92F3577B34DA6A3CE929D0E0E4736-00f067aa0ba902b7-01",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_FALSE(brpc::ParseTraceParent(
+        "00-00000000000000000000000000000000-00f067aa0ba902b7-01",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_FALSE(brpc::ParseTraceParent(
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-0000000000000000-01",
+        &high, &trace_id, &parent_id, &sampled));
+    ASSERT_FALSE(brpc::ParseTraceParent(
+        "ff-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01",
+        &high, &trace_id, &parent_id, &sampled));
+
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        "/x", 0xa3ce929d0e0e4736ULL, 0x1234, 0, butil::gettimeofday_us());
+    span->set_trace_id_high(0x4bf92f3577b34da6ULL);
+    ASSERT_EQ("00-4bf92f3577b34da6a3ce929d0e0e4736-0000000000001234-01",
+              brpc::MakeTraceParent(span));
+
+    brpc::otlp::Span out;
+    span->set_error_code(brpc::ERPCTIMEDOUT);
+    span->Annotate("hello");
+    brpc::SpanToOtlp(span, &out);
+    ASSERT_EQ(BigEndian(0x4bf92f3577b34da6ULL, 0xa3ce929d0e0e4736ULL), out.trace_id());
+    ASSERT_EQ(BigEndian(0, 0x1234).substr(8), out.span_id());
+    ASSERT_FALSE(out.has_parent_span_id());
+    ASSERT_EQ("/x", out.name());
+    ASSERT_EQ(brpc::otlp::Span::SPAN_KIND_SERVER, out.kind());
+    ASSERT_EQ(brpc::otlp::Status::STATUS_CODE_ERROR, out.status().code());
+    ASSERT_EQ(1, out.events_size());
+    ASSERT_EQ("hello", out.events(0).name());
+    brpc::Span::Submit(span, butil::cpuwide_time_us());
+}
+
+TEST_F(OtlpExporterTest, export_spans_of_w3c_traced_calls) {
+    ASSERT_TRUE(brpc::IsOtlpExportEnabled());
+    CallWithTraceParent(0x1111, 0x2222, 0x3333, 0);
+    brpc::otlp::Span span;
+    ASSERT_TRUE(g_collector->WaitSpan(BigEndian(0x1111, 0x2222), &span));
+    ASSERT_EQ(brpc::otlp::Span::SPAN_KIND_SERVER, span.kind());
+    ASSERT_EQ(BigEndian(0, 0x3333).substr(8), span.parent_span_id());
+    ASSERT_EQ(8u, span.span_id().size());
+    ASSERT_NE(span.parent_span_id(), span.span_id());
+    ASSERT_NE(std::string::npos, span.name().find("Echo"));
+    ASSERT_LE(span.start_time_unix_nano(), span.end_time_unix_nano());
+    ASSERT_FALSE(span.has_status());
+}
+
+TEST_F(OtlpExporterTest, tail_sampling_keeps_failed_traces) {
+    brpc::FLAGS_otlp_sample_ratio = 0;
+    CallWithTraceParent(0x1, 0x100, 0x1000, 0);
+    CallWithTraceParent(0x2, 0x200, 0x2000, brpc::EINTERNAL);
+    brpc::otlp::Span span;
+    ASSERT_TRUE(g_collector->WaitSpan(BigEndian(0x2, 0x200), &span));
+    ASSERT_EQ(brpc::otlp::Status::STATUS_CODE_ERROR, span.status().code());
+    bthread_usleep(100000);
+    ASSERT_FALSE(g_collector->FindSpan(BigEndian(0x1, 0x100), &span));
+    brpc::FLAGS_otlp_sample_ratio = 1.0;
+}
+
+} // namespace
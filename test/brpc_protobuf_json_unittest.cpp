@@ -1743,4 +1743,232 @@ TEST_F(ProtobufJsonTest, pb_to_proto_json) {
     ASSERT_NE(json2.find(R"("office":"Shanghai")"), std::string::npos);
 }
 
+TEST_F(ProtobufJsonTest, codec_cache_case) {
+    // Duplicated members, unknown members and encoded names.
+    std::string json = "{\"addr\":\"baidu.com\",\"addr\":\"apache.org\","
+                       "\"unknown\":1,"
+                       "\"numbers\":{\"tel\":123456,\"cell\":654321},"
+                       "\"friends\":{\"John\":[{\"school\":\"SJTU\",\"year\":2007}]}}";
+    json2pb::Json2PbOptions json2pb_opt;
+    json2pb::Pb2JsonOptions pb2json_opt;
+    std::string error;
+
+    AddressComplex ab1;
+    json2pb_opt.enable_codec_cache = false;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &ab1, json2pb_opt, &error)) << error;
+    AddressComplex ab2;
+    json2pb_opt.enable_codec_cache = true;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &ab2, json2pb_opt, &error)) << error;
+    ASSERT_EQ(ab1.SerializeAsString(), ab2.SerializeAsString());
+    ASSERT_EQ("baidu.com", ab2.addr());
+
+    std::string json1;
+    std::string json2;
+    pb2json_opt.enable_codec_cache = false;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(ab1, &json1, pb2json_opt, &error));
+    pb2json_opt.enable_codec_cache = true;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(ab2, &json2, pb2json_opt, &error));
+    ASSERT_EQ(json1, json2);
+    pb2json_opt.pretty_json = true;
+    json2.clear();
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(ab2, &json2, pb2json_opt, &error));
+    pb2json_opt.enable_codec_cache = false;
+    json1.clear();
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(ab1, &json1, pb2json_opt, &error));
+    ASSERT_EQ(json1, json2);
+
+    std::string info = "{\"@Content_Test%@\":[{\"Distance_info_\":1,"
+                       "\"_ext%T_\":{\"Aa_ge(\":1666666666, \"databyte(std::string)\":"
+                       "\"d2VsY29tZQ==\", \"enum--type\":\"HOME\"},\"uid*\":\"welcome\"}], "
+                       "\"judge\":false, \"spur\":2, \"data:array\":[]}";
+    JsonContextBodyEncDec data1;
+    json2pb_opt.enable_codec_cache = false;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(info, &data1, json2pb_opt, &error)) << error;
+    JsonContextBodyEncDec data2;
+    json2pb_opt.enable_codec_cache = true;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage(info, &data2, json2pb_opt, &error)) << error;
+    ASSERT_EQ(data1.SerializeAsString(), data2.SerializeAsString());
+    pb2json_opt.pretty_json = false;
+    json1.clear();
+    json2.clear();
+    pb2json_opt.enable_codec_cache = false;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(data1, &json1, pb2json_opt, &error));
+    pb2json_opt.enable_codec_cache = true;
+    ASSERT_TRUE(json2pb::ProtoMessageToJson(data2, &json2, pb2json_opt, &error));
+    ASSERT_EQ(json1, json2);
+
+    // Same errors on missing required fields.
+    std::string error1;
+    std::string error2;
+    Person p1;
+    json2pb_opt.enable_codec_cache = false;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage("{\"name\":\"x\"}", &p1, json2pb_opt, &error1));
+    Person p2;
+    json2pb_opt.enable_codec_cache = true;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage("{\"name\":\"x\"}", &p2, json2pb_opt, &error2));
+    ASSERT_EQ(error1, error2);
+}
+
+TEST_F(ProtobufJsonTest, codec_cache_perf_case) {
+    std::ifstream in("jsonout", std::ios::in);
+    std::ostringstream tmp;
+    tmp << in.rdbuf();
+    const std::string json = tmp.str();
+    in.close();
+
+    printf("----------test codec cache performance------------\n\n");
+
+    const int times = 10000;
+    for (int use_cache = 0; use_cache < 2; ++use_cache) {
+        json2pb::Json2PbOptions json2pb_opt;
+        json2pb_opt.base64_to_bytes = false;
+        json2pb_opt.enable_codec_cache = use_cache;
+        json2pb::Pb2JsonOptions pb2json_opt;
+        pb2json_opt.enable_codec_cache = use_cache;
+        std::string error;
+        butil::Timer timer;
+        float avg_time1 = 0;
+        float avg_time2 = 0;
+        for (int i = 0; i < times; i++) {
+            gss::message::gss_us_res_t data;
+            timer.start();
+            ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &data, json2pb_opt, &error));
+            timer.stop();
+            avg_time1 += timer.u_elapsed();
+
+            std::string output;
+            timer.start();
+            ASSERT_TRUE(json2pb::ProtoMessageToJson(data, &output, pb2json_opt, &error));
+            timer.stop();
+            avg_time2 += timer.u_elapsed();
+        }
+        avg_time1 /= times;
+        avg_time2 /= times;
+        printf("[%s] avg time to convert json to pb is %fus\n",
+               use_cache ? "codec" : "reflection", avg_time1);
+        printf("[%s] avg time to convert pb to json is %fus\n",
+               use_cache ? "codec" : "reflection", avg_time2);
+    }
+}
+
+TEST_F(ProtobufJsonTest, sax_parsing_case) {
+    const char* jsons[] = {
+        "{\"addr\":\"baidu.com\",\"addr\":\"apache.org\",\"unknown\":[1,{\"a\":2}],"
+        "\"numbers\":{\"tel\":123456,\"cell\":654321},"
+        "\"friends\":{\"John\":[{\"school\":\"SJTU\",\"year\":2007}]}}",
+        "{\"@Content_Test%@\":[{\"Distance_info_\":1,"
+        "\"_ext%T_\":{\"Aa_ge(\":1666666666, \"databyte(std::string)\":"
+        "\"d2VsY29tZQ==\", \"enum--type\":\"HOME\"},\"uid*\":\"welcome\"}], "
+        "\"judge\":false, \"spur\":2, \"data:array\":[]}",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(jsons); ++i) {
+        std::unique_ptr<google::protobuf::Message> msg1;
+        std::unique_ptr<google::protobuf::Message> msg2;
+        if (i == 0) {
+            msg1.reset(new AddressComplex);
+            msg2.reset(new AddressComplex);
+        } else {
+            msg1.reset(new JsonContextBodyEncDec);
+            msg2.reset(new JsonContextBodyEncDec);
+        }
+        json2pb::Json2PbOptions json2pb_opt;
+        std::string error;
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(jsons[i], msg1.get(), json2pb_opt, &error))
+            << error;
+        json2pb_opt.sax_parsing = true;
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(jsons[i], msg2.get(), json2pb_opt, &error))
+            << error;
+        ASSERT_EQ(msg1->SerializeAsString(), msg2->SerializeAsString());
+
+        // Input from ZeroCopyInputStream.
+        butil::IOBuf buf;
+        buf.append(jsons[i]);
+        butil::IOBufAsZeroCopyInputStream stream(buf);
+        msg2->Clear();
+        ASSERT_TRUE(json2pb::JsonToProtoMessage(&stream, msg2.get(), json2pb_opt, &error))
+            << error;
+        ASSERT_EQ(msg1->SerializeAsString(), msg2->SerializeAsString());
+    }
+
+    json2pb::Json2PbOptions json2pb_opt;
+    json2pb_opt.sax_parsing = true;
+    std::string error;
+
+    // Missing required fields.
+    Person person;
+    ASSERT_FALSE(json2pb::JsonToProtoMessage("{\"name\":\"x\"}", &person, json2pb_opt, &error));
+    ASSERT_FALSE(error.empty());
+
+    // Mismatched types.
+    person.Clear();
+    ASSERT_FALSE(json2pb::JsonToProtoMessage("{\"name\":\"x\",\"id\":\"y\",\"datadouble\":1}",
+                                             &person, json2pb_opt, &error));
+    ASSERT_FALSE(error.empty());
+
+    // Invalid json.
+    person.Clear();
+    ASSERT_FALSE(json2pb::JsonToProtoMessage("{\"name\":\"x\",", &person, json2pb_opt, &error));
+    ASSERT_EQ(0u, error.find("Invalid json")) << error;
+
+    // Single repeated field.
+    json2pb_opt.array_to_single_repeated = true;
+    AddressBookEncDec book;
+    ASSERT_TRUE(json2pb::JsonToProtoMessage("[{\"name\":\"foo\",\"id\":1},"
+                                            "{\"name\":\"bar\",\"id\":2}]",
+                                            &book, json2pb_opt, &error)) << error;
+    ASSERT_EQ(2, book.person_size());
+    ASSERT_EQ("bar", book.person(1).name());
+
+    // Multiple jsons in one input.
+    json2pb_opt.allow_remaining_bytes_after_parsing = true;
+    butil::IOBuf buf;
+    buf.append("{\"name\":\"tom\",\"id\":1,\"datadouble\":1.0}"
+               " {\"name\":\"bob\",\"id\":2,\"datadouble\":2.0} ");
+    butil::IOBufAsZeroCopyInputStream stream(buf);
+    json2pb::ZeroCopyStreamReader reader(&stream);
+    std::vector<std::string> names;
+    while (true) {
+        person.Clear();
+        size_t offset = 0;
+        if (!json2pb::JsonToProtoMessage(&reader, &person, json2pb_opt, &error, &offset)) {
+            ASSERT_TRUE(error.empty()) << error;
+            break;
+        }
+        names.push_back(person.name());
+    }
+    ASSERT_EQ(2u, names.size());
+    ASSERT_EQ("tom", names[0]);
+    ASSERT_EQ("bob", names[1]);
+}
+
+TEST_F(ProtobufJsonTest, sax_parsing_perf_case) {
+    std::ifstream in("jsonout", std::ios::in);
+    std::ostringstream tmp;
+    tmp << in.rdbuf();
+    const std::string json = tmp.str();
+    in.close();
+
+    printf("----------test sax parsing performance------------\n\n");
+
+    const int times = 10000;
+    for (int sax = 0; sax < 2; ++sax) {
+        json2pb::Json2PbOptions json2pb_opt;
+        json2pb_opt.base64_to_bytes = false;
+        json2pb_opt.sax_parsing = sax;
+        std::string error;
+        butil::Timer timer;
+        float avg_time = 0;
+        for (int i = 0; i < times; i++) {
+            gss::message::gss_us_res_t data;
+            timer.start();
+            ASSERT_TRUE(json2pb::JsonToProtoMessage(json, &data, json2pb_opt, &error));
+            timer.stop();
+            avg_time += timer.u_elapsed();
+        }
+        avg_time /= times;
+        printf("[%s] avg time to convert json to pb is %fus\n",
+               sax ? "sax" : "dom", avg_time);
+    }
+}
+
 } // namespace
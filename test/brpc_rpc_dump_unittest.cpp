@@ -0,0 +1,155 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <pthread.h>
+#include <map>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/file_util.h"
+#include "butil/string_printf.h"
+#include "butil/time.h"
+#include "bvar/variable.h"
+#include "brpc/rpc_dump.h"
+
+namespace brpc {
+DECLARE_double(rpc_dump_compact_sampling_ratio);
+DECLARE_int64(rpc_dump_max_bytes_per_second);
+DECLARE_int32(rpc_dump_compress_type);
+DECLARE_int32(rpc_dump_block_size);
+}
+
+namespace {
+
+const char* const DUMP_DIR = "./rpc_dump_compact_test";
+
+struct DumpArgs {
+    const char* method;
+    int begin;
+    int end;
+};
+
+void* dump_requests(void* arg) {
+    const DumpArgs* args = static_cast<const DumpArgs*>(arg);
+    for (int i = args->begin; i < args->end; ++i) {
+        brpc::SampledRequest* sample = brpc::AskToBeSampled();
+        if (sample == NULL) {
+            continue;
+        }
+        sample->meta.set_service_name("test.EchoService");
+        sample->meta.set_method_name(args->method);
+        sample->meta.set_protocol_type(brpc::PROTOCOL_BAIDU_STD);
+        sample->request.append(butil::string_printf("request_%d", i));
+        brpc::SubmitSample(sample, butil::cpuwide_time_us());
+    }
+    return NULL;
+}
+
+// Read all dumped requests, keyed by method and request.
+void read_dumped(std::map<std::string, std::map<std::string, int> >* out) {
+    out->clear();
+    brpc::SampleIterator it(DUMP_DIR);
+    for (brpc::SampledRequest* sample = it.Next(); sample != NULL;
+         sample = it.Next()) {
+        ++(*out)[sample->meta.method_name()][sample->request.to_string()];
+        delete sample;
+    }
+}
+
+// Wait until `n' requests of `method' are dumped, returns the number of
+// dumped ones.
+int wait_for_dumped(const std::string& method, int n,
+                    std::map<std::string, std::map<std::string, int> >* out) {
+    int total = 0;
+    for (int i = 0; i < 50; ++i) {
+        read_dumped(out);
+        total = 0;
+        const std::map<std::string, int>& reqs = (*out)[method];
+        for (std::map<std::string, int>::const_iterator
+                 it = reqs.begin(); it != reqs.end(); ++it) {
+            total += it->second;
+        }
+        if (total >= n) {
+            break;
+        }
+        usleep(100000);
+    }
+    return total;
+}
+
+TEST(RpcDumpTest, compact_blocks) {
+    ASSERT_FALSE(GFLAGS_NAMESPACE::SetCommandLineOption(
+                     "rpc_dump_dir", DUMP_DIR).empty());
+    ASSERT_FALSE(GFLAGS_NAMESPACE::SetCommandLineOption(
+                     "rpc_dump_method_sampling_ratios",
+                     "test.EchoService.Skipped=0, test.EchoService.Echo=1").empty());
+    brpc::FLAGS_rpc_dump_compact = true;
+    brpc::FLAGS_rpc_dump_compact_sampling_ratio = 0;
+    brpc::FLAGS_rpc_dump_block_size = 1024;
+    brpc::FLAGS_rpc_dump = true;
+    // Start the writer which parses the ratios of methods.
+    delete brpc::AskToBeSampled();
+    usleep(300000);
+
+    const int compress_types[] = { brpc::COMPRESS_TYPE_SNAPPY,
+                                   brpc::COMPRESS_TYPE_GZIP,
+                                   brpc::COMPRESS_TYPE_ZLIB,
+                                   brpc::COMPRESS_TYPE_NONE };
+    std::map<std::string, std::map<std::string, int> > dumped;
+    for (size_t i = 0; i < sizeof(compress_types) / sizeof(int); ++i) {
+        brpc::FLAGS_rpc_dump_compress_type = compress_types[i];
+        // Requests from several threads, some in full blocks and some in
+        // blocks written by timeout.
+        DumpArgs args[3] = { { "Echo", 0, 300 }, { "Echo", 300, 350 },
+                             { "Skipped", 0, 300 } };
+        pthread_t th[3];
+        for (size_t j = 0; j < 3; ++j) {
+            ASSERT_EQ(0, pthread_create(&th[j], NULL, dump_requests, &args[j]));
+        }
+        for (size_t j = 0; j < 3; ++j) {
+            ASSERT_EQ(0, pthread_join(th[j], NULL));
+        }
+        const int expected = 350 * ((int)i + 1);
+        ASSERT_EQ(expected, wait_for_dumped("Echo", expected, &dumped))
+            << "compress_type=" << compress_types[i];
+        ASSERT_EQ(0u, dumped.count("Skipped"));
+        for (int j = 0; j < 350; ++j) {
+            ASSERT_EQ((int)i + 1, dumped["Echo"][butil::string_printf("request_%d", j)]);
+        }
+    }
+
+    // Limit the dumped bytes.
+    brpc::FLAGS_rpc_dump_compact_sampling_ratio = 1;
+    brpc::FLAGS_rpc_dump_max_bytes_per_second = 1000;
+    const int64_t dropped_before = atoll(bvar::Variable::describe_exposed(
+        "rpc_dump_compact_dropped_count").c_str());
+    DumpArgs limited = { "Limited", 0, 1000 };
+    dump_requests(&limited);
+    ASSERT_GT(atoll(bvar::Variable::describe_exposed(
+                  "rpc_dump_compact_dropped_count").c_str()), dropped_before);
+    brpc::FLAGS_rpc_dump_max_bytes_per_second = 64 * 1024 * 1024;
+    // All buffered requests are written after dumping is off.
+    brpc::FLAGS_rpc_dump = false;
+    const int nlimited = wait_for_dumped("Limited", 1000, &dumped);
+    ASSERT_GT(nlimited, 0);
+    ASSERT_LT(nlimited, 1000);
+
+    brpc::FLAGS_rpc_dump_compact_sampling_ratio = 0.01;
+    brpc::FLAGS_rpc_dump_compact = false;
+    butil::DeleteFile(butil::FilePath(DUMP_DIR), true);
+}
+
+} // namespace
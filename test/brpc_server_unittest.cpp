@@ -53,6 +53,7 @@
 #include "brpc/socket_map.h"
 #include "brpc/controller.h"
 #include "brpc/compress.h"
+#include "bvar/variable.h"
 #include "echo.pb.h"
 #include "v1.pb.h"
 #include "v2.pb.h"
@@ -67,6 +68,7 @@ int main(int argc, char* argv[]) {
 namespace brpc {
 DECLARE_bool(enable_threads_service);
 DECLARE_bool(enable_dir_service);
+DECLARE_bool(enable_method_phase_latency);
 
 namespace policy {
 DECLARE_bool(use_http_error_code);
@@ -1662,6 +1664,65 @@ TEST_F(ServerTest, max_concurrency) {
     ASSERT_FALSE(cntl4.Failed()) << cntl4.ErrorText();
 }
 
+static int64_t GetPhaseLatency(const std::string& method_prefix,
+                               const char* phase) {
+    std::vector<std::string> names;
+    bvar::Variable::list_exposed(&names);
+    const std::string suffix = method_prefix + "_" + phase + "_max_latency";
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (names[i].size() >= suffix.size() &&
+            names[i].compare(names[i].size() - suffix.size(),
+                             suffix.size(), suffix) == 0) {
+            return strtoll(bvar::Variable::describe_exposed(names[i]).c_str(),
+                           NULL, 10);
+        }
+    }
+    return -1;
+}
+
+TEST_F(ServerTest, method_phase_latency) {
+    brpc::FLAGS_enable_method_phase_latency = true;
+    const int port = 9201;
+    brpc::Server server;
+    EchoServiceImpl service;
+    ASSERT_EQ(0, server.AddService(&service, brpc::SERVER_DOESNT_OWN_SERVICE));
+    ASSERT_EQ(0, server.Start(port, NULL));
+
+    brpc::Channel channel;
+    ASSERT_EQ(0, channel.Init("0.0.0.0", port, NULL));
+    test::EchoService_Stub stub(&channel);
+    brpc::ChannelOptions http_options;
+    http_options.protocol = "http";
+    brpc::Channel http_channel;
+    ASSERT_EQ(0, http_channel.Init("0.0.0.0", port, &http_options));
+    test::EchoService_Stub http_stub(&http_channel);
+    for (int i = 0; i < 5; ++i) {
+        brpc::Controller cntl;
+        test::EchoRequest req;
+        test::EchoResponse res;
+        req.set_message("hello");
+        req.set_sleep_us(20000);
+        stub.Echo(&cntl, &req, &res, NULL);
+        ASSERT_FALSE(cntl.Failed()) << cntl.ErrorText();
+
+        brpc::Controller http_cntl;
+        http_stub.Echo(&http_cntl, &req, &res, NULL);
+        ASSERT_FALSE(http_cntl.Failed()) << http_cntl.ErrorText();
+    }
+    // Wait for the server exposing vars and the sampler taking samples.
+    sleep(2);
+    const std::string prefix = "test_echo_service_echo";
+    ASSERT_GE(GetPhaseLatency(prefix, "process"), 20000);
+    ASSERT_GE(GetPhaseLatency(prefix, "queue"), 0);
+    ASSERT_GE(GetPhaseLatency(prefix, "parse"), 0);
+    ASSERT_GE(GetPhaseLatency(prefix, "serialize"), 0);
+    ASSERT_GE(GetPhaseLatency(prefix, "write"), 0);
+    ASSERT_LT(GetPhaseLatency(prefix, "write"), 20000);
+    brpc::FLAGS_enable_method_phase_latency = false;
+    server.Stop(0);
+    server.Join();
+}
+
 TEST_F(ServerTest, user_fields) {
     const int port = 9200;
     brpc::Server server;
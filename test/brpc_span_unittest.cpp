@@ -0,0 +1,145 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "bvar/variable.h"
+#include "brpc/errno.pb.h"
+#include "brpc/span.h"
+
+namespace brpc {
+DECLARE_double(rpcz_tail_latency_percentile);
+DECLARE_int32(rpcz_tail_hold_ms);
+}
+
+namespace {
+
+int64_t GetCount(const char* name) {
+    return strtoll(bvar::Variable::describe_exposed(name).c_str(), NULL, 10);
+}
+
+void SubmitSpan(const std::string& method, uint64_t trace_id,
+                int64_t latency_us, int error_code, uint64_t log_id = 0) {
+    brpc::Span* span = brpc::Span::CreateServerSpan(
+        method, trace_id, 0, 0, butil::gettimeofday_us());
+    span->set_received_us(0);
+    span->set_sent_us(latency_us);
+    span->set_error_code(error_code);
+    span->set_log_id(log_id);
+    brpc::Span::Submit(span, butil::cpuwide_time_us());
+}
+
+class KeepLogId : public brpc::SpanFilter {
+public:
+    bool Keep(const brpc::BriefSpan& brief) override {
+        return brief.log_id() == 42;
+    }
+};
+
+TEST(SpanTest, tail_sampling) {
+    brpc::FLAGS_rpcz_tail_sampling = true;
+    brpc::FLAGS_rpcz_tail_latency_percentile = 0.9;
+    brpc::FLAGS_rpcz_tail_hold_ms = 0;
+    ASSERT_TRUE(brpc::IsTraceable(false) || !brpc::FLAGS_enable_rpcz);
+
+    // Learn latencies of the method.
+    for (int i = 0; i < 100; ++i) {
+        SubmitSpan("/tail", 1, 1000 + i, 0);
+    }
+    usleep(2100000);
+    SubmitSpan("/tail", 1, 1000, 0);
+
+    int64_t kept = GetCount("rpcz_tail_kept_count");
+    int64_t dropped = GetCount("rpcz_tail_dropped_count");
+    SubmitSpan("/tail", 2, 100000, 0);
+    ASSERT_EQ(++kept, GetCount("rpcz_tail_kept_count"));
+    SubmitSpan("/tail", 3, 500, 0);
+    ASSERT_EQ(++dropped, GetCount("rpcz_tail_dropped_count"));
+    SubmitSpan("/tail", 4, 500, brpc::ERPCTIMEDOUT);
+    ASSERT_EQ(++kept, GetCount("rpcz_tail_kept_count"));
+
+    static KeepLogId filter;
+    brpc::SetRpczTailFilter(&filter);
+    SubmitSpan("/tail", 5, 500, 0, 42);
+    ASSERT_EQ(++kept, GetCount("rpcz_tail_kept_count"));
+    SubmitSpan("/tail", 6, 500, 0, 43);
+    ASSERT_EQ(++dropped, GetCount("rpcz_tail_dropped_count"));
+    brpc::SetRpczTailFilter(NULL);
+
+    // Spans not chosen are saved if another span of the trace is chosen
+    // before they expire.
+    brpc::FLAGS_rpcz_tail_hold_ms = 50;
+    SubmitSpan("/tail", 7, 500, 0);
+    SubmitSpan("/tail", 8, 500, 0);
+    SubmitSpan("/tail", 7, 500, brpc::EINTERNAL);
+    ASSERT_EQ(++kept, GetCount("rpcz_tail_kept_count"));
+    ASSERT_EQ(dropped, GetCount("rpcz_tail_dropped_count"));
+    // Expired spans are released without more spans submitted.
+    usleep(100000);
+    ASSERT_EQ(++kept, GetCount("rpcz_tail_kept_count"));
+    ASSERT_EQ(++dropped, GetCount("rpcz_tail_dropped_count"));
+
+    brpc::FLAGS_rpcz_tail_hold_ms = 1000;
+    brpc::FLAGS_rpcz_tail_sampling = false;
+}
+
+struct IdleHolderArgs {
+    bool submitted;
+    bool quit;
+};
+
+void* submit_and_idle(void* void_args) {
+    IdleHolderArgs* args = (IdleHolderArgs*)void_args;
+    SubmitSpan("/tail_idle", 100, 500, 0);
+    SubmitSpan("/tail_idle", 101, 500, 0);
+    args->submitted = true;
+    while (!args->quit) {
+        usleep(1000);
+    }
+    return NULL;
+}
+
+TEST(SpanTest, tail_sampling_idle_holder) {
+    brpc::FLAGS_rpcz_tail_sampling = true;
+    brpc::FLAGS_rpcz_tail_hold_ms = 50;
+    const int64_t kept = GetCount("rpcz_tail_kept_count");
+    const int64_t dropped = GetCount("rpcz_tail_dropped_count");
+    IdleHolderArgs args = { false, false };
+    pthread_t th;
+    ASSERT_EQ(0, pthread_create(&th, NULL, submit_and_idle, &args));
+    while (!args.submitted) {
+        usleep(1000);
+    }
+    // Another span of trace 100 is chosen, the held one should be saved.
+    SubmitSpan("/tail_idle", 100, 500, brpc::EINTERNAL);
+    ASSERT_EQ(kept + 1, GetCount("rpcz_tail_kept_count"));
+    // The holding thread stays alive but submits nothing.
+    usleep(200000);
+    ASSERT_EQ(kept + 2, GetCount("rpcz_tail_kept_count"));
+    ASSERT_EQ(dropped + 1, GetCount("rpcz_tail_dropped_count"));
+    args.quit = true;
+    pthread_join(th, NULL);
+    ASSERT_EQ(kept + 2, GetCount("rpcz_tail_kept_count"));
+    ASSERT_EQ(dropped + 1, GetCount("rpcz_tail_dropped_count"));
+
+    brpc::FLAGS_rpcz_tail_hold_ms = 1000;
+    brpc::FLAGS_rpcz_tail_sampling = false;
+}
+
+} // namespace
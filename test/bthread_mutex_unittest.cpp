@@ -25,6 +25,7 @@
 #include "bthread/butex.h"
 #include "bthread/task_control.h"
 #include "bthread/mutex.h"
+#include "bthread/adaptive_mutex.h"
 #include "gperftools_helper.h"
 
 namespace {
@@ -213,16 +214,22 @@ void PerfTest(Mutex* mutex,
     g_stopped = true;
     int64_t wait_time = 0;
     int64_t count = 0;
+    int64_t min_count = INT64_MAX;
+    int64_t max_count = 0;
     for (int i = 0; i < thread_num; ++i) {
         join_fn(threads[i], NULL);
         wait_time += args[i].elapse_ns;
         count += args[i].counter;
+        min_count = std::min(min_count, args[i].counter);
+        max_count = std::max(max_count, args[i].counter);
     }
     LOG(INFO) << butil::class_name<Mutex>() << " in "
               << ((void*)create_fn == (void*)pthread_create ? "pthread" : "bthread")
               << " thread_num=" << thread_num
               << " count=" << count
-              << " average_time=" << wait_time / (double)count;
+              << " average_time=" << wait_time / (double)count
+              << " min_count=" << min_count
+              << " max_count=" << max_count;
 }
 
 TEST(MutexTest, performance) {
@@ -240,6 +247,107 @@ TEST(MutexTest, performance) {
     PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
 }
 
+TEST(MutexTest, adaptive_mutex) {
+    for (int i = 0; i < 2; ++i) {
+        bthread::AdaptiveMutexOptions options;
+        options.fifo_handoff = (i == 1);
+        bthread::AdaptiveMutex mutex(options);
+        ASSERT_EQ(options.fifo_handoff, mutex.fifo_handoff());
+        ASSERT_TRUE(mutex.try_lock());
+        ASSERT_FALSE(mutex.try_lock());
+        mutex.unlock();
+        mutex.lock();
+        struct timespec t = { -2, 0 };
+        ASSERT_FALSE(mutex.timed_lock(&t));
+        timespec abstime = butil::milliseconds_from_now(20);
+        butil::Timer tm;
+        tm.start();
+        ASSERT_FALSE(mutex.timed_lock(&abstime));
+        tm.stop();
+        ASSERT_GE(tm.m_elapsed(), 15);
+        mutex.unlock();
+        ASSERT_TRUE(mutex.timed_lock(&t));
+        mutex.unlock();
+        {
+            std::unique_lock<bthread::AdaptiveMutex> lck(mutex);
+            ASSERT_FALSE(mutex.try_lock());
+        }
+        ASSERT_TRUE(mutex.try_lock());
+        mutex.unlock();
+    }
+}
+
+struct AdaptiveMutexArgs {
+    bthread::AdaptiveMutex* mutex;
+    int64_t* counter;
+};
+
+const int ADAPTIVE_MUTEX_LOOPS = 10000;
+
+void* add_with_adaptive_mutex(void* void_arg) {
+    AdaptiveMutexArgs* args = (AdaptiveMutexArgs*)void_arg;
+    for (int i = 0; i < ADAPTIVE_MUTEX_LOOPS; ++i) {
+        BAIDU_SCOPED_LOCK(*args->mutex);
+        ++*args->counter;
+        if (i % 1000 == 0) {
+            // Park the others.
+            bthread_usleep(100);
+        }
+    }
+    return NULL;
+}
+
+TEST(MutexTest, adaptive_mutex_exclusive) {
+    const int N = 8;
+    for (int i = 0; i < 2; ++i) {
+        bthread::AdaptiveMutexOptions options;
+        options.fifo_handoff = (i == 1);
+        options.name = "adaptive_mutex_test";
+        bthread::AdaptiveMutex mutex(options);
+        int64_t counter = 0;
+        AdaptiveMutexArgs args = { &mutex, &counter };
+        pthread_t pthreads[N];
+        bthread_t bthreads[N];
+        for (int j = 0; j < N; ++j) {
+            ASSERT_EQ(0, pthread_create(&pthreads[j], NULL,
+                                        add_with_adaptive_mutex, &args));
+            ASSERT_EQ(0, bthread_start_background(&bthreads[j], NULL,
+                                                  add_with_adaptive_mutex, &args));
+        }
+        for (int j = 0; j < N; ++j) {
+            pthread_join(pthreads[j], NULL);
+            bthread_join(bthreads[j], NULL);
+        }
+        ASSERT_EQ(2 * N * ADAPTIVE_MUTEX_LOOPS, counter);
+    }
+}
+
+class FifoAdaptiveMutex : public bthread::AdaptiveMutex {
+public:
+    FifoAdaptiveMutex() : bthread::AdaptiveMutex(fifo_options()) {}
+private:
+    static bthread::AdaptiveMutexOptions fifo_options() {
+        bthread::AdaptiveMutexOptions options;
+        options.fifo_handoff = true;
+        return options;
+    }
+};
+
+TEST(MutexTest, adaptive_mutex_performance) {
+    const int thread_num = 64;
+    bthread::Mutex bth_mutex;
+    PerfTest(&bth_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+    PerfTest(&bth_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+
+    bthread::AdaptiveMutex adaptive_mutex;
+    PerfTest(&adaptive_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+    PerfTest(&adaptive_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+
+    FifoAdaptiveMutex fifo_mutex;
+    PerfTest(&fifo_mutex, (pthread_t*)NULL, thread_num, pthread_create, pthread_join);
+    PerfTest(&fifo_mutex, (bthread_t*)NULL, thread_num, bthread_start_background, bthread_join);
+}
+
 template <typename Mutex>
 void* loop_until_stopped(void* arg) {
     auto m = (Mutex*)arg;
@@ -0,0 +1,121 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "butil/compat.h"
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <gflags/gflags.h>
+#include "butil/time.h"
+#include "butil/fd_guard.h"
+#include "bthread/bthread.h"
+#include "bthread/mutex.h"
+#include "bthread/unstable.h"
+#include "bthread/offcpu_profiler.h"
+
+namespace bthread {
+DECLARE_int32(bthread_offcpu_sample_period);
+}
+
+namespace {
+
+void* Sleeper(void*) {
+    for (int i = 0; i < 5; ++i) {
+        bthread_usleep(10000);
+    }
+    return NULL;
+}
+
+void* LockHolder(void* arg) {
+    bthread::Mutex* m = static_cast<bthread::Mutex*>(arg);
+    m->lock();
+    bthread_usleep(20000);
+    m->unlock();
+    return NULL;
+}
+
+void* Locker(void* arg) {
+    bthread::Mutex* m = static_cast<bthread::Mutex*>(arg);
+    m->lock();
+    m->unlock();
+    return NULL;
+}
+
+void* FdWaiter(void* arg) {
+    const int fd = *static_cast<int*>(arg);
+#if defined(OS_LINUX)
+    bthread_fd_wait(fd, EPOLLIN);
+#elif defined(OS_MACOSX)
+    bthread_fd_wait(fd, EVFILT_READ);
+#endif
+    return NULL;
+}
+
+TEST(OffCpuProfilerTest, record_waits_by_reason) {
+    bthread::FLAGS_bthread_offcpu_sample_period = 1;
+    ASSERT_TRUE(bthread::OffCpuProfilerStart());
+    ASSERT_FALSE(bthread::OffCpuProfilerStart());
+
+    bthread_t sleeper;
+    ASSERT_EQ(0, bthread_start_background(&sleeper, NULL, Sleeper, NULL));
+
+    bthread::Mutex m;
+    bthread_t holder;
+    bthread_t locker;
+    ASSERT_EQ(0, bthread_start_background(&holder, NULL, LockHolder, &m));
+    bthread_usleep(5000);
+    ASSERT_EQ(0, bthread_start_background(&locker, NULL, Locker, &m));
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+    butil::fd_guard rfd(fds[0]);
+    butil::fd_guard wfd(fds[1]);
+    bthread_t fd_waiter;
+    ASSERT_EQ(0, bthread_start_background(&fd_waiter, NULL, FdWaiter, &fds[0]));
+    bthread_usleep(20000);
+    ASSERT_EQ(1, write(fds[1], "x", 1));
+
+    ASSERT_EQ(0, bthread_join(sleeper, NULL));
+    ASSERT_EQ(0, bthread_join(holder, NULL));
+    ASSERT_EQ(0, bthread_join(locker, NULL));
+    ASSERT_EQ(0, bthread_join(fd_waiter, NULL));
+
+    std::vector<bthread::OffCpuStack> stacks;
+    bthread::OffCpuProfilerStop(&stacks);
+    int64_t count[bthread::OFFCPU_REASON_NUM] = { 0 };
+    int64_t wait_us[bthread::OFFCPU_REASON_NUM] = { 0 };
+    for (size_t i = 0; i < stacks.size(); ++i) {
+        ASSERT_LT(stacks[i].reason, bthread::OFFCPU_REASON_NUM);
+        ASSERT_FALSE(stacks[i].pcs.empty());
+        count[stacks[i].reason] += stacks[i].count;
+        wait_us[stacks[i].reason] += stacks[i].wait_us;
+    }
+    ASSERT_GE(count[bthread::OFFCPU_USLEEP], 5);
+    ASSERT_GE(wait_us[bthread::OFFCPU_USLEEP], 50000);
+    // The locker and the joins.
+    ASSERT_GE(count[bthread::OFFCPU_BUTEX], 1);
+    ASSERT_EQ(1, count[bthread::OFFCPU_FD]);
+    ASSERT_GE(wait_us[bthread::OFFCPU_FD], 10000);
+
+    // Nothing is recorded after stopping.
+    ASSERT_EQ(0, bthread_start_background(&sleeper, NULL, Sleeper, NULL));
+    ASSERT_EQ(0, bthread_join(sleeper, NULL));
+    bthread::OffCpuProfilerStop(&stacks);
+    ASSERT_TRUE(stacks.empty());
+    bthread::FLAGS_bthread_offcpu_sample_period = 16;
+}
+
+} // namespace
@@ -35,6 +35,7 @@ DEFINE_int32(thread_num, 1, "#pairs of threads doing ping pong");
 DEFINE_bool(loop, false, "run until ctrl-C is pressed");
 DEFINE_bool(use_futex, false, "use futex instead of pipe");
 DEFINE_bool(use_butex, false, "use butex instead of pipe");
+DEFINE_int32(switch_rounds, 500000, "#rounds of each bthread in switch benchmark");
 
 void ALLOW_UNUSED (*ignore_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
 
@@ -111,6 +112,59 @@ void* butex_player(void* void_arg) {
     return NULL;
 }
 
+// Wake the peer without signaling other workers, so that the peer is queued
+// in local runqueue and the following butex_wait switches to it directly.
+// Both players end up in the same worker and every round of a player is
+// exactly one context switch.
+void* switch_player(void* void_arg) {
+    PlayerArg* arg = static_cast<PlayerArg*>(void_arg);
+    int counter = INITIAL_FUTEX_VALUE;
+    while (arg->counter < FLAGS_switch_rounds) {
+        int rc = bthread::butex_wait(arg->wait_addr, counter, NULL);
+        ++counter;
+        ++*arg->wake_addr;
+        bthread::butex_wake(arg->wake_addr, true);
+        ++arg->counter;
+        arg->wakeup += (rc == 0);
+    }
+    return NULL;
+}
+
+TEST(PingPongTest, context_switch) {
+    PlayerArg arg1;
+    PlayerArg arg2;
+    arg1.wait_addr = bthread::butex_create_checked<int>();
+    *arg1.wait_addr = INITIAL_FUTEX_VALUE;
+    arg1.wake_addr = bthread::butex_create_checked<int>();
+    *arg1.wake_addr = INITIAL_FUTEX_VALUE;
+    arg1.counter = 0;
+    arg1.wakeup = 0;
+    arg2.wait_addr = arg1.wake_addr;
+    arg2.wake_addr = arg1.wait_addr;
+    arg2.counter = 0;
+    arg2.wakeup = 0;
+
+    bthread_t bth1, bth2;
+    ASSERT_EQ(0, bthread_start_background(&bth1, NULL, switch_player, &arg1));
+    ASSERT_EQ(0, bthread_start_background(&bth2, NULL, switch_player, &arg2));
+    butil::Timer tm;
+    tm.start();
+    ++*arg1.wait_addr;
+    bthread::butex_wake(arg1.wait_addr);
+    ASSERT_EQ(0, bthread_join(bth1, NULL));
+    ASSERT_EQ(0, bthread_join(bth2, NULL));
+    tm.stop();
+
+    ASSERT_EQ(FLAGS_switch_rounds, arg1.counter);
+    ASSERT_EQ(FLAGS_switch_rounds, arg2.counter);
+    const long nswitch = arg1.counter + arg2.counter;
+    printf("switched %ld times in %" PRId64 "ms, %" PRId64 "ns per switch,"
+           " wakeup=%ld\n", nswitch, tm.m_elapsed(),
+           tm.n_elapsed() / nswitch, arg1.wakeup + arg2.wakeup);
+    bthread::butex_destroy(arg1.wait_addr);
+    bthread::butex_destroy(arg1.wake_addr);
+}
+
 TEST(PingPongTest, ping_pong) {
     signal(SIGINT, quit_handler);
     stop = false;
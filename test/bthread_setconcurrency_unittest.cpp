@@ -27,8 +27,14 @@
 #include "bthread/bthread.h"
 #include "bthread/task_control.h"
 
+DECLARE_int32(bthread_autoscale_interval_s);
+DECLARE_int32(bthread_autoscale_max_concurrency);
+DECLARE_int32(bthread_autoscale_high_usage_percent);
+DECLARE_int32(bthread_autoscale_down_checks);
+
 namespace bthread {
     extern TaskControl* g_task_control;
+    DECLARE_int32(bthread_min_concurrency);
 }
 
 namespace {
@@ -52,8 +58,8 @@ TEST(BthreadTest, setconcurrency) {
     ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 1, bthread_getconcurrency());
     ASSERT_EQ(0, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 5));
     ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 5, bthread_getconcurrency());
-    ASSERT_EQ(EPERM, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 1));
-    ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 5, bthread_getconcurrency());
+    ASSERT_EQ(0, bthread_setconcurrency(BTHREAD_MIN_CONCURRENCY + 1));
+    ASSERT_EQ(BTHREAD_MIN_CONCURRENCY + 1, bthread_getconcurrency());
 }
 
 static butil::atomic<int> *odd;
@@ -222,4 +228,75 @@ TEST(BthreadTest, concurrency_by_tag) {
     ASSERT_EQ(concurrency_by_tag(con + 1), true);
 }
 
+static int64_t get_exposed(const char* name) {
+    return atoll(bvar::Variable::describe_exposed(name).c_str());
+}
+
+void* usleep_repeatedly(void*) {
+    for (int i = 0; i < 20; ++i) {
+        bthread_usleep(1000);
+        bthread_yield();
+    }
+    return NULL;
+}
+
+TEST(BthreadTest, reduce_concurrency) {
+    bthread::FLAGS_bthread_min_concurrency = 0;
+    const int con = bthread_getconcurrency();
+    ASSERT_EQ(0, bthread_setconcurrency(con + 8));
+    std::vector<bthread_t> tids(200);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&tids[i], NULL, usleep_repeatedly, NULL));
+    }
+    ASSERT_EQ(0, bthread_setconcurrency(con));
+    ASSERT_EQ(con, bthread_getconcurrency());
+    ASSERT_EQ(con, bthread::g_task_control->concurrency());
+    // Tasks of removed workers are not lost.
+    for (size_t i = 0; i < tids.size(); ++i) {
+        ASSERT_EQ(0, bthread_join(tids[i], NULL));
+    }
+    int64_t nworker = 0;
+    for (int i = 0; i < 200; ++i) {
+        nworker = get_exposed("bthread_worker_count");
+        if (nworker == con) {
+            break;
+        }
+        usleep(10000);
+    }
+    ASSERT_EQ(con, nworker);
+}
+
+void* spin_for_a_while(void* arg) {
+    const int64_t end_us = butil::cpuwide_time_us() + (intptr_t)arg;
+    while (butil::cpuwide_time_us() < end_us) {}
+    return NULL;
+}
+
+TEST(BthreadTest, autoscale) {
+    const int64_t nup = get_exposed("bthread_autoscale_up_count_0");
+    const int64_t ndown = get_exposed("bthread_autoscale_down_count_0");
+    FLAGS_bthread_autoscale_down_checks = 1;
+    FLAGS_bthread_autoscale_interval_s = 1;
+    // Idle workers are removed.
+    for (int i = 0; i < 50 && get_exposed("bthread_autoscale_down_count_0") == ndown; ++i) {
+        usleep(100000);
+    }
+    ASSERT_LT(ndown, get_exposed("bthread_autoscale_down_count_0"));
+
+    // Workers are added when they're busy.
+    FLAGS_bthread_autoscale_high_usage_percent = 1;
+    FLAGS_bthread_autoscale_max_concurrency = BTHREAD_MAX_CONCURRENCY;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, spin_for_a_while, (void*)3000000));
+    for (int i = 0; i < 50 && get_exposed("bthread_autoscale_up_count_0") == nup; ++i) {
+        usleep(100000);
+    }
+    FLAGS_bthread_autoscale_interval_s = 0;
+    FLAGS_bthread_autoscale_high_usage_percent = 80;
+    FLAGS_bthread_autoscale_max_concurrency = 64;
+    FLAGS_bthread_autoscale_down_checks = 3;
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    ASSERT_LT(nup, get_exposed("bthread_autoscale_up_count_0"));
+}
+
 } // namespace
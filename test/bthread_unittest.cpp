@@ -20,6 +20,7 @@
 #include "butil/time.h"
 #include "butil/macros.h"
 #include "butil/logging.h"
+#include "bvar/variable.h"
 #include "gperftools_helper.h"
 #include "bthread/bthread.h"
 #include "bthread/unstable.h"
@@ -32,9 +33,15 @@ int main(int argc, char* argv[]) {
     return rc;
 }
 
+DECLARE_int32(bthread_watchdog_interval_ms);
+
 namespace bthread {
 extern __thread bthread::LocalStorage tls_bls;
 DECLARE_bool(enable_fast_unwind);
+DECLARE_int32(bthread_sched_latency_sample_period);
+DECLARE_int32(bthread_priority_starvation_period);
+DECLARE_int32(bthread_time_slice_us);
+extern void print_sched_stats(std::ostream& os);
 #ifdef BRPC_BTHREAD_TRACER
 extern std::string stack_trace(bthread_t tid);
 #endif // BRPC_BTHREAD_TRACER
@@ -628,6 +635,136 @@ TEST_F(BthreadTest, yield_single_thread) {
     ASSERT_EQ(0, bthread_join(tid, NULL));
 }
 
+TEST_F(BthreadTest, sched_stats) {
+    bthread::FLAGS_bthread_sched_latency_sample_period = 1;
+    bthread_t th[32];
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&th[i], NULL, yield_thread, NULL));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(th); ++i) {
+        ASSERT_EQ(0, bthread_join(th[i], NULL));
+    }
+    bthread::FLAGS_bthread_sched_latency_sample_period = 32;
+    // Each bthread was put into runqueues when created and yielded.
+    ASSERT_GE(atoll(bvar::Variable::describe_exposed(
+                  "bthread_sched_0_count").c_str()), (int64_t)ARRAY_SIZE(th) * 2);
+    ASSERT_FALSE(bvar::Variable::describe_exposed("bthread_steal_second_0").empty());
+    ASSERT_FALSE(bvar::Variable::describe_exposed("bthread_steal_fail_second_0").empty());
+    ASSERT_FALSE(bvar::Variable::describe_exposed("bthread_park_second_0").empty());
+    ASSERT_FALSE(bvar::Variable::describe_exposed("bthread_unpark_second_0").empty());
+    ASSERT_EQ("0", bvar::Variable::describe_exposed("bthread_remote_rq_size_0"));
+
+    std::ostringstream os;
+    bthread::print_sched_stats(os);
+    LOG(INFO) << os.str();
+    ASSERT_NE(std::string::npos, os.str().find("[tag=0]"));
+    ASSERT_NE(std::string::npos, os.str().find("sched_latency(us): avg="));
+    ASSERT_NE(std::string::npos, os.str().find("rq_size(local/remote):"));
+}
+
+struct PriorityArgs {
+    butil::atomic<int> nstarted;
+    butil::atomic<int> high_order_sum;
+    butil::atomic<int> low_order_sum;
+    std::vector<bthread_t> tids;
+};
+
+void* record_high_priority(void* arg) {
+    PriorityArgs* args = static_cast<PriorityArgs*>(arg);
+    args->high_order_sum.fetch_add(args->nstarted.fetch_add(1));
+    return NULL;
+}
+
+void* record_low_priority(void* arg) {
+    PriorityArgs* args = static_cast<PriorityArgs*>(arg);
+    args->low_order_sum.fetch_add(args->nstarted.fetch_add(1));
+    return NULL;
+}
+
+void* start_high_then_low(void* arg) {
+    PriorityArgs* args = static_cast<PriorityArgs*>(arg);
+    bthread_attr_t high_attr = BTHREAD_ATTR_NORMAL | BTHREAD_PRIORITY_HIGH | BTHREAD_NOSIGNAL;
+    bthread_attr_t low_attr = BTHREAD_ATTR_NORMAL | BTHREAD_PRIORITY_LOW | BTHREAD_NOSIGNAL;
+    // Local runqueues are LIFO, the bthreads with low priority would run
+    // first without priorities.
+    for (size_t i = 0; i < args->tids.size() / 2; ++i) {
+        bthread_start_background(&args->tids[i], &high_attr,
+                                 record_high_priority, args);
+    }
+    for (size_t i = args->tids.size() / 2; i < args->tids.size(); ++i) {
+        bthread_start_background(&args->tids[i], &low_attr,
+                                 record_low_priority, args);
+    }
+    bthread_flush();
+    return NULL;
+}
+
+TEST_F(BthreadTest, priority) {
+    ASSERT_EQ(EPERM, bthread_set_priority_self(BTHREAD_PRIORITY_HIGH));
+    bthread::FLAGS_bthread_priority_starvation_period = 1000000;
+    bthread::FLAGS_bthread_sched_latency_sample_period = 1;
+    PriorityArgs args;
+    args.nstarted.store(0);
+    args.high_order_sum.store(0);
+    args.low_order_sum.store(0);
+    args.tids.resize(16);
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, start_high_then_low, &args));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    for (size_t i = 0; i < args.tids.size(); ++i) {
+        ASSERT_EQ(0, bthread_join(args.tids[i], NULL));
+    }
+    bthread::FLAGS_bthread_sched_latency_sample_period = 32;
+    bthread::FLAGS_bthread_priority_starvation_period = 16;
+    // Workers stealing from the runqueues may run some bthreads out of order.
+    ASSERT_LT(args.high_order_sum.load(), args.low_order_sum.load());
+    ASSERT_GT(atoll(bvar::Variable::describe_exposed(
+                  "bthread_sched_high_0_count").c_str()), 0);
+    ASSERT_GT(atoll(bvar::Variable::describe_exposed(
+                  "bthread_sched_low_0_count").c_str()), 0);
+}
+
+void* set_priority_self(void*) {
+    EXPECT_EQ(EINVAL, bthread_set_priority_self(BTHREAD_NOSIGNAL));
+    EXPECT_EQ(0, bthread_set_priority_self(BTHREAD_PRIORITY_LOW));
+    bthread_yield();
+    EXPECT_EQ(0, bthread_set_priority_self(0));
+    return NULL;
+}
+
+TEST_F(BthreadTest, set_priority_self) {
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, set_priority_self, NULL));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+}
+
+void* spin_and_maybe_yield(void* arg) {
+    // Just switched in.
+    EXPECT_EQ(0, bthread_maybe_yield());
+    // Long enough to be reported by the watchdog.
+    const int64_t end_us = butil::cpuwide_time_us() + (intptr_t)arg;
+    while (butil::cpuwide_time_us() < end_us) {}
+    EXPECT_EQ(1, bthread_maybe_yield());
+    EXPECT_EQ(0, bthread_maybe_yield());
+    return NULL;
+}
+
+TEST_F(BthreadTest, maybe_yield) {
+    ASSERT_EQ(0, bthread_maybe_yield());
+    const int64_t noverrun = atoll(bvar::Variable::describe_exposed(
+        "bthread_slice_overrun_count_0").c_str());
+    bthread::FLAGS_bthread_time_slice_us = 2000;
+    FLAGS_bthread_watchdog_interval_ms = 1;
+    bthread_t th;
+    ASSERT_EQ(0, bthread_start_background(&th, NULL, spin_and_maybe_yield,
+                                          (void*)200000));
+    ASSERT_EQ(0, bthread_join(th, NULL));
+    FLAGS_bthread_watchdog_interval_ms = 0;
+    bthread::FLAGS_bthread_time_slice_us = 10000;
+    ASSERT_LT(noverrun, atoll(bvar::Variable::describe_exposed(
+        "bthread_slice_overrun_count_0").c_str()));
+}
+
 #ifdef BRPC_BTHREAD_TRACER
 void spin_and_log_trace() {
     bool ok = false;
@@ -0,0 +1,92 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "latency_histogram.h"
+
+namespace pbrpcframework {
+
+LatencyHistogram::LatencyHistogram()
+    : _count(0), _sum(0), _max(0) {
+    for (int i = 0; i < NBUCKET; ++i) {
+        _buckets[i].store(0, butil::memory_order_relaxed);
+    }
+}
+
+int LatencyHistogram::bucket_of(int64_t value) {
+    if (value < (1L << SUB_BUCKET_BITS)) {
+        return value < 0 ? 0 : (int)value;
+    }
+    if (value >= (1L << MAX_VALUE_BITS)) {
+        value = (1L << MAX_VALUE_BITS) - 1;
+    }
+    const int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    // (value >> shift) is in [2^SUB_BUCKET_BITS, 2^(SUB_BUCKET_BITS+1)).
+    return (shift << SUB_BUCKET_BITS) + (int)(value >> shift);
+}
+
+int64_t LatencyHistogram::upper_bound_of(int bucket) {
+    if (bucket < (1 << SUB_BUCKET_BITS)) {
+        return bucket;
+    }
+    const int shift = (bucket >> SUB_BUCKET_BITS) - 1;
+    const int64_t sub = bucket - (shift << SUB_BUCKET_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(int64_t value) {
+    _buckets[bucket_of(value)].fetch_add(1, butil::memory_order_relaxed);
+    _count.fetch_add(1, butil::memory_order_relaxed);
+    _sum.fetch_add(value, butil::memory_order_relaxed);
+    int64_t cur_max = _max.load(butil::memory_order_relaxed);
+    while (value > cur_max &&
+           !_max.compare_exchange_weak(cur_max, value,
+                                       butil::memory_order_relaxed)) {}
+}
+
+double LatencyHistogram::mean() const {
+    const int64_t n = count();
+    return n ? (double)_sum.load(butil::memory_order_relaxed) / n : 0;
+}
+
+int64_t LatencyHistogram::percentile(double ratio) const {
+    int64_t total = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        total += _buckets[i].load(butil::memory_order_relaxed);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    int64_t rank = (int64_t)(ratio * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    } else if (rank > total) {
+        rank = total;
+    }
+    int64_t acc = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        acc += _buckets[i].load(butil::memory_order_relaxed);
+        if (acc >= rank) {
+            // The bucket may be wider than the recorded maximum.
+            const int64_t bound = upper_bound_of(i);
+            const int64_t m = max();
+            return bound < m ? bound : m;
+        }
+    }
+    return max();
+}
+
+} // namespace pbrpcframework
@@ -0,0 +1,68 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef PBRPCPRESS_LATENCY_HISTOGRAM_H
+#define PBRPCPRESS_LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+
+namespace pbrpcframework {
+
+// Histogram of latencies in the layout of HdrHistogram: values are grouped
+// by powers of 2 and each group is split into 2^SUB_BUCKET_BITS linear
+// buckets, so the relative error of any recorded value is below
+// 1/2^SUB_BUCKET_BITS (~1.6%) in the whole range [0, 2^MAX_VALUE_BITS).
+// All records are kept, which is required by exact percentiles of a whole
+// benchmark instead of the windowed ones of bvar::LatencyRecorder.
+// Thread-safe.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 6;
+    static const int MAX_VALUE_BITS = 40;
+    static const int NBUCKET =
+        (MAX_VALUE_BITS - SUB_BUCKET_BITS + 2) << SUB_BUCKET_BITS;
+
+    LatencyHistogram();
+
+    // Values out of range are clamped.
+    void record(int64_t value);
+
+    int64_t count() const { return _count.load(butil::memory_order_relaxed); }
+    int64_t max() const { return _max.load(butil::memory_order_relaxed); }
+    double mean() const;
+
+    // Value at `ratio' (in [0, 1]) of all records, e.g. 0.99 for p99. The
+    // upper bound of the bucket is returned, 0 when there are no records.
+    int64_t percentile(double ratio) const;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LatencyHistogram);
+
+    static int bucket_of(int64_t value);
+    static int64_t upper_bound_of(int bucket);
+
+    butil::atomic<int64_t> _count;
+    butil::atomic<int64_t> _sum;
+    butil::atomic<int64_t> _max;
+    butil::atomic<int64_t> _buckets[NBUCKET];
+};
+
+} // namespace pbrpcframework
+
+#endif // PBRPCPRESS_LATENCY_HISTOGRAM_H
@@ -22,7 +22,9 @@
 #include <butil/logging.h>
 #include <butil/string_splitter.h>
 #include <string.h>
+#include <sstream>
 #include "rpc_press_impl.h"
+#include "throughput_finder.h"
 
 DEFINE_int32(dummy_port, 8888, "Port of dummy server"); 
 DEFINE_string(proto, "", " user's proto files with path");
@@ -44,6 +46,80 @@ DEFINE_int32(attachment_size, 0, "Carry so many byte attachment along with reque
 DEFINE_int32(duration, 0, "how many seconds the press keep");
 DEFINE_int32(qps, 100 , "how many calls  per seconds");
 DEFINE_bool(pretty, true, "output pretty jsons");
+DEFINE_bool(open_loop, false, "Send requests at scheduled times without waiting "
+            "for responses, and count latencies from the scheduled times so that "
+            "stalls of the server are not hidden (coordinated omission)");
+DEFINE_string(load_profile, "", "[open_loop] Comma-separated stages of "
+              "`qps:seconds' or `start_qps-end_qps:seconds' (linear ramp), e.g. "
+              "`1000:30,1000-5000:60,5000:30'. The last stage lasts forever "
+              "without `:seconds'. Empty means -qps for -duration seconds");
+DEFINE_string(result_file, "", "[open_loop] Write latencies of each stage into "
+              "this file after the press");
+DEFINE_string(result_format, "json", "[open_loop] Format of -result_file: json, csv");
+DEFINE_bool(find_max_qps, false, "Search for the maximum qps meeting the latency "
+            "SLO with open-loop presses of fixed qps, instead of pressing");
+DEFINE_double(slo_latency_ms, 10, "[find_max_qps] Maximum latency at -slo_percentile");
+DEFINE_double(slo_percentile, 0.99, "[find_max_qps] Percentile of latencies in the SLO");
+DEFINE_double(slo_max_error_ratio, 0.001, "[find_max_qps] Maximum ratio of failed RPC");
+DEFINE_double(search_min_qps, 1000, "[find_max_qps] Start searching from this qps");
+DEFINE_double(search_max_qps, 10000000, "[find_max_qps] Stop searching at this qps");
+DEFINE_double(search_precision, 0.05, "[find_max_qps] Stop searching when the "
+              "range of qps is narrower than so much of its upper bound");
+DEFINE_int32(warmup_seconds, 2, "[find_max_qps] Press before measuring in each trial");
+DEFINE_int32(trial_seconds, 10, "[find_max_qps] Measure so many seconds in each "
+             "trial, better not less than -bvar_dump_interval of the server "
+             "over which its cpu usage is averaged");
+DEFINE_string(server_vars, "", "[find_max_qps] ip:port of builtin services of the "
+              "server to read its cpu usage. Empty means -server when -lb_policy "
+              "is empty");
+DEFINE_string(protocols, "", "[find_max_qps] Comma-separated protocols to search "
+              "one after another for comparison, e.g. baidu_std,h2:grpc,http. "
+              "Empty means -protocol");
+
+// Parse -load_profile into `stages'.
+static bool parse_load_profile(const std::string& profile,
+                               std::vector<pbrpcframework::LoadStage>* stages) {
+    std::vector<std::string> fields;
+    for (butil::StringSplitter sp(profile.c_str(), ','); sp; ++sp) {
+        fields.push_back(std::string(sp.field(), sp.length()));
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        std::string& field = fields[i];
+        pbrpcframework::LoadStage stage = { 0, 0, 0 };
+        const size_t colon_pos = field.find(':');
+        if (colon_pos != std::string::npos) {
+            char* endptr = NULL;
+            stage.duration_s = strtol(field.c_str() + colon_pos + 1, &endptr, 10);
+            if (*endptr != '\0' || stage.duration_s <= 0) {
+                LOG(ERROR) << "Invalid seconds in stage=`" << field << '\'';
+                return false;
+            }
+            field.resize(colon_pos);
+        } else if (i + 1 != fields.size()) {
+            // Only the last stage may last forever.
+            LOG(ERROR) << "Missing seconds in stage=`" << field << '\'';
+            return false;
+        }
+        const size_t dash_pos = field.find('-');
+        char* endptr = NULL;
+        stage.start_qps = strtod(field.c_str(), &endptr);
+        if (dash_pos != std::string::npos) {
+            if (endptr != field.c_str() + dash_pos) {
+                LOG(ERROR) << "Invalid qps in stage=`" << field << '\'';
+                return false;
+            }
+            stage.end_qps = strtod(field.c_str() + dash_pos + 1, &endptr);
+        } else {
+            stage.end_qps = stage.start_qps;
+        }
+        if (*endptr != '\0' || endptr == field.c_str()) {
+            LOG(ERROR) << "Invalid qps in stage=`" << field << '\'';
+            return false;
+        }
+        stages->push_back(stage);
+    }
+    return true;
+}
 
 bool set_press_options(pbrpcframework::PressOptions* options){
     size_t dot_pos = FLAGS_method.find_last_of('.');
@@ -55,13 +131,37 @@ bool set_press_options(pbrpcframework::PressOptions* options){
     options->method = FLAGS_method.substr(dot_pos + 1);
     options->lb_policy = FLAGS_lb_policy;
     options->test_req_rate = FLAGS_qps;
+    options->open_loop = FLAGS_open_loop;
+    if (FLAGS_open_loop) {
+        if (!parse_load_profile(FLAGS_load_profile, &options->load_stages)) {
+            return false;
+        }
+        if (options->load_stages.empty()) {
+            if (FLAGS_qps <= 0) {
+                LOG(ERROR) << "-open_loop requires positive -qps or -load_profile";
+                return false;
+            }
+            pbrpcframework::LoadStage stage = { (double)FLAGS_qps,
+                                                (double)FLAGS_qps, FLAGS_duration };
+            options->load_stages.push_back(stage);
+        }
+        // Choose threads and check the rate limit by the peak rate.
+        options->test_req_rate = 0;
+        for (size_t i = 0; i < options->load_stages.size(); ++i) {
+            options->test_req_rate = std::max(options->test_req_rate,
+                std::max(options->load_stages[i].start_qps,
+                         options->load_stages[i].end_qps));
+        }
+        options->result_file = FLAGS_result_file;
+        options->result_format = FLAGS_result_format;
+    }
     if (FLAGS_thread_num > 0) {
         options->test_thread_num = FLAGS_thread_num;
     } else {
-        if (FLAGS_qps <= 0) { // unlimited qps
+        if (options->test_req_rate <= 0) { // unlimited qps
             options->test_thread_num = 50;
         } else {
-            options->test_thread_num = FLAGS_qps / 10000;
+            options->test_thread_num = options->test_req_rate / 10000;
             if (options->test_thread_num < 1) {
                 options->test_thread_num = 1;
             }
@@ -95,6 +195,56 @@ bool set_press_options(pbrpcframework::PressOptions* options){
     return true;
 }
 
+static int find_max_qps(const pbrpcframework::PressOptions& press_options) {
+    pbrpcframework::FindMaxQpsOptions options;
+    options.slo_latency_ms = FLAGS_slo_latency_ms;
+    options.slo_percentile = FLAGS_slo_percentile;
+    options.max_error_ratio = FLAGS_slo_max_error_ratio;
+    options.min_qps = FLAGS_search_min_qps;
+    options.max_qps = FLAGS_search_max_qps;
+    options.precision = FLAGS_search_precision;
+    options.warmup_s = FLAGS_warmup_seconds;
+    options.trial_s = FLAGS_trial_seconds;
+    options.thread_num = FLAGS_thread_num;
+    options.server_vars = FLAGS_server_vars;
+    if (options.server_vars.empty() && FLAGS_lb_policy.empty()) {
+        options.server_vars = FLAGS_server;
+    }
+    std::vector<std::string> protocols;
+    for (butil::StringSplitter sp(FLAGS_protocols.c_str(), ','); sp; ++sp) {
+        protocols.push_back(std::string(sp.field(), sp.length()));
+    }
+    if (protocols.empty()) {
+        protocols.push_back(FLAGS_protocol);
+    }
+    std::vector<pbrpcframework::MaxQpsResult> results;
+    for (size_t i = 0; i < protocols.size() && !brpc::IsAskedToQuit(); ++i) {
+        pbrpcframework::PressOptions protocol_options = press_options;
+        protocol_options.protocol = protocols[i];
+        pbrpcframework::MaxQpsResult result;
+        if (pbrpcframework::FindMaxQps(protocol_options, options, &result) != 0) {
+            LOG(ERROR) << "Fail to find max qps on protocol=" << protocols[i];
+            return -1;
+        }
+        results.push_back(result);
+    }
+    std::ostringstream os;
+    pbrpcframework::PrintMaxQpsResults(os, results, "text");
+    printf("%s", os.str().c_str());
+    if (!FLAGS_result_file.empty()) {
+        FILE* fp = fopen(FLAGS_result_file.c_str(), "w");
+        if (fp == NULL) {
+            PLOG(ERROR) << "Fail to open " << FLAGS_result_file;
+            return -1;
+        }
+        os.str("");
+        pbrpcframework::PrintMaxQpsResults(os, results, FLAGS_result_format);
+        fprintf(fp, "%s", os.str().c_str());
+        fclose(fp);
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     // Parse gflags. We recommend you to use gflags as well
     GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
@@ -108,6 +258,9 @@ int main(int argc, char* argv[]) {
     if (!set_press_options(&options)) {
         return -1;
     }
+    if (FLAGS_find_max_qps) {
+        return find_max_qps(options);
+    }
     pbrpcframework::RpcPress* rpc_press = new pbrpcframework::RpcPress;
     if (0 != rpc_press->init(&options)) {
         LOG(FATAL) << "Fail to init rpc_press";
@@ -115,12 +268,26 @@ int main(int argc, char* argv[]) {
     }
 
     rpc_press->start();
-    if (FLAGS_duration <= 0) {
+    int duration_s = FLAGS_duration;
+    if (FLAGS_open_loop) {
+        // Stop after all stages unless the last one lasts forever.
+        duration_s = 0;
+        for (size_t i = 0; i < options.load_stages.size(); ++i) {
+            if (options.load_stages[i].duration_s <= 0) {
+                duration_s = 0;
+                break;
+            }
+            duration_s += options.load_stages[i].duration_s;
+        }
+    }
+    if (duration_s <= 0) {
         while (!brpc::IsAskedToQuit()) {
             sleep(1);
         }
     } else {
-        sleep(FLAGS_duration);
+        for (int i = 0; i < duration_s && !brpc::IsAskedToQuit(); ++i) {
+            sleep(1);
+        }
     }
     rpc_press->stop();
     // NOTE(gejun): Can't delete rpc_press on exit. It's probably
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sstream>
 #include <bthread/bthread.h>
 #include <butil/file_util.h>                     // butil::FilePath
 #include <butil/time.h>
@@ -95,7 +96,9 @@ RpcPress::RpcPress()
     : _pbrpc_client(NULL)
     , _started(false)
     , _stop(false)
-    , _output_json(NULL) {
+    , _output_json(NULL)
+    , _start_ns(0)
+    , _ninflight(0) {
 }
 
 RpcPress::~RpcPress() {
@@ -104,6 +107,9 @@ RpcPress::~RpcPress() {
         _output_json = NULL;
     }
     delete _importer;
+    for (size_t i = 0; i < _stage_stats.size(); ++i) {
+        delete _stage_stats[i];
+    }
 }
 
 int RpcPress::init(const PressOptions* options) {
@@ -179,14 +185,45 @@ int RpcPress::init(const PressOptions* options) {
         LOG(ERROR) << "Fail to load requests";
         return -1;
     }
+    if (_options.open_loop) {
+        if (_options.load_stages.empty()) {
+            LoadStage stage = { _options.test_req_rate,
+                                _options.test_req_rate, 0 };
+            _options.load_stages.push_back(stage);
+        }
+        for (size_t i = 0; i < _options.load_stages.size(); ++i) {
+            const LoadStage& stage = _options.load_stages[i];
+            if (stage.start_qps < 0 || stage.end_qps < 0 ||
+                (stage.duration_s <= 0 && stage.start_qps <= 0)) {
+                LOG(ERROR) << "Invalid load stage #" << i << ": qps="
+                           << stage.start_qps << '-' << stage.end_qps
+                           << " duration_s=" << stage.duration_s;
+                return -1;
+            }
+            _stage_stats.push_back(new StageStats);
+        }
+        if (!_options.result_format.empty() &&
+            _options.result_format != "json" &&
+            _options.result_format != "csv") {
+            LOG(ERROR) << "Unknown result format=" << _options.result_format;
+            return -1;
+        }
+    }
     LOG(INFO) << "Loaded " << _msgs.size() << " requests";
-    _latency_recorder.expose("rpc_press");
-    _error_count.expose("rpc_press_error_count");
+    if (_options.expose_vars) {
+        _latency_recorder.expose("rpc_press");
+        _error_count.expose("rpc_press_error_count");
+    }
     return 0;
 }
 
 void* RpcPress::sync_call_thread(void* arg) {
-    ((RpcPress*)arg)->sync_client();
+    RpcPress* press = (RpcPress*)arg;
+    if (press->_options.open_loop) {
+        press->open_loop_client();
+    } else {
+        press->sync_client();
+    }
     return NULL;
 }
 
@@ -263,12 +300,191 @@ void RpcPress::sync_client() {
     }
 }
 
+void RpcPress::handle_open_loop_response(brpc::Controller* cntl,
+                                         Message* response,
+                                         StageStats* stats,
+                                         int64_t scheduled_ns,
+                                         int64_t sent_ns) {
+    const int64_t now_ns = butil::monotonic_time_ns();
+    if (!cntl->Failed()) {
+        stats->corrected.record((now_ns - scheduled_ns) / 1000);
+        stats->uncorrected.record((now_ns - sent_ns) / 1000);
+        _latency_recorder << (now_ns - scheduled_ns) / 1000;
+    } else {
+        LOG_EVERY_SECOND(WARNING) << "error_code=" <<  cntl->ErrorCode()
+                                  << ", " << cntl->ErrorText();
+        stats->error.fetch_add(1, butil::memory_order_relaxed);
+        _error_count << 1;
+    }
+    delete response;
+    delete cntl;
+    _ninflight.fetch_sub(1, butil::memory_order_relaxed);
+}
+
+// Unlike sync_client() which waits for the response (unlimited qps) or
+// forgives the delay longer than max_tolerant_delay, every request has a
+// scheduled time which is not affected by how fast previous ones are sent
+// or responded, and latencies are counted from the scheduled time.
+void RpcPress::open_loop_client() {
+    const int nthread = _options.test_thread_num;
+    // The counter is shared by all RpcPress.
+    const int thread_index =
+        g_thread_count.fetch_add(1, butil::memory_order_relaxed) % nthread;
+    int msg_index = thread_index;
+    size_t stage_index = 0;
+    int64_t stage_begin_ns = _start_ns;
+    int64_t scheduled_ns = -1;
+    while (!_stop) {
+        const LoadStage& stage = _options.load_stages[stage_index];
+        const int64_t stage_ns = stage.duration_s * 1000000000L;
+        if (stage.duration_s > 0 && scheduled_ns >= stage_begin_ns + stage_ns) {
+            stage_begin_ns += stage_ns;
+            if (++stage_index == _options.load_stages.size()) {
+                break;
+            }
+            continue;
+        }
+        double qps = stage.start_qps;
+        if (stage.duration_s > 0 && scheduled_ns >= stage_begin_ns) {
+            qps += (stage.end_qps - stage.start_qps) *
+                (scheduled_ns - stage_begin_ns) / stage_ns;
+        }
+        if (qps <= 0) {
+            // Nothing to send in this part of the stage.
+            scheduled_ns = std::max(scheduled_ns, stage_begin_ns) + 1000000L;
+            continue;
+        }
+        // Threads take turns to send requests of the whole schedule.
+        const int64_t interval_ns = (int64_t)(1000000000L * nthread / qps);
+        if (scheduled_ns < 0) {
+            scheduled_ns = _start_ns + interval_ns * thread_index / nthread;
+            continue;
+        }
+        StageStats* stats = _stage_stats[stage_index];
+        int64_t now_ns = butil::monotonic_time_ns();
+        if (now_ns < scheduled_ns) {
+            usleep((scheduled_ns - now_ns) / 1000);
+            now_ns = butil::monotonic_time_ns();
+        } else if (now_ns - scheduled_ns > 1000000L) {
+            stats->late.fetch_add(1, butil::memory_order_relaxed);
+        }
+        brpc::Controller* cntl = new brpc::Controller;
+        msg_index = (msg_index + nthread) % _msgs.size();
+        Message* request = _msgs[msg_index];
+        Message* response = _pbrpc_client->get_output_message();
+        google::protobuf::Closure* done = brpc::NewCallback<
+            RpcPress,
+            RpcPress*,
+            brpc::Controller*,
+            Message*,
+            StageStats*, int64_t, int64_t>
+            (this, &RpcPress::handle_open_loop_response, cntl, response,
+             stats, scheduled_ns, now_ns);
+        _ninflight.fetch_add(1, butil::memory_order_relaxed);
+        stats->sent.fetch_add(1, butil::memory_order_relaxed);
+        _pbrpc_client->call_method(cntl, request, response, done);
+        _sent_count << 1;
+        scheduled_ns += interval_ns;
+    }
+}
+
+void RpcPress::write_open_loop_results() {
+    const double ratios[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    const char* const names[] = { "p50", "p90", "p99", "p999", "p9999" };
+    const bool csv = (_options.result_format == "csv");
+    std::ostringstream os;
+    if (csv) {
+        os << "stage,start_qps,end_qps,duration_s,sent,error,late,"
+              "achieved_qps,type,mean_us";
+        for (size_t j = 0; j < ARRAY_SIZE(names); ++j) {
+            os << ',' << names[j] << "_us";
+        }
+        os << ",max_us\n";
+    } else {
+        os << "{\"stages\":[";
+    }
+    for (size_t i = 0; i < _stage_stats.size(); ++i) {
+        const LoadStage& stage = _options.load_stages[i];
+        const StageStats* stats = _stage_stats[i];
+        const int64_t sent = stats->sent.load(butil::memory_order_relaxed);
+        const double elapsed_s = (stats->end_ns - stats->begin_ns) / 1e9;
+        const double achieved_qps = elapsed_s > 0 ? sent / elapsed_s : 0;
+        const LatencyHistogram* hists[] = { &stats->corrected,
+                                            &stats->uncorrected };
+        const char* const types[] = { "corrected", "uncorrected" };
+        if (!csv) {
+            os << (i ? "," : "") << "{\"stage\":" << i
+               << ",\"start_qps\":" << stage.start_qps
+               << ",\"end_qps\":" << stage.end_qps
+               << ",\"duration_s\":" << elapsed_s
+               << ",\"sent\":" << sent
+               << ",\"error\":" << stats->error.load(butil::memory_order_relaxed)
+               << ",\"late\":" << stats->late.load(butil::memory_order_relaxed)
+               << ",\"achieved_qps\":" << achieved_qps;
+        }
+        for (size_t k = 0; k < ARRAY_SIZE(hists); ++k) {
+            const LatencyHistogram* h = hists[k];
+            if (csv) {
+                os << i << ',' << stage.start_qps << ',' << stage.end_qps
+                   << ',' << elapsed_s << ',' << sent << ','
+                   << stats->error.load(butil::memory_order_relaxed) << ','
+                   << stats->late.load(butil::memory_order_relaxed) << ','
+                   << achieved_qps << ',' << types[k] << ',' << h->mean();
+                for (size_t j = 0; j < ARRAY_SIZE(ratios); ++j) {
+                    os << ',' << h->percentile(ratios[j]);
+                }
+                os << ',' << h->max() << '\n';
+            } else {
+                os << ",\"" << types[k] << "\":{\"count\":" << h->count()
+                   << ",\"mean_us\":" << h->mean();
+                for (size_t j = 0; j < ARRAY_SIZE(ratios); ++j) {
+                    os << ",\"" << names[j] << "_us\":" << h->percentile(ratios[j]);
+                }
+                os << ",\"max_us\":" << h->max() << '}';
+            }
+        }
+        if (!csv) {
+            os << '}';
+        }
+        LOG(INFO) << "Stage #" << i << " qps=" << stage.start_qps << '-'
+                  << stage.end_qps << " sent=" << sent
+                  << " achieved_qps=" << achieved_qps
+                  << " late=" << stats->late.load(butil::memory_order_relaxed)
+                  << " p99=" << stats->corrected.percentile(0.99)
+                  << "us(uncorrected:" << stats->uncorrected.percentile(0.99)
+                  << "us) max=" << stats->corrected.max() << "us";
+    }
+    if (!csv) {
+        os << "]}\n";
+    }
+    if (_options.result_file.empty()) {
+        return;
+    }
+    FILE* fp = fopen(_options.result_file.c_str(), "w");
+    if (fp == NULL) {
+        PLOG(ERROR) << "Fail to open " << _options.result_file;
+        return;
+    }
+    const std::string result = os.str();
+    fwrite(result.data(), 1, result.size(), fp);
+    fclose(fp);
+}
+
 int RpcPress::start() {
+    _start_ns = butil::monotonic_time_ns();
+    int64_t begin_ns = _start_ns;
+    for (size_t i = 0; i < _stage_stats.size(); ++i) {
+        _stage_stats[i]->begin_ns = begin_ns;
+        begin_ns += _options.load_stages[i].duration_s * 1000000000L;
+        _stage_stats[i]->end_ns = begin_ns;
+    }
     _ttid.resize(_options.test_thread_num);
     int ret = 0;
     for (int i = 0; i < _options.test_thread_num; i++) {
         if ((ret = pthread_create(&_ttid[i], NULL, sync_call_thread, this)) != 0) {
             LOG(ERROR) << "Fail to create sending threads";
+            _ttid.resize(i);
+            join_sending_threads();
             return -1;
         }
     }
@@ -278,11 +494,23 @@ int RpcPress::start() {
     info_thr_opt.sent_count = &_sent_count;
     if (!_info_thr.start(info_thr_opt)) {
         LOG(ERROR) << "Fail to create stats thread";
+        join_sending_threads();
         return -1;
     }
     _started = true;
     return 0;
 }
+
+// Stop the sending threads created by a failed start(), so that the press
+// can be deleted.
+void RpcPress::join_sending_threads() {
+    _stop = true;
+    for (size_t i = 0; i < _ttid.size(); i++) {
+        pthread_join(_ttid[i], NULL);
+    }
+    _ttid.clear();
+}
+
 int RpcPress::stop() {
     if (!_started) {
         return -1;
@@ -291,6 +519,25 @@ int RpcPress::stop() {
     for (size_t i = 0; i < _ttid.size(); i++) {
         pthread_join(_ttid[i], NULL);
     }
+    if (_options.open_loop) {
+        const int64_t now_ns = butil::monotonic_time_ns();
+        for (size_t i = 0; i < _stage_stats.size(); ++i) {
+            StageStats* stats = _stage_stats[i];
+            if (_options.load_stages[i].duration_s <= 0 ||
+                stats->end_ns > now_ns) {
+                // Stopped before the end of the stage.
+                stats->end_ns = std::max(stats->begin_ns, now_ns);
+            }
+        }
+        // Responses of the last requests, which are bounded by the timeout.
+        const int64_t deadline_ns = now_ns +
+            (_options.timeout_ms + 1000L) * 1000000L * (_options.max_retry + 1);
+        while (_ninflight.load(butil::memory_order_relaxed) > 0 &&
+               butil::monotonic_time_ns() < deadline_ns) {
+            usleep(10000);
+        }
+        write_open_loop_results();
+    }
     _info_thr.stop();
     return 0;
 }
@@ -25,11 +25,21 @@
 #include <bvar/bvar.h>
 #include <brpc/channel.h>
 #include "info_thread.h"
+#include "latency_histogram.h"
 #include "pb_util.h"
 
 namespace pbrpcframework {
 class JsonUtil;
 
+// Requests are sent at a rate changing linearly from `start_qps' to
+// `end_qps' in `duration_s' seconds. A stage with non-positive `duration_s'
+// lasts until the press is stopped.
+struct LoadStage {
+    double start_qps;
+    double end_qps;
+    int duration_s;
+};
+
 struct PressOptions {
     std::string service;         //service name (packet.rpcservice)
     std::string method;          //method name (rpc service method)
@@ -56,6 +66,14 @@ struct PressOptions {
     std::string lb_policy; // "rr", "Policy of load balance rr ||random"
     std::string proto_file;
     std::string proto_includes;
+    // Send requests at scheduled times regardless of responses and measure
+    // latencies from the scheduled times, so that stalls of the server are
+    // not hidden by the requests that should have been sent during them.
+    bool open_loop;
+    std::vector<LoadStage> load_stages; // [open_loop] empty: test_req_rate forever
+    std::string result_file; // [open_loop] write latencies of stages into
+    std::string result_format; // "json" or "csv"
+    bool expose_vars; // expose latencies and errors as bvar
     
     PressOptions() :
         server_type(0),
@@ -67,7 +85,9 @@ struct PressOptions {
         request_compress_type(0),
         response_compress_type(0),
         attachment_size(0),
-        auth(false)
+        auth(false),
+        open_loop(false),
+        expose_vars(true)
     {}
 };
 
@@ -111,18 +131,50 @@ public:
     int start();
     int stop();
     const PressOptions* options() { return &_options; }
+
+    // Latencies of requests scheduled in one LoadStage.
+    struct StageStats {
+        LatencyHistogram corrected;   // from the scheduled time
+        LatencyHistogram uncorrected; // from the sending time
+        butil::atomic<int64_t> sent;
+        butil::atomic<int64_t> error;
+        // Requests sent more than 1ms after the scheduled time, which means
+        // that the sending threads could not keep up with the schedule.
+        butil::atomic<int64_t> late;
+        int64_t begin_ns;
+        int64_t end_ns;
+        StageStats() : sent(0), error(0), late(0), begin_ns(0), end_ns(0) {}
+    private:
+        DISALLOW_COPY_AND_ASSIGN(StageStats);
+    };
+    // [open_loop] Stats of options()->load_stages[i], complete after stop().
+    const StageStats* stage_stats(size_t i) const { return _stage_stats[i]; }
+    // True if some responses did not come back in stop(), in which case
+    // this RpcPress can't be deleted.
+    bool has_inflight() const {
+        return _ninflight.load(butil::memory_order_relaxed) > 0;
+    }
     
 private:
     DISALLOW_COPY_AND_ASSIGN(RpcPress);
     
     bool new_pbrpc_press_client_by_client_type(int client_type);
     void sync_client();
+    void join_sending_threads();
     void handle_response(brpc::Controller* cntl,
                          google::protobuf::Message* request,
                          google::protobuf::Message* response,
                          int64_t start_time_ns);
     static void* sync_call_thread(void* arg);
 
+    void open_loop_client();
+    void handle_open_loop_response(brpc::Controller* cntl,
+                                   google::protobuf::Message* response,
+                                   StageStats* stats,
+                                   int64_t scheduled_ns,
+                                   int64_t sent_ns);
+    void write_open_loop_results();
+
     bvar::LatencyRecorder _latency_recorder;
     bvar::Adder<int64_t> _error_count;
     bvar::Adder<int64_t> _sent_count;
@@ -136,6 +188,9 @@ private:
     google::protobuf::DynamicMessageFactory _factory;
     std::vector<pthread_t> _ttid;
     brpc::InfoThread _info_thr;
+    std::vector<StageStats*> _stage_stats;
+    int64_t _start_ns;
+    butil::atomic<int64_t> _ninflight;
 };
 }
 #endif // PBRPCPRESS_PBRPC_PRESS_H
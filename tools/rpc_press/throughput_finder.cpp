@@ -0,0 +1,310 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include <brpc/server.h>
+#include "throughput_finder.h"
+
+namespace pbrpcframework {
+
+struct TrialResult {
+    bool ok;
+    bool client_limited;
+    std::string reason;
+    double achieved_qps;
+    int64_t slo_latency_us;
+    int64_t p50_us;
+    int64_t p99_us;
+    int64_t p999_us;
+    int64_t max_us;
+    double client_cpu_us;
+    double server_cpu_us;
+};
+
+static int64_t get_cpu_time_us() {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0) {
+        return -1;
+    }
+    return butil::timeval_to_microseconds(ru.ru_utime) +
+        butil::timeval_to_microseconds(ru.ru_stime);
+}
+
+// Cores used by the server averaged in last -bvar_dump_interval seconds
+// of the server, -1 on error.
+static double get_server_cpu_usage(brpc::Channel* chan) {
+    brpc::Controller cntl;
+    cntl.http_request().uri() = "/vars/process_cpu_usage";
+    chan->CallMethod(NULL, &cntl, NULL, NULL, NULL);
+    if (cntl.Failed()) {
+        LOG(WARNING) << "Fail to get cpu usage of the server: "
+                     << cntl.ErrorText();
+        return -1;
+    }
+    // In the form of "process_cpu_usage : 1.234".
+    const std::string body = cntl.response_attachment().to_string();
+    const size_t pos = body.find(" : ");
+    if (pos == std::string::npos) {
+        LOG(WARNING) << "Unknown cpu usage=`" << body << '\'';
+        return -1;
+    }
+    return strtod(body.c_str() + pos + 3, NULL);
+}
+
+static bool sleep_seconds(int seconds) {
+    for (int i = 0; i < seconds * 10; ++i) {
+        if (brpc::IsAskedToQuit()) {
+            return false;
+        }
+        usleep(100000);
+    }
+    return true;
+}
+
+static int run_trial(const PressOptions& press_options,
+                     const FindMaxQpsOptions& options,
+                     brpc::Channel* vars_chan, double qps,
+                     TrialResult* r) {
+    PressOptions trial_options = press_options;
+    trial_options.open_loop = true;
+    trial_options.expose_vars = false;
+    trial_options.output.clear();
+    trial_options.result_file.clear();
+    trial_options.test_req_rate = qps;
+    if (options.thread_num > 0) {
+        trial_options.test_thread_num = options.thread_num;
+    } else {
+        // One thread per 10000 qps and at most 50 threads, same as rpc_press
+        // choosing -thread_num by -qps.
+        trial_options.test_thread_num =
+            std::min(50, std::max(1, (int)(qps / 10000)));
+    }
+    trial_options.load_stages.clear();
+    if (options.warmup_s > 0) {
+        LoadStage warmup = { qps, qps, options.warmup_s };
+        trial_options.load_stages.push_back(warmup);
+    }
+    LoadStage measured = { qps, qps, options.trial_s };
+    trial_options.load_stages.push_back(measured);
+
+    RpcPress* press = new RpcPress;
+    if (press->init(&trial_options) != 0 || press->start() != 0) {
+        LOG(ERROR) << "Fail to start press at qps=" << qps;
+        if (!press->has_inflight()) {
+            delete press;
+        }
+        return -1;
+    }
+    bool quit = !sleep_seconds(options.warmup_s);
+    const int64_t cpu_begin_us = get_cpu_time_us();
+    quit = quit || !sleep_seconds(options.trial_s);
+    const int64_t cpu_end_us = get_cpu_time_us();
+    const double server_cpu =
+        (vars_chan && !quit) ? get_server_cpu_usage(vars_chan) : -1;
+    press->stop();
+    if (quit) {
+        return -1;
+    }
+
+    const RpcPress::StageStats* stats =
+        press->stage_stats(trial_options.load_stages.size() - 1);
+    const int64_t sent = stats->sent.load(butil::memory_order_relaxed);
+    const int64_t error = stats->error.load(butil::memory_order_relaxed);
+    const int64_t late = stats->late.load(butil::memory_order_relaxed);
+    r->achieved_qps = (double)sent / options.trial_s;
+    r->slo_latency_us = stats->corrected.percentile(options.slo_percentile);
+    r->p50_us = stats->corrected.percentile(0.5);
+    r->p99_us = stats->corrected.percentile(0.99);
+    r->p999_us = stats->corrected.percentile(0.999);
+    r->max_us = stats->corrected.max();
+    r->client_cpu_us = (sent > 0 && cpu_begin_us >= 0) ?
+        (double)(cpu_end_us - cpu_begin_us) / sent : -1;
+    r->server_cpu_us = (sent > 0 && server_cpu >= 0) ?
+        server_cpu * 1000000 / r->achieved_qps : -1;
+    // More than 1% of requests were sent late.
+    r->client_limited = (late * 100 > sent);
+    r->ok = false;
+    if (sent == 0) {
+        r->reason = "nothing sent";
+    } else if (error > options.max_error_ratio * sent) {
+        r->reason = "too many errors";
+    } else if (r->client_limited) {
+        r->reason = "press can't keep up";
+    } else if (r->achieved_qps < qps * 0.95) {
+        r->reason = "qps not reached";
+    } else if (r->slo_latency_us > options.slo_latency_ms * 1000) {
+        r->reason = "latency exceeds SLO";
+    } else {
+        r->ok = true;
+    }
+    LOG(INFO) << "protocol=" << trial_options.protocol << " qps=" << qps
+              << " achieved_qps=" << r->achieved_qps
+              << " latency(p" << options.slo_percentile * 100 << ")="
+              << r->slo_latency_us << "us errors=" << error
+              << (r->ok ? " PASS" : " FAIL: ") << r->reason;
+    if (press->has_inflight()) {
+        // Leak the press which is still used by the dones.
+        LOG(WARNING) << "Some responses did not come back";
+    } else {
+        delete press;
+    }
+    return 0;
+}
+
+int FindMaxQps(const PressOptions& press_options,
+               const FindMaxQpsOptions& options,
+               MaxQpsResult* result) {
+    if (options.min_qps <= 0 || options.max_qps < options.min_qps ||
+        options.precision <= 0 || options.trial_s <= 0) {
+        LOG(ERROR) << "Invalid options of searching";
+        return -1;
+    }
+    brpc::Channel vars_chan;
+    brpc::Channel* vars_chan_ptr = NULL;
+    if (!options.server_vars.empty()) {
+        brpc::ChannelOptions chan_options;
+        chan_options.protocol = brpc::PROTOCOL_HTTP;
+        if (vars_chan.Init(options.server_vars.c_str(), &chan_options) != 0) {
+            LOG(ERROR) << "Fail to init channel to " << options.server_vars;
+            return -1;
+        }
+        vars_chan_ptr = &vars_chan;
+    }
+    result->protocol = press_options.protocol;
+    // [lo, hi): lo meets the SLO, hi does not.
+    double lo = 0;
+    double hi = options.max_qps * 2;
+    TrialResult best;
+    TrialResult r;
+    for (double qps = options.min_qps; qps <= options.max_qps; qps *= 2) {
+        ++result->ntrial;
+        if (run_trial(press_options, options, vars_chan_ptr, qps, &r) != 0) {
+            return -1;
+        }
+        result->client_limited |= r.client_limited;
+        if (!r.ok) {
+            hi = qps;
+            break;
+        }
+        lo = qps;
+        best = r;
+    }
+    if (hi > options.max_qps) {
+        hi = options.max_qps;
+        if (lo < hi) {
+            // Try the upper bound which was skipped by doubling.
+            ++result->ntrial;
+            if (run_trial(press_options, options, vars_chan_ptr, hi, &r) != 0) {
+                return -1;
+            }
+            result->client_limited |= r.client_limited;
+            if (r.ok) {
+                lo = hi;
+                best = r;
+            }
+        }
+    }
+    while (lo > 0 && hi - lo > hi * options.precision) {
+        const double mid = (lo + hi) / 2;
+        ++result->ntrial;
+        if (run_trial(press_options, options, vars_chan_ptr, mid, &r) != 0) {
+            return -1;
+        }
+        result->client_limited |= r.client_limited;
+        if (r.ok) {
+            lo = mid;
+            best = r;
+        } else {
+            hi = mid;
+        }
+    }
+    result->max_qps = lo;
+    if (lo > 0) {
+        result->achieved_qps = best.achieved_qps;
+        result->p50_us = best.p50_us;
+        result->p99_us = best.p99_us;
+        result->p999_us = best.p999_us;
+        result->max_us = best.max_us;
+        result->client_cpu_us = best.client_cpu_us;
+        result->server_cpu_us = best.server_cpu_us;
+    }
+    return 0;
+}
+
+void PrintMaxQpsResults(std::ostream& os,
+                        const std::vector<MaxQpsResult>& results,
+                        const std::string& format) {
+    if (format == "json") {
+        os << "{\"results\":[";
+    } else if (format == "csv") {
+        os << "protocol,max_qps,achieved_qps,p50_us,p99_us,p999_us,max_us,"
+              "client_cpu_us_per_request,server_cpu_us_per_request,"
+              "client_limited,trials\n";
+    } else {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%-16s%12s%12s%10s%10s%10s%10s%12s%12s\n",
+                 "protocol", "max_qps", "achieved", "p50(us)", "p99(us)",
+                 "p999(us)", "max(us)", "client_cpu", "server_cpu");
+        os << buf;
+    }
+    for (size_t i = 0; i < results.size(); ++i) {
+        const MaxQpsResult& r = results[i];
+        if (format == "json") {
+            os << (i ? "," : "") << "{\"protocol\":\"" << r.protocol
+               << "\",\"max_qps\":" << r.max_qps
+               << ",\"achieved_qps\":" << r.achieved_qps
+               << ",\"p50_us\":" << r.p50_us
+               << ",\"p99_us\":" << r.p99_us
+               << ",\"p999_us\":" << r.p999_us
+               << ",\"max_us\":" << r.max_us
+               << ",\"client_cpu_us_per_request\":" << r.client_cpu_us
+               << ",\"server_cpu_us_per_request\":" << r.server_cpu_us
+               << ",\"client_limited\":" << (r.client_limited ? "true" : "false")
+               << ",\"trials\":" << r.ntrial << '}';
+        } else if (format == "csv") {
+            os << r.protocol << ',' << r.max_qps << ',' << r.achieved_qps
+               << ',' << r.p50_us << ',' << r.p99_us << ',' << r.p999_us
+               << ',' << r.max_us << ',' << r.client_cpu_us << ','
+               << r.server_cpu_us << ',' << (r.client_limited ? 1 : 0)
+               << ',' << r.ntrial << '\n';
+        } else {
+            char buf[256];
+            snprintf(buf, sizeof(buf),
+                     "%-16s%12.0f%12.0f%10lld%10lld%10lld%10lld%12.1f%12.1f%s\n",
+                     r.protocol.c_str(), r.max_qps, r.achieved_qps,
+                     (long long)r.p50_us, (long long)r.p99_us,
+                     (long long)r.p999_us, (long long)r.max_us,
+                     r.client_cpu_us, r.server_cpu_us,
+                     r.client_limited ? " (limited by press)" : "");
+            os << buf;
+        }
+    }
+    if (format == "json") {
+        os << "]}\n";
+    } else if (format == "text") {
+        os << "cpu columns are microseconds of cpu per request, -1 means "
+              "unknown\n";
+    }
+}
+
+} // namespace pbrpcframework
@@ -0,0 +1,98 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef PBRPCPRESS_THROUGHPUT_FINDER_H
+#define PBRPCPRESS_THROUGHPUT_FINDER_H
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "rpc_press_impl.h"
+
+namespace pbrpcframework {
+
+struct FindMaxQpsOptions {
+    // The latency at `slo_percentile' must not exceed `slo_latency_ms'.
+    double slo_latency_ms;
+    double slo_percentile;
+    double max_error_ratio;
+    // qps is doubled from `min_qps' until the SLO is broken or `max_qps' is
+    // reached, then binary searched until the range is narrower than
+    // `precision' of the upper bound.
+    double min_qps;
+    double max_qps;
+    double precision;
+    int warmup_s; // not measured
+    int trial_s;  // measured
+    // Number of threads sending requests in each trial, 0 means choosing
+    // by the qps of the trial.
+    int thread_num;
+    // ip:port of builtin services of the server, to read its cpu usage from
+    // /vars/process_cpu_usage. Empty means not to report cpu of the server.
+    std::string server_vars;
+
+    FindMaxQpsOptions()
+        : slo_latency_ms(10)
+        , slo_percentile(0.99)
+        , max_error_ratio(0.001)
+        , min_qps(1000)
+        , max_qps(10000000)
+        , precision(0.05)
+        , warmup_s(2)
+        , trial_s(10)
+        , thread_num(0) {}
+};
+
+struct MaxQpsResult {
+    std::string protocol;
+    // Maximum qps meeting the SLO, 0 if even min_qps did not.
+    double max_qps;
+    // Following fields are measured at max_qps.
+    double achieved_qps;
+    int64_t p50_us;
+    int64_t p99_us;
+    int64_t p999_us;
+    int64_t max_us;
+    // CPU time spent per request, -1 if unknown.
+    double client_cpu_us;
+    double server_cpu_us;
+    // The press could not send at the scheduled rate in some trials, the
+    // result may be limited by the client rather than the server.
+    bool client_limited;
+    int ntrial;
+
+    MaxQpsResult()
+        : max_qps(0), achieved_qps(0), p50_us(0), p99_us(0), p999_us(0)
+        , max_us(0), client_cpu_us(-1), server_cpu_us(-1)
+        , client_limited(false), ntrial(0) {}
+};
+
+// Search for the maximum qps of the method in `press_options' on the
+// protocol in it meeting the SLO in `options'. Each trial is an open-loop
+// press at a fixed qps. Returns 0 on success, -1 otherwise.
+int FindMaxQps(const PressOptions& press_options,
+               const FindMaxQpsOptions& options,
+               MaxQpsResult* result);
+
+// Print `results' as a table ("text"), "json" or "csv".
+void PrintMaxQpsResults(std::ostream& os,
+                        const std::vector<MaxQpsResult>& results,
+                        const std::string& format);
+
+} // namespace pbrpcframework
+
+#endif // PBRPCPRESS_THROUGHPUT_FINDER_H
@@ -16,6 +16,10 @@
 // under the License.
 
 
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <sstream>
 #include <gflags/gflags.h>
 #include <butil/logging.h>
 #include <butil/time.h>
@@ -23,6 +27,8 @@
 #include <butil/file_util.h>
 #include <bvar/bvar.h>
 #include <bthread/bthread.h>
+#include <bthread/mutex.h>
+#include <bthread/condition_variable.h>
 #include <brpc/channel.h>
 #include <brpc/server.h>
 #include <brpc/rpc_dump.h>
@@ -32,7 +38,8 @@
 #include "brpc/options.pb.h"
 #include "info_thread.h"
 
-DEFINE_string(dir, "", "The directory of dumped requests");
+DEFINE_string(dir, "", "The directory of dumped requests, either written one "
+              "by one or in compressed blocks(-rpc_dump_compact)");
 DEFINE_int32(times, 1, "Repeat replaying for so many times");
 DEFINE_int32(qps, 0, "Limit QPS if this flag is positive");
 DEFINE_int32(thread_num, 0, "Number of threads for replaying");
@@ -45,6 +52,17 @@ DEFINE_int32(timeout_ms, 100, "RPC timeout in milliseconds");
 DEFINE_int32(max_retry, 3, "Maximum retry times");
 DEFINE_int32(dummy_port, 8899, "Port of dummy server(to monitor replaying)");
 DEFINE_string(http_host, "", "Host field for http protocol");
+DEFINE_bool(replay_by_time, false, "Send requests at the recorded intervals "
+            "instead of as fast as possible or at -qps. Requests received from "
+            "one connection are sent in order over one connection");
+DEFINE_double(speedup, 1.0, "[replay_by_time] Replay so many times faster "
+              "than the requests were recorded");
+DEFINE_int32(connection_num, 64, "[replay_by_time] Number of connections to "
+             "replay the recorded connections over");
+DEFINE_int32(look_ahead, 1024, "[replay_by_time] Dumped requests are read while "
+             "being replayed, at most so many ahead of sending for each "
+             "connection. Requests dumped out of order within this window are "
+             "still sent in the recorded order");
 
 bvar::LatencyRecorder g_latency_recorder("rpc_replay");
 bvar::Adder<int64_t> g_error_count("rpc_replay_error_count");
@@ -53,7 +71,8 @@ bvar::Adder<int64_t> g_sent_count;
 // Include channels for all protocols that support both client and server.
 class ChannelGroup {
 public:
-    int Init();
+    // Channels of different `connection_group' do not share connections.
+    int Init(const std::string& connection_group = "");
 
     ~ChannelGroup();
 
@@ -69,7 +88,7 @@ private:
     std::vector<brpc::Channel*> _chans;
 };
 
-int ChannelGroup::Init() {
+int ChannelGroup::Init(const std::string& connection_group) {
     {
         // force global initialization of rpc.
         brpc::Channel dummy_channel;
@@ -90,6 +109,7 @@ int ChannelGroup::Init() {
         options.connection_type = FLAGS_connection_type;
         options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
         options.max_retry = FLAGS_max_retry;
+        options.connection_group = connection_group;
         if ((options.connection_type == brpc::CONNECTION_TYPE_UNKNOWN || 
             options.connection_type & protocol.supported_connection_type) &&
             protocol.support_client() &&
@@ -132,6 +152,39 @@ static void handle_response(brpc::Controller* cntl, int64_t start_time,
     delete cntl;
 }
 
+// Fill `cntl' with the dumped request and return the request to send.
+static google::protobuf::Message* prepare_request(
+    brpc::Controller* cntl, brpc::SampledRequest* sample,
+    brpc::SerializedRequest* req, brpc::NsheadMessage* nshead_req) {
+    req->Clear();
+    google::protobuf::Message* req_ptr = req;
+    cntl->reset_sampled_request(sample);
+    if (sample->meta.protocol_type() == brpc::PROTOCOL_HTTP) {
+        brpc::HttpMessage http_message;
+        http_message.ParseFromIOBuf(sample->request);
+        cntl->http_request().Swap(http_message.header());
+        if (!FLAGS_http_host.empty()) {
+            // reset Host in header
+            cntl->http_request().SetHeader("Host", FLAGS_http_host);
+        }
+        cntl->request_attachment() = http_message.body().movable();
+        req_ptr = NULL;
+    } else if (sample->meta.protocol_type() == brpc::PROTOCOL_NSHEAD) {
+        nshead_req->Clear();
+        memcpy(&nshead_req->head, sample->meta.nshead().c_str(), sample->meta.nshead().length());
+        nshead_req->body = sample->request;
+        req_ptr = nshead_req;
+    } else if (sample->meta.attachment_size() > 0) {
+        sample->request.cutn(
+            &req->serialized_data(),
+            sample->request.size() - sample->meta.attachment_size());
+        cntl->request_attachment() = sample->request.movable();
+    } else {
+        req->serialized_data() = sample->request.movable();
+    }
+    return req_ptr;
+}
+
 butil::atomic<int> g_thread_offset(0);
 
 static void* replay_thread(void* arg) {
@@ -162,33 +215,8 @@ static void* replay_thread(void* arg) {
             }
             
             brpc::Controller* cntl = new brpc::Controller;
-            req.Clear();
-            
-            google::protobuf::Message* req_ptr = &req;
-            cntl->reset_sampled_request(sample_guard.release());
-            if (sample->meta.protocol_type() == brpc::PROTOCOL_HTTP) {
-                brpc::HttpMessage http_message;
-                http_message.ParseFromIOBuf(sample->request);
-                cntl->http_request().Swap(http_message.header());
-                if (!FLAGS_http_host.empty()) {
-                    // reset Host in header
-                    cntl->http_request().SetHeader("Host", FLAGS_http_host);
-                }
-                cntl->request_attachment() = http_message.body().movable();
-                req_ptr = NULL;
-            } else if (sample->meta.protocol_type() == brpc::PROTOCOL_NSHEAD) {
-                nshead_req.Clear();
-                memcpy(&nshead_req.head, sample->meta.nshead().c_str(), sample->meta.nshead().length());
-                nshead_req.body = sample->request;
-                req_ptr = &nshead_req;
-            } else if (sample->meta.attachment_size() > 0) {
-                sample->request.cutn(
-                    &req.serialized_data(),
-                    sample->request.size() - sample->meta.attachment_size());
-                cntl->request_attachment() = sample->request.movable();
-            } else {
-                req.serialized_data() = sample->request.movable();
-            }
+            google::protobuf::Message* req_ptr = prepare_request(
+                cntl, sample_guard.release(), &req, &nshead_req);
             g_sent_count << 1;
             const int64_t start_time = butil::gettimeofday_us();
             if (FLAGS_qps <= 0) {
@@ -215,6 +243,329 @@ static void* replay_thread(void* arg) {
     return NULL;
 }
 
+// Latencies of replayed requests of a method, bucketed by powers of 2 of
+// microseconds so that percentiles of the whole replay can be reported.
+class MethodStats {
+public:
+    static const int NBUCKET = 32;
+
+    explicit MethodStats(const std::string& name)
+        : _name(name), _latency("rpc_replay", name), _nerror(0) {
+        for (int i = 0; i < NBUCKET; ++i) {
+            _buckets[i].store(0, butil::memory_order_relaxed);
+        }
+    }
+
+    const std::string& name() const { return _name; }
+
+    void on_response(int64_t latency_us, bool failed) {
+        if (failed) {
+            _nerror.fetch_add(1, butil::memory_order_relaxed);
+            return;
+        }
+        _latency << latency_us;
+        int i = 0;
+        while (i < NBUCKET - 1 && (1L << i) <= latency_us) {
+            ++i;
+        }
+        _buckets[i].fetch_add(1, butil::memory_order_relaxed);
+    }
+
+    void print(std::ostream& os) const;
+
+private:
+    // Upper bound of latencies in bucket `i'.
+    static int64_t bucket_limit(int i) { return 1L << i; }
+
+    std::string _name;
+    bvar::LatencyRecorder _latency;
+    butil::atomic<int64_t> _nerror;
+    butil::atomic<int64_t> _buckets[NBUCKET];
+};
+
+void MethodStats::print(std::ostream& os) const {
+    int64_t counts[NBUCKET];
+    int64_t total = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        counts[i] = _buckets[i].load(butil::memory_order_relaxed);
+        total += counts[i];
+    }
+    os << _name << ": success=" << total
+       << " error=" << _nerror.load(butil::memory_order_relaxed) << '\n';
+    if (total == 0) {
+        return;
+    }
+    const double ratios[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+    const char* const names[] = { "50%", "90%", "99%", "99.9%", "max" };
+    os << "  percentiles(us, upper bound):";
+    for (size_t r = 0; r < ARRAY_SIZE(ratios); ++r) {
+        const int64_t rank = std::max((int64_t)1, (int64_t)(ratios[r] * total));
+        int64_t acc = 0;
+        int i = 0;
+        for (; i < NBUCKET - 1; ++i) {
+            acc += counts[i];
+            if (acc >= rank) {
+                break;
+            }
+        }
+        os << ' ' << names[r] << "<=" << bucket_limit(i);
+    }
+    os << "\n  histogram(us):\n";
+    int64_t acc = 0;
+    for (int i = 0; i < NBUCKET; ++i) {
+        if (counts[i] == 0) {
+            continue;
+        }
+        acc += counts[i];
+        os << "    [" << (i == 0 ? 0 : bucket_limit(i - 1)) << ", "
+           << bucket_limit(i) << ") " << counts[i] << ' '
+           << (int)(acc * 100.0 / total) << "%\n";
+    }
+}
+
+// Name of the method of the dumped request.
+static std::string get_method_name(const brpc::RpcDumpMeta& meta) {
+    std::string name;
+    if (meta.has_service_name()) {
+        name = meta.service_name();
+        if (meta.has_method_index()) {
+            name.push_back('#');
+            name.append(std::to_string(meta.method_index()));
+        } else {
+            name.push_back('.');
+            name.append(meta.method_name());
+        }
+    } else if (meta.has_method_name()) {
+        name = meta.method_name();
+    } else {
+        name = brpc::ProtocolTypeToString(meta.protocol_type());
+    }
+    return name;
+}
+
+std::map<std::string, MethodStats*> g_method_stats;
+bvar::LatencyRecorder g_lag_recorder("rpc_replay_lag");
+butil::atomic<int64_t> g_ninflight(0);
+
+struct TimedRequest {
+    // Time after the first request when this one was received.
+    int64_t offset_us;
+    brpc::SampledRequest* sample;
+    MethodStats* stats;
+};
+
+static bool compare_offset(const TimedRequest& a, const TimedRequest& b) {
+    return a.offset_us < b.offset_us;
+}
+
+// Requests of recorded connections replayed over one connection.
+struct ReplayConnection {
+    ChannelGroup chan_group;
+    int64_t start_us;
+    bthread::Mutex mutex;
+    bthread::ConditionVariable cond;
+    // Requests read but not sent yet, sorted by offsets.
+    std::deque<TimedRequest> requests;
+    // All requests were read.
+    bool eof;
+
+    // Called by the reader, blocks when the look-ahead window is full.
+    void push(const TimedRequest& r) {
+        std::unique_lock<bthread::Mutex> lck(mutex);
+        while ((int)requests.size() >= FLAGS_look_ahead) {
+            cond.wait(lck);
+        }
+        requests.insert(std::upper_bound(requests.begin(), requests.end(),
+                                         r, compare_offset), r);
+        cond.notify_all();
+    }
+    void set_eof() {
+        std::unique_lock<bthread::Mutex> lck(mutex);
+        eof = true;
+        cond.notify_all();
+    }
+    // Returns false when all requests were popped.
+    bool pop(TimedRequest* r) {
+        std::unique_lock<bthread::Mutex> lck(mutex);
+        while (requests.empty() && !eof) {
+            cond.wait(lck);
+        }
+        if (requests.empty()) {
+            return false;
+        }
+        *r = requests.front();
+        requests.pop_front();
+        cond.notify_all();
+        return true;
+    }
+};
+
+static void handle_timed_response(brpc::Controller* cntl, int64_t start_time,
+                                  MethodStats* stats) {
+    const int64_t elp = butil::gettimeofday_us() - start_time;
+    stats->on_response(elp, cntl->Failed());
+    handle_response(cntl, start_time, false);
+    g_ninflight.fetch_sub(1, butil::memory_order_relaxed);
+}
+
+static void* replay_connection(void* arg) {
+    ReplayConnection* conn = static_cast<ReplayConnection*>(arg);
+    brpc::SerializedRequest req;
+    brpc::NsheadMessage nshead_req;
+    TimedRequest r;
+    while (conn->pop(&r)) {
+        std::unique_ptr<brpc::SampledRequest> sample_guard(r.sample);
+        r.sample = NULL;
+        if (brpc::IsAskedToQuit()) {
+            continue;
+        }
+        const int64_t due_us =
+            conn->start_us + (int64_t)(r.offset_us / FLAGS_speedup);
+        const int64_t now_us = butil::gettimeofday_us();
+        if (now_us < due_us) {
+            bthread_usleep(due_us - now_us);
+        } else {
+            g_lag_recorder << now_us - due_us;
+        }
+        brpc::Channel* chan = conn->chan_group.channel(
+            sample_guard->meta.protocol_type());
+        if (chan == NULL) {
+            LOG(ERROR) << "No channel on protocol="
+                       << sample_guard->meta.protocol_type();
+            continue;
+        }
+        brpc::Controller* cntl = new brpc::Controller;
+        google::protobuf::Message* req_ptr = prepare_request(
+            cntl, sample_guard.release(), &req, &nshead_req);
+        g_sent_count << 1;
+        g_ninflight.fetch_add(1, butil::memory_order_relaxed);
+        const int64_t start_time = butil::gettimeofday_us();
+        // Don't wait for the response so that later requests are still sent
+        // at their time, as the recorded client did.
+        google::protobuf::Closure* done = brpc::NewCallback(
+            handle_timed_response, cntl, start_time, r.stats);
+        chan->CallMethod(NULL/*use rpc_dump_context in cntl instead*/,
+                         cntl, req_ptr, NULL/*ignore response*/, done);
+    }
+    return NULL;
+}
+
+// Replay all dumped requests once at the recorded time. Requests are read
+// while being replayed, memory is bounded by -look_ahead.
+static int replay_by_time(std::vector<ReplayConnection*>& conns) {
+    const int64_t start_us = butil::gettimeofday_us();
+    std::vector<bthread_t> bids(conns.size());
+    for (size_t i = 0; i < conns.size(); ++i) {
+        conns[i]->start_us = start_us;
+        conns[i]->eof = false;
+        if (bthread_start_background(&bids[i], NULL, replay_connection,
+                                     conns[i]) != 0) {
+            LOG(ERROR) << "Fail to create bthread";
+            for (size_t j = 0; j < i; ++j) {
+                conns[j]->set_eof();
+                bthread_join(bids[j], NULL);
+            }
+            return -1;
+        }
+    }
+    // Map each recorded connection to a replaying connection in turn.
+    std::map<uint64_t, size_t> conn_index;
+    // Offsets are relative to the first request read. Requests dumped
+    // before it (by other threads) are sent at the beginning.
+    int64_t first_us = -1;
+    size_t nrequest = 0;
+    brpc::SampleIterator it(FLAGS_dir);
+    for (brpc::SampledRequest* sample = it.Next();
+         !brpc::IsAskedToQuit() && sample != NULL; sample = it.Next()) {
+        const std::string method_name = get_method_name(sample->meta);
+        MethodStats*& stats = g_method_stats[method_name];
+        if (stats == NULL) {
+            stats = new MethodStats(method_name);
+        }
+        if (first_us < 0) {
+            first_us = sample->meta.received_us();
+        }
+        TimedRequest r = {
+            std::max(sample->meta.received_us() - first_us, (int64_t)0),
+            sample, stats };
+        ++nrequest;
+        // Requests dumped by old versions do not have connections, spread
+        // them to all connections.
+        const uint64_t connection_id = sample->meta.has_connection_id() ?
+            sample->meta.connection_id() : (uint64_t)nrequest;
+        auto res = conn_index.insert(std::make_pair(
+            connection_id, conn_index.size() % conns.size()));
+        conns[res.first->second]->push(r);
+    }
+    for (size_t i = 0; i < conns.size(); ++i) {
+        conns[i]->set_eof();
+    }
+    for (size_t i = 0; i < conns.size(); ++i) {
+        bthread_join(bids[i], NULL);
+    }
+    LOG(INFO) << "Replayed " << nrequest << " requests of "
+              << conn_index.size() << " connections in "
+              << (butil::gettimeofday_us() - start_us) / 1000 << "ms";
+    return 0;
+}
+
+static int run_replay_by_time() {
+    if (FLAGS_speedup <= 0) {
+        LOG(ERROR) << "--speedup must be positive";
+        return -1;
+    }
+    if (FLAGS_connection_num <= 0) {
+        LOG(ERROR) << "--connection_num must be positive";
+        return -1;
+    }
+    if (FLAGS_look_ahead <= 0) {
+        LOG(ERROR) << "--look_ahead must be positive";
+        return -1;
+    }
+    std::vector<ReplayConnection*> conns;
+    for (int i = 0; i < FLAGS_connection_num; ++i) {
+        conns.push_back(new ReplayConnection);
+        if (conns.back()->chan_group.Init(
+                "rpc_replay_" + std::to_string(i)) != 0) {
+            LOG(ERROR) << "Fail to init ChannelGroup";
+            return -1;
+        }
+    }
+    brpc::InfoThread info_thr;
+    brpc::InfoThreadOptions info_thr_opt;
+    info_thr_opt.latency_recorder = &g_latency_recorder;
+    info_thr_opt.error_count = &g_error_count;
+    info_thr_opt.sent_count = &g_sent_count;
+    if (!info_thr.start(info_thr_opt)) {
+        LOG(ERROR) << "Fail to create info_thread";
+        return -1;
+    }
+    for (int i = 0; !brpc::IsAskedToQuit() && i < FLAGS_times; ++i) {
+        if (replay_by_time(conns) != 0) {
+            return -1;
+        }
+    }
+    // Wait for responses of the last requests.
+    while (g_ninflight.load(butil::memory_order_relaxed) > 0) {
+        bthread_usleep(10000);
+    }
+    info_thr.stop();
+
+    std::ostringstream os;
+    os << "[Latency by method]\n";
+    for (std::map<std::string, MethodStats*>::const_iterator
+             it = g_method_stats.begin(); it != g_method_stats.end(); ++it) {
+        it->second->print(os);
+    }
+    os << "[Lag behind recorded time] count=" << g_lag_recorder.count()
+       << " max=" << g_lag_recorder.max_latency() << "us\n";
+    printf("%s", os.str().c_str());
+    for (size_t i = 0; i < conns.size(); ++i) {
+        delete conns[i];
+    }
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     // Parse gflags. We recommend you to use gflags as well.
     GFLAGS_NAMESPACE::ParseCommandLineFlags(&argc, &argv, true);
@@ -229,6 +580,10 @@ int main(int argc, char* argv[]) {
         brpc::StartDummyServerAt(FLAGS_dummy_port);
     }
     
+    if (FLAGS_replay_by_time) {
+        return run_replay_by_time();
+    }
+
     ChannelGroup chan_group;
     if (chan_group.Init() != 0) {
         LOG(ERROR) << "Fail to init ChannelGroup";